@@ -0,0 +1,354 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file client_bench.c
+  @brief benchmark of the client table and the firewall counters parser
+
+  The client list is filled with synthetic clients, then lookups,
+  client_list_dup and a replay of canned `iptables -v -n -x -L` output
+  through iptables_fw_counters_parse are timed. Allocations are counted
+  by linking with -Wl,--wrap for the libc allocator entry points, so
+  memory taken inside libc itself (vasprintf, stdio) is not seen.
+  */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "client_list.h"
+#include "fw_iptables.h"
+#include "pstring.h"
+
+#define	DEFAULT_CLIENTS		1000
+#define	DEFAULT_ITERATIONS	100000
+
+static unsigned long long nr_alloc, nr_free;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+char *__real_strdup(const char *);
+void __real_free(void *);
+
+void *__wrap_malloc(size_t);
+void *__wrap_calloc(size_t, size_t);
+void *__wrap_realloc(void *, size_t);
+char *__wrap_strdup(const char *);
+void __wrap_free(void *);
+
+void *
+__wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&nr_alloc, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&nr_alloc, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&nr_alloc, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+char *
+__wrap_strdup(const char *s)
+{
+	__atomic_add_fetch(&nr_alloc, 1, __ATOMIC_RELAXED);
+	return __real_strdup(s);
+}
+
+void
+__wrap_free(void *ptr)
+{
+	if (ptr)
+		__atomic_add_fetch(&nr_free, 1, __ATOMIC_RELAXED);
+	__real_free(ptr);
+}
+
+struct bench_client {
+	char	ip[16];
+	char	mac[18];
+	char	token[33];
+};
+
+static struct bench_client *clients;
+static int nr_clients = DEFAULT_CLIENTS;
+static int iterations = DEFAULT_ITERATIONS;
+
+struct bench_run {
+	struct timespec		start;
+	unsigned long long	alloc;
+	unsigned long long	free;
+};
+
+static void
+bench_begin(struct bench_run *run)
+{
+	run->alloc = nr_alloc;
+	run->free = nr_free;
+	clock_gettime(CLOCK_MONOTONIC, &run->start);
+}
+
+static void
+bench_end(struct bench_run *run, const char *name, long ops)
+{
+	struct timespec end;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - run->start.tv_sec) + (end.tv_nsec - run->start.tv_nsec) / 1e9;
+	if (ops <= 0)
+		ops = 1;
+
+	printf("%-28s %10ld ops %12.0f ops/sec %10.1f ns/op %8.2f allocs/op %8.2f frees/op\n",
+		name, ops, secs > 0 ? ops / secs : 0, secs * 1e9 / ops,
+		(double)(nr_alloc - run->alloc) / ops, (double)(nr_free - run->free) / ops);
+}
+
+static void
+bench_make_clients(void)
+{
+	int i;
+
+	clients = safe_malloc(nr_clients * sizeof(struct bench_client));
+	for (i = 0; i < nr_clients; i++) {
+		snprintf(clients[i].ip, sizeof(clients[i].ip), "10.%d.%d.%d",
+			((i + 1) >> 16) & 0xff, ((i + 1) >> 8) & 0xff, (i + 1) & 0xff);
+		snprintf(clients[i].mac, sizeof(clients[i].mac), "02:00:00:%02x:%02x:%02x",
+			(i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		snprintf(clients[i].token, sizeof(clients[i].token), "%08x%08x%08x%08x",
+			i, (unsigned)rand(), (unsigned)rand(), (unsigned)rand());
+	}
+}
+
+static void
+bench_client_list_add(void)
+{
+	struct bench_run run;
+	t_client *client;
+	int i;
+
+	bench_begin(&run);
+	LOCK_CLIENT_LIST();
+	for (i = 0; i < nr_clients; i++) {
+		client = client_list_add(clients[i].ip, clients[i].mac, clients[i].token);
+		/* counters parsing would otherwise look the name up in dhcp leases and the bridge */
+		client->name = safe_strdup("bench");
+		client->wired = 0;
+	}
+	UNLOCK_CLIENT_LIST();
+	bench_end(&run, "client_list_add", nr_clients);
+}
+
+static void
+bench_client_list_find(void)
+{
+	struct bench_run run;
+	struct bench_client *c;
+	long found;
+	int i;
+
+	LOCK_CLIENT_LIST();
+
+	bench_begin(&run);
+	for (i = 0, found = 0; i < iterations; i++)
+		found += client_list_find_by_ip(clients[rand() % nr_clients].ip) != NULL;
+	bench_end(&run, "client_list_find_by_ip", iterations);
+
+	bench_begin(&run);
+	for (i = 0; i < iterations; i++)
+		found += client_list_find_by_mac(clients[rand() % nr_clients].mac) != NULL;
+	bench_end(&run, "client_list_find_by_mac", iterations);
+
+	bench_begin(&run);
+	for (i = 0; i < iterations; i++) {
+		c = &clients[rand() % nr_clients];
+		found += client_list_find(c->ip, c->mac) != NULL;
+	}
+	bench_end(&run, "client_list_find", iterations);
+
+	bench_begin(&run);
+	for (i = 0; i < iterations; i++)
+		found += client_list_find_by_token(clients[rand() % nr_clients].token) != NULL;
+	bench_end(&run, "client_list_find_by_token", iterations);
+
+	bench_begin(&run);
+	for (i = 0; i < iterations; i++)
+		found += client_list_find_by_ip("192.0.2.1") != NULL;
+	bench_end(&run, "client_list_find_by_ip miss", iterations);
+
+	UNLOCK_CLIENT_LIST();
+
+	if (found != 4L * iterations)
+		fprintf(stderr, "warning: %ld of %d lookups found a client\n", found, 4 * iterations);
+}
+
+static void
+bench_client_list_dup(void)
+{
+	struct bench_run run;
+	t_client *worklist;
+	int i, rounds;
+
+	rounds = iterations / nr_clients;
+	if (rounds < 10)
+		rounds = 10;
+
+	bench_begin(&run);
+	for (i = 0; i < rounds; i++) {
+		LOCK_CLIENT_LIST();
+		client_list_dup(&worklist);
+		UNLOCK_CLIENT_LIST();
+		client_list_destroy(worklist);
+	}
+	bench_end(&run, "client_list_dup+destroy", rounds);
+}
+
+/** @internal
+ * Canned chain listing in the layout of `iptables -v -n -x -t mangle -L`
+ */
+static char *
+bench_counters_listing(int incoming, unsigned long long round)
+{
+	pstr_t *pstr = pstr_new();
+	int i;
+
+	if (incoming) {
+		pstr_cat(pstr, "Chain " CHAIN_INCOMING " (1 references)\n");
+		pstr_cat(pstr, "    pkts      bytes target     prot opt in     out     source               destination\n");
+		for (i = 0; i < nr_clients; i++)
+			pstr_append_sprintf(pstr, "%8llu %10llu ACCEPT     all  --  *      *       0.0.0.0/0            %-20s\n",
+				round + i, (round + 1) * 1500 + i, clients[i].ip);
+	} else {
+		pstr_cat(pstr, "Chain " CHAIN_OUTGOING " (1 references)\n");
+		pstr_cat(pstr, "    pkts      bytes target     prot opt in     out     source               destination\n");
+		for (i = 0; i < nr_clients; i++)
+			pstr_append_sprintf(pstr, "%8llu %10llu MARK       all  --  *      *       %-20s 0.0.0.0/0            "
+				"MAC %s MARK or 0x20000\n",
+				round + i, (round + 1) * 600 + i, clients[i].ip, clients[i].mac);
+	}
+
+	return pstr_to_string(pstr);
+}
+
+static void
+bench_counters_parse(void)
+{
+	struct bench_run run;
+	char **listing;
+	FILE *output;
+	int i, rounds, incoming;
+
+	rounds = iterations / nr_clients;
+	if (rounds < 10)
+		rounds = 10;
+
+	listing = safe_malloc(rounds * sizeof(char *));
+	for (incoming = 0; incoming < 2; incoming++) {
+		/* every round carries larger byte counts so the update path is taken */
+		for (i = 0; i < rounds; i++)
+			listing[i] = bench_counters_listing(incoming, i);
+
+		bench_begin(&run);
+		for (i = 0; i < rounds; i++) {
+			output = fmemopen(listing[i], strlen(listing[i]), "r");
+			if (!output) {
+				perror("fmemopen");
+				exit(1);
+			}
+			iptables_fw_counters_parse(output, incoming);
+			fclose(output);
+		}
+		bench_end(&run, incoming ? "counters_parse incoming" : "counters_parse outgoing",
+			(long)rounds * nr_clients);
+
+		for (i = 0; i < rounds; i++)
+			free(listing[i]);
+	}
+	free(listing);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	fprintf(stderr, "  -n <clients>     synthetic clients in the list (default %d)\n", DEFAULT_CLIENTS);
+	fprintf(stderr, "  -i <iterations>  lookups per benchmark (default %d)\n", DEFAULT_ITERATIONS);
+	fprintf(stderr, "  -s <seed>        random seed\n");
+	fprintf(stderr, "  -h               this help\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+
+	srand(1);
+	while ((c = getopt(argc, argv, "n:i:s:h")) != -1) {
+		switch (c) {
+		case 'n':
+			nr_clients = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			srand(atoi(optarg));
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (nr_clients <= 0 || nr_clients >= 0xffffff || iterations <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	debugconf.debuglevel = LOG_WARNING;
+	config_init();
+	client_list_init();
+	bench_make_clients();
+
+	printf("%d clients, %d iterations\n", nr_clients, iterations);
+	bench_client_list_add();
+	bench_client_list_find();
+	bench_client_list_dup();
+	bench_counters_parse();
+
+	return 0;
+}
@@ -0,0 +1,404 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file fake_authserver.c
+  @brief stand-in auth server for load tests on one machine
+
+  Speaks the subset of the auth server protocol the gateway uses: ping,
+  auth with stage login, counters and logout, the login and portal pages
+  and the roam query, over http and optionally https. The login page
+  sends the client straight back to the gateway with a fresh token, so
+  a whole login can be driven without a browser. Replies can be delayed,
+  failed with a 500 or never sent, to look at the gateway under a slow
+  or broken auth server. Request counts are printed on SIGINT/SIGTERM.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#define	DEFAULT_LISTEN_ADDRESS	"127.0.0.1"
+#define	DEFAULT_PORT			8001
+#define	DEFAULT_PATH			"/wifidog/"
+
+enum {
+	REQ_PING,
+	REQ_LOGIN_STAGE,
+	REQ_COUNTERS_STAGE,
+	REQ_LOGOUT_STAGE,
+	REQ_LOGIN_PAGE,
+	REQ_PORTAL_PAGE,
+	REQ_ROAM,
+	REQ_UNKNOWN,
+	REQ_MAX
+};
+
+static const char *req_names[REQ_MAX] = {
+	"ping", "auth login", "auth counters", "auth logout", "login page", "portal page", "roam", "unknown"
+};
+
+static struct {
+	const char	*path;
+	int			delay_ms;
+	int			jitter_ms;
+	int			error_percent;
+	int			drop_percent;
+	int			auth_code[3];	/* login, counters, logout */
+	int			roam;
+} fa;
+
+static struct event_base *base;
+static unsigned long req_count[REQ_MAX], req_errors, req_dropped;
+
+struct delayed_reply {
+	struct evhttp_request	*req;
+	struct evbuffer			*body;
+	int						code;
+	char					*location;
+};
+
+static void
+send_reply(struct delayed_reply *r)
+{
+	struct evkeyvalq *headers = evhttp_request_get_output_headers(r->req);
+
+	if (r->location)
+		evhttp_add_header(headers, "Location", r->location);
+	evhttp_add_header(headers, "Content-Type", "text/html");
+	evhttp_send_reply(r->req, r->code, r->code == HTTP_OK ? "OK" :
+		r->code == HTTP_MOVETEMP ? "Found" : "Internal Server Error", r->body);
+
+	evbuffer_free(r->body);
+	free(r->location);
+	free(r);
+}
+
+static void
+delayed_reply_cb(evutil_socket_t fd, short what, void *arg)
+{
+	send_reply(arg);
+}
+
+/** @internal
+ * Reply now or after the configured latency, or not at all when the
+ * request falls into the dropped share.
+ */
+static void
+reply(struct evhttp_request *req, int code, const char *location, const char *fmt, ...)
+{
+	struct delayed_reply *r;
+	struct timeval tv;
+	va_list ap;
+	int delay;
+
+	if (fa.drop_percent && rand() % 100 < fa.drop_percent) {
+		/* evhttp frees the request once the gateway gives up */
+		req_dropped++;
+		return;
+	}
+
+	r = calloc(1, sizeof(struct delayed_reply));
+	r->req = req;
+	r->body = evbuffer_new();
+	if (fa.error_percent && rand() % 100 < fa.error_percent) {
+		req_errors++;
+		r->code = HTTP_INTERNAL;
+	} else {
+		r->code = code;
+		if (location)
+			r->location = strdup(location);
+		va_start(ap, fmt);
+		evbuffer_add_vprintf(r->body, fmt, ap);
+		va_end(ap);
+	}
+
+	delay = fa.delay_ms + (fa.jitter_ms ? rand() % (fa.jitter_ms + 1) : 0);
+	if (!delay) {
+		send_reply(r);
+		return;
+	}
+	tv.tv_sec = delay / 1000;
+	tv.tv_usec = (delay % 1000) * 1000;
+	event_base_once(base, -1, EV_TIMEOUT, delayed_reply_cb, r, &tv);
+}
+
+static void
+reply_login_page(struct evhttp_request *req, struct evkeyvalq *params)
+{
+	const char *gw_address = evhttp_find_header(params, "gw_address");
+	const char *gw_port = evhttp_find_header(params, "gw_port");
+	char location[256];
+
+	req_count[REQ_LOGIN_PAGE]++;
+	if (!gw_address || !gw_port) {
+		reply(req, HTTP_OK, NULL, "<html><body>fake auth server login</body></html>");
+		return;
+	}
+
+	/* what a real portal does once the user accepted the terms */
+	snprintf(location, sizeof(location), "http://%s:%s/wifidog/auth?token=%08x%08x%08x%08x",
+		gw_address, gw_port, rand(), rand(), rand(), rand());
+	reply(req, HTTP_MOVETEMP, location, "<html><body>Please <a href='%s'>click here</a>.</body></html>",
+		location);
+}
+
+static void
+reply_auth(struct evhttp_request *req, struct evkeyvalq *params)
+{
+	const char *stage = evhttp_find_header(params, "stage");
+	int type;
+
+	if (stage && !strcmp(stage, "login"))
+		type = REQ_LOGIN_STAGE;
+	else if (stage && !strcmp(stage, "counters"))
+		type = REQ_COUNTERS_STAGE;
+	else if (stage && !strcmp(stage, "logout"))
+		type = REQ_LOGOUT_STAGE;
+	else {
+		req_count[REQ_UNKNOWN]++;
+		evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+		return;
+	}
+
+	req_count[type]++;
+	reply(req, HTTP_OK, NULL, "Auth: %d\n", fa.auth_code[type - REQ_LOGIN_STAGE]);
+}
+
+static void
+reply_roam(struct evhttp_request *req, struct evkeyvalq *params)
+{
+	req_count[REQ_ROAM]++;
+	if (!fa.roam) {
+		reply(req, HTTP_OK, NULL, "{\"roam\":\"no\"}");
+		return;
+	}
+
+	reply(req, HTTP_OK, NULL, "{\"roam\":\"yes\",\"client\":{\"token\":\"%08x%08x\",\"first_login\":\"%ld\"}}",
+		rand(), rand(), (long)time(NULL));
+}
+
+static void
+request_cb(struct evhttp_request *req, void *arg)
+{
+	const char *uri = evhttp_request_get_uri(req);
+	size_t len = strlen(fa.path);
+	struct evkeyvalq params;
+	const char *script, *query;
+
+	if (strncmp(uri, fa.path, len) != 0) {
+		req_count[REQ_UNKNOWN]++;
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return;
+	}
+
+	script = uri + len;
+	query = strchr(script, '?');
+	evhttp_parse_query_str(query ? query + 1 : "", &params);
+
+	if (!strncmp(script, "ping", 4)) {
+		req_count[REQ_PING]++;
+		reply(req, HTTP_OK, NULL, "Pong");
+	} else if (!strncmp(script, "auth", 4))
+		reply_auth(req, &params);
+	else if (!strncmp(script, "login", 5))
+		reply_login_page(req, &params);
+	else if (!strncmp(script, "portal", 6)) {
+		req_count[REQ_PORTAL_PAGE]++;
+		reply(req, HTTP_OK, NULL, "<html><body>fake auth server portal</body></html>");
+	} else if (!strncmp(script, "roam", 4))
+		reply_roam(req, &params);
+	else {
+		req_count[REQ_UNKNOWN]++;
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+	}
+
+	evhttp_clear_headers(&params);
+}
+
+static struct bufferevent *
+https_bevcb(struct event_base *base, void *arg)
+{
+	return bufferevent_openssl_socket_new(base, -1, SSL_new((SSL_CTX *)arg),
+		BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+}
+
+static void
+signal_cb(evutil_socket_t sig, short what, void *arg)
+{
+	int i;
+
+	for (i = 0; i < REQ_MAX; i++)
+		printf("%-16s %lu\n", req_names[i], req_count[i]);
+	printf("%-16s %lu\n", "failed (500)", req_errors);
+	printf("%-16s %lu\n", "never answered", req_dropped);
+	event_base_loopexit(base, NULL);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	fprintf(stderr, "  -l <address>     listen address (default %s)\n", DEFAULT_LISTEN_ADDRESS);
+	fprintf(stderr, "  -p <port>        http port (default %d)\n", DEFAULT_PORT);
+	fprintf(stderr, "  -s <port>        https port, needs -C and -K\n");
+	fprintf(stderr, "  -C <file>        https certificate chain (PEM)\n");
+	fprintf(stderr, "  -K <file>        https private key (PEM)\n");
+	fprintf(stderr, "  -P <path>        auth server path (default %s)\n", DEFAULT_PATH);
+	fprintf(stderr, "  -d <ms>          delay every reply\n");
+	fprintf(stderr, "  -j <ms>          add up to this much random delay\n");
+	fprintf(stderr, "  -e <percent>     reply 500 to this share of requests\n");
+	fprintf(stderr, "  -x <percent>     never reply to this share of requests\n");
+	fprintf(stderr, "  -L <code>        auth code for stage=login (default 1)\n");
+	fprintf(stderr, "  -T <code>        auth code for stage=counters (default 1)\n");
+	fprintf(stderr, "  -O <code>        auth code for stage=logout (default 0)\n");
+	fprintf(stderr, "  -r               answer roam queries with a roaming client\n");
+	fprintf(stderr, "  -h               this help\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *address = DEFAULT_LISTEN_ADDRESS, *cert = NULL, *key = NULL;
+	int port = DEFAULT_PORT, https_port = 0;
+	struct evhttp *http, *https = NULL;
+	struct event *ev_int, *ev_term;
+	SSL_CTX *ctx = NULL;
+	int c;
+
+	fa.path = DEFAULT_PATH;
+	fa.auth_code[0] = 1;
+	fa.auth_code[1] = 1;
+	fa.auth_code[2] = 0;
+
+	while ((c = getopt(argc, argv, "l:p:s:C:K:P:d:j:e:x:L:T:O:rh")) != -1) {
+		switch (c) {
+		case 'l':
+			address = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			https_port = atoi(optarg);
+			break;
+		case 'C':
+			cert = optarg;
+			break;
+		case 'K':
+			key = optarg;
+			break;
+		case 'P':
+			fa.path = optarg;
+			break;
+		case 'd':
+			fa.delay_ms = atoi(optarg);
+			break;
+		case 'j':
+			fa.jitter_ms = atoi(optarg);
+			break;
+		case 'e':
+			fa.error_percent = atoi(optarg);
+			break;
+		case 'x':
+			fa.drop_percent = atoi(optarg);
+			break;
+		case 'L':
+			fa.auth_code[0] = atoi(optarg);
+			break;
+		case 'T':
+			fa.auth_code[1] = atoi(optarg);
+			break;
+		case 'O':
+			fa.auth_code[2] = atoi(optarg);
+			break;
+		case 'r':
+			fa.roam = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (https_port && (!cert || !key)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	base = event_base_new();
+	http = evhttp_new(base);
+	evhttp_set_gencb(http, request_cb, NULL);
+	if (evhttp_bind_socket(http, address, port) < 0) {
+		fprintf(stderr, "couldn't bind to %s:%d\n", address, port);
+		return 1;
+	}
+
+	if (https_port) {
+		SSL_library_init();
+		SSL_load_error_strings();
+		ctx = SSL_CTX_new(SSLv23_server_method());
+		if (1 != SSL_CTX_use_certificate_chain_file(ctx, cert) ||
+			1 != SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) ||
+			1 != SSL_CTX_check_private_key(ctx)) {
+			ERR_print_errors_fp(stderr);
+			return 1;
+		}
+
+		https = evhttp_new(base);
+		evhttp_set_bevcb(https, https_bevcb, ctx);
+		evhttp_set_gencb(https, request_cb, NULL);
+		if (evhttp_bind_socket(https, address, https_port) < 0) {
+			fprintf(stderr, "couldn't bind to %s:%d\n", address, https_port);
+			return 1;
+		}
+	}
+
+	ev_int = evsignal_new(base, SIGINT, signal_cb, NULL);
+	ev_term = evsignal_new(base, SIGTERM, signal_cb, NULL);
+	evsignal_add(ev_int, NULL);
+	evsignal_add(ev_term, NULL);
+
+	event_base_dispatch(base);
+
+	event_free(ev_int);
+	event_free(ev_term);
+	if (https)
+		evhttp_free(https);
+	evhttp_free(http);
+	event_base_free(base);
+	if (ctx)
+		SSL_CTX_free(ctx);
+	return 0;
+}
@@ -0,0 +1,457 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file loadgen.c
+  @brief captive portal load generator
+
+  Simulates many clients sending the usual OS captive probes to gw_port
+  (libhttpd) and, with TLS and SNI, to gw_https_port (evhttp). Every
+  simulated client binds its own loopback source address, so the gateway
+  sees distinct clients; -a writes a matching stub of /proc/net/arp to be
+  handed to wifidog with its own -a option. A response carrying the
+  gateway's login url counts as a redirect, redirects/sec and latency
+  percentiles are reported per scheme.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+
+#define	DEFAULT_GW_ADDRESS		"127.0.0.1"
+#define	DEFAULT_GW_PORT			2060
+#define	DEFAULT_GW_HTTPS_PORT	8443
+#define	DEFAULT_CLIENT_BASE		"127.1.0.0"
+#define	DEFAULT_CLIENTS			1000
+#define	DEFAULT_CONCURRENCY		64
+#define	DEFAULT_REQUESTS		10000
+#define	PROBE_TIMEOUT			10
+
+/* the gateway puts this in every login url it redirects to */
+#define	REDIRECT_MARK			"gw_id="
+
+enum {
+	SCHEME_HTTP,
+	SCHEME_HTTPS,
+	SCHEME_MAX
+};
+
+static const char *scheme_names[SCHEME_MAX] = { "http", "https" };
+
+struct captive_probe {
+	const char	*host;
+	const char	*path;
+};
+
+static const struct captive_probe captive_probes[] = {
+	{ "captive.apple.com", "/hotspot-detect.html" },
+	{ "connectivitycheck.gstatic.com", "/generate_204" },
+	{ "www.msftconnecttest.com", "/connecttest.txt" },
+	{ "detectportal.firefox.com", "/success.txt" },
+};
+
+#define	NR_CAPTIVE_PROBES	(sizeof(captive_probes) / sizeof(captive_probes[0]))
+
+struct scheme_stats {
+	long		requests;
+	long		redirects;
+	long		others;
+	long		errors;
+	uint32_t	*latency;	/* microseconds, one per finished probe */
+	long		latency_len;
+	long		latency_size;
+};
+
+struct probe {
+	struct bufferevent	*bev;
+	struct timespec		start;
+	int					scheme;
+};
+
+static struct {
+	struct sockaddr_in	gw_http;
+	struct sockaddr_in	gw_https;
+	uint32_t			client_base;
+	int					clients;
+	int					concurrency;
+	long				requests;
+	int					duration;
+	int					https_percent;
+	const char			*arp_file;
+} lg;
+
+static struct event_base *base;
+static SSL_CTX *ssl_ctx;
+static struct scheme_stats stats[SCHEME_MAX];
+static struct timespec run_start;
+static long started, in_flight;
+static int stopping;
+
+static void probe_start(void);
+
+static double
+elapsed_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+stats_add_latency(struct scheme_stats *st, uint32_t us)
+{
+	if (st->latency_len == st->latency_size) {
+		st->latency_size = st->latency_size ? st->latency_size * 2 : 4096;
+		st->latency = realloc(st->latency, st->latency_size * sizeof(uint32_t));
+		if (!st->latency) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	st->latency[st->latency_len++] = us;
+}
+
+static void
+probe_finish(struct probe *p, int failed)
+{
+	struct scheme_stats *st = &stats[p->scheme];
+	struct evbuffer *input = NULL;
+	size_t len = 0;
+
+	if (p->bev) {
+		input = bufferevent_get_input(p->bev);
+		len = evbuffer_get_length(input);
+	}
+
+	stats_add_latency(st, (uint32_t)(elapsed_since(&p->start) * 1e6));
+	if (len && evbuffer_search(input, REDIRECT_MARK, strlen(REDIRECT_MARK), NULL).pos != -1)
+		st->redirects++;
+	else if (len || !failed)
+		st->others++;
+	else
+		st->errors++;
+
+	if (p->bev)
+		bufferevent_free(p->bev);
+	free(p);
+	in_flight--;
+
+	if (!stopping)
+		probe_start();
+	else if (!in_flight)
+		event_base_loopexit(base, NULL);
+}
+
+static void
+probe_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	if (events & BEV_EVENT_EOF)
+		probe_finish(arg, 0);
+	else if (events & (BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT))
+		probe_finish(arg, 1);
+}
+
+static void
+probe_read_cb(struct bufferevent *bev, void *arg)
+{
+	/* keep everything, the response is only looked at on close */
+}
+
+static void
+probe_start(void)
+{
+	const struct captive_probe *target;
+	struct timeval timeout = { PROBE_TIMEOUT, 0 };
+	struct sockaddr_in src;
+	struct bufferevent *bev;
+	struct probe *p;
+	SSL *ssl;
+	int client, fd;
+
+	if (lg.requests && started >= lg.requests) {
+		stopping = 1;
+		if (!in_flight)
+			event_base_loopexit(base, NULL);
+		return;
+	}
+
+	client = started % lg.clients;
+	target = &captive_probes[started % NR_CAPTIVE_PROBES];
+	started++;
+
+	p = calloc(1, sizeof(struct probe));
+	p->scheme = (rand() % 100) < lg.https_percent ? SCHEME_HTTPS : SCHEME_HTTP;
+	stats[p->scheme].requests++;
+	clock_gettime(CLOCK_MONOTONIC, &p->start);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "socket(): %s\n", strerror(errno));
+		exit(1);
+	}
+	memset(&src, 0, sizeof(src));
+	src.sin_family = AF_INET;
+	src.sin_addr.s_addr = htonl(lg.client_base + client + 1);
+	if (bind(fd, (struct sockaddr *)&src, sizeof(src)) < 0) {
+		fprintf(stderr, "bind(%s): %s\n", inet_ntoa(src.sin_addr), strerror(errno));
+		exit(1);
+	}
+	evutil_make_socket_nonblocking(fd);
+
+	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (bufferevent_socket_connect(bev, p->scheme == SCHEME_HTTPS ? (struct sockaddr *)&lg.gw_https :
+			(struct sockaddr *)&lg.gw_http, sizeof(struct sockaddr_in)) < 0) {
+		bufferevent_free(bev);
+		bev = NULL;
+	} else if (p->scheme == SCHEME_HTTPS) {
+		ssl = SSL_new(ssl_ctx);
+		SSL_set_tlsext_host_name(ssl, target->host);
+		bev = bufferevent_openssl_filter_new(base, bev, ssl, BUFFEREVENT_SSL_CONNECTING,
+			BEV_OPT_CLOSE_ON_FREE);
+		/* the gateway closes without close_notify */
+		bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+	}
+
+	in_flight++;
+	if (!bev) {
+		probe_finish(p, 1);
+		return;
+	}
+
+	p->bev = bev;
+	bufferevent_setcb(bev, probe_read_cb, NULL, probe_event_cb, p);
+	bufferevent_set_timeouts(bev, &timeout, &timeout);
+	bufferevent_enable(bev, EV_READ | EV_WRITE);
+	evbuffer_add_printf(bufferevent_get_output(bev),
+		"GET %s HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"User-Agent: CaptiveNetworkSupport wdloadgen\r\n"
+		"Accept: */*\r\n"
+		"Connection: close\r\n"
+		"\r\n", target->path, target->host);
+}
+
+static void
+duration_cb(evutil_socket_t fd, short what, void *arg)
+{
+	stopping = 1;
+	if (!in_flight)
+		event_base_loopexit(base, NULL);
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile_ms(const struct scheme_stats *st, double q)
+{
+	long i;
+
+	if (!st->latency_len)
+		return 0;
+	i = (long)(q * st->latency_len);
+	if (i >= st->latency_len)
+		i = st->latency_len - 1;
+	return st->latency[i] / 1000.0;
+}
+
+static void
+report(double secs)
+{
+	struct scheme_stats *st;
+	int i;
+
+	printf("%ld probes in %.2f s, %d clients, concurrency %d\n", started, secs, lg.clients, lg.concurrency);
+	printf("%-6s %9s %9s %7s %7s %12s %9s %9s %9s %9s %9s\n", "scheme", "requests", "redirects",
+		"other", "errors", "redirects/s", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+	for (i = 0; i < SCHEME_MAX; i++) {
+		st = &stats[i];
+		if (!st->requests)
+			continue;
+		qsort(st->latency, st->latency_len, sizeof(uint32_t), cmp_u32);
+		printf("%-6s %9ld %9ld %7ld %7ld %12.0f %9.2f %9.2f %9.2f %9.2f %9.2f\n", scheme_names[i],
+			st->requests, st->redirects, st->others, st->errors, secs > 0 ? st->redirects / secs : 0,
+			percentile_ms(st, 0.5), percentile_ms(st, 0.9), percentile_ms(st, 0.99),
+			percentile_ms(st, 0.999), percentile_ms(st, 1));
+	}
+}
+
+/** @internal
+ * Stub of /proc/net/arp covering every simulated client, for wifidog -a
+ */
+static int
+write_arp_file(const char *path)
+{
+	struct in_addr addr;
+	FILE *fp;
+	int i;
+
+	if (!(fp = fopen(path, "w"))) {
+		fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "IP address       HW type     Flags       HW address            Mask     Device\n");
+	for (i = 0; i < lg.clients; i++) {
+		addr.s_addr = htonl(lg.client_base + i + 1);
+		fprintf(fp, "%-16s 0x1         0x2         02:00:%02x:%02x:%02x:%02x     *        lo\n",
+			inet_ntoa(addr), (i >> 24) & 0xff, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	fprintf(stderr, "  -g <address>     gateway address (default %s)\n", DEFAULT_GW_ADDRESS);
+	fprintf(stderr, "  -p <port>        gateway http port (default %d)\n", DEFAULT_GW_PORT);
+	fprintf(stderr, "  -s <port>        gateway https port (default %d)\n", DEFAULT_GW_HTTPS_PORT);
+	fprintf(stderr, "  -S <percent>     share of probes sent over https (default 0)\n");
+	fprintf(stderr, "  -b <address>     first simulated client address minus one (default %s)\n", DEFAULT_CLIENT_BASE);
+	fprintf(stderr, "  -c <clients>     simulated clients (default %d)\n", DEFAULT_CLIENTS);
+	fprintf(stderr, "  -C <probes>      probes in flight (default %d)\n", DEFAULT_CONCURRENCY);
+	fprintf(stderr, "  -n <probes>      probes to send, 0 for no limit (default %d)\n", DEFAULT_REQUESTS);
+	fprintf(stderr, "  -d <seconds>     stop after this long\n");
+	fprintf(stderr, "  -a <path>        write a stub arp table for the clients, for wifidog -a\n");
+	fprintf(stderr, "  -h               this help\n");
+}
+
+static int
+parse_address(const char *s, struct sockaddr_in *sin, int port)
+{
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	return inet_aton(s, &sin->sin_addr) ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *gw_address = DEFAULT_GW_ADDRESS, *client_base = DEFAULT_CLIENT_BASE;
+	int gw_port = DEFAULT_GW_PORT, gw_https_port = DEFAULT_GW_HTTPS_PORT;
+	struct in_addr addr;
+	struct event *ev_duration = NULL;
+	struct timeval tv;
+	int c, i;
+
+	lg.clients = DEFAULT_CLIENTS;
+	lg.concurrency = DEFAULT_CONCURRENCY;
+	lg.requests = DEFAULT_REQUESTS;
+
+	while ((c = getopt(argc, argv, "g:p:s:S:b:c:C:n:d:a:h")) != -1) {
+		switch (c) {
+		case 'g':
+			gw_address = optarg;
+			break;
+		case 'p':
+			gw_port = atoi(optarg);
+			break;
+		case 's':
+			gw_https_port = atoi(optarg);
+			break;
+		case 'S':
+			lg.https_percent = atoi(optarg);
+			break;
+		case 'b':
+			client_base = optarg;
+			break;
+		case 'c':
+			lg.clients = atoi(optarg);
+			break;
+		case 'C':
+			lg.concurrency = atoi(optarg);
+			break;
+		case 'n':
+			lg.requests = atol(optarg);
+			break;
+		case 'd':
+			lg.duration = atoi(optarg);
+			break;
+		case 'a':
+			lg.arp_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (parse_address(gw_address, &lg.gw_http, gw_port) < 0 ||
+		parse_address(gw_address, &lg.gw_https, gw_https_port) < 0 ||
+		!inet_aton(client_base, &addr) || lg.clients <= 0 || lg.concurrency <= 0 ||
+		lg.https_percent < 0 || lg.https_percent > 100 || (!lg.requests && !lg.duration)) {
+		usage(argv[0]);
+		return 1;
+	}
+	lg.client_base = ntohl(addr.s_addr);
+
+	if (lg.arp_file && write_arp_file(lg.arp_file) < 0)
+		return 1;
+
+	SSL_library_init();
+	SSL_load_error_strings();
+	ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+
+	base = event_base_new();
+	if (lg.duration) {
+		tv.tv_sec = lg.duration;
+		tv.tv_usec = 0;
+		ev_duration = evtimer_new(base, duration_cb, NULL);
+		evtimer_add(ev_duration, &tv);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &run_start);
+	for (i = 0; i < lg.concurrency && !stopping; i++)
+		probe_start();
+	event_base_dispatch(base);
+
+	report(elapsed_since(&run_start));
+
+	if (ev_duration)
+		event_free(ev_duration);
+	event_base_free(base);
+	SSL_CTX_free(ssl_ctx);
+	return 0;
+}
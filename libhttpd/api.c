@@ -49,19 +49,8 @@ char *
 httpdUrlEncode(str)
 const char *str;
 {
-    char *new, *cp;
-
-    new = (char *)_httpd_escape(str);
-    if (new == NULL) {
-        return (NULL);
-    }
-    cp = new;
-    while (*cp) {
-        if (*cp == ' ')
-            *cp = '+';
-        cp++;
-    }
-    return (new);
+    /* a space is escaped as %20 like any other reserved byte */
+    return (_httpd_escape(str));
 }
 
 char *
@@ -207,6 +196,7 @@ int port;
         return (NULL);
     bzero(new, sizeof(httpd));
     new->port = port;
+    new->serverSock6 = -1;
     if (host == HTTP_ANY_ADDR)
         new->host = HTTP_ANY_ADDR;
     else
@@ -288,6 +278,40 @@ int port;
     return (new);
 }
 
+/*
+** Also accept connections on [::]:port.  The socket is v6 only so the
+** ipv4 listener keeps its own, possibly more specific, address.
+*/
+int
+httpdAddListener6(server)
+httpd *server;
+{
+    int sock, opt = 1;
+    struct sockaddr_in6 addr;
+
+    sock = socket(AF_INET6, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return (-1);
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(int)) < 0 ||
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&opt, sizeof(int)) < 0) {
+        close(sock);
+        return (-1);
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (int[]) {1}, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, (int[]) {1}, sizeof(int));
+
+    bzero(&addr, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons((u_short) server->port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 20) < 0) {
+        close(sock);
+        return (-1);
+    }
+    server->serverSock6 = sock;
+    return (0);
+}
+
 void
 httpdDestroy(server)
 httpd *server;
@@ -304,18 +328,24 @@ httpdGetConnection(server, timeout)
 httpd *server;
 struct timeval *timeout;
 {
-    int result;
+    int result, sock, maxSock;
     fd_set fds;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addrLen;
     request *r;
     /* Reset error */
     server->lastError = 0;
     FD_ZERO(&fds);
     FD_SET(server->serverSock, &fds);
+    maxSock = server->serverSock;
+    if (server->serverSock6 >= 0) {
+        FD_SET(server->serverSock6, &fds);
+        if (server->serverSock6 > maxSock)
+            maxSock = server->serverSock6;
+    }
     result = 0;
     while (result == 0) {
-        result = select(server->serverSock + 1, &fds, 0, 0, timeout);
+        result = select(maxSock + 1, &fds, 0, 0, timeout);
         if (result < 0) {
             server->lastError = -1;
             return (NULL);
@@ -336,12 +366,15 @@ struct timeval *timeout;
     }
     memset((void *)r, 0, sizeof(request));
     
-    r->clientSock = accept(server->serverSock, NULL, NULL);
+    /* both ready: the v6 one is still ready on the next call */
+    sock = FD_ISSET(server->serverSock, &fds) ? server->serverSock : server->serverSock6;
+    r->clientSock = accept(sock, NULL, NULL);
 	if (r->clientSock < 0) {
 		server->lastError = -1;
 		free(r);
 		return NULL;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &r->acceptTime);
 	
 	/* Get on with it */
     bzero(&addr, sizeof(addr));
@@ -352,7 +385,9 @@ struct timeval *timeout;
 		return NULL;
 	} 
 		
-	if(inet_ntop(AF_INET, &addr.sin_addr, r->clientAddr, HTTP_IP_ADDR_LEN)) {
+	if (addr.ss_family == AF_INET6) {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, r->clientAddr, HTTP_IP_ADDR_LEN);
+	} else if(inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, r->clientAddr, HTTP_IP_ADDR_LEN)) {
         r->clientAddr[HTTP_IP_ADDR_LEN - 1] = 0;
     } 
 	
@@ -373,13 +408,113 @@ struct timeval *timeout;
     return (r);
 }
 
+/*
+** Request parsing states.  The receive buffer is parsed in place, one
+** line as soon as its newline has arrived, so the socket is read in
+** whole chunks and nothing is copied but the fields we keep.
+*/
+#define	HTTPD_PARSE_REQUEST_LINE	0
+#define	HTTPD_PARSE_HEADERS		1
+#define	HTTPD_PARSE_DONE		2
+
+/*
+** Length of the method token at the start of buf, -1 once something
+** which can't be part of a method shows up before the space.  Lets
+** binary junk (TLS to the plain port...) be refused on the first read.
+*/
+static int
+_httpd_methodLength(const char *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] == ' ' || buf[i] == '\r')
+            return (i);
+        if (!isalpha((unsigned char)buf[i]))
+            return (-1);
+    }
+    return (i);
+}
+
+static int
+_httpd_badMethod(httpd * server, request * r, const char *method, int len)
+{
+    _httpd_net_write(r->clientSock, HTTP_METHOD_ERROR, strlen(HTTP_METHOD_ERROR));
+    _httpd_net_write(r->clientSock, (char *)method, len);
+    _httpd_writeErrorLog(server, r, LEVEL_ERROR, "Invalid method received");
+    return (-1);
+}
+
+static int
+_httpd_parseRequestLine(httpd * server, request * r, char *line)
+{
+    char *cp, *cp2;
+
+    cp = cp2 = line;
+    while (isalpha((unsigned char)*cp2))
+        cp2++;
+    if (*cp2 != 0)
+        *cp2++ = 0;
+    if (strcasecmp(cp, "GET") == 0)
+        r->request.method = HTTP_GET;
+    else if (strcasecmp(cp, "POST") == 0)
+        r->request.method = HTTP_POST;
+    if (r->request.method == 0)
+        return (_httpd_badMethod(server, r, cp, strlen(cp)));
+
+    cp = cp2;
+    while (*cp == ' ')
+        cp++;
+    cp2 = cp;
+    while (*cp2 != ' ' && *cp2 != 0)
+        cp2++;
+    if (*cp2 != 0)
+        *cp2++ = 0;
+    strncpy(r->request.path, cp, HTTP_MAX_URL);
+    r->request.path[HTTP_MAX_URL - 1] = 0;
+    _httpd_sanitiseUrl(r->request.path);
+
+    if (strncmp(cp2, "HTTP/1.0", 8) == 0)
+        r->request.version = HTTP_1_0;
+    else
+        r->request.version = HTTP_1_1;
+    return (0);
+}
+
+static void
+_httpd_parseHeader(request * r, char *line)
+{
+    char *cp;
+
+    switch (*line) {
+    case 'H':
+    case 'h':
+        /* acv@acv.ca/wifidog: Added decoding of host: if present. */
+        if (strncasecmp(line, "Host: ", 6) == 0) {
+            cp = line + 6;
+            strncpy(r->request.host, cp, HTTP_MAX_URL);
+            r->request.host[HTTP_MAX_URL - 1] = 0;
+        }
+        break;
+    case 'A':
+    case 'a':
+        if (strncasecmp(line, "Accept-Encoding:", 16) == 0) {
+            cp = line + 16;
+            // some Accept-Encoding is "gzip,deflate", some is "gzip, deflate"
+            while (*cp == ' ')
+                cp++;
+            if (strncasecmp(cp, "gzip", 4) == 0)
+                r->request.deflate = 1;
+        }
+        break;
+    }
+}
+
 int
 httpdReadRequest(httpd * server, request * r)
 {
-    char buf[HTTP_MAX_LEN] = {0};
-    int count, inHeaders;
-    char *cp, *cp2;
-    int _httpd_decode();
+    char *buf = r->readBuf, *line, *eol;
+    int len, start, n, state, skip;
 
     /*
      ** Setup for a standard response
@@ -390,133 +525,76 @@ httpdReadRequest(httpd * server, request * r)
     r->response.headersSent = 0;
 
     /*
-     ** Read the request
+     ** Read the request.  memchr() is the libc's word-at-a-time (or
+     ** SIMD) scan, so finding the end of a line is cheap whatever its
+     ** length.  A line longer than the buffer is cut there and the rest
+     ** of it dropped, memory stays bounded by the request structure.
      */
-    count = 0;
-    inHeaders = 1;
-    while (_httpd_readLine(r, buf, HTTP_MAX_LEN-1) > 0) {
-        count++;
-
-        /*
-         ** Special case for the first line.  Scan the request
-         ** method and path etc
-         */
-        if (count == 1) {
-            /*
-             ** First line.  Scan the request info
-             */
-            cp = cp2 = buf;
-            while (isalpha((unsigned char)*cp2))
-                cp2++;
-            *cp2 = 0;
-            if (strcasecmp(cp, "GET") == 0)
-                r->request.method = HTTP_GET;
-            if (strcasecmp(cp, "POST") == 0)
-                r->request.method = HTTP_POST;
-            if (r->request.method == 0) {
-                _httpd_net_write(r->clientSock, HTTP_METHOD_ERROR, strlen(HTTP_METHOD_ERROR));
-                _httpd_net_write(r->clientSock, cp, strlen(cp));
-                _httpd_writeErrorLog(server, r, LEVEL_ERROR, "Invalid method received");
-                return (-1);
-            }
-            cp = cp2 + 1;
-            while (*cp == ' ')
-                cp++;
-            cp2 = cp;
-            while (*cp2 != ' ' && *cp2 != 0)
-                cp2++;
-            *cp2 = 0;
-            strncpy(r->request.path, cp, HTTP_MAX_URL);
-            r->request.path[HTTP_MAX_URL - 1] = 0;
-            _httpd_sanitiseUrl(r->request.path);
-			
-			cp = cp2 + 1;
-			if(memcmp(cp, "HTTP/1.0", 8) == 0)
-				r->request.version = HTTP_1_0;
-			else 
-				r->request.version = HTTP_1_1; 
-            continue;
-        }
-
-        /*
-         ** Process the headers
-         */
-        if (inHeaders) {
-            if (*buf == 0) {
-                /*
-                 ** End of headers.  Continue if there's
-                 ** data to read
-                 */
-                break;
+    len = start = skip = 0;
+    state = HTTPD_PARSE_REQUEST_LINE;
+    while (state != HTTPD_PARSE_DONE) {
+        eol = memchr(buf + start, '\n', len - start);
+        if (eol == NULL) {
+            if (state == HTTPD_PARSE_REQUEST_LINE && !skip &&
+                _httpd_methodLength(buf + start, len - start) < 0) {
+                for (n = 0; isalpha((unsigned char)buf[start + n]); n++) ;
+                return (_httpd_badMethod(server, r, buf + start, n));
             }
-#if	0
-            if (strncasecmp(buf, "Authorization: ", 15) == 0) {
-                cp = strchr(buf, ':');
-                if (cp) {
-                    cp += 2;
-
-                    if (strncmp(cp, "Basic ", 6) != 0) {
-                        /* Unknown auth method */
-                    } else {
-                        char authBuf[100];
-
-                        cp = strchr(cp, ' ') + 1;
-                        _httpd_decode(cp, authBuf, 100);
-                        r->request.authLength = strlen(authBuf);
-                        cp = strchr(authBuf, ':');
-                        if (cp) {
-                            *cp = 0;
-                            strncpy(r->request.authPassword, cp + 1, HTTP_MAX_AUTH);
-                            r->request.authPassword[HTTP_MAX_AUTH - 1] = 0;
-                        }
-                        strncpy(r->request.authUser, authBuf, HTTP_MAX_AUTH);
-                        r->request.authUser[HTTP_MAX_AUTH - 1] = 0;
-                    }
-                }
+            if (start > 0) {
+                memmove(buf, buf + start, len - start);
+                len -= start;
+                start = 0;
             }
-#endif
-            /* acv@acv.ca/wifidog: Added decoding of host: if
-             * present. */
-            if (strncasecmp(buf, "Host: ", 6) == 0) {
-                cp = strchr(buf, ':');
-                if (cp) {
-                    cp += 2;
-                    strncpy(r->request.host, cp, HTTP_MAX_URL);
-                    r->request.host[HTTP_MAX_URL - 1] = 0;
-					// liudf added 20160223
-					// only parse Host
-					//inHeaders = 0;
-					//break;
-                }
+            if (len < HTTP_READ_BUF_LEN) {
+                n = _httpd_net_read(r->clientSock, buf + len, HTTP_READ_BUF_LEN - len);
+                if (n < 1)
+                    break;      /* peer is gone, go with what we have */
+                len += n;
+                continue;
             }
-			
-			if (strncasecmp(buf, "Accept-Encoding:", 16) == 0) {
-				cp = strchr(buf, ':');
-                if (cp) {
-                    cp += 2;
-					// some Accept-Encoding is "gzip,deflate", some is "gzip, deflate"
-					if (strncasecmp(cp, "gzip", 4) == 0) 
-						r->request.deflate = 1;                 
-                }
-			}
-			
-			if (strncasecmp(buf, "\r\n\r\n", 4) == 0) {
-				break;
-			}
-            /* End modification */
+            eol = buf + len;
+        }
+
+        line = buf + start;
+        start = eol - buf + (eol < buf + len);
+        if (skip) {
+            /* tail of an over long line */
+            skip = (eol == buf + len);
             continue;
         }
+        skip = (eol == buf + len);
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        *eol = 0;
+
+        if (state == HTTPD_PARSE_REQUEST_LINE) {
+            /* robustness: empty lines ahead of the request line are ignored */
+            if (*line == 0)
+                continue;
+            if (_httpd_parseRequestLine(server, r, line) < 0)
+                return (-1);
+            state = HTTPD_PARSE_HEADERS;
+        } else if (*line == 0) {
+            state = HTTPD_PARSE_DONE;
+        } else {
+            _httpd_parseHeader(r, line);
+        }
     }
 
+    /* whatever follows the headers is left for _httpd_readChar() */
+    r->readBufPtr = buf + start;
+    r->readBufRemain = len - start;
+    buf[len] = 0;
+
     /*
      ** Process any URL data
      */
-    cp = strchr(r->request.path, '?');
-    if (cp != NULL) {
-        *cp++ = 0;
-        strncpy(r->request.query, cp, sizeof(r->request.query));
+    line = strchr(r->request.path, '?');
+    if (line != NULL) {
+        *line++ = 0;
+        strncpy(r->request.query, line, sizeof(r->request.query));
         r->request.query[sizeof(r->request.query) - 1] = 0;
-        _httpd_storeData(r, cp);
+        _httpd_storeData(r, line);
     }
 
     return (0);
@@ -765,6 +843,35 @@ httpdOutputLengthDirect(request *r, const char *msg, int msg_len)
     _httpd_net_write(r->clientSock, msg, msg_len);
 }
 
+/* liudf added 20160616
+ * send headers and body segments with one writev, the caller's iovec
+ * is left untouched
+ */
+int
+httpdOutputVectorDirect(request *r, const struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[HTTP_MAX_IOV + 1];
+	char hdrBuf[HTTP_READ_BUF_LEN];
+	int i, n = 0, len = 0;
+
+	if (iovcnt < 0 || iovcnt > HTTP_MAX_IOV)
+		return -1;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (r->response.headersSent == 0) {
+		r->response.headersSent = 1;
+		vec[n].iov_base	= hdrBuf;
+		vec[n].iov_len	= _httpd_formatHeaders(r, hdrBuf, len, 0);
+		n++;
+	}
+	memcpy(vec + n, iov, iovcnt * sizeof(struct iovec));
+	r->response.responseLength += len;
+
+	return _httpd_net_writev(r->clientSock, vec, n + iovcnt);
+}
+
 void
 httpdOutputDirect(request * r, const char *msg)
 {
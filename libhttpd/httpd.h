@@ -32,6 +32,7 @@
 #define LIB_HTTPD_H 1
 
 #include <sys/time.h>
+#include <time.h>
 
 #if !defined(__ANSI_PROTO)
 #if defined(_WIN32) || defined(__STDC__) || defined(__cplusplus)
@@ -44,6 +45,7 @@
 #ifndef u_int
 #include <sys/types.h>
 #endif
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,7 +60,8 @@ extern "C" {
 #define HTTP_MAX_URL		1024
 #define HTTP_MAX_HEADERS	1024
 #define HTTP_MAX_AUTH		128
-#define	HTTP_IP_ADDR_LEN	17
+#define HTTP_MAX_IOV		64
+#define	HTTP_IP_ADDR_LEN	46	/* INET6_ADDRSTRLEN */
 #define	HTTP_TIME_STRING_LEN	40
 #define	HTTP_READ_BUF_LEN	4096
 #define	HTTP_ANY_ADDR		NULL
@@ -137,7 +140,7 @@ extern "C" {
     } httpAcl;
 
     typedef struct {
-        int port, serverSock, startTime, lastError;
+        int port, serverSock, serverSock6, startTime, lastError;
         char fileBasePath[HTTP_MAX_URL], *host;
         httpDir *content;
         httpAcl *defaultAcl;
@@ -151,6 +154,7 @@ extern "C" {
         httpRes response;
         httpVar *variables;
         char readBuf[HTTP_READ_BUF_LEN + 1], *readBufPtr, clientAddr[HTTP_IP_ADDR_LEN];
+        struct timespec acceptTime;     /* CLOCK_MONOTONIC */
     } request;
 
 /***********************************************************************
@@ -173,6 +177,8 @@ extern "C" {
 
     char *httpdRequestMethodName __ANSI_PROTO((request *));
     char *httpdUrlEncode __ANSI_PROTO((const char *));
+    int httpdUrlEncodeBuf __ANSI_PROTO((const char *, char *, int));
+    int httpdUrlDecodeBuf __ANSI_PROTO((const char *, char *, int));
 
     void httpdAddHeader __ANSI_PROTO((request *, const char *));
     void httpdSetContentType __ANSI_PROTO((request *, const char *));
@@ -182,11 +188,13 @@ extern "C" {
     void httpdEndRequest __ANSI_PROTO((request *));
 
     httpd *httpdCreate __ANSI_PROTO(());
+    int httpdAddListener6 __ANSI_PROTO((httpd *));
     void httpdFreeVariables __ANSI_PROTO((request *));
     void httpdDumpVariables __ANSI_PROTO((request *));
     void httpdOutput __ANSI_PROTO((request *, const char *));
     void httpdOutputDirect __ANSI_PROTO((request *, const char *));
 	void httpdOutputLengthDirect __ANSI_PROTO((request *, const char *, int));
+	int httpdOutputVectorDirect __ANSI_PROTO((request *, const struct iovec *, int));
     void httpdPrintf __ANSI_PROTO((request *, const char *, ...));
     void httpdProcessRequest __ANSI_PROTO((httpd *, request *));
     void httpdSendHeaders __ANSI_PROTO((request *));
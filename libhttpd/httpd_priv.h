@@ -59,6 +59,7 @@ extern "C" {
     void _httpd_sendStatic __ANSI_PROTO((httpd *, request *, char *));
     void _httpd_sendHeaders __ANSI_PROTO((request *, int, int);
         )
+    int _httpd_formatHeaders __ANSI_PROTO((request *, char *, int, int));
     void _httpd_sanitiseUrl __ANSI_PROTO((char *));
     void _httpd_freeVariables __ANSI_PROTO((httpVar *));
     void _httpd_formatTimeString __ANSI_PROTO((char *, int));
@@ -68,6 +69,7 @@ extern "C" {
 
     int _httpd_net_read __ANSI_PROTO((int, char *, int));
     int _httpd_net_write __ANSI_PROTO((int, char *, int));
+    int _httpd_net_writev __ANSI_PROTO((int, struct iovec *, int));
     int _httpd_readBuf __ANSI_PROTO((request *, char *, int));
     int _httpd_readChar __ANSI_PROTO((request *, char *));
     int _httpd_readLine __ANSI_PROTO((request *, char *, int));
@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/file.h>
+#include <sys/uio.h>
 #endif
 
 #include "httpd.h"
@@ -76,7 +77,8 @@ int len;
         fds.fd      = sock;
         fds.events   = POLLIN;
         nfds = poll(&fds, 1, 100);
-		if (nfds > 0 && fds.revents == POLLIN) {
+		/* a hung up peer has to be read too, read() tells EOF from error */
+		if (nfds > 0 && (fds.revents & (POLLIN | POLLHUP | POLLERR))) {
 #endif
 			nret = read(sock, buf+nread, len-nread);
 			if (nret > 0 && nret <= (len-nread)) {
@@ -154,6 +156,54 @@ int len;
 #endif
 }
 
+/* liudf added 20160616
+ * write a whole iovec array, like _httpd_net_write; iov is consumed on
+ * partial writes so it must be writable scratch owned by the caller
+ */
+int
+_httpd_net_writev(int sock, struct iovec *iov, int iovcnt)
+{
+	struct pollfd fds;
+	int i = 0, nfds = 0;
+	int nwrite = 0, nret = 0;
+
+	while (iovcnt > 0 && iov->iov_len == 0) {
+		iov++;
+		iovcnt--;
+	}
+	while (iovcnt > 0 && i++ < 100) {
+		memset(&fds, 0, sizeof(fds));
+		fds.fd		= sock;
+		fds.events	= POLLOUT;
+		nfds = poll(&fds, 1, 100);
+		if (nfds < 0)
+			return nfds;
+		if (nfds == 0 || !(fds.revents & POLLOUT))
+			continue;
+
+		nret = writev(sock, iov, iovcnt);
+		if (nret < 0 && errno == EINTR)
+			continue;
+		else if (nret < 0)
+			return -1;
+		else if (nret == 0)
+			return nwrite;
+
+		nwrite += nret;
+		while (iovcnt > 0 && (size_t)nret >= iov->iov_len) {
+			nret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nret;
+			iov->iov_len -= nret;
+		}
+	}
+
+	return iovcnt > 0 ? nfds : nwrite;
+}
+
 int
 _httpd_readChar(request * r, char *cp)
 {
@@ -330,40 +380,69 @@ int outbufsize;
     return (nbytesdecoded);
 }
 
+/*
+** URL coder tables.  _httpd_urlPlain marks the bytes which go out
+** unescaped: the xpalpha class of RFC 1630 (the former isAcceptable[]
+** table with the XPALPHA mask) less '&', and less '+' so a query value
+** survives the round trip, and less both quotes since encoded urls get
+** pasted into quoted HTML attributes and javascript strings.
+** _httpd_hexValue maps a hex digit of either case to its value and
+** everything else to -1.
+*/
+static const unsigned char _httpd_urlPlain[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     /* 0x */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     /* 1x */
+    0, 1, 0, 0, 1, 0, 0, 0, 1, 1, 1, 0, 1, 1, 1, 0,     /* 2x */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,     /* 3x */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,     /* 4x */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,     /* 5x */
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,     /* 6x */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,     /* 7x */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     /* 8x */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     /* 9x */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     /* Ax */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     /* Bx */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     /* Cx */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     /* Dx */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     /* Ex */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0      /* Fx */
+};
+
+static const signed char _httpd_hexValue[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* 0x */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* 1x */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* 2x */
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,     /* 3x */
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* 4x */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* 5x */
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* 6x */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* 7x */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* 8x */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* 9x */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* Ax */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* Bx */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* Cx */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* Dx */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     /* Ex */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1      /* Fx */
+};
+
 char
 _httpd_from_hex(char c)
 {
-    return c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : c - 'a' + 10; /* accept small letters just in case */
+    int v = _httpd_hexValue[(unsigned char)c];
+
+    return (v < 0 ? 0 : v);
 }
 
 char *
 _httpd_unescape(str)
 char *str;
 {
-    char *p = str;
-    char *q = str;
-
     if (!str)
         return ("");
-    while (*p) {
-        if (*p == '%') {
-            p++;
-            if (*p)
-                *q = _httpd_from_hex(*p++) * 16;
-            if (*p)
-                *q = (*q + _httpd_from_hex(*p++));
-            q++;
-        } else {
-            if (*p == '+') {
-                *q++ = ' ';
-                p++;
-            } else {
-                *q++ = *p++;
-            }
-        }
-    }
-
-    *q++ = 0;
+    /* decoding never grows the string, so it can be done in place */
+    httpdUrlDecodeBuf(str, str, strlen(str) + 1);
     return str;
 }
 
@@ -391,58 +470,30 @@ httpVar *var;
 void
 _httpd_storeData(request * r, char *query)
 {
-    char *cp, *cp2, *var, *val, *tmpVal;
+    char *name, *val, *last, *next;
 
     if (!query)
         return;
 
-    var = (char *)malloc(strlen(query) + 1);
-
-    cp = query;
-    cp2 = var;
-    bzero(var, strlen(query) + 1);
-    val = NULL;
-    while (*cp) {
-        if (*cp == '=') {
-            cp++;
-            *cp2 = 0;
-            val = cp;
-            continue;
-        }
-        if (*cp == '&') {
-            *cp = 0;
-            tmpVal = _httpd_unescape(val);
-            httpdAddVariable(r, var, tmpVal);
-            cp++;
-            cp2 = var;
-            val = NULL;
-            continue;
-        }
+    /*
+    ** split the query in place, only the stored copies are allocated.
+    ** as before, a name without '=' is stored with an empty value, unless
+    ** it is the last one of the query which is dropped: "a&b=1&c" gives
+    ** a="" and b=1; and the value starts after the last '=': "a=1=2" is a=2
+    */
+    for (name = query; name; name = next) {
+        next = strchr(name, '&');
+        if (next)
+            *next++ = 0;
+        val = strchr(name, '=');
         if (val) {
-            cp++;
-        } else {
-            *cp2 = *cp++;
-            /*
-               if (*cp2 == '.')
-               {
-               strcpy(cp2,"_dot_");
-               cp2 += 5;
-               }
-               else
-               {
-             */
-            cp2++;
-            /*
-               }
-             */
-        }
-    }
-    if (val != NULL) {
-        *cp = 0;
-        tmpVal = _httpd_unescape(val);
-        httpdAddVariable(r, var, tmpVal);
+            *val++ = 0;
+            if ((last = strrchr(val, '=')) != NULL)
+                val = last + 1;
+        } else if (!next)
+            break;
+        httpdAddVariable(r, name, _httpd_unescape(val));
     }
-    free(var);
 }
 
 void
@@ -456,17 +507,12 @@ _httpd_formatTimeString(char *ptr, int clock)
     strftime(ptr, HTTP_TIME_STRING_LEN, "%a, %d %b %Y %T GMT", timePtr);
 }
 
-void
-_httpd_sendHeaders(request * r, int contentLength, int modTime)
+int
+_httpd_formatHeaders(request * r, char *hdrBuf, int contentLength, int modTime)
 {
     char timeBuf[HTTP_TIME_STRING_LEN] = {0};
-	char hdrBuf[HTTP_READ_BUF_LEN] = {0};
 	int  totalLength = 0, nret;
 
-    if (r->response.headersSent)
-        return;
-
-    r->response.headersSent = 1;
 	nret = snprintf(hdrBuf, HTTP_READ_BUF_LEN, "HTTP/1.1 ");
 	totalLength += nret;
 	nret = snprintf(hdrBuf+totalLength, HTTP_READ_BUF_LEN-totalLength, "%s", r->response.response);
@@ -504,6 +550,20 @@ _httpd_sendHeaders(request * r, int contentLength, int modTime)
 	totalLength += nret;
 	nret = snprintf(hdrBuf+totalLength, HTTP_READ_BUF_LEN-totalLength, "\r\n");
 	totalLength += nret;
+	return totalLength < HTTP_READ_BUF_LEN ? totalLength : HTTP_READ_BUF_LEN - 1;
+}
+
+void
+_httpd_sendHeaders(request * r, int contentLength, int modTime)
+{
+	char hdrBuf[HTTP_READ_BUF_LEN] = {0};
+	int  totalLength;
+
+    if (r->response.headersSent)
+        return;
+
+    r->response.headersSent = 1;
+	totalLength = _httpd_formatHeaders(r, hdrBuf, contentLength, modTime);
 	_httpd_net_write(r->clientSock, hdrBuf, totalLength);
 }
 
@@ -701,55 +761,117 @@ _httpd_checkLastModified(request * r, int modTime)
     return (1);
 }
 
-static unsigned char isAcceptable[96] =
-/* Overencodes */
-#define URL_XALPHAS     (unsigned char) 1
-#define URL_XPALPHAS    (unsigned char) 2
-/*      Bit 0           xalpha          -- see RFC 1630
-**      Bit 1           xpalpha         -- as xalpha but with plus.
-**      Bit 2 ...       path            -- as xpalpha but with /
+static const char _httpd_hexDigits[] = "0123456789ABCDEF";
+
+/*
+** Escaped length of str, not counting the terminator
+*/
+static int
+_httpd_escapedLength(const char *str)
+{
+    const unsigned char *p;
+    int len = 0;
+
+    for (p = (const unsigned char *)str; *p; p++)
+        len += _httpd_urlPlain[*p] ? 1 : 3;
+    return (len);
+}
+
+/*
+** Escape src into dst, dstLen bytes big.  Returns the length of the
+** result, or -1 with dst emptied when it doesn't fit.
 */
-    /*   0 1 2 3 4 5 6 7 8 9 A B C D E F */
-{ 0, 7, 7, 0, 7, 0, 7, 7, 7, 7, 7, 6, 7, 7, 7, 4,       /* 2x   !"#$%&'()*+,-./ */
-    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 0, 0, 0, 0, 0, 0,     /* 3x  0123456789:;<=>?  */
-    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,     /* 4x  @ABCDEFGHIJKLMNO */
-    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 0, 0, 0, 0, 7,     /* 5X  PQRSTUVWXYZ[\]^_ */
-    0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,     /* 6x  `abcdefghijklmno */
-    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 0, 0, 0, 0, 0
-};                              /* 7X  pqrstuvwxyz{\}~ DEL */
+int
+httpdUrlEncodeBuf(src, dst, dstLen)
+const char *src;
+char *dst;
+int dstLen;
+{
+    const unsigned char *p, *run;
+    char *q, *end;
+    int n;
+
+    if (dstLen < 1)
+        return (-1);
+    q = dst;
+    end = dst + dstLen - 1;
+    p = (const unsigned char *)src;
+    while (*p) {
+        /* copy runs of plain bytes in one go */
+        for (run = p; _httpd_urlPlain[*p]; p++) ;
+        n = p - run;
+        if (n > end - q)
+            goto overflow;
+        memcpy(q, run, n);
+        q += n;
+        if (*p == 0)
+            break;
+        if (end - q < 3)
+            goto overflow;
+        q[0] = '%';
+        q[1] = _httpd_hexDigits[*p >> 4];
+        q[2] = _httpd_hexDigits[*p & 15];
+        q += 3;
+        p++;
+    }
+    *q = 0;
+    return (q - dst);
 
-#define ACCEPTABLE(a)   ( a!='&' && a>=32 && a<128 && ((isAcceptable[a-32]) & mask))
+  overflow:
+    *dst = 0;
+    return (-1);
+}
 
-static char *hex = "0123456789ABCDEF";
+/*
+** Unescape src into dst, dstLen bytes big, '+' becomes a space.  dst may
+** be src itself.  Returns the length of the result, or -1 with dst
+** emptied when it doesn't fit.
+*/
+int
+httpdUrlDecodeBuf(src, dst, dstLen)
+const char *src;
+char *dst;
+int dstLen;
+{
+    const unsigned char *p;
+    char *q, *end;
+    int hi, lo;
+
+    if (dstLen < 1)
+        return (-1);
+    q = dst;
+    end = dst + dstLen - 1;
+    for (p = (const unsigned char *)src; *p; p++) {
+        if (q == end) {
+            *dst = 0;
+            return (-1);
+        }
+        if (*p == '%' && (hi = _httpd_hexValue[p[1]]) >= 0 && (lo = _httpd_hexValue[p[2]]) >= 0) {
+            *q++ = (char)(hi << 4 | lo);
+            p += 2;
+        } else if (*p == '+') {
+            *q++ = ' ';
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q = 0;
+    return (q - dst);
+}
 
 char *
 _httpd_escape(str)
 const char *str;
 {
-    unsigned char mask = URL_XPALPHAS;
-    const char *p;
-    char *q;
     char *result;
-    int unacceptable = 0;
-    for (p = str; *p; p++)
-        if (!ACCEPTABLE((unsigned char)*p))
-            unacceptable += 2;
-    result = (char *)malloc(p - str + unacceptable + 1);
-    bzero(result, (p - str + unacceptable + 1));
+    int len;
 
+    len = _httpd_escapedLength(str) + 1;
+    result = (char *)malloc(len);
     if (result == NULL) {
         return (NULL);
     }
-    for (q = result, p = str; *p; p++) {
-        unsigned char a = *p;
-        if (!ACCEPTABLE(a)) {
-            *q++ = '%';         /* Means hex commming */
-            *q++ = hex[a >> 4];
-            *q++ = hex[a & 15];
-        } else
-            *q++ = *p;
-    }
-    *q++ = 0;                   /* Terminate */
+    httpdUrlEncodeBuf(str, result, len);
     return result;
 }
 
@@ -64,6 +64,7 @@ thread_client_timeout_check(const void *arg)
     struct timespec timeout;
     t_auth_serv *auth_server = get_auth_server();
     struct evhttps_request_context *context = NULL;
+    time_t last_refresh = time(NULL);
 
     if (auth_server->authserv_use_ssl) {
         context = evhttps_context_init();
@@ -74,8 +75,8 @@ thread_client_timeout_check(const void *arg)
     }
 
     while (1) {
-        /* Sleep for config.checkinterval seconds... */
-        timeout.tv_sec = time(NULL) + config_get_config()->checkinterval;
+        /* Sleep for a tick, every client has its own deadline in the client timer wheel */
+        timeout.tv_sec = time(NULL) + CLIENT_TIMER_TICK;
         timeout.tv_nsec = 0;
 
         /* Mutex must be locked for pthread_cond_timedwait... */
@@ -87,14 +88,22 @@ thread_client_timeout_check(const void *arg)
         /* No longer needs to be locked */
         pthread_mutex_unlock(&cond_mutex);
 
-        debug(LOG_DEBUG, "Running fw_counter()");
+        /* ...the firewall counters and trusted macs are still refreshed every config.checkinterval seconds */
+        if (time(NULL) - last_refresh >= config_get_config()->checkinterval || time(NULL) < last_refresh) {
+            last_refresh = time(NULL);
+            debug(LOG_DEBUG, "Running fw_counter()");
+
+            fw_refresh_clients_activity();
+            if (auth_server->authserv_use_ssl)
+                evhttps_update_trusted_mac_list_status(context);
+            else
+                update_trusted_mac_list_status();
+        }
 
         if (auth_server->authserv_use_ssl) {
             evhttps_fw_sync_with_authserver(context);
-            evhttps_update_trusted_mac_list_status(context);
         } else {
             fw_sync_with_authserver(); 
-            update_trusted_mac_list_status();
         }  
     }
 
@@ -170,6 +179,7 @@ authenticate_client(request * r)
     t_client *client, *tmp;
     t_authresponse auth_response; 
     char *urlFragment = NULL;
+    char *mac = NULL;
 
     LOCK_CLIENT_LIST();
     client = client_dup(client_list_find_by_ip(r->clientAddr));
@@ -277,11 +287,11 @@ authenticate_client(request * r)
         break;
 
     case AUTH_VALIDATION:
-    	UNLOCK_CLIENT_LIST();
         /* They just got validated for X minutes to check their email */
         debug(LOG_INFO, "Got VALIDATION from central server authenticating token %s from %s at %s"
               "- adding to firewall and redirecting them to activate message", client->token, client->ip, client->mac);
         fw_allow(client, FW_MARK_PROBATION);
+    	UNLOCK_CLIENT_LIST();
         safe_asprintf(&urlFragment, "%smessage=%s",
                       auth_server->authserv_msg_script_path_fragment, GATEWAY_MESSAGE_ACTIVATE_ACCOUNT);
         http_send_redirect_to_auth(r, urlFragment, "Redirect to activate message");
@@ -289,34 +299,38 @@ authenticate_client(request * r)
         break;
 
     case AUTH_ALLOWED:
-        UNLOCK_CLIENT_LIST();
         /* Logged in successfully as a regular account */
         debug(LOG_INFO, "Got ALLOWED from central server authenticating token %s from %s at %s - "
               "adding to firewall and redirecting them to portal", client->token, client->ip, client->mac);
-        fw_allow(client, FW_MARK_KNOWN);
-    	
 		//>>> liudf added 20160112
 		client->first_login = time(NULL);
 		client->is_online = 1;
+		//<<< liudf added end
+        /* fw_allow journals the client, it must be complete and still listed */
+        fw_allow(client, FW_MARK_KNOWN);
+        mac = safe_strdup(client->mac);
+        if(!httpdGetVariableByName(r, "type"))
+        	safe_asprintf(&urlFragment, "%sgw_id=%s&channel_path=%s&mac=%s&name=%s", 
+				auth_server->authserv_portal_script_path_fragment, 
+				config->gw_id,
+				g_channel_path?g_channel_path:"null",
+				client->mac?client->mac:"null",
+				client->name?client->name:"null");
+    	UNLOCK_CLIENT_LIST();
+
         {
             LOCK_OFFLINE_CLIENT_LIST();
-            t_offline_client *o_client = offline_client_list_find_by_mac(client->mac);    
+            t_offline_client *o_client = offline_client_list_find_by_mac(mac);    
             if(o_client)
                 offline_client_list_delete(o_client);
             UNLOCK_OFFLINE_CLIENT_LIST();
         }
+        free(mac);
 		
-		//<<< liudf added end
         served_this_session++;
 		if(httpdGetVariableByName(r, "type")) {
         	send_http_page_direct(r, "<htm><body>weixin auth success!</body><html>");
 		} else {
-        	safe_asprintf(&urlFragment, "%sgw_id=%s&channel_path=%s&mac=%s&name=%s", 
-				auth_server->authserv_portal_script_path_fragment, 
-				config->gw_id,
-				g_channel_path?g_channel_path:"null",
-				client->mac?client->mac:"null",
-				client->name?client->name:"null");
         	http_send_redirect_to_auth(r, urlFragment, "Redirect to portal");
         	free(urlFragment);
 		}
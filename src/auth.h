@@ -63,6 +63,9 @@ void evhttps_logout_client(void *, t_client *);
 /** @brief Authenticate a single client against the central server */
 void authenticate_client(request *);
 
+/** @brief Seconds between two runs of the client timer wheel */
+#define CLIENT_TIMER_TICK 1
+
 /** @brief Periodically check if connections expired */
 void thread_client_timeout_check(const void *arg);
 
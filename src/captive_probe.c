@@ -0,0 +1,388 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file captive_probe.c
+  @brief answer the captive portal detection probes of known systems from a table
+
+  Phones and laptops fetch a well known url as soon as they join the
+  network and again every few seconds while the portal stays unanswered.
+  Such a request is recognised by host and path with one hash lookup,
+  and answered from responses built once at startup: Apple's first probe
+  gets the page that keeps its Captive Network Assistant waiting, later
+  probes of the same client replay the redirect url built for it on the
+  previous one instead of building it again. Clients are tracked by ip and
+  mac, the caller has resolved the mac and run its client checks first, so
+  an address handed to another device within PROBE_URL_TTL starts over.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include <httpd.h>
+#include "httpd_priv.h"
+
+#include "safe.h"
+#include "debug.h"
+#include "common.h"
+#include "conf.h"
+#include "firewall.h"
+#include "client_list.h"
+#include "metrics.h"
+#include "util.h"
+#include "captive_probe.h"
+
+typedef enum {
+	PROBE_OS_APPLE,
+	PROBE_OS_ANDROID,
+	PROBE_OS_WINDOWS,
+	PROBE_OS_OTHER
+} probe_os_t;
+
+struct captive_probe {
+	const char	*host;
+	const char	*path;	/** NULL matches every path of the host */
+	probe_os_t	os;
+};
+
+static const struct captive_probe probes[] = {
+	{ "captive.apple.com",						NULL,							PROBE_OS_APPLE },
+	{ "www.apple.com",							NULL,							PROBE_OS_APPLE },
+	{ "www.appleiphonecell.com",				NULL,							PROBE_OS_APPLE },
+	{ "connectivitycheck.gstatic.com",			"/generate_204",				PROBE_OS_ANDROID },
+	{ "connectivitycheck.android.com",			"/generate_204",				PROBE_OS_ANDROID },
+	{ "clients1.google.com",					"/generate_204",				PROBE_OS_ANDROID },
+	{ "clients3.google.com",					"/generate_204",				PROBE_OS_ANDROID },
+	{ "www.google.com",							"/gen_204",						PROBE_OS_ANDROID },
+	{ "www.gstatic.com",						"/generate_204",				PROBE_OS_ANDROID },
+	{ "connect.rom.miui.com",					"/generate_204",				PROBE_OS_ANDROID },
+	{ "connectivitycheck.platform.hicloud.com",	"/generate_204",				PROBE_OS_ANDROID },
+	{ "wifi.vivo.com.cn",						"/generate_204",				PROBE_OS_ANDROID },
+	{ "www.msftconnecttest.com",				"/connecttest.txt",				PROBE_OS_WINDOWS },
+	{ "www.msftconnecttest.com",				"/redirect",					PROBE_OS_WINDOWS },
+	{ "www.msftncsi.com",						"/ncsi.txt",					PROBE_OS_WINDOWS },
+	{ "detectportal.firefox.com",				"/success.txt",					PROBE_OS_OTHER },
+	{ "detectportal.firefox.com",				"/canonical.html",				PROBE_OS_OTHER },
+	{ "connectivity-check.ubuntu.com",			"/",							PROBE_OS_OTHER },
+	{ "nmcheck.gnome.org",						"/check_network_status.txt",	PROBE_OS_OTHER },
+};
+
+#define	NR_PROBES			(int)(sizeof(probes) / sizeof(probes[0]))
+#define	PROBE_INDEX_SIZE	64	/** power of two, well above NR_PROBES */
+#define	PROBE_WINDOW		8	/** slots of the client table searched per ip */
+
+static signed char probe_index[PROBE_INDEX_SIZE];
+
+typedef enum {
+	PROBE_STATE_NEW,
+	PROBE_STATE_WISPERED,	/** apple client held with the wisper page */
+} probe_state_t;
+
+/** Way a probe gets answered */
+typedef enum {
+	PROBE_REPLY_REDIRECT,
+	PROBE_REPLY_APPLE,		/** "Success" page that loads the login page */
+	PROBE_REPLY_TEMPORARY,	/** same, after letting the mac out for a while */
+} probe_reply_t;
+
+struct probe_client {
+	uint32_t		ip;			/** ip_key_fold of the client address */
+	probe_state_t	state;
+	int				probe;		/** the probe redir_url was built for */
+	time_t			first_seen;
+	time_t			last_seen;
+	time_t			url_time;
+	int				hits;		/** apple probes */
+	char			mac[18];	/** with ip, identifies the client */
+	char			*redir_url;
+};
+
+static pthread_mutex_t probe_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct probe_client probe_clients[PROBE_CLIENTS];
+
+#define	PROBE_HEADERS	"Connection: close\r\n"						\
+						"Content-Type: text/html\r\n"				\
+						"Cache-Control: no-store, must-revalidate\r\n"	\
+						"Expires: 0\r\n"							\
+						"Pragma: no-cache\r\n"
+
+static const char redirect_head[] = "HTTP/1.1 307 Redirect to login page\r\n"
+				"Location: ";
+static const char redirect_tail[] = "\r\n"
+				PROBE_HEADERS
+				"Content-Length: 0\r\n"
+				"\r\n";
+
+static const char apple_head[] = "HTTP/1.1 200 OK\r\n"
+				PROBE_HEADERS
+				"\r\n"
+				"<!DOCTYPE html>"
+				"<html>"
+				"<title>Success</title>"
+				"<script type=\"text/javascript\">"
+					"window.location.replace(\"";
+static const char apple_tail[] = "\");"
+				"</script>"
+				"<body>"
+				"Success"
+				"</body>"
+				"</html>";
+
+#define	APPLE_WISPER	"<!DOCTYPE html>"	\
+				"<html>"	\
+				"<script type=\"text/javascript\">"	\
+					"window.setTimeout(function() {location.href = \"captive.apple.com/hotspot-detect.html\";}, 12000);"	\
+				"</script>"	\
+				"<body>"	\
+				"</body>"	\
+				"</html>"
+
+static char apple_wisper[512];
+static int apple_wisper_len;
+
+static unsigned int
+probe_hash(const char *host, const char *path)
+{
+	unsigned int h = 2166136261u; // FNV-1a
+	for (; *host != '\0'; host++) {
+		h ^= (unsigned char)(*host | 0x20);	// host names are case insensitive
+		h *= 16777619u;
+	}
+	h ^= '/';
+	h *= 16777619u;
+	for (; path && *path != '\0'; path++) {
+		h ^= (unsigned char)*path;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void
+captive_probe_init(void)
+{
+	int i, slot;
+
+	memset(probe_index, -1, sizeof(probe_index));
+	for (i = 0; i < NR_PROBES; i++) {
+		slot = probe_hash(probes[i].host, probes[i].path) & (PROBE_INDEX_SIZE - 1);
+		while (probe_index[slot] >= 0)
+			slot = (slot + 1) & (PROBE_INDEX_SIZE - 1);
+		probe_index[slot] = i;
+	}
+
+	apple_wisper_len = snprintf(apple_wisper, sizeof(apple_wisper),
+			"HTTP/1.1 200 OK\r\n" PROBE_HEADERS "Content-Length: %d\r\n\r\n" APPLE_WISPER,
+			(int)(sizeof(APPLE_WISPER) - 1));
+}
+
+static int
+probe_find(const char *host, const char *path)
+{
+	int slot = probe_hash(host, path) & (PROBE_INDEX_SIZE - 1);
+	int i;
+
+	while ((i = probe_index[slot]) >= 0) {
+		if (strcasecmp(probes[i].host, host) == 0 &&
+			(probes[i].path == NULL ? path == NULL : path && strcmp(probes[i].path, path) == 0))
+			return i;
+		slot = (slot + 1) & (PROBE_INDEX_SIZE - 1);
+	}
+	return -1;
+}
+
+int
+captive_probe_lookup(const char *host, const char *path)
+{
+	int i;
+
+	if (!host || host[0] == '\0')
+		return -1;
+	if ((i = probe_find(host, path)) < 0)
+		i = probe_find(host, NULL);
+	return i;
+}
+
+/** @internal
+ * Slot of the client, reset if new, idle for too long or if its ip now
+ * belongs to another mac. Called with the lock held.
+ */
+static struct probe_client *
+probe_client_get(uint32_t ip, const char *mac, time_t now)
+{
+	unsigned int start = (ip * 2654435761u) >> 24;	// PROBE_CLIENTS slots
+	struct probe_client *c, *victim = NULL;
+	int i;
+
+	for (i = 0; i < PROBE_WINDOW; i++) {
+		c = &probe_clients[(start + i) % PROBE_CLIENTS];
+		if (c->ip == ip)
+			break;
+		if (!victim || c->last_seen < victim->last_seen)
+			victim = c;
+		c = NULL;
+	}
+
+	if (c && now - c->last_seen <= PROBE_CLIENT_IDLE && strcasecmp(c->mac, mac) == 0)
+		return c;
+	if (!c)
+		c = victim;
+
+	free(c->redir_url);
+	memset(c, 0, sizeof(*c));
+	c->ip = ip;
+	strncpy(c->mac, mac, sizeof(c->mac) - 1);
+	c->first_seen = now;
+	return c;
+}
+
+/** @internal
+ * Apple's assistant pops up the login page only once it believes it is
+ * captive: the wisper page keeps it quiet at first, then HTTP/1.0 probes,
+ * which come from the assistant itself, get the "Success" page.
+ */
+static probe_reply_t
+probe_client_decide(const struct probe_client *c, int probe, const request *r)
+{
+	if (probes[probe].os != PROBE_OS_APPLE || c->state != PROBE_STATE_WISPERED)
+		return PROBE_REPLY_REDIRECT;
+
+	debug(LOG_DEBUG, "Into %s hit_counts %d interval %d http version %d",
+		probes[probe].host, c->hits, (int)(c->last_seen - c->first_seen), r->request.version);
+	if (r->request.version != HTTP_1_0)
+		return PROBE_REPLY_REDIRECT;
+	if (c->last_seen - c->first_seen > 20)
+		return PROBE_REPLY_TEMPORARY;
+	return c->hits > 2 ? PROBE_REPLY_APPLE : PROBE_REPLY_REDIRECT;
+}
+
+static void
+probe_send(request *r, probe_reply_t reply, const char *mac, const char *redir_url)
+{
+	struct iovec iov[3];
+
+	if (reply == PROBE_REPLY_TEMPORARY)
+		fw_set_mac_temporary(mac, 0);
+
+	if (reply == PROBE_REPLY_REDIRECT) {
+		iov[0].iov_base = (void *)redirect_head;
+		iov[0].iov_len	= sizeof(redirect_head) - 1;
+		iov[2].iov_base = (void *)redirect_tail;
+		iov[2].iov_len	= sizeof(redirect_tail) - 1;
+	} else {
+		iov[0].iov_base = (void *)apple_head;
+		iov[0].iov_len	= sizeof(apple_head) - 1;
+		iov[2].iov_base = (void *)apple_tail;
+		iov[2].iov_len	= sizeof(apple_tail) - 1;
+	}
+	iov[1].iov_base = (void *)redir_url;
+	iov[1].iov_len	= strlen(redir_url);
+
+	_httpd_net_writev(r->clientSock, iov, 3);
+	_httpd_closeSocket(r);
+}
+
+int
+captive_probe_reply(request *r, int probe, const char *mac)
+{
+	struct probe_client *c;
+	t_ip_key key;
+	time_t now = time(NULL);
+	char url[MAX_BUF];
+	probe_reply_t reply;
+
+	if (!ip_key_parse(r->clientAddr, &key))
+		return 0;
+
+	pthread_mutex_lock(&probe_clients_mutex);
+	c = probe_client_get(ip_key_fold(&key), mac, now);
+	c->last_seen = now;
+	if (probes[probe].os == PROBE_OS_APPLE)
+		c->hits++;
+
+	if (probes[probe].os == PROBE_OS_APPLE && c->state == PROBE_STATE_NEW &&
+		config_get_config()->bypass_apple_cna) {
+		c->state = PROBE_STATE_WISPERED;
+		pthread_mutex_unlock(&probe_clients_mutex);
+
+		debug(LOG_DEBUG, "Holding the captive assistant of %s with the wisper page", r->clientAddr);
+		metric_inc(METRIC_HTTP_PROBES);
+		_httpd_net_write(r->clientSock, apple_wisper, apple_wisper_len);
+		_httpd_closeSocket(r);
+		return 1;
+	}
+
+	if (!c->redir_url || c->probe != probe || now - c->url_time > PROBE_URL_TTL ||
+		strlen(c->redir_url) >= sizeof(url)) {
+		pthread_mutex_unlock(&probe_clients_mutex);
+		return 0;
+	}
+	reply = probe_client_decide(c, probe, r);
+	strcpy(url, c->redir_url);
+	pthread_mutex_unlock(&probe_clients_mutex);
+
+	debug(LOG_DEBUG, "Answered probe of %s%s from %s out of the probe table",
+		r->request.host, r->request.path, r->clientAddr);
+	metric_inc(METRIC_HTTP_PROBES);
+	probe_send(r, reply, mac, url);
+	return 1;
+}
+
+void
+captive_probe_redirect(request *r, int probe, const char *mac, const char *redir_url)
+{
+	struct probe_client *c;
+	t_ip_key key;
+	t_offline_client *o_client;
+	time_t now = time(NULL);
+	probe_reply_t reply = PROBE_REPLY_REDIRECT;
+
+	if (ip_key_parse(r->clientAddr, &key)) {
+		pthread_mutex_lock(&probe_clients_mutex);
+		c = probe_client_get(ip_key_fold(&key), mac, now);
+		c->last_seen = now;
+		c->probe = probe;
+		c->url_time = now;
+		free(c->redir_url);
+		c->redir_url = safe_strdup(redir_url);
+		reply = probe_client_decide(c, probe, r);
+		pthread_mutex_unlock(&probe_clients_mutex);
+	}
+
+	if (probes[probe].os == PROBE_OS_APPLE) {
+		/* still shown as unconnected in the status until it logs in */
+		LOCK_OFFLINE_CLIENT_LIST();
+		if ((o_client = offline_client_list_find_by_mac(mac)) == NULL)
+			offline_client_list_add(r->clientAddr, mac);
+		else
+			o_client->last_login = now;
+		UNLOCK_OFFLINE_CLIENT_LIST();
+	}
+
+	probe_send(r, reply, mac, redir_url);
+}
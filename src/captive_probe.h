@@ -0,0 +1,55 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file captive_probe.h
+  @brief answer the captive portal detection probes of known systems from a table
+  */
+
+#ifndef	_CAPTIVE_PROBE_H_
+#define	_CAPTIVE_PROBE_H_
+
+#include <stdio.h>
+
+#include <httpd.h>
+
+/** Clients whose probe state is kept, oldest are evicted first */
+#define	PROBE_CLIENTS		256
+/** Seconds without a probe before a client starts over */
+#define	PROBE_CLIENT_IDLE	120
+/** Seconds a redirect url built for a client is replayed to its probes */
+#define	PROBE_URL_TTL		30
+
+/** @brief Hash the probe table, called once before the http server starts */
+void captive_probe_init(void);
+
+/** @brief Index of the probe asked for by host and path, or -1 for any other request */
+int captive_probe_lookup(const char *host, const char *path);
+
+/** @brief Answer a probe from the table and the state of its client alone,
+ * once the caller has resolved the mac of the client and found it must be redirected
+ * @return 1 if answered and the socket closed, 0 if the redirect url must be built first */
+int captive_probe_reply(request *, int probe, const char *mac);
+
+/** @brief Answer a probe with the redirect url just built and remember it for the next probes */
+void captive_probe_redirect(request *, int probe, const char *mac, const char *redir_url);
+
+#endif
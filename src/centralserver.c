@@ -54,6 +54,8 @@
 #include "debug.h"
 #include "simple_http.h"
 #include "http.h"
+#include "event_log.h"
+#include "metrics.h"
 
 json_object *
 auth_server_roam_request(const char *mac)
@@ -144,7 +146,7 @@ get_auth_uri(const char *request_type, client_type_t type, void *data)
     char *ip    = NULL;
     char *mac   = NULL;
     char *name  = NULL;
-    char *safe_token    = NULL;
+    char safe_token[HTTP_MAX_URL * 3] = {0};
     unsigned long long int incoming = 0,  outgoing = 0, incoming_delta = 0, outgoing_delta = 0;
     time_t first_login = 0;
     unsigned int online_time = 0;
@@ -156,7 +158,7 @@ get_auth_uri(const char *request_type, client_type_t type, void *data)
         t_client *o_client = (t_client *)data;
         ip  = o_client->ip;
         mac = o_client->mac;
-        safe_token = httpdUrlEncode(o_client->token);
+        httpdUrlEncodeBuf(o_client->token, safe_token, sizeof(safe_token));
         if (o_client->name)
             name = o_client->name;
         first_login = o_client->first_login;
@@ -216,11 +218,30 @@ get_auth_uri(const char *request_type, client_type_t type, void *data)
              name?name:"null", wired);
     }
 
-    if (safe_token) free(safe_token);
-
     return nret>0?uri:NULL;
 }
 
+static int
+event_request_kind(const char *request_type)
+{
+    if (strcmp(request_type, REQUEST_TYPE_LOGIN) == 0)
+        return EVENT_REQ_LOGIN;
+    if (strcmp(request_type, REQUEST_TYPE_LOGOUT) == 0)
+        return EVENT_REQ_LOGOUT;
+    return EVENT_REQ_COUNTERS;
+}
+
+/* journal and account for the outcome of an auth_server_request */
+static t_authcode
+auth_request_done(const char *request_type, const char *ip, const char *mac, t_authcode authcode, uint64_t start)
+{
+    metric_observe_since(METRIC_AUTH_LATENCY, start);
+    if (authcode == AUTH_ERROR)
+        metric_inc(METRIC_AUTH_FAILURES);
+    event_log_write(EVENT_AUTH_CODE, ip, mac, authcode, 0, event_request_kind(request_type));
+    return authcode;
+}
+
 /** Initiates a transaction with the auth server, either to authenticate or to
  * update the traffic counters at the server
 @param authresponse Returns the information given by the central server 
@@ -241,22 +262,24 @@ auth_server_request(t_authresponse * authresponse, const char *request_type, con
     int sockfd;
     char buf[MAX_BUF] = {0};
     char *tmp;
-    char *safe_token;
+    char safe_token[HTTP_MAX_URL * 3];
     t_auth_serv *auth_server = get_auth_server();
+    uint64_t start = metric_now_us();
 
     /* Blanket default is error. */
     authresponse->authcode = AUTH_ERROR;
+    metric_inc(METRIC_AUTH_REQUESTS);
 
     sockfd = connect_auth_server();
 	if (sockfd <= 0) {
 		debug(LOG_ERR, "There was a problem connecting to the auth server!");		
-        return AUTH_ERROR;
+        return auth_request_done(request_type, ip, mac, AUTH_ERROR, start);
 	}
         /**
 	 * TODO: XXX change the PHP so we can harmonize stage as request_type
 	 * everywhere.
 	 */
-    safe_token = httpdUrlEncode(token);
+    httpdUrlEncodeBuf(token, safe_token, sizeof(safe_token));
     if(config -> deltatraffic) {
            snprintf(buf, (sizeof(buf) - 1),
              "GET %s%sstage=%s&ip=%s&mac=%s&token=%s&incoming=%llu&outgoing=%llu&incomingdelta=%llu&outgoingdelta=%llu&first_login=%lld&online_time=%u&gw_id=%s&channel_path=%s&name=%s&wired=%d HTTP/1.1\r\n"
@@ -298,13 +321,12 @@ auth_server_request(t_authresponse * authresponse, const char *request_type, con
 			 wired,
 			 VERSION, auth_server->authserv_hostname);
         }
-    free(safe_token);
 
     char *res = http_get(sockfd, buf);
     if (NULL == res) {
 		close_auth_server();
         debug(LOG_ERR, "There was a problem talking to the auth server!");
-        return (AUTH_ERROR);
+        return auth_request_done(request_type, ip, mac, AUTH_ERROR, start);
     }
 
 	decrease_authserv_fd_ref();
@@ -312,15 +334,13 @@ auth_server_request(t_authresponse * authresponse, const char *request_type, con
         if (sscanf(tmp, "Auth: %d", (int *)&authresponse->authcode) == 1) {
             debug(LOG_INFO, "Auth server returned authentication code %d", authresponse->authcode);
             free(res);
-            return (authresponse->authcode);
+            return auth_request_done(request_type, ip, mac, authresponse->authcode, start);
         } else {
             debug(LOG_WARNING, "Auth server did not return expected authentication code");
-            free(res);
-            return (AUTH_ERROR);
         }
     }
     free(res);
-    return (AUTH_ERROR);
+    return auth_request_done(request_type, ip, mac, AUTH_ERROR, start);
 }
 
 /* Tries really hard to connect to an auth server. Returns a file descriptor, -1 on error
@@ -553,6 +573,7 @@ reply_counter_response(t_authresponse *authresponse, struct evhttps_request_cont
     t_client    *p1 = authresponse_client->client;
     t_client *tmp_c = NULL;
     time_t current_time = time(NULL);
+    time_t last_active;
     s_config *config = config_get_config();
 
     if (p1 == NULL) {
@@ -560,15 +581,17 @@ reply_counter_response(t_authresponse *authresponse, struct evhttps_request_cont
         return;
     }
 
+    last_active = client_get_last_active(p1);
     debug(LOG_DEBUG,
-          "Checking client %s for timeout:  Last updated %ld (%ld seconds ago), timeout delay %ld seconds, current time %ld, ",
-          p1->ip, p1->counters.last_updated, current_time - p1->counters.last_updated,
+          "Checking client %s for timeout:  Last active %ld (%ld seconds ago), rtt %u ms, timeout delay %ld seconds, current time %ld, ",
+          p1->ip, last_active, current_time - last_active, p1->rtt,
           config->checkinterval * config->clienttimeout, current_time);
 
-    if (p1->counters.last_updated + (config->checkinterval * config->clienttimeout) <= current_time) {
+    if (last_active + (config->checkinterval * config->clienttimeout) <= current_time) {
         /* Timing out user */
         debug(LOG_DEBUG, "%s - Inactive for more than %ld seconds, removing client and denying in firewall",
               p1->ip, config->checkinterval * config->clienttimeout);
+        event_log_write(EVENT_TIMEOUT, p1->ip, p1->mac, current_time - last_active, 0, 0);
         LOCK_CLIENT_LIST();
         tmp_c = client_list_find_by_client(p1);
         if (NULL != tmp_c) {
@@ -600,6 +623,7 @@ reply_login_response(t_authresponse *authresponse, struct evhttps_request_contex
     request     *r = authresponse_client->req;
     char    *urlFragment = NULL;
     char    *token = NULL;
+    char    *mac = NULL;
     httpVar *var = NULL;
     
 
@@ -664,11 +688,11 @@ reply_login_response(t_authresponse *authresponse, struct evhttps_request_contex
         break;
 
     case AUTH_VALIDATION:
-        UNLOCK_CLIENT_LIST();
         /* They just got validated for X minutes to check their email */
         debug(LOG_INFO, "Got VALIDATION from central server authenticating token %s from %s at %s"
               "- adding to firewall and redirecting them to activate message", client->token, client->ip, client->mac);
         fw_allow(client, FW_MARK_PROBATION);    
+        UNLOCK_CLIENT_LIST();
 
         safe_asprintf(&urlFragment, "%smessage=%s",
                       auth_server->authserv_msg_script_path_fragment, GATEWAY_MESSAGE_ACTIVATE_ACCOUNT);
@@ -677,32 +701,35 @@ reply_login_response(t_authresponse *authresponse, struct evhttps_request_contex
         break;
 
     case AUTH_ALLOWED:
-        UNLOCK_CLIENT_LIST();
         /* Logged in successfully as a regular account */
         debug(LOG_INFO, "Got ALLOWED from central server authenticating token %s from %s at %s - "
               "adding to firewall and redirecting them to portal", client->token, client->ip, client->mac);
-        fw_allow(client, FW_MARK_KNOWN);
-        
         //>>> liudf added 20160112
         client->first_login = time(NULL);
         client->is_online = 1;
+        //<<< liudf added end
+        /* fw_allow journals the client, it must be complete and still listed */
+        fw_allow(client, FW_MARK_KNOWN);
+        mac = safe_strdup(client->mac);
+        if(!httpdGetVariableByName(r, "type"))
+            safe_asprintf(&urlFragment, "%sgw_id=%s&channel_path=%s&mac=%s&name=%s", 
+                auth_server->authserv_portal_script_path_fragment, 
+                config->gw_id,
+                g_channel_path?g_channel_path:"null",
+                client->mac?client->mac:"null",
+                client->name?client->name:"null");
+        UNLOCK_CLIENT_LIST();
 
         LOCK_OFFLINE_CLIENT_LIST();
-        o_client = offline_client_list_find_by_mac(client->mac);    
+        o_client = offline_client_list_find_by_mac(mac);    
         if(o_client)
             offline_client_list_delete(o_client);
         UNLOCK_OFFLINE_CLIENT_LIST();
-        //<<< liudf added end
+        free(mac);
         served_this_session++;
         if(httpdGetVariableByName(r, "type")) {
             send_http_page_direct(r, "<htm><body>weixin auth success!</body><html>");
         } else {
-            safe_asprintf(&urlFragment, "%sgw_id=%s&channel_path=%s&mac=%s&name=%s", 
-                auth_server->authserv_portal_script_path_fragment, 
-                config->gw_id,
-                g_channel_path?g_channel_path:"null",
-                client->mac?client->mac:"null",
-                client->name?client->name:"null");
             http_send_redirect_to_auth(r, urlFragment, "Redirect to portal");
             free(urlFragment);
         }
@@ -757,8 +784,23 @@ process_auth_server_response(struct evhttp_request *req, void *ctx) {
     if (ctx == NULL)
         return; // impossible here
 
+    struct evhttps_request_context *context = ctx;
+    struct auth_response_client *authresponse_client = context->data;
+    t_client *client = authresponse_client->client;
+    static const int kinds[] = {
+        [request_type_login]    = EVENT_REQ_LOGIN,
+        [request_type_logout]   = EVENT_REQ_LOGOUT,
+        [request_type_counters] = EVENT_REQ_COUNTERS,
+    };
+
     t_authresponse authresponse;
     if (parse_auth_server_response(&authresponse, req)) {
+        event_log_write(EVENT_AUTH_CODE, client ? client->ip : NULL, client ? client->mac : NULL,
+                        authresponse.authcode, 0, kinds[authresponse_client->type]);
         reply_auth_server_response(&authresponse, ctx);
-    } 
+    } else {
+        metric_inc(METRIC_AUTH_FAILURES);
+        event_log_write(EVENT_AUTH_CODE, client ? client->ip : NULL, client ? client->mac : NULL,
+                        AUTH_ERROR, 0, kinds[authresponse_client->type]);
+    }
 }
@@ -0,0 +1,453 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file client_journal.c
+  @brief journal of the client sessions, replayed after a crash or a reboot
+
+  ClientJournal names a file on persistent storage. It starts with the
+  whole client list as a client snapshot; after it, every client granted
+  access appends a put entry and every client leaving the list a del
+  entry. An entry is
+
+      u32 length, u32 crc32, u8 type, body
+
+  with length and crc32 covering type and body. Entries are collected in
+  memory and written with a single write and fsync every
+  ClientJournalSyncInterval seconds, and only if something changed, so
+  the flash is not written on every login. When the file has grown to
+  twice the snapshot, and at least hourly to keep the counters close, it
+  is compacted: a fresh snapshot is written to a temporary file which is
+  renamed over the journal.
+
+  At startup the journal is replayed into the client list up to the
+  first entry that is cut short or fails its checksum, a write torn by a
+  power cut, and the firewall restores the clients in one commit.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "util.h"
+#include "client_list.h"
+#include "client_snapshot.h"
+#include "client_journal.h"
+
+#define	JOURNAL_ENTRY_HEADER	9
+#define	JOURNAL_SNAPSHOT	1
+#define	JOURNAL_PUT			2
+#define	JOURNAL_DEL			3
+/** Entries kept in memory before giving up on them and compacting instead */
+#define	JOURNAL_MAX_PENDING	(1024 * 1024)
+#define	JOURNAL_COMPACT_SLACK	(16 * 1024)
+#define	JOURNAL_COMPACT_INTERVAL	3600
+
+struct journal_buf {
+	char	*data;
+	size_t	len;
+	size_t	size;
+};
+
+/* journal_mutex guards what is collected in memory, it is taken with the
+ * client list locked; journal_io_mutex serializes the writes to the file */
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t journal_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct journal_buf journal_pending;
+static int journal_enabled;
+static int journal_overflow;
+
+static int journal_fd = -1;
+static off_t journal_size;
+static off_t journal_snapshot_size;
+
+static void
+journal_put_uint32(unsigned char *p, unsigned long v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static unsigned long
+journal_get_uint32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+/** @internal
+ * Appends one entry, header and checksum included, to a buffer
+ */
+static void
+journal_add_entry(struct journal_buf *buf, int type, const char *body, size_t len)
+{
+	unsigned char *entry;
+	unsigned long crc;
+
+	if (buf->len + JOURNAL_ENTRY_HEADER + len > buf->size) {
+		while (buf->len + JOURNAL_ENTRY_HEADER + len > buf->size)
+			buf->size = buf->size ? buf->size * 2 : 4096;
+		buf->data = safe_realloc(buf->data, buf->size);
+	}
+
+	entry = (unsigned char *)buf->data + buf->len;
+	entry[8] = type;
+	memcpy(entry + JOURNAL_ENTRY_HEADER, body, len);
+	crc = crc32(0L, entry + 8, len + 1);
+	journal_put_uint32(entry, len + 1);
+	journal_put_uint32(entry + 4, crc);
+	buf->len += JOURNAL_ENTRY_HEADER + len;
+}
+
+/** @internal
+ * Queues an entry for the next sync
+ */
+static void
+journal_queue(int type, const char *body, size_t len)
+{
+	pthread_mutex_lock(&journal_mutex);
+	if (journal_enabled && !journal_overflow) {
+		if (journal_pending.len + len > JOURNAL_MAX_PENDING) {
+			/* the writes are stuck, a compaction will have it all */
+			debug(LOG_WARNING, "Client journal has %lu bytes waiting, compacting instead", (unsigned long)journal_pending.len);
+			journal_pending.len = 0;
+			journal_overflow = 1;
+		} else {
+			journal_add_entry(&journal_pending, type, body, len);
+		}
+	}
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+/** Record a client granted access, or whose access changed
+ * Called with the client list locked.
+ */
+void
+client_journal_put(const t_client *client)
+{
+	char *record;
+	size_t len;
+
+	if (!journal_enabled)
+		return;
+
+	record = client_snapshot_record(client, &len);
+	journal_queue(JOURNAL_PUT, record, len);
+	free(record);
+}
+
+/** Record a client leaving the client list
+ * Called with the client list locked.
+ */
+void
+client_journal_del(const char *ip, const char *mac)
+{
+	char *body;
+	size_t len;
+
+	if (!journal_enabled || ip == NULL || mac == NULL)
+		return;
+
+	/* both strings with their terminating nul */
+	len = strlen(ip) + 1 + strlen(mac) + 1;
+	body = safe_malloc(len);
+	strcpy(body, ip);
+	strcpy(body + strlen(ip) + 1, mac);
+	journal_queue(JOURNAL_DEL, body, len);
+	free(body);
+}
+
+/** @internal
+ * Writes all of a buffer
+ */
+static int
+journal_write(int fd, const char *data, size_t len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = write(fd, data, len);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		data += rc;
+		len -= rc;
+	}
+	return 1;
+}
+
+/** Write the entries collected since the last sync, in one write and one fsync */
+void
+client_journal_sync(void)
+{
+	struct journal_buf buf;
+
+	pthread_mutex_lock(&journal_io_mutex);
+	pthread_mutex_lock(&journal_mutex);
+	buf = journal_pending;
+	memset(&journal_pending, 0, sizeof(journal_pending));
+	pthread_mutex_unlock(&journal_mutex);
+
+	if (buf.len > 0 && journal_fd != -1) {
+		if (!journal_write(journal_fd, buf.data, buf.len) || fdatasync(journal_fd) == -1) {
+			debug(LOG_ERR, "Could not write the client journal: %s", strerror(errno));
+			/* what was written is checked on replay, a compaction rewrites it all */
+			journal_overflow = 1;
+		} else {
+			journal_size += buf.len;
+		}
+	}
+	pthread_mutex_unlock(&journal_io_mutex);
+
+	free(buf.data);
+}
+
+/** @internal
+ * fsync the directory holding a file, so a rename in it is durable
+ */
+static void
+journal_sync_dir(const char *path)
+{
+	char *copy = safe_strdup(path);
+	int fd;
+
+	fd = open(dirname(copy), O_RDONLY);
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	free(copy);
+}
+
+/** @internal
+ * Replaces the journal with a snapshot of the client list
+ */
+static void
+journal_compact(const char *path)
+{
+	struct journal_buf buf = { NULL, 0, 0 };
+	char *snapshot, *tmp;
+	size_t len;
+	int fd;
+
+	pthread_mutex_lock(&journal_io_mutex);
+
+	/* the snapshot covers everything queued so far */
+	LOCK_CLIENT_LIST();
+	pthread_mutex_lock(&journal_mutex);
+	snapshot = client_snapshot_build(&len);
+	journal_pending.len = 0;
+	journal_overflow = 0;
+	pthread_mutex_unlock(&journal_mutex);
+	UNLOCK_CLIENT_LIST();
+
+	journal_add_entry(&buf, JOURNAL_SNAPSHOT, snapshot, len);
+	free(snapshot);
+
+	safe_asprintf(&tmp, "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1 || !journal_write(fd, buf.data, buf.len) || fsync(fd) == -1) {
+		debug(LOG_ERR, "Could not write the client journal %s: %s", tmp, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+	if (rename(tmp, path) == -1) {
+		debug(LOG_ERR, "Could not rename %s to %s: %s", tmp, path, strerror(errno));
+		goto fail;
+	}
+	journal_sync_dir(path);
+
+	if (journal_fd != -1)
+		close(journal_fd);
+	journal_fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (journal_fd == -1) {
+		debug(LOG_ERR, "Could not open the client journal %s: %s", path, strerror(errno));
+		goto fail;
+	}
+	journal_size = journal_snapshot_size = buf.len;
+	debug(LOG_INFO, "Compacted the client journal to %lu bytes", (unsigned long)buf.len);
+
+	free(tmp);
+	free(buf.data);
+	pthread_mutex_unlock(&journal_io_mutex);
+	return;
+
+fail:
+	if (fd != -1)
+		close(fd);
+	unlink(tmp);
+	free(tmp);
+	free(buf.data);
+	/* the entries dropped above are only in the client list now, try again */
+	journal_overflow = 1;
+	pthread_mutex_unlock(&journal_io_mutex);
+}
+
+/** @internal
+ * Applies one entry to the client list, locked by the caller
+ * @return 1 if it could be applied
+ */
+static int
+journal_apply(int type, const char *body, size_t len)
+{
+	const char *mac;
+	t_client *client, *old;
+
+	switch (type) {
+	case JOURNAL_SNAPSHOT:
+		return client_snapshot_load(body, len) >= 0;
+	case JOURNAL_PUT:
+		if ((client = client_snapshot_parse_record(body, len)) == NULL)
+			return 0;
+		if ((old = client_list_find(client->ip, client->mac)) != NULL) {
+			client_list_remove(old);
+			client_free_node(old);
+		}
+		client_list_insert_client(client);
+		return 1;
+	case JOURNAL_DEL:
+		/* ip and mac, each nul terminated */
+		if (len < 2 || body[len - 1] != '\0' || (mac = memchr(body, '\0', len - 1)) == NULL)
+			return 0;
+		if ((old = client_list_find(body, mac + 1)) != NULL) {
+			client_list_remove(old);
+			client_free_node(old);
+		}
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/** Load the sessions recorded in the journal into the client list
+ * Called once at startup, before the firewall is set up.
+ * @return number of clients on the list afterwards, -1 if the journal
+ * could not be read
+ */
+int
+client_journal_replay(void)
+{
+	const s_config *config = config_get_config();
+	const unsigned char *p, *end;
+	unsigned long len;
+	struct stat st;
+	char *data;
+	int fd, entries = 0, clients = 0;
+	t_client *client;
+
+	if (config->client_journal == NULL)
+		return 0;
+
+	fd = open(config->client_journal, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			debug(LOG_ERR, "Could not open the client journal %s: %s", config->client_journal, strerror(errno));
+		return errno == ENOENT ? 0 : -1;
+	}
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	data = safe_malloc(st.st_size + 1);
+	if (read(fd, data, st.st_size) != st.st_size) {
+		debug(LOG_ERR, "Could not read the client journal %s: %s", config->client_journal, strerror(errno));
+		free(data);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	LOCK_CLIENT_LIST();
+	p = (const unsigned char *)data;
+	end = p + st.st_size;
+	while (end - p >= JOURNAL_ENTRY_HEADER) {
+		len = journal_get_uint32(p);
+		if (len < 1 || (unsigned long)(end - p - 8) < len ||
+			crc32(0L, p + 8, len) != journal_get_uint32(p + 4))
+			break;
+		if (!journal_apply(p[8], (const char *)p + JOURNAL_ENTRY_HEADER, len - 1))
+			debug(LOG_WARNING, "Client journal entry %d of type %d could not be applied", entries, p[8]);
+		p += 8 + len;
+		entries++;
+	}
+	for (client = client_get_first_client(); client; client = client->next)
+		clients++;
+	UNLOCK_CLIENT_LIST();
+
+	if (p != end)
+		debug(LOG_WARNING, "Client journal %s is torn after entry %d, %ld bytes dropped",
+			config->client_journal, entries, (long)(end - p));
+	debug(LOG_NOTICE, "Replayed %d client journal entries, %d clients restored", entries, clients);
+
+	free(data);
+	return clients;
+}
+
+/** Journal thread: writes the collected entries every ClientJournalSyncInterval
+ * seconds and compacts the journal when it grew or the counters got old.
+ * @param arg unused
+ */
+void
+thread_client_journal(void *arg)
+{
+	const s_config *config = config_get_config();
+	const char *path = config->client_journal;
+	time_t last_compact;
+	int interval;
+
+	pthread_mutex_lock(&journal_mutex);
+	journal_enabled = 1;
+	pthread_mutex_unlock(&journal_mutex);
+
+	/* start over from the list restored at startup */
+	journal_compact(path);
+	last_compact = time(NULL);
+
+	while (1) {
+		interval = config->client_journal_sync_interval;
+		s_sleep(interval > 0 ? interval : 1, 0);
+
+		if (journal_overflow || journal_size > 2 * journal_snapshot_size + JOURNAL_COMPACT_SLACK ||
+			time(NULL) - last_compact >= JOURNAL_COMPACT_INTERVAL) {
+			journal_compact(path);
+			last_compact = time(NULL);
+		} else {
+			client_journal_sync();
+		}
+	}
+}
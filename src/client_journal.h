@@ -0,0 +1,47 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file client_journal.h
+  @brief journal of the client sessions, replayed after a crash or a reboot
+  */
+
+#ifndef	_CLIENT_JOURNAL_H_
+#define	_CLIENT_JOURNAL_H_
+
+#include "client_list.h"
+
+/** @brief Load the sessions of the journal into the client list */
+int client_journal_replay(void);
+
+/** @brief Record a client granted access or changed */
+void client_journal_put(const t_client *);
+
+/** @brief Record a client leaving the client list */
+void client_journal_del(const char *, const char *);
+
+/** @brief Write what was recorded since the last sync */
+void client_journal_sync(void);
+
+/** @brief Journal thread: syncs and compacts the journal */
+void thread_client_journal(void *);
+
+#endif /* _CLIENT_JOURNAL_H_ */
@@ -35,6 +35,8 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <stddef.h>
+#include <time.h>
 
 #include <string.h>
 
@@ -47,6 +49,8 @@
 #include "firewall.h"
 #include "util.h"
 #include "centralserver.h"
+#include "timer_wheel.h"
+#include "client_journal.h"
 
 /** @internal
  * Holds a pointer to the first element of the list 
@@ -72,6 +76,100 @@ pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 // liudf added 20160216
 pthread_mutex_t offline_client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/** @internal
+ * Deadlines of the listed clients, each client is due for its counters
+ * report and idle check once per checkinterval from the time it joined, so
+ * the work is spread over the interval instead of landing in one burst.
+ * Protected by client_list_mutex.
+ */
+static timer_wheel_t *client_timers = NULL;
+
+/** @internal
+ * Hash index of the listed clients by ip, ipv4 and ipv6 share it through
+ * t_ip_key so a lookup stays one bucket walk whatever the family.
+ * Doubles once there are more clients than buckets.
+ * Protected by client_list_mutex.
+ */
+#define	CLIENT_IP_INDEX_MIN_SIZE	64
+
+static t_client **client_ip_index = NULL;
+static unsigned int client_ip_index_size = 0;
+static unsigned int client_ip_count = 0;
+
+static unsigned long
+client_timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void
+client_timer_arm(t_client *client, unsigned long expires)
+{
+    if (client_timers == NULL)
+        client_timers = timer_wheel_create(client_timer_now());
+    timer_wheel_add(client_timers, &client->timer, expires);
+}
+
+static void
+client_ip_index_resize(unsigned int size)
+{
+    t_client **index = safe_malloc(size * sizeof(t_client *));
+    t_client *c;
+
+    for (c = firstclient; c != NULL; c = c->next) {
+        c->ip_hnext = index[ip_key_hash(&c->ip_key) % size];
+        index[ip_key_hash(&c->ip_key) % size] = c;
+    }
+
+    free(client_ip_index);
+    client_ip_index = index;
+    client_ip_index_size = size;
+}
+
+/** @internal
+ * Called once the client is linked on firstclient, a resize reindexes
+ * the whole list including it.
+ */
+static void
+client_ip_index_add(t_client *client)
+{
+    unsigned int slot;
+
+    if (!ip_key_parse(client->ip, &client->ip_key)) {
+        debug(LOG_WARNING, "client %s has no valid ip, it is not indexed", client->ip);
+        memset(&client->ip_key, 0, sizeof(client->ip_key));
+    }
+    client_ip_count++;
+    if (client_ip_index == NULL || client_ip_count > client_ip_index_size) {
+        client_ip_index_resize(client_ip_index_size ? client_ip_index_size * 2 : CLIENT_IP_INDEX_MIN_SIZE);
+        return;
+    }
+
+    slot = ip_key_hash(&client->ip_key) % client_ip_index_size;
+    client->ip_hnext = client_ip_index[slot];
+    client_ip_index[slot] = client;
+}
+
+static void
+client_ip_index_del(t_client *client)
+{
+    t_client **pp;
+
+    if (client_ip_index == NULL)
+        return;
+
+    for (pp = &client_ip_index[ip_key_hash(&client->ip_key) % client_ip_index_size]; *pp != NULL; pp = &(*pp)->ip_hnext) {
+        if (*pp == client) {
+            *pp = client->ip_hnext;
+            client->ip_hnext = NULL;
+            client_ip_count--;
+            return;
+        }
+    }
+}
+
 /** Get a new client struct, not added to the list yet
  * @return Pointer to newly created client object not on the list yet.
  */
@@ -115,6 +213,9 @@ void
 client_list_init(void)
 {
     firstclient = NULL;
+    free(client_ip_index);
+    client_ip_index = NULL;
+    client_ip_index_size = client_ip_count = 0;
 }
 
 // liudf added 20160216
@@ -139,6 +240,10 @@ client_list_insert_client(t_client * client)
     prev_head = firstclient;
     client->next = prev_head;
     firstclient = client;
+    client_ip_index_add(client);
+
+    /* first deadline is spread by id, clients restored in a batch don't stay in step */
+    client_timer_arm(client, client_timer_now() + 1 + client->id % config_get_config()->checkinterval);
 }
 
 // liudf added 20160216
@@ -242,6 +347,51 @@ client_list_dup(t_client ** dest)
     return copied;
 }
 
+struct due_clients {
+    t_client *top;
+    t_client *prev;
+    int count;
+    unsigned long now;
+};
+
+static void
+client_timer_expired(struct wheel_timer *timer, void *arg)
+{
+    struct due_clients *due = arg;
+    t_client *client = (t_client *)((char *)timer - offsetof(t_client, timer));
+    t_client *new = client_dup(client);
+
+    if (NULL == due->top)
+        due->top = new;
+    else
+        due->prev->next = new;
+    due->prev = new;
+    due->count++;
+
+    client_timer_arm(client, due->now + config_get_config()->checkinterval);
+}
+
+/** Duplicate the clients whose counters report and idle check are due,
+ * their timers are re-armed for the next checkinterval.
+ * Lock should be held when calling this!
+ * @param dest pointer to the list of due clients
+ * @return number of due clients
+ */
+int
+client_list_dup_due(t_client ** dest)
+{
+    struct due_clients due;
+
+    memset(&due, 0, sizeof(due));
+    if (client_timers != NULL) {
+        due.now = client_timer_now();
+        timer_wheel_advance(client_timers, due.now, client_timer_expired, &due);
+    }
+
+    *dest = due.top;
+    return due.count;
+}
+
 /** Create a duplicate of a client.
  * @param src Original client
  * @return duplicate client object with next == NULL
@@ -276,6 +426,8 @@ client_dup(const t_client * src)
 	new->first_login = src->first_login;
 	new->is_online = src->is_online;
 	new->wired	= src->wired;
+	new->last_reachable = src->last_reachable;
+	new->rtt	= src->rtt;
     new->next = NULL;
 
     return new;
@@ -310,12 +462,14 @@ t_client *
 client_list_find(const char *ip, const char *mac)
 {
     t_client *ptr;
+    t_ip_key key;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->ip, ip) && 0 == strcmp(ptr->mac, mac))
+    if (client_ip_index == NULL || !ip_key_parse(ip, &key))
+        return NULL;
+
+    for (ptr = client_ip_index[ip_key_hash(&key) % client_ip_index_size]; ptr != NULL; ptr = ptr->ip_hnext) {
+        if (0 == memcmp(&ptr->ip_key, &key, sizeof(key)) && 0 == strcmp(ptr->mac, mac))
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
@@ -331,17 +485,36 @@ t_client *
 client_list_find_by_ip(const char *ip)
 {
     t_client *ptr;
+    t_ip_key key;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->ip, ip))
+    /* the same address may be written differently in ipv6, compare binary keys */
+    if (client_ip_index == NULL || !ip_key_parse(ip, &key))
+        return NULL;
+
+    for (ptr = client_ip_index[ip_key_hash(&key) % client_ip_index_size]; ptr != NULL; ptr = ptr->ip_hnext) {
+        if (0 == memcmp(&ptr->ip_key, &key, sizeof(key)))
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
 }
 
+/** Change the ip of a listed client.
+ * Lock should be held when calling this!
+ * @param client client on the list
+ * @param ip its new ip
+ */
+void
+client_list_set_ip(t_client *client, const char *ip)
+{
+    client_journal_del(client->ip, client->mac);
+    client_ip_index_del(client);
+    free(client->ip);
+    client->ip = safe_strdup(ip);
+    client_ip_index_add(client);
+    client_journal_put(client);
+}
+
 
 /**
  * Finds a  client by its Mac, returns NULL if the client could not
@@ -436,6 +609,7 @@ offline_client_list_destroy(t_offline_client *list)
 void
 client_free_node(t_client * client)
 {
+    timer_wheel_del(&client->timer);
 
     if (client->mac != NULL)
         free(client->mac);
@@ -562,6 +736,10 @@ client_list_remove(t_client * client)
 
     ptr = firstclient;
 
+    timer_wheel_del(&client->timer);
+    client_ip_index_del(client);
+    client_journal_del(client->ip, client->mac);
+
     if (ptr == NULL) {
         debug(LOG_ERR, "Node list empty!");
     } else if (ptr == client) {
@@ -638,7 +816,7 @@ add_online_client(const char *info)
 	name	= json_object_get_string(name_jo);
 
 	if(is_valid_mac(mac) &&  
-        is_valid_ip(ip) && 
+        (is_valid_ip(ip) || is_valid_ip6(ip)) && 
         !is_trusted_mac(mac) &&
         !is_untrusted_mac(mac) && 
         (roam_client != NULL || (roam_client = auth_server_roam_request(mac)) != NULL)) {
@@ -676,8 +854,7 @@ add_online_client(const char *info)
 			}
 		} else if (strcmp(old_client->ip, ip) != 0) { // has login; but ip changed
 			fw_deny(old_client);
-			free(old_client->ip);
-			old_client->ip = safe_strdup(ip);
+			client_list_set_ip(old_client, ip);
 			fw_allow(old_client, FW_MARK_KNOWN);
 		}
 
@@ -700,3 +877,16 @@ get_online_client_uri(t_client *client)
 
     safe_asprintf(&client_uri, "");
 }
+
+/** Last time the client showed activity, either traffic counted by the firewall
+ * or a reply to the keepalive ping.
+ * @param client client to check
+ * @return the later of counters.last_updated and last_reachable
+ */
+time_t
+client_get_last_active(const t_client *client)
+{
+    if (client->last_reachable > client->counters.last_updated)
+        return client->last_reachable;
+    return client->counters.last_updated;
+}
@@ -29,6 +29,9 @@
 #ifndef _CLIENT_LIST_H_
 #define _CLIENT_LIST_H_
 
+#include "common.h"
+#include "timer_wheel.h"
+
 /** Global mutex to protect access to the client list */
 extern pthread_mutex_t client_list_mutex;
 extern pthread_mutex_t offline_client_list_mutex;
@@ -66,6 +69,11 @@ typedef struct _t_client {
 	char	*name;			/**< @brief device name */
 	short 	is_online;
 	short	wired;	/** default 0: wireless */
+	time_t	last_reachable;	/** last echo reply to the keepalive ping */
+	unsigned int	rtt;	/** round trip time of that reply in ms */
+	struct wheel_timer	timer;	/** next counters report and idle check, only armed on listed clients */
+	t_ip_key	ip_key;	/** binary ip, key of the ip index, only set on listed clients */
+	struct _t_client	*ip_hnext;	/** next client in the same ip index bucket */
 } t_client;
 
 // liudf added 20160216
@@ -115,6 +123,9 @@ t_offline_client *offline_client_list_add(const char *, const char *);
 /** Duplicate the whole client list to process in a thread safe way */
 int client_list_dup(t_client **);
 
+/** @brief Duplicate the clients whose counters report and idle check are due */
+int client_list_dup_due(t_client **);
+
 /** @brief Create a duplicate of a client. */
 t_client *client_dup(const t_client *);
 
@@ -124,6 +135,9 @@ t_client *client_list_find(const char *, const char *);
 /** @brief Find a client in the list from a client struct, matching operates by id. */
 t_client *client_list_find_by_client(t_client *);
 
+/** @brief Change the ip of a listed client, keeping the ip index in step */
+void client_list_set_ip(t_client *, const char *);
+
 /** @brief Finds a client only by its IP */
 t_client *client_list_find_by_ip(const char *); /* needed by fw_iptables.c, auth.c 
                                                  * and wdctl_thread.c */
@@ -159,6 +173,9 @@ void reset_client_list();
 
 int add_online_client(const char *);
 
+/** @brief Last time the client was seen active, by traffic or by ping */
+time_t client_get_last_active(const t_client *);
+
 char *get_online_client_uri(t_client *);
 
 #define LOCK_OFFLINE_CLIENT_LIST() do { \
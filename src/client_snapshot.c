@@ -0,0 +1,433 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file client_snapshot.c
+  @brief binary snapshot of the client list, handed over on restart
+
+  The parent sends the whole list in one write and the child reads it with
+  two reads, no line splitting or key=value parsing. All integers are big
+  endian. The snapshot starts with a header:
+
+      "WDCS" u16 version, u16 header length, u32 clients, u32 payload length
+
+  followed by one record per client:
+
+      u16 record length, u32 fw_connection_state, u8 wired (0xff unknown),
+      u64 incoming, u64 outgoing, u64 last_updated, u64 first_login,
+      ip, mac, token, name as u16 length (0xffff for none) and the bytes
+
+  A reader skips whatever is left at the end of a record, so new fields are
+  appended to it and only a change of meaning bumps the version. A record
+  must fit its u16 length: strings are cut to what room is left, token and
+  name before ip and mac can ever be.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "client_list.h"
+#include "client_snapshot.h"
+
+#define	SNAPSHOT_HEADER_LEN	16
+#define	SNAPSHOT_NO_STRING	0xffff
+#define	SNAPSHOT_MAX_RECORD	0xffff
+/** Bytes of a record besides the bytes of its strings */
+#define	SNAPSHOT_RECORD_FIXED	(4 + 1 + 4 * 8 + 4 * 2)
+/** Sanity limit on the payload announced by a header */
+#define	SNAPSHOT_MAX_PAYLOAD	(64 * 1024 * 1024)
+
+struct snapshot_buf {
+	unsigned char	*data;
+	size_t	len;
+	size_t	size;
+};
+
+struct snapshot_reader {
+	const unsigned char	*p;
+	const unsigned char	*end;
+};
+
+static void
+snapshot_reserve(struct snapshot_buf *buf, size_t len)
+{
+	if (buf->len + len <= buf->size)
+		return;
+	while (buf->len + len > buf->size)
+		buf->size = buf->size ? buf->size * 2 : 4096;
+	buf->data = safe_realloc(buf->data, buf->size);
+}
+
+static void
+snapshot_put_uint(struct snapshot_buf *buf, unsigned long long v, int bytes)
+{
+	snapshot_reserve(buf, bytes);
+	while (bytes--)
+		buf->data[buf->len++] = (v >> (bytes * 8)) & 0xff;
+}
+
+/** @internal
+ * Appends a string, cut to room bytes, and takes its length off room
+ */
+static void
+snapshot_put_string(struct snapshot_buf *buf, const char *s, size_t *room)
+{
+	size_t len;
+
+	if (s == NULL) {
+		snapshot_put_uint(buf, SNAPSHOT_NO_STRING, 2);
+		return;
+	}
+	len = strlen(s);
+	if (len > *room) {
+		debug(LOG_WARNING, "Client snapshot cuts a %lu byte string to %lu", (unsigned long)len, (unsigned long)*room);
+		len = *room;
+	}
+	*room -= len;
+	snapshot_put_uint(buf, len, 2);
+	snapshot_reserve(buf, len);
+	memcpy(buf->data + buf->len, s, len);
+	buf->len += len;
+}
+
+static void
+snapshot_put_fields(struct snapshot_buf *buf, const t_client *client)
+{
+	size_t room = SNAPSHOT_MAX_RECORD - SNAPSHOT_RECORD_FIXED;
+
+	snapshot_put_uint(buf, (unsigned int)client->fw_connection_state, 4);
+	snapshot_put_uint(buf, client->wired < 0 ? 0xff : client->wired, 1);
+	snapshot_put_uint(buf, client->counters.incoming, 8);
+	snapshot_put_uint(buf, client->counters.outgoing, 8);
+	snapshot_put_uint(buf, (unsigned long long)client->counters.last_updated, 8);
+	snapshot_put_uint(buf, (unsigned long long)client->first_login, 8);
+	snapshot_put_string(buf, client->ip, &room);
+	snapshot_put_string(buf, client->mac, &room);
+	snapshot_put_string(buf, client->token, &room);
+	snapshot_put_string(buf, client->name, &room);
+}
+
+static void
+snapshot_put_client(struct snapshot_buf *buf, const t_client *client)
+{
+	size_t start = buf->len, len;
+
+	snapshot_put_uint(buf, 0, 2);	/* record length, filled in below */
+	snapshot_put_fields(buf, client);
+
+	len = buf->len - start - 2;
+	buf->data[start] = (len >> 8) & 0xff;
+	buf->data[start + 1] = len & 0xff;
+}
+
+static int
+snapshot_get_uint(struct snapshot_reader *r, int bytes, unsigned long long *v)
+{
+	if (r->end - r->p < bytes)
+		return 0;
+	*v = 0;
+	while (bytes--)
+		*v = (*v << 8) | *r->p++;
+	return 1;
+}
+
+static int
+snapshot_get_string(struct snapshot_reader *r, char **s)
+{
+	unsigned long long len;
+
+	*s = NULL;
+	if (!snapshot_get_uint(r, 2, &len))
+		return 0;
+	if (len == SNAPSHOT_NO_STRING)
+		return 1;
+	if ((unsigned long long)(r->end - r->p) < len)
+		return 0;
+	*s = safe_malloc(len + 1);
+	memcpy(*s, r->p, len);
+	r->p += len;
+	return 1;
+}
+
+/** @internal
+ * Decodes one record into a new client
+ * @return the client, NULL if the record is cut short or has no ip or mac
+ */
+static t_client *
+snapshot_get_client(struct snapshot_reader *rec)
+{
+	t_client *client = client_get_new();
+	unsigned long long state, wired, incoming, outgoing, last_updated, first_login;
+
+	if (!snapshot_get_uint(rec, 4, &state) ||
+		!snapshot_get_uint(rec, 1, &wired) ||
+		!snapshot_get_uint(rec, 8, &incoming) ||
+		!snapshot_get_uint(rec, 8, &outgoing) ||
+		!snapshot_get_uint(rec, 8, &last_updated) ||
+		!snapshot_get_uint(rec, 8, &first_login) ||
+		!snapshot_get_string(rec, &client->ip) ||
+		!snapshot_get_string(rec, &client->mac) ||
+		!snapshot_get_string(rec, &client->token) ||
+		!snapshot_get_string(rec, &client->name) ||
+		client->ip == NULL || client->mac == NULL) {
+		client_free_node(client);
+		return NULL;
+	}
+
+	client->fw_connection_state = (int)state;
+	client->wired = wired == 0xff ? -1 : (short)wired;
+	/* the new firewall counts from zero, what was counted so far is history */
+	client->counters.incoming_history = client->counters.incoming = incoming;
+	client->counters.outgoing_history = client->counters.outgoing = outgoing;
+	client->counters.last_updated = (time_t)last_updated;
+	client->first_login = (time_t)first_login;
+
+	return client;
+}
+
+/** Serialize one client as the body of a snapshot record
+ * @param len Set to the size of the record
+ * @return The record, to be freed by the caller
+ */
+char *
+client_snapshot_record(const t_client *client, size_t *len)
+{
+	struct snapshot_buf buf = { NULL, 0, 0 };
+
+	snapshot_put_fields(&buf, client);
+	*len = buf.len;
+	return (char *)buf.data;
+}
+
+/** Decode the body of a snapshot record
+ * @return A new client, not on the list yet, NULL if the record is corrupt
+ */
+t_client *
+client_snapshot_parse_record(const char *data, size_t len)
+{
+	struct snapshot_reader rec = { (const unsigned char *)data, (const unsigned char *)data + len };
+
+	return snapshot_get_client(&rec);
+}
+
+/** Serialize the client list into a snapshot, header included
+ * The client list must be locked.
+ * @param len Set to the size of the snapshot
+ * @return The snapshot, to be freed by the caller
+ */
+char *
+client_snapshot_build(size_t *len)
+{
+	struct snapshot_buf buf = { NULL, 0, 0 };
+	t_client *client;
+	unsigned int count = 0;
+
+	snapshot_reserve(&buf, SNAPSHOT_HEADER_LEN);
+	buf.len = SNAPSHOT_HEADER_LEN;
+	for (client = client_get_first_client(); client; client = client->next) {
+		snapshot_put_client(&buf, client);
+		count++;
+	}
+
+	*len = buf.len;
+	memcpy(buf.data, CLIENT_SNAPSHOT_MAGIC, 4);
+	buf.len = 4;
+	snapshot_put_uint(&buf, CLIENT_SNAPSHOT_VERSION, 2);
+	snapshot_put_uint(&buf, SNAPSHOT_HEADER_LEN, 2);
+	snapshot_put_uint(&buf, count, 4);
+	snapshot_put_uint(&buf, *len - SNAPSHOT_HEADER_LEN, 4);
+
+	return (char *)buf.data;
+}
+
+/** @internal
+ * Checks a snapshot header
+ * @return the header length, 0 if it is not a snapshot this version reads
+ */
+static size_t
+snapshot_check_header(const unsigned char *data, size_t len, unsigned long long *count, unsigned long long *payload)
+{
+	struct snapshot_reader r = { data + 4, data + len };
+	unsigned long long version, hlen;
+
+	if (len < SNAPSHOT_HEADER_LEN || memcmp(data, CLIENT_SNAPSHOT_MAGIC, 4) != 0) {
+		debug(LOG_ERR, "Client snapshot has no valid header");
+		return 0;
+	}
+	if (!snapshot_get_uint(&r, 2, &version) ||
+		!snapshot_get_uint(&r, 2, &hlen) ||
+		!snapshot_get_uint(&r, 4, count) ||
+		!snapshot_get_uint(&r, 4, payload)) {
+		debug(LOG_ERR, "Client snapshot header is truncated");
+		return 0;
+	}
+	if (version != CLIENT_SNAPSHOT_VERSION) {
+		debug(LOG_ERR, "Client snapshot version %llu, only version %d is understood", version, CLIENT_SNAPSHOT_VERSION);
+		return 0;
+	}
+	if (hlen < SNAPSHOT_HEADER_LEN || *payload > SNAPSHOT_MAX_PAYLOAD) {
+		debug(LOG_ERR, "Client snapshot header is corrupt");
+		return 0;
+	}
+	return hlen;
+}
+
+/** Add the clients of a snapshot to the client list
+ * The client list must be locked.
+ * @return number of clients added, -1 if the snapshot is corrupt; the
+ * clients before the corrupt record are kept
+ */
+int
+client_snapshot_load(const char *data, size_t len)
+{
+	struct snapshot_reader r, rec;
+	unsigned long long count, payload, reclen;
+	size_t hlen;
+	t_client *client;
+	int added = 0;
+
+	hlen = snapshot_check_header((const unsigned char *)data, len, &count, &payload);
+	if (hlen == 0)
+		return -1;
+	if (len < hlen + payload) {
+		debug(LOG_ERR, "Client snapshot is cut short: %lu of %llu bytes", (unsigned long)len, hlen + payload);
+		return -1;
+	}
+
+	r.p = (const unsigned char *)data + hlen;
+	r.end = r.p + payload;
+	while (r.p < r.end) {
+		if (!snapshot_get_uint(&r, 2, &reclen) || (unsigned long long)(r.end - r.p) < reclen) {
+			debug(LOG_ERR, "Client snapshot record %d is cut short", added);
+			return -1;
+		}
+		rec.p = r.p;
+		rec.end = r.p + reclen;
+		r.p = rec.end;
+
+		if ((client = snapshot_get_client(&rec)) == NULL) {
+			debug(LOG_ERR, "Client snapshot record %d is corrupt", added);
+			return -1;
+		}
+		client_list_insert_client(client);
+		added++;
+	}
+
+	if ((unsigned long long)added != count)
+		debug(LOG_WARNING, "Client snapshot announced %llu clients, %d read", count, added);
+	return added;
+}
+
+/** Write a snapshot of the client list to a socket
+ * The list is serialized under the client list lock and sent after it is
+ * released, in one write unless the socket buffer is smaller.
+ * @return 1 on success, 0 on a write error
+ */
+int
+client_snapshot_send(int fd)
+{
+	char *data;
+	size_t len, written = 0;
+	ssize_t rc;
+
+	LOCK_CLIENT_LIST();
+	data = client_snapshot_build(&len);
+	UNLOCK_CLIENT_LIST();
+
+	while (written < len) {
+		rc = write(fd, data + written, len - written);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			debug(LOG_CRIT, "Failed to write client snapshot: %s", strerror(errno));
+			free(data);
+			return 0;
+		}
+		written += rc;
+	}
+
+	debug(LOG_INFO, "Sent a client snapshot of %lu bytes", (unsigned long)len);
+	free(data);
+	return 1;
+}
+
+/** @internal
+ * Reads exactly len bytes
+ */
+static int
+snapshot_read_full(int fd, unsigned char *data, size_t len)
+{
+	size_t got = 0;
+	ssize_t rc;
+
+	while (got < len) {
+		rc = read(fd, data + got, len - got);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return 0;
+		got += rc;
+	}
+	return 1;
+}
+
+/** Read a snapshot from a socket and add its clients to the client list
+ * @return number of clients added, -1 on error
+ */
+int
+client_snapshot_receive(int fd)
+{
+	unsigned char header[SNAPSHOT_HEADER_LEN], *data;
+	unsigned long long count, payload;
+	size_t hlen;
+	int added;
+
+	if (!snapshot_read_full(fd, header, sizeof(header))) {
+		debug(LOG_ERR, "Could not read the client snapshot header: %s", errno ? strerror(errno) : "connection closed");
+		return -1;
+	}
+	hlen = snapshot_check_header(header, sizeof(header), &count, &payload);
+	if (hlen == 0)
+		return -1;
+
+	data = safe_malloc(hlen + payload);
+	memcpy(data, header, sizeof(header));
+	if (!snapshot_read_full(fd, data + sizeof(header), hlen + payload - sizeof(header))) {
+		debug(LOG_ERR, "Client snapshot is cut short");
+		free(data);
+		return -1;
+	}
+
+	LOCK_CLIENT_LIST();
+	added = client_snapshot_load((char *)data, hlen + payload);
+	UNLOCK_CLIENT_LIST();
+
+	free(data);
+	return added;
+}
@@ -0,0 +1,56 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file client_snapshot.h
+  @brief binary snapshot of the client list, handed over on restart
+  */
+
+#ifndef	_CLIENT_SNAPSHOT_H_
+#define	_CLIENT_SNAPSHOT_H_
+
+#include <stddef.h>
+
+#define	CLIENT_SNAPSHOT_MAGIC	"WDCS"
+/** Bumped when a field changes meaning; new fields are appended to the record instead */
+#define	CLIENT_SNAPSHOT_VERSION	1
+
+#include "client_list.h"
+
+/** @brief Serialize one client as the body of a record */
+char *client_snapshot_record(const t_client *, size_t *);
+
+/** @brief Decode the body of a record into a new client */
+t_client *client_snapshot_parse_record(const char *, size_t);
+
+/** @brief Serialize the client list, the client list must be locked */
+char *client_snapshot_build(size_t *);
+
+/** @brief Add the clients of a snapshot to the client list, the client list must be locked */
+int client_snapshot_load(const char *, size_t);
+
+/** @brief Write a snapshot of the client list to a socket in one go */
+int client_snapshot_send(int);
+
+/** @brief Read a snapshot from a socket and add its clients to the client list */
+int client_snapshot_receive(int);
+
+#endif /* _CLIENT_SNAPSHOT_H_ */
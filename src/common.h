@@ -30,6 +30,12 @@
 /** @brief Read buffer for socket read? */
 #define MAX_BUF             4096
 
-#define HTTP_IP_ADDR_LEN    17
+/** @brief Textual ip of either family, INET6_ADDRSTRLEN */
+#define HTTP_IP_ADDR_LEN    46
+
+/** @brief Binary ip of either family, ipv4 as v4-mapped ipv6 */
+typedef struct _ip_key_t {
+    unsigned char addr[16];
+} t_ip_key;
 
 #endif /* _COMMON_H_ */
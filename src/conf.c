@@ -37,6 +37,7 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -67,6 +68,7 @@
 #include "ezxml.h"
 #include "util.h"
 #include "wd_util.h"
+#include "config_snapshot.h"
 
 
 //>>> liudf added 20160114
@@ -90,6 +92,12 @@ pthread_mutex_t domains_mutex = PTHREAD_MUTEX_INITIALIZER;
  */
 static int missing_parms;
 
+/** @internal
+ * The file being parsed and, during a reload, where a bad option jumps back
+ * to; reloads are serialized by the caller */
+static FILE *config_parse_file;
+static jmp_buf *config_parse_abort;
+
 /** @internal
  The different configuration options */
 typedef enum {
@@ -161,6 +169,21 @@ typedef enum {
 	oMQTTServer,
 	oMQTTServerPort,
 	oDNSTimeout,
+	oHttpsSessionCacheSize,
+	oHttpsSessionTimeout,
+	oHttpsSessionTickets,
+	oHttpsTicketKeyLifetime,
+	oHttpsCipherList,
+	oHttpsCipherSuites,
+	oHttpsCurves,
+	oHttpsSniPeek,
+	oHttpsRedirectRate,
+	oHttpsRedirectBurst,
+	oClientConnRate,
+	oClientConnBurst,
+	oEnableIpv6,
+	oClientJournal,
+	oClientJournalSyncInterval,
 } OpCodes;
 
 /** @internal
@@ -236,17 +259,34 @@ static const struct {
 	"serveraddr", oMQTTServer}, {
 	"serverport", oMQTTServerPort}, {
 	"dnstimeout",oDNSTimeout},{
+	"httpsSessionCacheSize", oHttpsSessionCacheSize}, {
+	"httpsSessionTimeout", oHttpsSessionTimeout}, {
+	"httpsSessionTickets", oHttpsSessionTickets}, {
+	"httpsTicketKeyLifetime", oHttpsTicketKeyLifetime}, {
+	"httpsCipherList", oHttpsCipherList}, {
+	"httpsCipherSuites", oHttpsCipherSuites}, {
+	"httpsCurves", oHttpsCurves}, {
+	"httpsSniPeek", oHttpsSniPeek}, {
+	"httpsRedirectRate", oHttpsRedirectRate}, {
+	"httpsRedirectBurst", oHttpsRedirectBurst}, {
+	"clientConnRate", oClientConnRate}, {
+	"clientConnBurst", oClientConnBurst}, {
+	"enableIpv6", oEnableIpv6}, {
+	"clientJournal", oClientJournal}, {
+	"clientJournalSyncInterval", oClientJournalSyncInterval}, {
     NULL, oBadOption},};
 
 static void config_notnull(const void *, const char *);
 static int parse_boolean_value(char *);
-static void parse_auth_server(FILE *, const char *, int *);
-static void parse_mqtt_server(FILE *, const char *, int *);
-static int _parse_firewall_rule(const char *, char *);
-static void parse_firewall_ruleset(const char *, FILE *, const char *, int *);
-static void parse_popular_servers(const char *);
-static void validate_popular_servers(void);
-static void add_popular_server(const char *);
+static void parse_auth_server(s_config *, FILE *, const char *, int *);
+static void parse_mqtt_server(s_config *, FILE *, const char *, int *);
+static int _parse_firewall_rule(s_config *, const char *, char *);
+static void parse_firewall_ruleset(s_config *, const char *, FILE *, const char *, int *);
+static void parse_popular_servers(s_config *, const char *);
+static void validate_popular_servers(s_config *);
+static void add_popular_server(s_config *, const char *);
+static void config_parse_error(void);
+static void config_list_append(s_config *, config_list_t, const char *);
 
 static OpCodes config_parse_token(const char *, const char *, int);
 
@@ -260,62 +300,67 @@ config_get_config(void)
 	return &config;
 }
 
-/** Sets the default config parameters and initialises the configuration system */
-void
-config_init(void)
-{
-	debug(LOG_DEBUG, "Setting default config parameters");
-	config.configfile = safe_strdup(DEFAULT_CONFIGFILE);
-	config.htmlmsgfile = safe_strdup(DEFAULT_HTMLMSGFILE);
-	config.httpdmaxconn = DEFAULT_HTTPDMAXCONN;
-	config.external_interface = NULL;
-	config.gw_id = DEFAULT_GATEWAYID;
-	config.gw_interface = NULL;
-	config.gw_address = NULL;
-	config.gw_port = DEFAULT_GATEWAYPORT;
-	config.auth_servers = NULL;
-	config.httpdname = NULL;
-	config.httpdrealm = DEFAULT_HTTPDNAME;
-	config.httpdusername = NULL;
-	config.httpdpassword = NULL;
-	config.clienttimeout = DEFAULT_CLIENTTIMEOUT;
-	config.checkinterval = DEFAULT_CHECKINTERVAL;
-	config.daemon = -1;
-	config.pidfile = NULL;
-	config.wdctl_sock = safe_strdup(DEFAULT_WDCTL_SOCK);
-	config.internal_sock = safe_strdup(DEFAULT_INTERNAL_SOCK);
-	config.rulesets = NULL;
-	config.trustedmaclist = NULL;
-	config.popular_servers = NULL;
-	config.proxy_port = 0;
-	config.ssl_certs = safe_strdup(DEFAULT_AUTHSERVSSLCERTPATH);
-	config.ssl_verify = DEFAULT_AUTHSERVSSLPEERVER;
-	config.deltatraffic = DEFAULT_DELTATRAFFIC;
-	config.ssl_cipher_list = NULL;
-	config.arp_table_path = safe_strdup(DEFAULT_ARPTABLE);
-	config.ssl_use_sni = DEFAULT_AUTHSERVSSLSNI;
+/** @internal
+ * Fills a configuration with the default parameters */
+static void
+config_defaults(s_config *conf)
+{
+	conf->configfile = safe_strdup(DEFAULT_CONFIGFILE);
+	conf->htmlmsgfile = safe_strdup(DEFAULT_HTMLMSGFILE);
+	conf->httpdmaxconn = DEFAULT_HTTPDMAXCONN;
+	conf->external_interface = NULL;
+	conf->gw_id = DEFAULT_GATEWAYID;
+	conf->gw_interface = NULL;
+	conf->gw_address = NULL;
+	conf->gw_port = DEFAULT_GATEWAYPORT;
+	conf->auth_servers = NULL;
+	conf->httpdname = NULL;
+	conf->httpdrealm = safe_strdup(DEFAULT_HTTPDNAME);
+	conf->httpdusername = NULL;
+	conf->httpdpassword = NULL;
+	conf->clienttimeout = DEFAULT_CLIENTTIMEOUT;
+	conf->checkinterval = DEFAULT_CHECKINTERVAL;
+	conf->daemon = -1;
+	conf->pidfile = NULL;
+	conf->wdctl_sock = safe_strdup(DEFAULT_WDCTL_SOCK);
+	conf->internal_sock = safe_strdup(DEFAULT_INTERNAL_SOCK);
+	conf->rulesets = NULL;
+	conf->trustedmaclist = NULL;
+	conf->popular_servers = NULL;
+	conf->proxy_port = 0;
+	conf->ssl_certs = safe_strdup(DEFAULT_AUTHSERVSSLCERTPATH);
+	conf->ssl_verify = DEFAULT_AUTHSERVSSLPEERVER;
+	conf->deltatraffic = DEFAULT_DELTATRAFFIC;
+	conf->ssl_cipher_list = NULL;
+	conf->arp_table_path = safe_strdup(DEFAULT_ARPTABLE);
+	conf->ssl_use_sni = DEFAULT_AUTHSERVSSLSNI;
 	//>>> liudf 20160104 added
-	config.htmlredirfile 			= safe_strdup(DEFAULT_REDIRECTFILE);
-	config.internet_offline_file	= safe_strdup(DEFAULT_INTERNET_OFFLINE_FILE);
-	config.authserver_offline_file	= safe_strdup(DEFAULT_AUTHSERVER_OFFLINE_FILE);
-	config.js_filter 		= 1; // default enable it
-	config.pool_mode		= 1;
-	config.thread_number 	= 10; // only valid when poolMode == 1
-	config.queue_size 		= 30; // only valid when poolMode == 1
-	config.wired_passed		= 1; // default wired device no need login
-	config.parse_checked	= 1; // before parse domain's ip; fping check it
-	config.no_auth 			= 0; //
-	config.work_mode		= 0;
-	config.update_domain_interval  = 60; // very 60*interval second parse trusted domain
-	config.dns_timeout         =   "1.0";  //default dns parsing timeout  is 1.0s
-	config.bypass_apple_cna = 1; // default enable it
-
-	config.pan_domains_trusted		= NULL;
-	config.domains_trusted			= NULL;
-	config.inner_domains_trusted	= NULL;
-	config.roam_maclist				= NULL;
-	config.trusted_local_maclist	= NULL;
-	config.mac_blacklist			= NULL;
+	conf->htmlredirfile 			= safe_strdup(DEFAULT_REDIRECTFILE);
+	conf->internet_offline_file	= safe_strdup(DEFAULT_INTERNET_OFFLINE_FILE);
+	conf->authserver_offline_file	= safe_strdup(DEFAULT_AUTHSERVER_OFFLINE_FILE);
+	conf->js_filter 		= 1; // default enable it
+	conf->pool_mode		= 1;
+	conf->thread_number 	= 10; // only valid when poolMode == 1
+	conf->queue_size 		= 30; // only valid when poolMode == 1
+	conf->wired_passed		= 1; // default wired device no need login
+	conf->parse_checked	= 1; // before parse domain's ip; fping check it
+	conf->no_auth 			= 0; //
+	conf->work_mode		= 0;
+	conf->update_domain_interval  = 60; // very 60*interval second parse trusted domain
+	conf->dns_timeout         =   safe_strdup("1.0");  //default dns parsing timeout  is 1.0s
+	conf->bypass_apple_cna = 1; // default enable it
+	conf->client_conn_rate	= 0;
+	conf->client_conn_burst = DEFAULT_CLIENT_CONN_BURST;
+	conf->enable_ipv6		= 0;
+	conf->client_journal	= NULL;
+	conf->client_journal_sync_interval = DEFAULT_CLIENT_JOURNAL_SYNC_INTERVAL;
+
+	conf->pan_domains_trusted		= NULL;
+	conf->domains_trusted			= NULL;
+	conf->inner_domains_trusted	= NULL;
+	conf->roam_maclist				= NULL;
+	conf->trusted_local_maclist	= NULL;
+	conf->mac_blacklist			= NULL;
 	
 	t_https_server *https_server	= (t_https_server *)malloc(sizeof(t_https_server));
 	memset(https_server, 0, sizeof(t_https_server));
@@ -323,15 +368,23 @@ config_init(void)
 	https_server->ca_crt_file	= safe_strdup(DEFAULT_CA_CRT_FILE);
 	https_server->svr_crt_file	= safe_strdup(DEFAULT_SVR_CRT_FILE);
 	https_server->svr_key_file	= safe_strdup(DEFAULT_SVR_KEY_FILE);
+	https_server->session_cache_size	= DEFAULT_HTTPS_SESSION_CACHE_SIZE;
+	https_server->session_timeout		= DEFAULT_HTTPS_SESSION_TIMEOUT;
+	https_server->session_tickets		= 1;
+	https_server->ticket_key_lifetime	= DEFAULT_HTTPS_TICKET_KEY_LIFETIME;
+	https_server->cipher_list	= safe_strdup(DEFAULT_HTTPS_CIPHER_LIST);
+	https_server->cipher_suites	= safe_strdup(DEFAULT_HTTPS_CIPHER_SUITES);
+	https_server->curves		= safe_strdup(DEFAULT_HTTPS_CURVES);
+	https_server->redirect_burst	= DEFAULT_HTTPS_REDIRECT_BURST;
 
-	config.https_server	= https_server;
+	conf->https_server	= https_server;
 
 	t_http_server *http_server  = (t_http_server *)malloc(sizeof(t_http_server));
 	memset(http_server, 0, sizeof(t_http_server));
 	http_server->gw_http_port   = 8403;
 	http_server->base_path	  = safe_strdup(DEFAULT_WWW_PATH);
 
-	config.http_server  = http_server;
+	conf->http_server  = http_server;
 
 	t_mqtt_server *mqtt_server = (t_mqtt_server *)malloc(sizeof(t_mqtt_server));
 	memset(mqtt_server, 0, sizeof(t_mqtt_server));
@@ -340,15 +393,23 @@ config_init(void)
 	mqtt_server->cafile	 = safe_strdup(DEFAULT_CA_CRT_FILE);
 	mqtt_server->crtfile	= NULL;
 	mqtt_server->keyfile	= NULL;
-	config.mqtt_server  = mqtt_server;
+	conf->mqtt_server  = mqtt_server;
 
 	t_pool_server *pool_server = (t_pool_server *)malloc(sizeof(t_pool_server));
 	memset(pool_server, 0, sizeof(t_pool_server));
 	pool_server->pool_server = safe_strdup(DEFAULT_POOL_SERVER);
 	pool_server->port		= 3333;
 	pool_server->coinbase_address	= safe_strdup(DEFAULT_COINBASE_ADDRESS);
-	config.pool_server = pool_server;
+	conf->pool_server = pool_server;
 	//<<<
+}
+
+/** Sets the default config parameters and initialises the configuration system */
+void
+config_init(void)
+{
+	debug(LOG_DEBUG, "Setting default config parameters");
+	config_defaults(&config);
 
 	debugconf.log_stderr = 1;
 	debugconf.debuglevel = DEFAULT_DEBUGLEVEL;
@@ -390,7 +451,7 @@ config_parse_token(const char *cp, const char *filename, int linenum)
 Parses auth server information
 */
 static void
-parse_auth_server(FILE * file, const char *filename, int *linenum)
+parse_auth_server(s_config *conf, FILE * file, const char *filename, int *linenum)
 {
 	char *host = NULL,
 		*path = NULL,
@@ -500,14 +561,13 @@ parse_auth_server(FILE * file, const char *filename, int *linenum)
 				if (ssl_available < 0) {
 					debug(LOG_WARNING, "Bad syntax for Parameter: SSLAvailable on line %d " "in %s."
 						"The syntax is yes or no." , *linenum, filename);
-					exit(-1);
+					config_parse_error();
 				}
 				break;
 			case oBadOption:
 			default:
 				debug(LOG_ERR, "Bad option on line %d " "in %s.", *linenum, filename);
-				debug(LOG_ERR, "Exiting...");
-				exit(-1);
+				config_parse_error();
 				break;
 			}
 		}
@@ -545,10 +605,10 @@ parse_auth_server(FILE * file, const char *filename, int *linenum)
 	new->authserv_fd_ref	= 0;
 
 	/* If it's the first, add to config, else append to last server */
-	if (config.auth_servers == NULL) {
-		config.auth_servers = new;
+	if (conf->auth_servers == NULL) {
+		conf->auth_servers = new;
 	} else {
-		for (tmp = config.auth_servers; tmp->next != NULL; tmp = tmp->next) ;
+		for (tmp = conf->auth_servers; tmp->next != NULL; tmp = tmp->next) ;
 		tmp->next = new;
 	}
 
@@ -559,11 +619,11 @@ parse_auth_server(FILE * file, const char *filename, int *linenum)
 Parses mqtt server information
 */
 static void
-parse_mqtt_server(FILE * file, const char *filename, int *linenum)
+parse_mqtt_server(s_config *conf, FILE * file, const char *filename, int *linenum)
 {
 	char *host = NULL, line[MAX_BUF], *p1, *p2;
 	int port = 0, opcode;
-	t_mqtt_server *mqtt_server = config.mqtt_server;
+	t_mqtt_server *mqtt_server = conf->mqtt_server;
 
 	/* Parsing loop */
 	while (memset(line, 0, MAX_BUF) && fgets(line, MAX_BUF - 1, file) && (strchr(line, '}') == NULL)) {
@@ -614,8 +674,7 @@ parse_mqtt_server(FILE * file, const char *filename, int *linenum)
 			case oBadOption:
 			default:
 				debug(LOG_ERR, "Bad option on line %d " "in %s.", *linenum, filename);
-				debug(LOG_ERR, "Exiting...");
-				exit(-1);
+				config_parse_error();
 				break;
 			}
 		}
@@ -662,7 +721,7 @@ Advance to the next word
 Parses firewall rule set information
 */
 static void
-parse_firewall_ruleset(const char *ruleset, FILE * file, const char *filename, int *linenum)
+parse_firewall_ruleset(s_config *conf, const char *ruleset, FILE * file, const char *filename, int *linenum)
 {
 	char line[MAX_BUF], *p1, *p2;
 	int opcode;
@@ -707,14 +766,13 @@ parse_firewall_ruleset(const char *ruleset, FILE * file, const char *filename, i
 
 			switch (opcode) {
 			case oFirewallRule:
-				_parse_firewall_rule(ruleset, p2);
+				_parse_firewall_rule(conf, ruleset, p2);
 				break;
 
 			case oBadOption:
 			default:
 				debug(LOG_ERR, "Bad option on line %d " "in %s.", *linenum, filename);
-				debug(LOG_ERR, "Exiting...");
-				exit(-1);
+				config_parse_error();
 				break;
 			}
 		}
@@ -727,7 +785,7 @@ parse_firewall_ruleset(const char *ruleset, FILE * file, const char *filename, i
 Helper for parse_firewall_ruleset.  Parses a single rule in a ruleset
 */
 static int
-_parse_firewall_rule(const char *ruleset, char *leftover)
+_parse_firewall_rule(s_config *conf, const char *ruleset, char *leftover)
 {
 	int i;
 	t_firewall_target target = TARGET_REJECT;	 /**< firewall target */
@@ -823,12 +881,12 @@ _parse_firewall_rule(const char *ruleset, char *leftover)
 	debug(LOG_DEBUG, "Adding Firewall Rule %s %s port %s to %s", token, tmp->protocol, tmp->port, tmp->mask);
 
 	/* Append the rule record */
-	if (config.rulesets == NULL) {
-		config.rulesets = safe_malloc(sizeof(t_firewall_ruleset));
-		config.rulesets->name = safe_strdup(ruleset);
-		tmpr = config.rulesets;
+	if (conf->rulesets == NULL) {
+		conf->rulesets = safe_malloc(sizeof(t_firewall_ruleset));
+		conf->rulesets->name = safe_strdup(ruleset);
+		tmpr = conf->rulesets;
 	} else {
-		tmpr2 = tmpr = config.rulesets;
+		tmpr2 = tmpr = conf->rulesets;
 		while (tmpr != NULL && (strcmp(tmpr->name, ruleset) != 0)) {
 			tmpr2 = tmpr;
 			tmpr = tmpr->next;
@@ -868,11 +926,14 @@ get_ruleset(const char *ruleset)
 	return (tmp->rules);
 }
 
-/**
-@param filename Full path of the configuration file to be read
-*/
-void
-config_read(const char *filename)
+/** @internal
+ * Parses a configuration file into conf. On a reload the list options are
+ * only recorded in conf->lists, the live lists and their indexes are left
+ * alone, and the options which only make sense at startup are skipped.
+ * @return 0 on success, -1 if the file could not be opened
+ */
+static int
+config_parse(s_config *conf, const char *filename, int reload)
 {
 	FILE *fd;
 	char line[MAX_BUF] = {0}, *s, *p1, *p2, *rawarg = NULL;
@@ -882,9 +943,10 @@ config_read(const char *filename)
 	debug(LOG_INFO, "Reading configuration file '%s'", filename);
 
 	if (!(fd = fopen(filename, "r"))) {
-		debug(LOG_ERR, "Could not open configuration file '%s', " "exiting...", filename);
-		exit(1);
+		debug(LOG_ERR, "Could not open configuration file '%s'", filename);
+		return -1;
 	}
+	config_parse_file = fd;
 
 	while (!feof(fd) && fgets(line, MAX_BUF, fd)) {
 		linenum++;
@@ -930,12 +992,13 @@ config_read(const char *filename)
 
 				switch (opcode) {
 				case oDeltaTraffic:
-					config.deltatraffic = parse_boolean_value(p1);
+					conf->deltatraffic = parse_boolean_value(p1);
 					break;
 				case oDaemon:
-					if (config.daemon == -1 && ((value = parse_boolean_value(p1)) != -1)) {
-						config.daemon = value;
-						if (config.daemon > 0) {
+					/* a running wifidog is already (not) daemonized */
+					if (!reload && conf->daemon == -1 && ((value = parse_boolean_value(p1)) != -1)) {
+						conf->daemon = value;
+						if (conf->daemon > 0) {
 							debugconf.log_stderr = 0;
 						} else {
 							debugconf.log_stderr = 1;
@@ -943,100 +1006,105 @@ config_read(const char *filename)
 					}
 					break;
 				case oExternalInterface:
-					config.external_interface = safe_strdup(p1);
+					conf->external_interface = safe_strdup(p1);
 					break;
 				case oGatewayID:
-					config.gw_id = safe_strdup(p1);
+					conf->gw_id = safe_strdup(p1);
 					break;
 				case oGatewayInterface:
-					config.gw_interface = safe_strdup(p1);
+					conf->gw_interface = safe_strdup(p1);
 					break;
 				case oGatewayAddress:
-					config.gw_address = safe_strdup(p1);
+					conf->gw_address = safe_strdup(p1);
 					break;
 				case oGatewayPort:
-					sscanf(p1, "%d", &config.gw_port);
+					sscanf(p1, "%d", &conf->gw_port);
 					break;
 				case oAuthServer:
-					parse_auth_server(fd, filename, &linenum);
+					parse_auth_server(conf, fd, filename, &linenum);
 					break;
 				case oFirewallRuleSet:
-					parse_firewall_ruleset(p1, fd, filename, &linenum);
+					parse_firewall_ruleset(conf, p1, fd, filename, &linenum);
 					break;
 				case oTrustedMACList:
-					parse_trusted_mac_list(p1);
+					config_list_append(conf, CONFIG_LIST_TRUSTED_MAC, p1);
+					if (!reload)
+						parse_trusted_mac_list(p1);
 					break;
 				case oTrustedLocalMACList:
-					parse_trusted_local_mac_list(p1);
+					config_list_append(conf, CONFIG_LIST_TRUSTED_LOCAL_MAC, p1);
+					if (!reload)
+						parse_trusted_local_mac_list(p1);
 					break;
 				case oPopularServers:
-					parse_popular_servers(rawarg);
+					parse_popular_servers(conf, rawarg);
 					break;
 				case oMQTT:
-					parse_mqtt_server(fd, filename, &linenum);
+					parse_mqtt_server(conf, fd, filename, &linenum);
 				case oHTTPDName:
-					config.httpdname = safe_strdup(p1);
+					conf->httpdname = safe_strdup(p1);
 					break;
 				case oHTTPDMaxConn:
-					sscanf(p1, "%d", &config.httpdmaxconn);
+					sscanf(p1, "%d", &conf->httpdmaxconn);
 					break;
 				case oHTTPDRealm:
-					config.httpdrealm = safe_strdup(p1);
+					conf->httpdrealm = safe_strdup(p1);
 					break;
 				case oHTTPDUsername:
-					config.httpdusername = safe_strdup(p1);
+					conf->httpdusername = safe_strdup(p1);
 					break;
 				case oHTTPDPassword:
-					config.httpdpassword = safe_strdup(p1);
+					conf->httpdpassword = safe_strdup(p1);
 					break;
 				case oCheckInterval:
-					sscanf(p1, "%d", &config.checkinterval);
+					sscanf(p1, "%d", &conf->checkinterval);
 					break;
 				case oWdctlSocket:
-					free(config.wdctl_sock);
-					config.wdctl_sock = safe_strdup(p1);
+					free(conf->wdctl_sock);
+					conf->wdctl_sock = safe_strdup(p1);
 					break;
 				case oClientTimeout:
-					sscanf(p1, "%d", &config.clienttimeout);
+					sscanf(p1, "%d", &conf->clienttimeout);
 					break;
 				case oSyslogFacility:
-					sscanf(p1, "%d", &debugconf.syslog_facility);
+					if (!reload)
+						sscanf(p1, "%d", &debugconf.syslog_facility);
 					break;
 				case oHtmlMessageFile:
-					config.htmlmsgfile = safe_strdup(p1);
+					conf->htmlmsgfile = safe_strdup(p1);
 					break;
 				case oProxyPort:
-					sscanf(p1, "%d", &config.proxy_port);
+					sscanf(p1, "%d", &conf->proxy_port);
 					break;
 				case oSSLCertPath:
-					config.ssl_certs = safe_strdup(p1);
+					conf->ssl_certs = safe_strdup(p1);
 #ifndef USE_CYASSL
 					debug(LOG_WARNING, "SSLCertPath is set but not SSL compiled in. Ignoring!");
 #endif
 					break;
 				case oSSLPeerVerification:
-					config.ssl_verify = parse_boolean_value(p1);
-					if (config.ssl_verify < 0) {
+					conf->ssl_verify = parse_boolean_value(p1);
+					if (conf->ssl_verify < 0) {
 						debug(LOG_WARNING, "Bad syntax for Parameter: SSLPeerVerification on line %d " "in %s."
 							"The syntax is yes or no." , linenum, filename);
-						exit(-1);
+						config_parse_error();
 					}
 #ifndef USE_CYASSL
 					debug(LOG_WARNING, "SSLPeerVerification is set but no SSL compiled in. Ignoring!");
 #endif
 					break;
 				case oSSLAllowedCipherList:
-					config.ssl_cipher_list = safe_strdup(p1);
+					conf->ssl_cipher_list = safe_strdup(p1);
 #ifndef USE_CYASSL
 					debug(LOG_WARNING, "SSLAllowedCipherList is set but no SSL compiled in. Ignoring!");
 #endif
 					break;
 				case oSSLUseSNI:
-					config.ssl_use_sni = parse_boolean_value(p1);
-					if (config.ssl_use_sni < 0) {
+					conf->ssl_use_sni = parse_boolean_value(p1);
+					if (conf->ssl_use_sni < 0) {
 						debug(LOG_WARNING, "Bad syntax for Parameter: SSLUseSNI on line %d " "in %s."
 							"The syntax is yes or no." , linenum, filename);
-						exit(-1);
+						config_parse_error();
 					}
 #ifndef USE_CYASSL
 					debug(LOG_WARNING, "SSLUseSNI is set but no SSL compiled in. Ignoring!");
@@ -1048,60 +1116,116 @@ config_read(const char *filename)
 					break;
 				// >>> liudf added 20151224
 				case oTrustedPanDomains:
-					parse_trusted_pan_domain_string(rawarg);
+					config_list_append(conf, CONFIG_LIST_TRUSTED_PAN_DOMAINS, rawarg);
+					if (!reload)
+						parse_trusted_pan_domain_string(rawarg);
 					break;
 				case oTrustedDomains:
-					parse_user_trusted_domain_string(rawarg);
+					config_list_append(conf, CONFIG_LIST_TRUSTED_DOMAINS, rawarg);
+					if (!reload)
+						parse_user_trusted_domain_string(rawarg);
 					break;
 				case oUntrustedMACList:
-					parse_untrusted_mac_list(p1);
+					config_list_append(conf, CONFIG_LIST_UNTRUSTED_MAC, p1);
+					if (!reload)
+						parse_untrusted_mac_list(p1);
 					break;
 				case oJsFilter:
-					config.js_filter = parse_boolean_value(p1);
+					conf->js_filter = parse_boolean_value(p1);
 					break;
 				case oPoolMode:
-					config.pool_mode = parse_boolean_value(p1);
+					conf->pool_mode = parse_boolean_value(p1);
 					break;
 				case oThreadNumber:
-					sscanf(p1, "%hd", &config.thread_number);
+					sscanf(p1, "%hd", &conf->thread_number);
 					break;
 				case oQueueSize:
-					sscanf(p1, "%hd", &config.queue_size);
+					sscanf(p1, "%hd", &conf->queue_size);
 					break;
 				case oWiredPassed:
-					config.wired_passed = parse_boolean_value(p1);
+					conf->wired_passed = parse_boolean_value(p1);
 					break;
 				case oParseChecked:
-					config.parse_checked = parse_boolean_value(p1);
+					conf->parse_checked = parse_boolean_value(p1);
 					break;
 				case oTrustedIpList:
-					add_trusted_ip_list(rawarg);
+					config_list_append(conf, CONFIG_LIST_TRUSTED_IP, rawarg);
+					if (!reload)
+						add_trusted_ip_list(rawarg);
 					break;
 				case oNoAuth:
-					config.no_auth = parse_boolean_value(p1);
+					conf->no_auth = parse_boolean_value(p1);
 					break;
 				case oGatewayHttpsPort:
-					sscanf(p1, "%hu", &config.https_server->gw_https_port);
+					sscanf(p1, "%hu", &conf->https_server->gw_https_port);
 					break;
 				case oWorkMode:
-					sscanf(p1, "%hu", &config.work_mode);
+					sscanf(p1, "%hu", &conf->work_mode);
 					break;
 				case oUpdateDomainInterval:
-					sscanf(p1, "%d", &config.update_domain_interval);
+					sscanf(p1, "%d", &conf->update_domain_interval);
 					break;
 				case oDNSTimeout:
-					config.dns_timeout = safe_strdup(p1);
+					conf->dns_timeout = safe_strdup(p1);
+					break;
+				case oHttpsSessionCacheSize:
+					sscanf(p1, "%d", &conf->https_server->session_cache_size);
+					break;
+				case oHttpsSessionTimeout:
+					sscanf(p1, "%d", &conf->https_server->session_timeout);
+					break;
+				case oHttpsSessionTickets:
+					conf->https_server->session_tickets = parse_boolean_value(p1);
+					break;
+				case oHttpsTicketKeyLifetime:
+					sscanf(p1, "%d", &conf->https_server->ticket_key_lifetime);
+					break;
+				case oHttpsCipherList:
+					free(conf->https_server->cipher_list);
+					conf->https_server->cipher_list = safe_strdup(p1);
+					break;
+				case oHttpsCipherSuites:
+					free(conf->https_server->cipher_suites);
+					conf->https_server->cipher_suites = safe_strdup(p1);
+					break;
+				case oHttpsCurves:
+					free(conf->https_server->curves);
+					conf->https_server->curves = safe_strdup(p1);
+					break;
+				case oHttpsSniPeek:
+					sscanf(p1, "%hd", &conf->https_server->sni_peek);
+					break;
+				case oHttpsRedirectRate:
+					sscanf(p1, "%d", &conf->https_server->redirect_rate);
+					break;
+				case oHttpsRedirectBurst:
+					sscanf(p1, "%d", &conf->https_server->redirect_burst);
+					break;
+				case oClientConnRate:
+					sscanf(p1, "%d", &conf->client_conn_rate);
+					break;
+				case oClientConnBurst:
+					sscanf(p1, "%d", &conf->client_conn_burst);
+					break;
+				case oEnableIpv6:
+					conf->enable_ipv6 = parse_boolean_value(p1);
+					break;
+				case oClientJournal:
+					free(conf->client_journal);
+					conf->client_journal = safe_strdup(p1);
+					break;
+				case oClientJournalSyncInterval:
+					sscanf(p1, "%d", &conf->client_journal_sync_interval);
 					break;
 				// <<< liudf added end
 				case oAppleCNA:
-					config.bypass_apple_cna = parse_boolean_value(p1);
+					conf->bypass_apple_cna = parse_boolean_value(p1);
 					break;
 				case oBadOption:
 					/* FALL THROUGH */
 				default:
 					debug(LOG_ERR, "Bad option on line %d " "in %s.", linenum, filename);
-					debug(LOG_ERR, "Exiting...");
-					exit(-1);
+					config_parse_error();
 					break;
 				}
 			}
@@ -1114,14 +1238,212 @@ config_read(const char *filename)
 
 	// liudf added 20160125
 	// parse inner trusted domain string
-	parse_inner_trusted_domain_string(g_inner_trusted_domains);
+	if (!reload)
+		parse_inner_trusted_domain_string(g_inner_trusted_domains);
 
-	if (config.httpdusername && !config.httpdpassword) {
+	if (conf->httpdusername && !conf->httpdpassword) {
 		debug(LOG_ERR, "HTTPDUserName requires a HTTPDPassword to be set.");
-		exit(-1);
+		config_parse_error();
 	}
 
+	config_parse_file = NULL;
 	fclose(fd);
+	return 0;
+}
+
+/**
+@param filename Full path of the configuration file to be read
+*/
+void
+config_read(const char *filename)
+{
+	if (config_parse(&config, filename, 0) != 0) {
+		debug(LOG_ERR, "Exiting...");
+		exit(1);
+	}
+}
+
+/** Reads the configuration file into a new configuration, for a reload to
+ * diff against the live one; the live configuration is not touched.
+ * @param filename Full path of the configuration file to be read
+ * @return The new configuration, free it with config_free(), or NULL if the
+ * file could not be read or is not valid
+ */
+s_config *
+config_read_next(const char *filename)
+{
+	s_config *next = safe_malloc(sizeof(s_config));
+	jmp_buf abort_parse;
+
+	config_defaults(next);
+	free(next->configfile);
+	next->configfile = safe_strdup(filename);
+
+	config_parse_abort = &abort_parse;
+	if (setjmp(abort_parse) != 0) {
+		/* a bad option: config_parse_error() jumped back here */
+		if (config_parse_file) {
+			fclose(config_parse_file);
+			config_parse_file = NULL;
+		}
+		config_parse_abort = NULL;
+		config_free(next);
+		return NULL;
+	}
+
+	if (config_parse(next, filename, 1) != 0) {
+		config_parse_abort = NULL;
+		config_free(next);
+		return NULL;
+	}
+	config_parse_abort = NULL;
+
+	if (next->gw_interface == NULL || next->auth_servers == NULL) {
+		debug(LOG_ERR, "%s: GatewayInterface and AuthServer are mandatory", filename);
+		config_free(next);
+		return NULL;
+	}
+	validate_popular_servers(next);
+
+	return next;
+}
+
+/** Frees the rules of a firewall ruleset */
+void
+config_free_rules(t_firewall_rule *rule)
+{
+	t_firewall_rule *next;
+
+	for (; rule != NULL; rule = next) {
+		next = rule->next;
+		free(rule->protocol);
+		free(rule->port);
+		free(rule->mask);
+		free(rule);
+	}
+}
+
+/** Frees a configuration returned by config_read_next() and everything it
+ * still points to; the trusted domain and mac lists are not parsed into
+ * such a configuration, only recorded in its lists.
+ */
+void
+config_free(s_config *conf)
+{
+	t_auth_serv *auth_server;
+	t_firewall_ruleset *ruleset;
+	t_popular_server *popular_server;
+	void *next;
+	int i;
+
+	free(conf->configfile);
+	free(conf->htmlmsgfile);
+	free(conf->wdctl_sock);
+	free(conf->internal_sock);
+	free(conf->pidfile);
+	free(conf->external_interface);
+	free(conf->gw_id);
+	free(conf->gw_interface);
+	free(conf->gw_address);
+	free(conf->httpdname);
+	free(conf->httpdrealm);
+	free(conf->httpdusername);
+	free(conf->httpdpassword);
+	free(conf->ssl_certs);
+	free(conf->ssl_cipher_list);
+	free(conf->arp_table_path);
+	free(conf->htmlredirfile);
+	free(conf->internet_offline_file);
+	free(conf->authserver_offline_file);
+	free(conf->dns_timeout);
+	free(conf->client_journal);
+
+	for (auth_server = conf->auth_servers; auth_server != NULL; auth_server = next) {
+		next = auth_server->next;
+		free(auth_server->authserv_hostname);
+		free(auth_server->authserv_path);
+		free(auth_server->authserv_login_script_path_fragment);
+		free(auth_server->authserv_portal_script_path_fragment);
+		free(auth_server->authserv_msg_script_path_fragment);
+		free(auth_server->authserv_ping_script_path_fragment);
+		free(auth_server->authserv_auth_script_path_fragment);
+		free(auth_server->last_ip);
+		free(auth_server);
+	}
+
+	for (ruleset = conf->rulesets; ruleset != NULL; ruleset = next) {
+		next = ruleset->next;
+		config_free_rules(ruleset->rules);
+		free(ruleset->name);
+		free(ruleset);
+	}
+
+	for (popular_server = conf->popular_servers; popular_server != NULL; popular_server = next) {
+		next = popular_server->next;
+		free(popular_server->hostname);
+		free(popular_server);
+	}
+
+	if (conf->https_server) {
+		free(conf->https_server->ca_crt_file);
+		free(conf->https_server->svr_crt_file);
+		free(conf->https_server->svr_key_file);
+		free(conf->https_server->cipher_list);
+		free(conf->https_server->cipher_suites);
+		free(conf->https_server->curves);
+		free(conf->https_server);
+	}
+	if (conf->http_server) {
+		free(conf->http_server->base_path);
+		free(conf->http_server);
+	}
+	if (conf->mqtt_server) {
+		free(conf->mqtt_server->hostname);
+		free(conf->mqtt_server->cafile);
+		free(conf->mqtt_server->crtfile);
+		free(conf->mqtt_server->keyfile);
+		free(conf->mqtt_server);
+	}
+	if (conf->pool_server) {
+		free(conf->pool_server->pool_server);
+		free(conf->pool_server->coinbase_address);
+		free(conf->pool_server);
+	}
+
+	for (i = 0; i < CONFIG_LIST_MAX; i++)
+		free(conf->lists[i]);
+
+	free(conf);
+}
+
+/** @internal
+ * A bad option in the config file: wifidog exits when it starts, a reload
+ * is abandoned and the running configuration stays.
+ */
+static void
+config_parse_error(void)
+{
+	if (config_parse_abort)
+		longjmp(*config_parse_abort, 1);
+
+	debug(LOG_ERR, "Exiting...");
+	exit(-1);
+}
+
+/** @internal
+ * Records the value of a list option, the options may be repeated */
+static void
+config_list_append(s_config *conf, config_list_t which, const char *value)
+{
+	char *joined = NULL;
+
+	if (conf->lists[which] == NULL) {
+		conf->lists[which] = safe_strdup(value);
+	} else {
+		safe_asprintf(&joined, "%s,%s", conf->lists[which], value);
+		free(conf->lists[which]);
+		conf->lists[which] = joined;
+	}
 }
 
 /** @internal
@@ -1166,6 +1488,263 @@ check_mac_format(const char *possiblemac)
  *
  */
 
+/*
+ * mac sets for trusted, untrusted, trusted local and roam mac lists
+ *
+ * open addressing table keyed by the 48-bit mac, so is_trusted_mac and
+ * friends which run for every captive request don't walk the lists or take
+ * the config lock. writers still serialize on LOCK_CONFIG; a slot is a single
+ * 64-bit word and the table pointer is published after it's filled, so a
+ * reader sees either the old or the new table. a table replaced by a grow
+ * stays on the set's retired list for MAC_SET_GRACE seconds, which is far
+ * longer than any reader holds it, and is freed by a later writer. tombstones
+ * are compacted in place, so a table is only replaced when it has to grow
+ */
+#define	MAC_SET_MIN_SIZE	64
+#define	MAC_SET_GRACE		60
+#define	MAC_SLOT_EMPTY		0ULL
+#define	MAC_SLOT_DELETED	(~0ULL)
+#define	MAC_SLOT_USED		(1ULL << 48)
+
+struct mac_set_table {
+	unsigned int	size;
+	uint64_t		*slots;
+	unsigned int	gen; // odd while __mac_set_compact moves keys
+	time_t			retired_at;
+	struct mac_set_table *next_retired;
+};
+
+struct mac_set {
+	struct mac_set_table *table;
+	struct mac_set_table *retired;
+	unsigned int	count;
+	unsigned int	used; // count + deleted slots
+};
+
+static struct mac_set mac_sets[ROAM_MAC+1];
+
+static int
+mac_str_2_key(const char *mac, uint64_t *key)
+{
+	unsigned int b[6];
+	int i;
+
+	if (mac == NULL || sscanf(mac, "%2x:%2x:%2x:%2x:%2x:%2x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+		return 0;
+
+	*key = 0;
+	for (i = 0; i < 6; i++)
+		*key = (*key << 8) | b[i];
+	*key |= MAC_SLOT_USED;
+	return 1;
+}
+
+static unsigned int
+mac_key_slot(uint64_t key, unsigned int size)
+{
+	key ^= key >> 29;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 32;
+	return (unsigned int)key & (size - 1);
+}
+
+static struct mac_set_table *
+mac_set_table_new(unsigned int size)
+{
+	struct mac_set_table *t = safe_malloc(sizeof(struct mac_set_table));
+	t->size = size;
+	t->slots = safe_malloc(size * sizeof(uint64_t));
+	return t;
+}
+
+static void
+mac_set_table_insert(struct mac_set_table *t, uint64_t key)
+{
+	unsigned int i = mac_key_slot(key, t->size);
+	while (t->slots[i] != MAC_SLOT_EMPTY && t->slots[i] != MAC_SLOT_DELETED)
+		i = (i + 1) & (t->size - 1);
+	__atomic_store_n(&t->slots[i], key, __ATOMIC_RELEASE);
+}
+
+static int
+mac_set_contains(struct mac_set *set, const char *mac)
+{
+	struct mac_set_table *t = __atomic_load_n(&set->table, __ATOMIC_ACQUIRE);
+	uint64_t key, slot;
+	unsigned int i, n, gen;
+
+	if (t == NULL || !mac_str_2_key(mac, &key))
+		return 0;
+
+	do {
+		gen = __atomic_load_n(&t->gen, __ATOMIC_ACQUIRE);
+		i = mac_key_slot(key, t->size);
+		for (n = 0; n < t->size; n++) {
+			slot = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+			if (slot == key)
+				return 1;
+			if (slot == MAC_SLOT_EMPTY)
+				break;
+			i = (i + 1) & (t->size - 1);
+		}
+		// a miss while keys were being moved may have stepped over one
+	} while ((gen & 1) || __atomic_load_n(&t->gen, __ATOMIC_ACQUIRE) != gen);
+
+	return 0;
+}
+
+static time_t
+mac_set_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+// should hold LOCK_CONFIG
+static void
+__mac_set_reap(struct mac_set *set)
+{
+	struct mac_set_table **pp = &set->retired, *t;
+	time_t now = mac_set_now();
+
+	while ((t = *pp) != NULL) {
+		if (now - t->retired_at >= MAC_SET_GRACE) {
+			*pp = t->next_retired;
+			free(t->slots);
+			free(t);
+		} else
+			pp = &t->next_retired;
+	}
+}
+
+// should hold LOCK_CONFIG
+static void
+__mac_set_rehash(struct mac_set *set, unsigned int size)
+{
+	struct mac_set_table *old = set->table, *t = mac_set_table_new(size);
+	unsigned int i;
+
+	__mac_set_reap(set);
+	if (old) {
+		for (i = 0; i < old->size; i++) {
+			if (old->slots[i] != MAC_SLOT_EMPTY && old->slots[i] != MAC_SLOT_DELETED)
+				mac_set_table_insert(t, old->slots[i]);
+		}
+	}
+	set->used = set->count;
+	__atomic_store_n(&set->table, t, __ATOMIC_RELEASE);
+	if (old) {
+		old->retired_at = mac_set_now();
+		old->next_retired = set->retired;
+		set->retired = old;
+	}
+}
+
+/*
+ * drop the tombstones of a table readers may be probing. a key is first
+ * copied to the earliest free slot of its probe path and only then
+ * tombstoned where it was; once no key can move, no probe path of a live key
+ * crosses a tombstone and they can all become empty. a reader that missed
+ * while gen was odd or changed probes again
+ */
+// should hold LOCK_CONFIG
+static void
+__mac_set_compact(struct mac_set *set)
+{
+	struct mac_set_table *t = set->table;
+	unsigned int i, j, moved;
+	uint64_t key;
+
+	__atomic_store_n(&t->gen, t->gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	do {
+		moved = 0;
+		for (i = 0; i < t->size; i++) {
+			key = t->slots[i];
+			if (key == MAC_SLOT_EMPTY || key == MAC_SLOT_DELETED)
+				continue;
+			for (j = mac_key_slot(key, t->size); j != i; j = (j + 1) & (t->size - 1)) {
+				if (t->slots[j] == MAC_SLOT_DELETED) {
+					__atomic_store_n(&t->slots[j], key, __ATOMIC_RELEASE);
+					__atomic_store_n(&t->slots[i], MAC_SLOT_DELETED, __ATOMIC_RELEASE);
+					moved++;
+					break;
+				}
+			}
+		}
+	} while (moved);
+
+	for (i = 0; i < t->size; i++) {
+		if (t->slots[i] == MAC_SLOT_DELETED)
+			__atomic_store_n(&t->slots[i], MAC_SLOT_EMPTY, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&t->gen, t->gen + 1, __ATOMIC_RELEASE);
+	set->used = set->count;
+}
+
+// should hold LOCK_CONFIG
+static void
+__mac_set_add(struct mac_set *set, const char *mac)
+{
+	uint64_t key;
+
+	if (!mac_str_2_key(mac, &key) || mac_set_contains(set, mac))
+		return;
+
+	if (set->table == NULL)
+		__mac_set_rehash(set, MAC_SET_MIN_SIZE);
+	else if ((set->used + 1) * 4 > set->table->size * 3) {
+		if (set->count * 2 < set->table->size)
+			__mac_set_compact(set);
+		else
+			__mac_set_rehash(set, set->table->size * 2);
+	}
+
+	mac_set_table_insert(set->table, key);
+	set->count++;
+	set->used++;
+}
+
+// should hold LOCK_CONFIG
+static void
+__mac_set_remove(struct mac_set *set, const char *mac)
+{
+	struct mac_set_table *t = set->table;
+	uint64_t key;
+	unsigned int i, n;
+
+	if (t == NULL || !mac_str_2_key(mac, &key))
+		return;
+
+	i = mac_key_slot(key, t->size);
+	for (n = 0; n < t->size && t->slots[i] != MAC_SLOT_EMPTY; n++) {
+		if (t->slots[i] == key) {
+			__atomic_store_n(&t->slots[i], MAC_SLOT_DELETED, __ATOMIC_RELEASE);
+			set->count--;
+			return;
+		}
+		i = (i + 1) & (t->size - 1);
+	}
+}
+
+// should hold LOCK_CONFIG
+static void
+__mac_set_clear(struct mac_set *set)
+{
+	struct mac_set_table *t = set->table;
+	unsigned int i;
+
+	if (t == NULL)
+		return;
+
+	for (i = 0; i < t->size; i++)
+		__atomic_store_n(&t->slots[i], MAC_SLOT_EMPTY, __ATOMIC_RELEASE);
+	set->count = 0;
+	set->used = 0;
+}
+
 static void
 remove_online_client(const char *mac)
 {
@@ -1181,32 +1760,30 @@ remove_online_client(const char *mac)
 	UNLOCK_CLIENT_LIST();
 }
 
-static void
-remove_mac_from_list(const char *mac, mac_choice_t which)
+static t_trusted_mac **
+get_mac_list_head(mac_choice_t which)
 {
-	t_trusted_mac *p = NULL, *p1 = NULL;
 	switch(which) {
 	case TRUSTED_MAC:
-		p = config.trustedmaclist;
-		p1 = p;
-		break;
+		return &config.trustedmaclist;
 	case UNTRUSTED_MAC:
-		p = config.mac_blacklist;
-		p1 = p;
-		break;
+		return &config.mac_blacklist;
 	case TRUSTED_LOCAL_MAC:
-		p = config.trusted_local_maclist;
-		p1 = p;
-		break;
+		return &config.trusted_local_maclist;
 	case ROAM_MAC:
-		p = config.roam_maclist;
-		p1 = p;
-		break;
-	default:
-		return;
+		return &config.roam_maclist;
 	}
-	
-	if (p == NULL) {
+
+	return NULL;
+}
+
+static void
+remove_mac_from_list(const char *mac, mac_choice_t which)
+{
+	t_trusted_mac *p = NULL, *p1 = NULL;
+	t_trusted_mac **head = get_mac_list_head(which);
+
+	if (head == NULL || *head == NULL) {
 		return;
 	}
 	
@@ -1214,43 +1791,24 @@ remove_mac_from_list(const char *mac, mac_choice_t which)
 	
 	remove_online_client(mac);
 	
+	if (!mac_set_contains(&mac_sets[which], mac))
+		return;
+
 	LOCK_CONFIG();
 
-	while(p) {
-		if(strcmp(p->mac, mac) == 0) {
+	__mac_set_remove(&mac_sets[which], mac);
+
+	for (p = *head; p != NULL; p1 = p, p = p->next) {
+		if(strcasecmp(p->mac, mac) == 0) {
 			break;
 		}
-		p1 = p;
-		p = p->next;
 	}
 
 	if(p) {
-		switch(which) {
-		case TRUSTED_MAC:
-			if(p == config.trustedmaclist)
-				config.trustedmaclist = p->next;
-			else
-				p1->next = p->next;
-			break;
-		case UNTRUSTED_MAC:
-			if(p == config.mac_blacklist)
-				config.mac_blacklist = p->next;
-			else
-				p1->next = p->next;
-			break;
-		case TRUSTED_LOCAL_MAC:
-			if(p == config.trusted_local_maclist)
-				config.trusted_local_maclist = p->next;
-			else
-				p1->next = p->next;
-			break;
-		case ROAM_MAC:
-			if(p == config.roam_maclist)
-				config.roam_maclist = p->next;
-			else
-				p1->next = p->next;
-			break;
-		}	
+		if(p1 == NULL)
+			*head = p->next;
+		else
+			p1->next = p->next;
 		free(p->mac);
 		if(p->ip) free(p->ip);
 		free(p);
@@ -1263,6 +1821,10 @@ static t_trusted_mac *
 add_mac_from_list(const char *mac, mac_choice_t which)
 {
 	t_trusted_mac *pret = NULL, *p = NULL;
+	t_trusted_mac **head = get_mac_list_head(which);
+
+	if (head == NULL || which == ROAM_MAC) //deprecated
+		return NULL;
 
 	remove_online_client(mac);
 
@@ -1270,79 +1832,13 @@ add_mac_from_list(const char *mac, mac_choice_t which)
 
 	LOCK_CONFIG();
 
-	switch (which) {
-	case TRUSTED_MAC:
-		if (config.trustedmaclist == NULL) {
-			config.trustedmaclist = safe_malloc(sizeof(t_trusted_mac));
-			config.trustedmaclist->mac = safe_strdup(mac);
-			config.trustedmaclist->next = NULL;
-			pret = config.trustedmaclist;
-			UNLOCK_CONFIG();
-			return pret;
-		} else {
-			p = config.trustedmaclist;
-		}
-		break;
-	case UNTRUSTED_MAC:
-		if (config.mac_blacklist == NULL) {
-			config.mac_blacklist = safe_malloc(sizeof(t_untrusted_mac));
-			config.mac_blacklist->mac = safe_strdup(mac);
-			config.mac_blacklist->next = NULL;
-			UNLOCK_CONFIG();
-			return pret;
-		} else {
-			p = config.mac_blacklist;
-		}
-		break;
-	case TRUSTED_LOCAL_MAC:
-		if (config.trusted_local_maclist == NULL) {
-			config.trusted_local_maclist = safe_malloc(sizeof(t_trusted_mac));
-			config.trusted_local_maclist->mac = safe_strdup(mac);
-			config.trusted_local_maclist->next = NULL;
-			pret = config.trusted_local_maclist;
-			UNLOCK_CONFIG();
-			return pret;
-		} else {
-			p = config.trusted_local_maclist;
-		}
-		break;
-	case ROAM_MAC: //deprecated
-		break;
-	}
-	
-	
-	int skipmac;
-	/* Advance to the last entry */
-	skipmac = 0;
-	while (p != NULL) {
-		if (0 == strcmp(p->mac, mac)) {
-			skipmac = 1;
-		}
-		p = p->next;
-	}
-	if (!skipmac) {
+	if (!mac_set_contains(&mac_sets[which], mac)) {
 		p = safe_malloc(sizeof(t_trusted_mac));
 		p->mac = safe_strdup(mac);
-		switch (which) {
-		case TRUSTED_MAC:
-			p->next = config.trustedmaclist;
-			config.trustedmaclist = p;
-			pret = p;
-			break;
-		case UNTRUSTED_MAC:
-			p->next = config.mac_blacklist;
-			config.mac_blacklist = p;
-			pret = p;
-			break;
-		case TRUSTED_LOCAL_MAC:
-			p->next = config.trusted_local_maclist;
-			config.trusted_local_maclist = p;
-			pret = p;
-			break;
-		case ROAM_MAC: //deprecated
-			break;
-		}
-		
+		p->next = *head;
+		*head = p;
+		__mac_set_add(&mac_sets[which], mac);
+		pret = p;
 	} else {
 		debug(LOG_ERR,
 			"MAC address [%s] already on mac list.  ",
@@ -1474,24 +1970,24 @@ parse_roam_mac_list(const char *pstr)
  * @param server The hostname to add.
  */
 static void
-add_popular_server(const char *server)
+add_popular_server(s_config *conf, const char *server)
 {
 	t_popular_server *p = NULL;
 
 	p = (t_popular_server *)safe_malloc(sizeof(t_popular_server));
 	p->hostname = safe_strdup(server);
 
-	if (config.popular_servers == NULL) {
+	if (conf->popular_servers == NULL) {
 		p->next = NULL;
-		config.popular_servers = p;
+		conf->popular_servers = p;
 	} else {
-		p->next = config.popular_servers;
-		config.popular_servers = p;
+		p->next = conf->popular_servers;
+		conf->popular_servers = p;
 	}
 }
 
 static void
-parse_popular_servers(const char *ptr)
+parse_popular_servers(s_config *conf, const char *ptr)
 {
 	char *ptrcopy = NULL, *pt = NULL;
 	char *hostname = NULL;
@@ -1521,7 +2017,7 @@ parse_popular_servers(const char *ptr)
 			*tmp = '\0';
 		}
 		debug(LOG_DEBUG, "Adding Popular Server [%s] to list", hostname);
-		add_popular_server(hostname);
+		add_popular_server(conf, hostname);
 	}
 
 	free(pt);
@@ -1532,101 +2028,118 @@ parse_popular_servers(const char *ptr)
  * trust domain related function
  */
 
-t_domain_trusted *
-__del_domain_common(const char *domain, trusted_domain_t which)
+/*
+ * trusted domains are indexed by name so add/del/lookup don't walk the lists,
+ * each domain's ips are indexed by their binary address; the linked lists
+ * stay as they are for the code which iterates them. a domain keeps the link
+ * pointing at it in both its bucket and its list, so it unlinks in O(1).
+ * both indexes are protected by LOCK_DOMAIN
+ */
+#define	DOMAIN_INDEX_SIZE	256
+#define	IP_INDEX_MIN_SIZE	16
+
+static t_domain_trusted *domain_index[TRUSTED_PAN_DOMAIN+1][DOMAIN_INDEX_SIZE];
+
+static unsigned int
+domain_hash(const char *domain)
 {
-	t_domain_trusted *p = NULL, *p1 = NULL;
+	unsigned int h = 2166136261u; // FNV-1a
+	for (; *domain != '\0'; domain++) {
+		h ^= (unsigned char)*domain;
+		h *= 16777619u;
+	}
+	return h;
+}
 
-	if(which == USER_TRUSTED_DOMAIN) {
-		if (config.domains_trusted != NULL) {
-			for(p = config.domains_trusted; p != NULL; p1 = p, p = p->next) {
-				if(strcmp(p->domain, domain) == 0) {
-					break;
-				}
-			}
+static t_domain_trusted **
+get_domain_list_head(trusted_domain_t which)
+{
+	switch(which) {
+	case USER_TRUSTED_DOMAIN:
+		return &config.domains_trusted;
+	case INNER_TRUSTED_DOMAIN:
+		return &config.inner_domains_trusted;
+	case TRUSTED_PAN_DOMAIN:
+		return &config.pan_domains_trusted;
+	}
 
-			if(p == NULL)
-				return NULL;
+	return NULL;
+}
 
-			if(p1 != NULL) {
-				p1->next = p->next;
-			} else {
-				config.domains_trusted = p->next;
-			}
-		}
-	} else if (which == INNER_TRUSTED_DOMAIN) {
-		if (config.inner_domains_trusted != NULL) {
-			for(p = config.inner_domains_trusted; p != NULL; p1 = p, p = p->next) {
-				if(strcmp(p->domain, domain) == 0) {
-					break;
-				}
-			}
+static void
+__unindex_domain(t_domain_trusted *p)
+{
+	if(p->hpprev == NULL)
+		return;
 
-			if(p == NULL)
-				return NULL;
+	*p->hpprev = p->hnext;
+	if(p->hnext)
+		p->hnext->hpprev = p->hpprev;
+	p->hnext = NULL;
+	p->hpprev = NULL;
+}
 
-			if(p1 != NULL) {
-				p1->next = p->next;
-			} else {
-				config.inner_domains_trusted = p->next;
-			}
-		}
-	} else if (which == TRUSTED_PAN_DOMAIN) {
-		if (config.pan_domains_trusted != NULL) {
-			for(p = config.pan_domains_trusted; p != NULL; p1 = p, p = p->next) {
-				if(strcmp(p->domain, domain) == 0) {
-					break;
-				}
-			}
+static void
+__unlink_domain(t_domain_trusted *p)
+{
+	if(p->pprev == NULL)
+		return;
+
+	*p->pprev = p->next;
+	if(p->next)
+		p->next->pprev = p->pprev;
+	p->next = NULL;
+	p->pprev = NULL;
+}
 
-			if(p == NULL)
-				return NULL;
+static void
+__free_trusted_domain(t_domain_trusted *p)
+{
+	__clear_trusted_domain_ip(p->ips_trusted);
+	free(p->ip_index);
+	free(p->domain);
+	free(p);
+}
 
-			if(p1 != NULL) {
-				p1->next = p->next;
-			} else {
-				config.pan_domains_trusted = p->next;
-			}
-		}
+t_domain_trusted *
+__find_domain_common(const char *domain, trusted_domain_t which)
+{
+	t_domain_trusted *p = NULL;
+	unsigned int h;
+
+	if(which > TRUSTED_PAN_DOMAIN)
+		return NULL;
+
+	h = domain_hash(domain);
+	for(p = domain_index[which][h % DOMAIN_INDEX_SIZE]; p != NULL; p = p->hnext) {
+		if(p->hash == h && strcmp(p->domain, domain) == 0)
+			break;
 	}
 
 	return p;
 }
 
-static t_domain_trusted *
-__del_ip_domain_common(const char *domain, trusted_domain_t which)
+t_domain_trusted *
+__del_domain_common(const char *domain, trusted_domain_t which)
 {
 	t_domain_trusted *p = NULL;
-	
-	if(which == USER_TRUSTED_DOMAIN) {	
-    	if (config.domains_trusted != NULL) {
-			for(p = config.domains_trusted; p != NULL; p = p->next) {
-				if(strcmp(p->domain, domain) == 0) {
-					break;
-				}
-			}
-    	}
-	} else if (which == INNER_TRUSTED_DOMAIN) {
-		if (config.inner_domains_trusted != NULL) {
-			for(p = config.inner_domains_trusted; p != NULL; p = p->next) {
-				if(strcmp(p->domain, domain) == 0) {
-					break;
-				}
-			}
-    	}
-	} else if (which == TRUSTED_PAN_DOMAIN) {	
-		if (config.pan_domains_trusted != NULL) {
-			for(p = config.pan_domains_trusted; p != NULL; p = p->next) {
-				if(strcmp(p->domain, domain) == 0) {
-					break;
-				}
-			}
-    	}
-	}
+
+	p = __find_domain_common(domain, which);
+	if(p == NULL)
+		return NULL;
+
+	__unindex_domain(p);
+	__unlink_domain(p);
 
 	return p;
 }
 
+static t_domain_trusted *
+__del_ip_domain_common(const char *domain, trusted_domain_t which)
+{
+	return __find_domain_common(domain, which);
+}
+
 
 void
 del_domain_common(const char *domain, trusted_domain_t which)
@@ -1636,84 +2149,43 @@ del_domain_common(const char *domain, trusted_domain_t which)
 	p = __del_domain_common(domain, which);
 	UNLOCK_DOMAIN();
 
-	if(p) {
-		__clear_trusted_domain_ip(p->ips_trusted);
-		free(p->domain);
-		free(p);
-	}
+	if(p)
+		__free_trusted_domain(p);
 }
 
 t_domain_trusted *
 __add_domain_common(const char *domain, trusted_domain_t which)
 {
 	t_domain_trusted *p = NULL;
+	t_domain_trusted **head = NULL, **bucket = NULL;
 
-	if(which == USER_TRUSTED_DOMAIN) {
-		if (config.domains_trusted == NULL) {
-			p = (t_domain_trusted *)safe_malloc(sizeof(t_domain_trusted));
-			p->domain = safe_strdup(domain);
-			p->next = NULL;
-			config.domains_trusted = p;
-		} else {
-			for(p = config.domains_trusted; p != NULL; p = p->next) {
-				if(strcmp(p->domain, domain) == 0)
-					break;
-			}
-			if(p == NULL) {
-				p = (t_domain_trusted *)safe_malloc(sizeof(t_domain_trusted));
-				p->domain = safe_strdup(domain);
-				p->next = config.domains_trusted;
-				config.domains_trusted = p;
-			}
-		}
-
-		return p;
-	} else if (which == INNER_TRUSTED_DOMAIN) {
-		if (config.inner_domains_trusted == NULL) {
-			p = (t_domain_trusted *)safe_malloc(sizeof(t_domain_trusted));
-			p->domain = safe_strdup(domain);
-			p->next = NULL;
-			config.inner_domains_trusted = p;
-		} else {
-			for(p = config.inner_domains_trusted; p != NULL; p = p->next) {
-				if(strcmp(p->domain, domain) == 0)
-					break;
-			}
-			if(p == NULL) {
-				p = (t_domain_trusted *)safe_malloc(sizeof(t_domain_trusted));
-				p->domain = safe_strdup(domain);
-				p->next = config.inner_domains_trusted;
-				config.inner_domains_trusted = p;
-			}
-		}
+	if(which > TRUSTED_PAN_DOMAIN)
+		return NULL;
 
+	p = __find_domain_common(domain, which);
+	if(p != NULL)
 		return p;
-	} else if ( which == TRUSTED_PAN_DOMAIN) {
-		if (config.pan_domains_trusted == NULL) {
-			p = (t_domain_trusted *)safe_malloc(sizeof(t_domain_trusted));
-			p->domain = safe_strdup(domain);
-			p->next = NULL;
-			config.pan_domains_trusted = p;
-		} else {
-			for(p = config.pan_domains_trusted; p != NULL; p = p->next) {
-				if(strcmp(p->domain, domain) == 0)
-					break;
-			}
-			if(p == NULL) {
-				p = (t_domain_trusted *)safe_malloc(sizeof(t_domain_trusted));
-				p->domain = safe_strdup(domain);
-				p->next = config.pan_domains_trusted;
-				config.pan_domains_trusted = p;
-			}
-		}
 
-		return p;
-	}
+	head = get_domain_list_head(which);
+
+	p = (t_domain_trusted *)safe_malloc(sizeof(t_domain_trusted));
+	p->domain = safe_strdup(domain);
+	p->hash = domain_hash(domain);
+	bucket = &domain_index[which][p->hash % DOMAIN_INDEX_SIZE];
+	p->hnext = *bucket;
+	if(p->hnext)
+		p->hnext->hpprev = &p->hnext;
+	p->hpprev = bucket;
+	*bucket = p;
+	p->next = *head;
+	if(p->next)
+		p->next->pprev = &p->next;
+	p->pprev = head;
+	*head = p;
 
-	return NULL;
+	return p;
 }
 
-
 t_domain_trusted *
 add_domain_common(const char *domain, trusted_domain_t which)
 {
@@ -1806,11 +2278,8 @@ parse_domain_string_common_action(const char *ptr, trusted_domain_t which, int a
 			__add_domain_common(hostname, which);
 		else {// 0: del
 			t_domain_trusted *p = __del_domain_common(hostname, which);
-			if(p) {
-				__clear_trusted_domain_ip(p->ips_trusted);
-				free(p->domain);
-				free(p);
-			}
+			if(p)
+				__free_trusted_domain(p);
 		}
 	}
 
@@ -1836,42 +2305,107 @@ parse_del_trusted_domain_string(const char *ptr)
 	parse_domain_string_common_action(ptr, USER_TRUSTED_DOMAIN, 0);
 }
 
-// add ip to domain list
+static void
+__resize_ip_index(t_domain_trusted *dt, unsigned int size)
+{
+	t_ip_trusted **index = (t_ip_trusted **)safe_malloc(size * sizeof(t_ip_trusted *));
+	t_ip_trusted *ipt;
+
+	for(ipt = dt->ips_trusted; ipt != NULL; ipt = ipt->next) {
+		ipt->hnext = index[ipt->hkey % size];
+		index[ipt->hkey % size] = ipt;
+	}
+
+	free(dt->ip_index);
+	dt->ip_index = index;
+	dt->ip_index_size = size;
+}
+
 static t_ip_trusted *
+__find_ip_in_domain(t_domain_trusted *dt, const t_ip_key *key, unsigned int hkey)
+{
+	t_ip_trusted *ipt = NULL;
+
+	if(dt->ip_index == NULL)
+		return NULL;
+
+	for(ipt = dt->ip_index[hkey % dt->ip_index_size]; ipt != NULL; ipt = ipt->hnext) {
+		if(ipt->hkey == hkey && memcmp(&ipt->key, key, sizeof(*key)) == 0)
+			break;
+	}
+
+	return ipt;
+}
+
+// add ip to domain list
+t_ip_trusted *
 __add_ip_2_domain(t_domain_trusted *dt, const char *ip)
 {
-	t_ip_trusted *ipt = dt->ips_trusted;
-	for(; ipt != NULL && strcmp(ipt->ip, ip) != 0; ipt = ipt->next)
-		;
+	t_ip_trusted *ipt = NULL;
+	t_ip_key key;
+	unsigned int hkey;
 
-	if(ipt == NULL) {
-		ipt = (t_ip_trusted *)malloc(sizeof(t_ip_trusted));
-		strncpy(ipt->ip, ip, HTTP_IP_ADDR_LEN);
-		ipt->ip[HTTP_IP_ADDR_LEN-1] = '\0';
-		ipt->next = dt->ips_trusted;
-		dt->ips_trusted = ipt;
+	if(!ip_key_parse(ip, &key)) {
+		debug(LOG_INFO, "domain (%s) ignore illegal ip (%s)", dt->domain, ip);
+		return NULL;
 	}
 
+	hkey = ip_key_hash(&key);
+	ipt = __find_ip_in_domain(dt, &key, hkey);
+	if(ipt != NULL)
+		return ipt;
+
+	if(dt->ip_index == NULL)
+		__resize_ip_index(dt, IP_INDEX_MIN_SIZE);
+	else if(dt->ip_count >= dt->ip_index_size)
+		__resize_ip_index(dt, dt->ip_index_size*2);
+
+	ipt = (t_ip_trusted *)safe_malloc(sizeof(t_ip_trusted));
+	if(ip_key_is_v4(&key))
+		inet_ntop(AF_INET, key.addr + 12, ipt->ip, HTTP_IP_ADDR_LEN);
+	else
+		inet_ntop(AF_INET6, key.addr, ipt->ip, HTTP_IP_ADDR_LEN);
+	ipt->key = key;
+	ipt->hkey = hkey;
+	ipt->hnext = dt->ip_index[hkey % dt->ip_index_size];
+	dt->ip_index[hkey % dt->ip_index_size] = ipt;
+	ipt->next = dt->ips_trusted;
+	if(dt->ips_trusted)
+		dt->ips_trusted->prev = ipt;
+	dt->ips_trusted = ipt;
+	dt->ip_count++;
+
 	return ipt;
 }
 
 static void
 __del_ip_2_domain(t_domain_trusted *dt, const char *ip)
 {
-	t_ip_trusted *ipt = dt->ips_trusted;
-	t_ip_trusted *tmp = NULL;
-	for(; ipt != NULL && strcmp(ipt->ip, ip) != 0; tmp = ipt,ipt = ipt->next)
-		;
-	debug(LOG_DEBUG,"deling ip = %s",ipt->ip);
+	t_ip_trusted *ipt = NULL;
+	t_ip_trusted **pp = NULL;
+	t_ip_key key;
+
+	if(!ip_key_parse(ip, &key))
+		return;
 
+	ipt = __find_ip_in_domain(dt, &key, ip_key_hash(&key));
 	if(ipt == NULL)
 		return;
-	
-	if(tmp == NULL) {
+
+	debug(LOG_DEBUG,"deling ip = %s",ipt->ip);
+
+	for(pp = &dt->ip_index[ipt->hkey % dt->ip_index_size]; *pp != ipt; pp = &(*pp)->hnext)
+		;
+	*pp = ipt->hnext;
+
+	if(ipt->prev == NULL) {
 		dt->ips_trusted = ipt->next;
 	} else {
-		tmp->next = ipt->next;
-	}	
+		ipt->prev->next = ipt->next;
+	}
+	if(ipt->next)
+		ipt->next->prev = ipt->prev;
+	dt->ip_count--;
 	free(ipt);	
 	return ;
 }
@@ -1897,7 +2431,8 @@ add_domain_ip_pair(const char *args, trusted_domain_t which)
 	}
 
 	ip = ptrcopy;
-	if(ip == NULL || !(strlen(ip) >= 7 && strlen(ip) <= 15)) {
+	// domains have no ':', the rest may be an ipv6 address
+	if(ip == NULL || !(is_valid_ip(ip) || is_valid_ip6(ip))) {
 		debug(LOG_DEBUG, "illegal ip");
 		free(pt);
 		return;
@@ -1919,7 +2454,7 @@ void
 parse_trusted_domain_2_ip(t_domain_trusted *p)
 {
 	struct hostent *he;
-	struct in_addr **addr_list;
+	char **addr_list;
 	int i;
 
 	// if has parsed or ip list; then passed it
@@ -1933,38 +2468,26 @@ parse_trusted_domain_2_ip(t_domain_trusted *p)
 		goto err;
 	}
 
-	addr_list = (struct in_addr **) he->h_addr_list;
+	addr_list = he->h_addr_list;
 
 	for(i = 0; addr_list[i] != NULL; i++){
 		char hostname[HTTP_IP_ADDR_LEN] = {0};
-		t_ip_trusted *ipt = NULL;
 		inet_ntop(AF_INET, addr_list[i], hostname, HTTP_IP_ADDR_LEN);
 		hostname[HTTP_IP_ADDR_LEN-1] = '\0';
 		debug(LOG_DEBUG, "hostname ip is(%s)", hostname);
 
-		if(p->ips_trusted == NULL) {
-			ipt = (t_ip_trusted *)malloc(sizeof(t_ip_trusted));
-			memset(ipt, 0, sizeof(t_ip_trusted));
-			strncpy(ipt->ip, hostname, HTTP_IP_ADDR_LEN);
-			ipt->next = NULL;
-			p->ips_trusted = ipt;
-		} else {
-			ipt = p->ips_trusted;
-			while(ipt) {
-				if(strcmp(ipt->ip, hostname) == 0)
-					break;
-				ipt = ipt->next;
-			}
+		__add_ip_2_domain(p, hostname);
+	}
 
-			if(ipt == NULL) {
-				ipt = (t_ip_trusted *)malloc(sizeof(t_ip_trusted));
-				memset(ipt, 0, sizeof(t_ip_trusted));
-				strncpy(ipt->ip, hostname, HTTP_IP_ADDR_LEN);
-				ipt->next = p->ips_trusted;
-				p->ips_trusted = ipt;
-			}
-		}
+	// a domain without AAAA is still valid
+	if (config.enable_ipv6 && (he = gethostbyname2(p->domain, AF_INET6)) != NULL) {
+		for(i = 0; he->h_addr_list[i] != NULL; i++){
+			char hostname[HTTP_IP_ADDR_LEN] = {0};
+			inet_ntop(AF_INET6, he->h_addr_list[i], hostname, HTTP_IP_ADDR_LEN);
+			debug(LOG_DEBUG, "hostname ip6 is(%s)", hostname);
 
+			__add_ip_2_domain(p, hostname);
+		}
 	}
 
 err:
@@ -2045,7 +2568,7 @@ void del_trusted_ip_list(const char *ptr)
 			*tmp = '\0';
 		}
 
-		if(is_valid_ip(ip) == 0) // not valid ip address
+		if(is_valid_ip(ip) == 0 && is_valid_ip6(ip) == 0) // not valid ip address
 			continue;
 
 		debug(LOG_DEBUG, "Deling trust ip [%s] from list", ip);
@@ -2095,7 +2618,7 @@ void add_trusted_ip_list(const char *ptr)
 			*tmp = '\0';
 		}
 
-		if(is_valid_ip(ip) == 0) // not valid ip address
+		if(is_valid_ip(ip) == 0 && is_valid_ip6(ip) == 0) // not valid ip address
 			continue;
 
 		debug(LOG_DEBUG, "Adding trust ip [%s] to list", ip);
@@ -2176,11 +2699,11 @@ __clear_trusted_domains(void)
 		if(strcmp(p->domain, "iplist") != 0) {
 			p1 = p;
 			p = p->next;
-			__clear_trusted_domain_ip(p1->ips_trusted);
-			free(p1->domain);
-			free(p1);
+			__unindex_domain(p1);
+			__free_trusted_domain(p1);
 		} else {
 			config.domains_trusted = p;
+			p->pprev = &config.domains_trusted;
 			has_iplist = 1;
 			p = p->next;
 			config.domains_trusted->next = NULL;
@@ -2205,8 +2728,8 @@ __clear_trusted_pan_domains(void)
 	for (p = config.pan_domains_trusted; p != NULL;) {
 		p1 = p;
 	   	p = p->next;
-	   	free(p1->domain);
-	   	free(p1);
+		__unindex_domain(p1);
+		__free_trusted_domain(p1);
 	}
 
    	config.pan_domains_trusted = NULL;
@@ -2223,23 +2746,10 @@ clear_trusted_pan_domains(void)
 void
 __clear_trusted_iplist(void)
 {
-	t_domain_trusted *p, *p1;
-	for (p = config.domains_trusted, p1 = p; p != NULL; p1 = p, p = p->next) {
-		if(strcmp(p->domain, "iplist") == 0) {
-			if(p == config.domains_trusted)
-				config.domains_trusted = p->next;
-			else
-				p1->next = p->next;
-			p->next = NULL;
-			break;
-		}
-	}
+	t_domain_trusted *p = __del_domain_common("iplist", USER_TRUSTED_DOMAIN);
 
-	if(p != NULL) {
-		__clear_trusted_domain_ip(p->ips_trusted);
-		free(p->domain);
-		free(p);
-	}
+	if(p != NULL)
+		__free_trusted_domain(p);
 }
 
 void
@@ -2261,44 +2771,22 @@ static void
 __clear_mac_list(mac_choice_t which)
 {
 	t_trusted_mac *p, *p1;
-	switch (which) {
-	case TRUSTED_MAC:
-		p = config.trustedmaclist;
-		break;
-	case UNTRUSTED_MAC:
-		p = config.mac_blacklist;
-		break;
-	case TRUSTED_LOCAL_MAC:
-		p = config.trusted_local_maclist;
-		break;
-	case ROAM_MAC:
-		p = config.roam_maclist;
-		break;
-	default:
+	t_trusted_mac **head = get_mac_list_head(which);
+
+	if (head == NULL)
 		return;
-	}
-	
-	for (; p != NULL;) {
+
+	__mac_set_clear(&mac_sets[which]);
+
+	for (p = *head; p != NULL;) {
 		p1 = p;
 		p = p->next;
 		free(p1->mac);
+		if(p1->ip) free(p1->ip);
 		free(p1);
 	}
 	
-	switch (which) {
-	case TRUSTED_MAC:
-		config.trustedmaclist = NULL;
-		break;
-	case UNTRUSTED_MAC:
-		config.mac_blacklist = NULL;
-		break;
-	case TRUSTED_LOCAL_MAC:
-		config.trusted_local_maclist = NULL;
-		break;
-	case ROAM_MAC:
-		config.roam_maclist = NULL;
-		break;
-	}
+	*head = NULL;
 }
 
 /**
@@ -2327,31 +2815,14 @@ get_roam_maclist()
 int
 is_roaming(const char *mac)
 {
-	t_trusted_mac *p = NULL;
-
-	for (p = config.roam_maclist; p != NULL; p = p->next) {
-		if(strcmp(mac, p->mac) == 0)
-			break;
-	}
-
-	return p==NULL?0:1;
+	return mac_set_contains(&mac_sets[ROAM_MAC], mac);
 }
 
 // 0: not; 1 is
 int
 is_trusted_mac(const char *mac)
 {
-	t_trusted_mac *p = NULL;
-
-	LOCK_CONFIG();
-	for (p = config.trustedmaclist; p != NULL; p = p->next) {
-		if(strcmp(mac, p->mac) == 0)
-			break;
-	}
-	UNLOCK_CONFIG();
-
-	return p==NULL?0:1;
-
+	return mac_set_contains(&mac_sets[TRUSTED_MAC], mac);
 }
 
 t_trusted_mac *
@@ -2372,17 +2843,7 @@ get_trusted_mac_by_ip(const char *ip)
 int
 is_untrusted_mac(const char *mac)
 {
-	t_trusted_mac *p = NULL;
-
-	LOCK_CONFIG();
-	for (p = config.mac_blacklist; p != NULL; p = p->next) {
-		if(strcmp(mac, p->mac) == 0)
-			break;
-	}
-	UNLOCK_CONFIG();
-
-	return p==NULL?0:1;
-
+	return mac_set_contains(&mac_sets[UNTRUSTED_MAC], mac);
 }
 
 void
@@ -2526,7 +2987,7 @@ config_validate(void)
 {
 	config_notnull(config.gw_interface, "GatewayInterface");
 	config_notnull(config.auth_servers, "AuthServer");
-	validate_popular_servers();
+	validate_popular_servers(&config);
 
 	if (missing_parms) {
 		debug(LOG_ERR, "Configuration is not complete, exiting...");
@@ -2538,12 +2999,12 @@ config_validate(void)
  * Validate that popular servers are populated or log a warning and set a default.
  */
 static void
-validate_popular_servers(void)
+validate_popular_servers(s_config *conf)
 {
-	if (config.popular_servers == NULL) {
-		add_popular_server("www.qq.com");
-		add_popular_server("www.kunteng.org");
-		add_popular_server("www.baidu.com");
+	if (conf->popular_servers == NULL) {
+		add_popular_server(conf, "www.qq.com");
+		add_popular_server(conf, "www.kunteng.org");
+		add_popular_server(conf, "www.baidu.com");
 	}
 }
 
@@ -2560,19 +3021,28 @@ config_notnull(const void *parm, const char *parmname)
 }
 
 /**
- * This function returns the current (first auth_server)
+ * This function returns the current (first auth_server), as of the
+ * published configuration snapshot
  */
 t_auth_serv *
 get_auth_server(void)
 {
+	const t_config_snapshot *snap = config_snapshot_acquire();
+	t_auth_serv *auth_server;
+
+	if (snap == NULL)
+		return config.auth_servers;
 
-	/* This is as good as atomic */
-	return config.auth_servers;
+	/* the servers themselves are never freed, only the snapshot needs holding */
+	auth_server = snap->auth_server;
+	config_snapshot_release(snap);
+	return auth_server;
 }
 
 /**
  * This function marks the current auth_server, if it matches the argument,
  * as bad. Basically, the "bad" server becomes the last one on the list.
+ * The configuration must be locked.
  */
 void
 mark_auth_server_bad(t_auth_serv * bad_server)
@@ -2597,6 +3067,7 @@ mark_auth_server_bad(t_auth_serv * bad_server)
 		config.auth_servers = bad_server->next;
 		/* Set the next pointe to NULL in the last element */
 		bad_server->next = NULL;
+		__config_snapshot_publish();
 	}
 
 }
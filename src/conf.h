@@ -93,13 +93,26 @@
 #define	DEFAULT_CA_CRT_FILE		"/etc/apfree.ca"
 #define	DEFAULT_SVR_CRT_FILE	"/etc/apfree.crt"
 #define	DEFAULT_SVR_KEY_FILE	"/etc/apfree.key"
+#define	DEFAULT_HTTPS_SESSION_CACHE_SIZE	256
+#define	DEFAULT_HTTPS_SESSION_TIMEOUT		3600
+#define	DEFAULT_HTTPS_TICKET_KEY_LIFETIME	3600
+/** ChaCha20 first: routers' MIPS and most ARM cores have no AES instructions */
+#define	DEFAULT_HTTPS_CIPHER_LIST	"ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:" \
+									"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+									"ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES128-SHA:AES128-GCM-SHA256:AES128-SHA"
+#define	DEFAULT_HTTPS_CIPHER_SUITES	"TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+#define	DEFAULT_HTTPS_CURVES		"X25519:P-256"
+#define	DEFAULT_HTTPS_REDIRECT_BURST	5
+#define	DEFAULT_CLIENT_CONN_BURST	20
+#define	DEFAULT_CLIENT_JOURNAL_SYNC_INTERVAL	60
 #define DEFAULT_WWW_PATH		"/etc/www/"
 
 #define DEFAULT_MQTT_SERVER		"wifidog.kunteng.org"
 #define DEFAULT_POOL_SERVER		"wifidog.kunteng.org"
 #define	DEFAULT_COINBASE_ADDRESS	"wMiWEo8oVBKjM25Mx4DVAo1j8VJxKCdR77"
 
-#define	WIFIDOG_REDIR_HTML_CONTENT	"setTimeout(function() {location.href = \"%s\";}, 10);"
+/** Script between the redirect page .front and .rear, $url is the html template slot */
+#define	WIFIDOG_REDIR_HTML_CONTENT	"setTimeout(function() {location.href = \"$url\";}, 10);"
 
 
 typedef enum trusted_domain_t_ {
@@ -114,6 +127,18 @@ typedef enum mac_choice_t_ {
 	TRUSTED_LOCAL_MAC,
 	ROAM_MAC
 } mac_choice_t;
+
+/** list options of the config file, recorded as written so a reload can
+ * tell which lists changed */
+typedef enum config_list_t_ {
+	CONFIG_LIST_TRUSTED_MAC,
+	CONFIG_LIST_TRUSTED_LOCAL_MAC,
+	CONFIG_LIST_UNTRUSTED_MAC,
+	CONFIG_LIST_TRUSTED_PAN_DOMAINS,
+	CONFIG_LIST_TRUSTED_DOMAINS,
+	CONFIG_LIST_TRUSTED_IP,
+	CONFIG_LIST_MAX
+} config_list_t;
 //<<< liudf added end
 
 /**
@@ -207,14 +232,25 @@ typedef struct _popular_server_t {
 
 typedef struct _ip_trusted_t {
 	char	ip[HTTP_IP_ADDR_LEN];
+	t_ip_key	key;	/** binary ip of either family, key of domain's ip index */
+	unsigned int	hkey;	/** ip_key_hash of key */
 	struct _ip_trusted_t *next;
+	struct _ip_trusted_t *prev;
+	struct _ip_trusted_t *hnext;	/** next entry in the same ip index bucket */
 } t_ip_trusted;
 
 typedef struct _domain_trusted_t {
 	char *domain;
 	t_ip_trusted	*ips_trusted;
+	t_ip_trusted	**ip_index;	/** hash index of ips_trusted, keyed by key */
+	unsigned int	ip_index_size;
+	unsigned int	ip_count;
 	int		invalid;
+	unsigned int	hash;	/** hash of domain name, key of trusted domain index */
+	struct _domain_trusted_t *hnext;	/** next entry in the same domain index bucket */
+	struct _domain_trusted_t **hpprev;	/** link pointing at this entry in its bucket */
 	struct _domain_trusted_t *next;
+	struct _domain_trusted_t **pprev;	/** link pointing at this entry in its list */
 } t_domain_trusted;
 
 typedef struct _https_server_t {
@@ -222,6 +258,16 @@ typedef struct _https_server_t {
 	char	*svr_crt_file;
 	char	*svr_key_file;
 	short	gw_https_port;
+	int		session_cache_size;		/** 0 disables the server side session cache */
+	int		session_timeout;		/** seconds a cached session or ticket stays valid */
+	short	session_tickets;		/** RFC 5077 session tickets */
+	int		ticket_key_lifetime;	/** seconds before a new ticket key takes over */
+	char	*cipher_list;			/** TLSv1.2 and older, in preference order */
+	char	*cipher_suites;			/** TLSv1.3 */
+	char	*curves;				/** ECDHE groups, in preference order */
+	short	sni_peek;				/** SNI_PEEK_*, answer ClientHellos without a handshake */
+	int		redirect_rate;			/** https connections per minute and client sent to gw_https_port, 0 for no limit */
+	int		redirect_burst;
 } t_https_server;
 
 typedef struct _http_server_t {
@@ -316,8 +362,14 @@ typedef struct {
 	short	no_auth;
 	short	work_mode; /** when work_mode 1, it will drop all packets default*/
 	short	bypass_apple_cna; /* boolean, Bypass Apple Captive Network Assistant */
+	short	enable_ipv6; /** boolean, serve ipv6 clients: ip6tables chains, [::] listeners and aaaa trusted domains */
+	int		client_conn_rate; /** connections per second and client to gw_port and gw_https_port, 0 for no limit */
+	int		client_conn_burst;
+	char	*client_journal; /** file the client sessions are journaled to, NULL to keep them in memory only */
+	int		client_journal_sync_interval; /** seconds between two writes of the journal */
 	int 	update_domain_interval; /** 0, no need update; otherwise update every update_domain_interval*checkinterval seconds*/
 	char * dns_timeout; /*time to limit during of parsing the dns */
+	char	*lists[CONFIG_LIST_MAX]; /** values of the list options in the config file, comma joined */
 } s_config;
 
 /** @brief Get the current gateway configuration */
@@ -332,6 +384,15 @@ void config_init_override(void);
 /** @brief Reads the configuration file */
 void config_read(const char *filename);
 
+/** @brief Reads the configuration file into a new configuration, for a reload */
+s_config *config_read_next(const char *filename);
+
+/** @brief Frees a configuration returned by config_read_next */
+void config_free(s_config *);
+
+/** @brief Frees the rules of a firewall ruleset */
+void config_free_rules(t_firewall_rule *);
+
 /** @brief Check that the configuration is valid */
 void config_validate(void);
 
@@ -399,6 +460,12 @@ void __clear_trusted_domains(void);
 
 void __clear_trusted_domain_ip(t_ip_trusted *);
 
+/** @brief add ip to domain's ip list if not exist, should hold LOCK_DOMAIN */
+t_ip_trusted *__add_ip_2_domain(t_domain_trusted *, const char *);
+
+/** @brief find domain in trusted domain list, should hold LOCK_DOMAIN */
+t_domain_trusted *__find_domain_common(const char *, trusted_domain_t);
+
 
 /** @brief  */
 void fix_weixin_http_dns_ip(void);
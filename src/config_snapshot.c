@@ -0,0 +1,235 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file config_snapshot.c
+  @brief immutable snapshots of the configuration, read without a lock
+
+  s_config is changed in place by wdctl, by a reload and when an auth
+  server goes bad. What the request handlers need from it is compiled
+  into a snapshot: the strings are copied and the auth server urls
+  formatted once. A snapshot is published by swapping one pointer and is
+  never changed afterwards. Only the auth server it points to is the live
+  one: its fd and address are kept up to date by the ping thread, and it
+  is never freed. Whatever changes a field the snapshot copies publishes a
+  new one.
+
+  The configuration is locked while a snapshot is compiled, then
+  snapshot_mutex, never the other way round.
+
+  A reader takes a reference with an atomic increment and checks that the
+  snapshot is still the published one; no lock is taken on either side. A
+  snapshot that was replaced is freed at a later publish, once nobody
+  holds it and CONFIG_SNAPSHOT_GRACE seconds have passed. The grace covers
+  a reader caught between loading the pointer and taking its reference.
+  The same delay lets a reload free the strings it replaces in s_config,
+  since threads that read s_config directly only hold them briefly.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "config_snapshot.h"
+
+#define	CONFIG_SNAPSHOT_GRACE	60
+
+struct config_garbage {
+	void	*ptr;
+	struct config_garbage *next;
+};
+
+/** Serializes publishing, the readers never take it */
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static t_config_snapshot *snapshot_current;
+static t_config_snapshot *snapshot_retired;
+static struct config_garbage *snapshot_garbage;
+
+static char *
+snapshot_strdup(const char *s)
+{
+	return s ? safe_strdup(s) : NULL;
+}
+
+/** @internal
+ * Copies what the handlers read out of the live configuration, which must
+ * be locked
+ */
+static t_config_snapshot *
+snapshot_compile(const s_config *config)
+{
+	t_config_snapshot *snap = safe_malloc(sizeof(t_config_snapshot));
+	t_auth_serv *auth_server = config->auth_servers;
+
+	snap->refs = 1;
+	snap->gw_id = snapshot_strdup(config->gw_id);
+	snap->gw_address = snapshot_strdup(config->gw_address);
+	snap->gw_port = config->gw_port;
+	snap->arp_table_path = snapshot_strdup(config->arp_table_path);
+	snap->js_filter = config->js_filter;
+	snap->wired_passed = config->wired_passed;
+	snap->httpdrealm = snapshot_strdup(config->httpdrealm);
+	snap->httpdusername = snapshot_strdup(config->httpdusername);
+	snap->httpdpassword = snapshot_strdup(config->httpdpassword);
+
+	snap->auth_server = auth_server;
+	if (auth_server) {
+		safe_asprintf(&snap->auth_url, "%s://%s:%d%s",
+			auth_server->authserv_use_ssl ? "https" : "http",
+			auth_server->authserv_hostname,
+			auth_server->authserv_use_ssl ? auth_server->authserv_ssl_port : auth_server->authserv_http_port,
+			auth_server->authserv_path);
+		safe_asprintf(&snap->login_url, "%s%sgw_address=%s&gw_port=%d&gw_id=%s&",
+			snap->auth_url, auth_server->authserv_login_script_path_fragment,
+			config->gw_address, config->gw_port, config->gw_id);
+	}
+
+	return snap;
+}
+
+static void
+snapshot_free(t_config_snapshot *snap)
+{
+	struct config_garbage *g;
+
+	while ((g = snap->garbage) != NULL) {
+		snap->garbage = g->next;
+		free(g->ptr);
+		free(g);
+	}
+	free(snap->gw_id);
+	free(snap->gw_address);
+	free(snap->arp_table_path);
+	free(snap->httpdrealm);
+	free(snap->httpdusername);
+	free(snap->httpdpassword);
+	free(snap->auth_url);
+	free(snap->login_url);
+	free(snap);
+}
+
+/** Take a reference on the published snapshot
+ * @return The snapshot, to be given back with config_snapshot_release(),
+ * NULL if none was published yet
+ */
+const t_config_snapshot *
+config_snapshot_acquire(void)
+{
+	t_config_snapshot *snap;
+
+	for (;;) {
+		snap = __atomic_load_n(&snapshot_current, __ATOMIC_ACQUIRE);
+		if (snap == NULL)
+			return NULL;
+		__atomic_add_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL);
+		if (snap == __atomic_load_n(&snapshot_current, __ATOMIC_ACQUIRE))
+			return snap;
+		/* replaced meanwhile, the grace period keeps it alive */
+		__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/** Drop a reference taken by config_snapshot_acquire() */
+void
+config_snapshot_release(const t_config_snapshot *snap)
+{
+	if (snap)
+		__atomic_sub_fetch(&((t_config_snapshot *)snap)->refs, 1, __ATOMIC_RELEASE);
+}
+
+/** Free a value which was replaced in s_config, such as a string option
+ * changed by a reload. It goes with the snapshot published now and is
+ * freed with it.
+ */
+void
+config_retire(void *ptr)
+{
+	struct config_garbage *g;
+
+	if (ptr == NULL)
+		return;
+
+	g = safe_malloc(sizeof(struct config_garbage));
+	g->ptr = ptr;
+	pthread_mutex_lock(&snapshot_mutex);
+	g->next = snapshot_garbage;
+	snapshot_garbage = g;
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/** Compile the configuration into a new snapshot and publish it
+ * Called at startup once the gateway address and id are known, and by
+ * whatever changes the fields the snapshot copies.
+ */
+void
+config_snapshot_publish(void)
+{
+	LOCK_CONFIG();
+	__config_snapshot_publish();
+	UNLOCK_CONFIG();
+}
+
+/** Same as config_snapshot_publish(), for a caller which holds the
+ * configuration lock
+ */
+void
+__config_snapshot_publish(void)
+{
+	t_config_snapshot *snap, *old, **pp;
+	struct timespec ts;
+	time_t now;
+
+	/* monotonic, the clock of a router jumps when ntp first sets it */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snap = snapshot_compile(config_get_config());
+	old = __atomic_exchange_n(&snapshot_current, snap, __ATOMIC_ACQ_REL);
+	if (old) {
+		old->garbage = snapshot_garbage;
+		snapshot_garbage = NULL;
+		old->retired = now;
+		old->next_retired = snapshot_retired;
+		snapshot_retired = old;
+		config_snapshot_release(old);
+	}
+
+	/* free the snapshots nobody can hold anymore */
+	for (pp = &snapshot_retired; (old = *pp) != NULL;) {
+		if (__atomic_load_n(&old->refs, __ATOMIC_ACQUIRE) == 0 && now - old->retired >= CONFIG_SNAPSHOT_GRACE) {
+			*pp = old->next_retired;
+			snapshot_free(old);
+		} else {
+			pp = &old->next_retired;
+		}
+	}
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	debug(LOG_DEBUG, "Published a new configuration snapshot");
+}
@@ -0,0 +1,75 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file config_snapshot.h
+  @brief immutable snapshots of the configuration, read without a lock
+  */
+
+#ifndef	_CONFIG_SNAPSHOT_H_
+#define	_CONFIG_SNAPSHOT_H_
+
+#include <time.h>
+
+#include "conf.h"
+
+/**
+ * What the request handlers read from the configuration, copied out of
+ * s_config when it changes. Nothing in it changes once it is published,
+ * except the auth server it points to.
+ */
+typedef struct _t_config_snapshot {
+	int		refs;			/** readers holding it, plus one while it is published */
+	time_t	retired;		/** monotonic second a newer snapshot replaced it */
+	struct _t_config_snapshot *next_retired;
+	struct config_garbage	*garbage;	/** values of s_config replaced while it was published */
+
+	char	*gw_id;
+	char	*gw_address;
+	int		gw_port;
+	char	*arp_table_path;
+	short	js_filter;
+	short	wired_passed;
+	char	*httpdrealm;
+	char	*httpdusername;
+	char	*httpdpassword;
+
+	t_auth_serv	*auth_server;	/** auth server in use, first of the list; the live one, not a copy */
+	char	*auth_url;			/** "http[s]://host:port/path/" of auth_server */
+	char	*login_url;			/** login script url of auth_server with the gateway parameters, ends with '&' */
+} t_config_snapshot;
+
+/** @brief Take a reference on the current snapshot, NULL before the first publish */
+const t_config_snapshot *config_snapshot_acquire(void);
+
+/** @brief Drop a reference taken by config_snapshot_acquire */
+void config_snapshot_release(const t_config_snapshot *);
+
+/** @brief Compile the configuration into a new snapshot and publish it */
+void config_snapshot_publish(void);
+
+/** @brief config_snapshot_publish with the configuration already locked */
+void __config_snapshot_publish(void);
+
+/** @brief Free a value replaced in s_config once no reader can hold it */
+void config_retire(void *);
+
+#endif /* _CONFIG_SNAPSHOT_H_ */
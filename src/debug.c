@@ -25,15 +25,23 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <syslog.h>
 #include <stdarg.h>
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "debug.h"
 
+#define DEBUG_RING_SLOTS        64  /* per thread, must be a power of 2 */
+#define DEBUG_MSG_LEN           512
+#define DEBUG_FLUSH_INTERVAL    200 /* ms */
+
 debugconf_t debugconf = {
     .debuglevel = LOG_INFO,
     .log_stderr = 1,
@@ -41,6 +49,291 @@ debugconf_t debugconf = {
     .syslog_facility = 0
 };
 
+/*
+ * Once debug_async_start() is called, every thread formats its messages into
+ * its own bounded ring and a background writer does the time formatting and
+ * the stderr/syslog output. A slot is reserved with a CAS on head and
+ * published with its sequence number, so a signal handler interrupting a
+ * thread in the middle of a debug() call can still queue its own message.
+ * When a ring is full the message is dropped and counted.
+ */
+struct debug_record {
+    unsigned int seq;
+    int level;
+    int line;
+    time_t ts;
+    const char *filename;
+    char msg[DEBUG_MSG_LEN];
+};
+
+struct debug_ring {
+    struct debug_ring *next;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int dropped;
+    int orphaned;
+    struct debug_record slot[DEBUG_RING_SLOTS];
+};
+
+static int debug_async;
+static int debug_wakeup_fd[2] = { -1, -1 };
+static int debug_wakeup_pending;
+static struct debug_ring *debug_rings;
+static pthread_key_t debug_ring_key;
+static pthread_mutex_t debug_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+debug_ring_release(void *arg)
+{
+    struct debug_ring *ring = arg;
+
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static struct debug_ring *
+debug_get_ring(void)
+{
+    struct debug_ring *ring = pthread_getspecific(debug_ring_key);
+    int i;
+
+    if (ring)
+        return ring;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+    for (i = 0; i < DEBUG_RING_SLOTS; i++)
+        ring->slot[i].seq = i;
+    pthread_setspecific(debug_ring_key, ring);
+
+    ring->next = __atomic_load_n(&debug_rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&debug_rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) ;
+
+    return ring;
+}
+
+static void
+debug_wakeup(void)
+{
+    int saved_errno = errno;
+
+    if (!__atomic_exchange_n(&debug_wakeup_pending, 1, __ATOMIC_ACQ_REL))
+        (void)!write(debug_wakeup_fd[1], "", 1);
+    errno = saved_errno;
+}
+
+/** @internal
+ * Queue a message for the writer thread.
+ * @return 0 when queued or dropped, -1 when the caller has to write it itself */
+static int
+debug_async_log(const char *filename, int line, int level, const char *format, va_list vlist)
+{
+    struct debug_ring *ring = debug_get_ring();
+    struct debug_record *rec;
+    unsigned int pos, seq;
+    int diff;
+
+    if (!ring)
+        return -1;
+
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = &ring->slot[pos & (DEBUG_RING_SLOTS - 1)];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* full: errors are written synchronously rather than lost */
+            if (level <= LOG_ERR)
+                return -1;
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            debug_wakeup();
+            return 0;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    rec->level = level;
+    rec->line = line;
+    rec->filename = filename;
+    time(&rec->ts);
+    vsnprintf(rec->msg, sizeof(rec->msg), format, vlist);
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (level <= LOG_ERR ||
+        pos + 1 - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) >= DEBUG_RING_SLOTS / 2)
+        debug_wakeup();
+
+    return 0;
+}
+
+static void
+debug_write_record(int level, time_t ts, const char *filename, int line, const char *msg)
+{
+    static time_t cached_ts = (time_t)-1;
+    static char cached_ctime[28];
+    static unsigned int pid;
+
+    if (!pid)
+        pid = getpid();
+
+    if (level <= LOG_WARNING || debugconf.log_stderr) {
+        if (ts != cached_ts) {
+            ctime_r(&ts, cached_ctime);
+            cached_ts = ts;
+        }
+        fprintf(stderr, "[%d][%.24s][%u](%s:%d) %s\n", level, cached_ctime, pid, filename, line, msg);
+    }
+
+    if (debugconf.log_syslog)
+        syslog(level, "%s", msg);
+}
+
+/** @internal
+ * Write out everything queued so far, must hold debug_writer_mutex */
+static void
+debug_drain(void)
+{
+    struct debug_ring *ring, *next, **pprev;
+    struct debug_record *rec;
+    unsigned int dropped;
+    char msg[64];
+    time_t ts;
+
+    pprev = &debug_rings;
+    for (ring = __atomic_load_n(&debug_rings, __ATOMIC_ACQUIRE); ring; ring = next) {
+        int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+
+        next = ring->next;
+        for (;;) {
+            rec = &ring->slot[ring->tail & (DEBUG_RING_SLOTS - 1)];
+            if ((int)(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - (ring->tail + 1)) < 0)
+                break;
+            debug_write_record(rec->level, rec->ts, rec->filename, rec->line, rec->msg);
+            __atomic_store_n(&rec->seq, ring->tail + DEBUG_RING_SLOTS, __ATOMIC_RELEASE);
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELAXED);
+        }
+
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            time(&ts);
+            snprintf(msg, sizeof(msg), "%u log messages dropped, log ring full", dropped);
+            debug_write_record(LOG_WARNING, ts, __FILENAME__, __LINE__, msg);
+        }
+
+        if (!orphaned) {
+            pprev = &ring->next;
+            continue;
+        }
+
+        /* the owner thread is gone; new rings are only ever pushed on the list head */
+        if (pprev == &debug_rings) {
+            struct debug_ring *head = ring;
+
+            if (!__atomic_compare_exchange_n(&debug_rings, &head, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                for (pprev = &debug_rings; *pprev != ring; pprev = &(*pprev)->next) ;
+                *pprev = next;
+            }
+        } else {
+            *pprev = next;
+        }
+        free(ring);
+    }
+
+    fflush(stderr);
+}
+
+static void *
+debug_writer_thread(void *arg)
+{
+    struct pollfd pfd = { .fd = debug_wakeup_fd[0], .events = POLLIN };
+    char buf[64];
+    sigset_t all;
+
+    /* signal handlers log too, they must never run on the thread holding the rings */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    for (;;) {
+        if (poll(&pfd, 1, DEBUG_FLUSH_INTERVAL) > 0)
+            while (read(debug_wakeup_fd[0], buf, sizeof(buf)) > 0) ;
+        __atomic_store_n(&debug_wakeup_pending, 0, __ATOMIC_RELEASE);
+
+        pthread_mutex_lock(&debug_writer_mutex);
+        debug_drain();
+        pthread_mutex_unlock(&debug_writer_mutex);
+    }
+
+    return NULL;
+}
+
+static void
+debug_atfork_child(void)
+{
+    /* no writer thread in the child, go back to writing directly */
+    debug_async = 0;
+}
+
+void
+debug_flush(void)
+{
+    if (!debug_async)
+        return;
+
+    pthread_mutex_lock(&debug_writer_mutex);
+    debug_drain();
+    pthread_mutex_unlock(&debug_writer_mutex);
+}
+
+/** @brief Start the background log writer
+ * Only the gateway calls this, wdctl and forked children keep writing directly.
+ * @return 0 on success, -1 when messages are still written synchronously */
+int
+debug_async_start(void)
+{
+    pthread_t tid;
+    int i;
+
+    if (debug_async)
+        return 0;
+
+    if (pipe(debug_wakeup_fd) != 0)
+        return -1;
+    for (i = 0; i < 2; i++) {
+        fcntl(debug_wakeup_fd[i], F_SETFL, O_NONBLOCK);
+        fcntl(debug_wakeup_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (pthread_key_create(&debug_ring_key, debug_ring_release) != 0)
+        goto err;
+
+    if (debugconf.log_syslog)
+        openlog("wifidog", LOG_PID, debugconf.syslog_facility);
+
+    if (pthread_create(&tid, NULL, debug_writer_thread, NULL) != 0) {
+        pthread_key_delete(debug_ring_key);
+        goto err;
+    }
+    pthread_detach(tid);
+    /* the main thread runs the signal handlers, give it its ring up front */
+    debug_get_ring();
+
+    pthread_atfork(NULL, NULL, debug_atfork_child);
+    atexit(debug_flush);
+    __atomic_store_n(&debug_async, 1, __ATOMIC_RELEASE);
+
+    return 0;
+
+err:
+    close(debug_wakeup_fd[0]);
+    close(debug_wakeup_fd[1]);
+    debug_wakeup_fd[0] = debug_wakeup_fd[1] = -1;
+    return -1;
+}
+
 /** @internal
 Do not use directly, use the debug macro */
 void
@@ -51,39 +344,45 @@ _debug(const char *filename, int line, int level, const char *format, ...)
     time_t ts;
     sigset_t block_chld;
 
+    if (debugconf.debuglevel < level)
+        return;
+
+    if (__atomic_load_n(&debug_async, __ATOMIC_ACQUIRE)) {
+        int queued;
+
+        va_start(vlist, format);
+        queued = debug_async_log(filename, line, level, format, vlist);
+        va_end(vlist);
+        if (queued == 0)
+            return;
+    }
+
     time(&ts);
-    
-    if (debugconf.debuglevel >= level) {
-        sigemptyset(&block_chld);
-        sigaddset(&block_chld, SIGCHLD);
-        sigprocmask(SIG_BLOCK, &block_chld, NULL);
-
-        if (level <= LOG_WARNING) {          
-            fprintf(stderr, "[%d][%.24s][%u](%s:%d) ", level, ctime_r(&ts, buf), getpid(),
-                filename, line);
-            va_start(vlist, format);
-            vfprintf(stderr, format, vlist);
-            va_end(vlist);
-            fputc('\n', stderr); 
-            fflush(stderr);
-        } else if (debugconf.log_stderr) {
-            fprintf(stderr, "[%d][%.24s][%u](%s:%d) ", level, ctime_r(&ts, buf), getpid(),
-                filename, line);
-            va_start(vlist, format);
-            vfprintf(stderr, format, vlist);
-            va_end(vlist);
-            fputc('\n', stderr);
-            fflush(stderr);
-        }
 
-        if (debugconf.log_syslog) {
+    sigemptyset(&block_chld);
+    sigaddset(&block_chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block_chld, NULL);
+
+    if (level <= LOG_WARNING || debugconf.log_stderr) {
+        fprintf(stderr, "[%d][%.24s][%u](%s:%d) ", level, ctime_r(&ts, buf), getpid(),
+            filename, line);
+        va_start(vlist, format);
+        vfprintf(stderr, format, vlist);
+        va_end(vlist);
+        fputc('\n', stderr);
+        fflush(stderr);
+    }
+
+    if (debugconf.log_syslog) {
+        /* the writer thread keeps syslog open once started */
+        if (!debug_async)
             openlog("wifidog", LOG_PID, debugconf.syslog_facility);
-            va_start(vlist, format);
-            vsyslog(level, format, vlist);
-            va_end(vlist);
+        va_start(vlist, format);
+        vsyslog(level, format, vlist);
+        va_end(vlist);
+        if (!debug_async)
             closelog();
-        }
-        
-        sigprocmask(SIG_UNBLOCK, &block_chld, NULL);
     }
+
+    sigprocmask(SIG_UNBLOCK, &block_chld, NULL);
 }
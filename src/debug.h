@@ -44,13 +44,23 @@ extern debugconf_t debugconf;
 
 /** Used to output messages.
  * The messages will include the filename and line number, and will be sent to syslog if so configured in the config file 
+ * The level is checked first, the arguments of a filtered message are not even evaluated.
  * @param level Debug level
  * @param format... sprintf like format string
  */
 
-#define debug(level, format...) _debug(__FILENAME__, __LINE__, level, format)
+#define debug(level, format...) do { \
+    if (debugconf.debuglevel >= (level)) \
+        _debug(__FILENAME__, __LINE__, level, format); \
+} while (0)
 
 /** @internal */
 void _debug(const char *, int, int, const char *, ...);
 
+/** @brief Hand messages to a background writer instead of writing them in the calling thread */
+int debug_async_start(void);
+
+/** @brief Write out every message still queued for the background writer */
+void debug_flush(void);
+
 #endif /* _DEBUG_H_ */
@@ -0,0 +1,405 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file event_log.c
+  @brief binary journal of auth and firewall decisions
+
+  The gateway appends fixed size records to a ring mapped from a file in
+  /tmp: a slot is reserved with one atomic add on the shared head, so
+  logging an event costs a few stores and no lock, no syscall. wdctl maps
+  the same file read-only to decode it, even after the gateway died.
+
+  Counter updates come every checkinterval for every client, so they are
+  kept in a second ring after the first one: however many clients there
+  are, they never push the decisions out of the journal.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "event_log.h"
+
+#define	EVENT_LOG_SIZE	(sizeof(struct event_log_header) + \
+	(EVENT_LOG_RECORDS + EVENT_LOG_COUNTER_RECORDS) * sizeof(struct event_record))
+
+static const char *event_names[EVENT_MAX] = {
+	[EVENT_NONE]		= "none",
+	[EVENT_LOGIN]		= "login",
+	[EVENT_AUTH_CODE]	= "auth",
+	[EVENT_ALLOW]		= "allow",
+	[EVENT_DENY]		= "deny",
+	[EVENT_TIMEOUT]		= "timeout",
+	[EVENT_COUNTERS]	= "counters",
+};
+
+static struct event_log_header *journal;
+
+static struct event_record *
+journal_records(const struct event_log_header *hdr)
+{
+	return (struct event_record *)(hdr + 1);
+}
+
+/** The ring an event type goes to: its records, head and size */
+static struct event_record *
+journal_ring(const struct event_log_header *hdr, int counters, uint32_t **head, uint32_t *size)
+{
+	if (counters) {
+		*head = (uint32_t *)&hdr->counter_head;
+		*size = EVENT_LOG_COUNTER_RECORDS;
+		return journal_records(hdr) + EVENT_LOG_RECORDS;
+	}
+	*head = (uint32_t *)&hdr->head;
+	*size = EVENT_LOG_RECORDS;
+	return journal_records(hdr);
+}
+
+static int
+journal_valid(const struct event_log_header *hdr)
+{
+	return hdr->magic == EVENT_LOG_MAGIC &&
+		hdr->version == EVENT_LOG_VERSION &&
+		hdr->record_size == sizeof(struct event_record) &&
+		hdr->records == EVENT_LOG_RECORDS &&
+		hdr->counter_records == EVENT_LOG_COUNTER_RECORDS;
+}
+
+/* ipv4 is kept mapped into ipv6 so both families share the 16 byte key */
+static int
+parse_ip(const char *ip, uint8_t *out)
+{
+	struct in_addr addr;
+
+	if (!ip)
+		return -1;
+	if (inet_pton(AF_INET6, ip, out) == 1)
+		return 0;
+	if (inet_pton(AF_INET, ip, &addr) != 1)
+		return -1;
+	memset(out, 0, 10);
+	out[10] = out[11] = 0xff;
+	memcpy(out + 12, &addr, 4);
+	return 0;
+}
+
+static int
+parse_mac(const char *mac, uint8_t *out)
+{
+	unsigned int b[6];
+	int i;
+
+	if (!mac || sscanf(mac, "%2x:%2x:%2x:%2x:%2x:%2x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+		return -1;
+	for (i = 0; i < 6; i++)
+		out[i] = b[i];
+	return 0;
+}
+
+int
+event_log_open(void)
+{
+	struct event_log_header *hdr;
+	int fd;
+
+	fd = open(EVENT_LOG_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		debug(LOG_ERR, "Could not open event journal %s: %s", EVENT_LOG_FILE, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, EVENT_LOG_SIZE) != 0) {
+		debug(LOG_ERR, "Could not size event journal %s: %s", EVENT_LOG_FILE, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	hdr = mmap(NULL, EVENT_LOG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		debug(LOG_ERR, "Could not map event journal %s: %s", EVENT_LOG_FILE, strerror(errno));
+		return -1;
+	}
+
+	/* keep the history of a previous run when the layout did not change */
+	if (!journal_valid(hdr)) {
+		memset(hdr, 0, EVENT_LOG_SIZE);
+		hdr->magic = EVENT_LOG_MAGIC;
+		hdr->version = EVENT_LOG_VERSION;
+		hdr->record_size = sizeof(struct event_record);
+		hdr->records = EVENT_LOG_RECORDS;
+		hdr->counter_records = EVENT_LOG_COUNTER_RECORDS;
+	}
+
+	__atomic_store_n(&journal, hdr, __ATOMIC_RELEASE);
+	debug(LOG_INFO, "Event journal %s opened at position %u", EVENT_LOG_FILE, hdr->head);
+	return 0;
+}
+
+void
+event_log_write(event_type_t type, const char *ip, const char *mac, int value, unsigned long long data, int flags)
+{
+	struct event_log_header *hdr = __atomic_load_n(&journal, __ATOMIC_ACQUIRE);
+	struct event_record *recs, *rec;
+	uint32_t *head, size, pos;
+
+	if (!hdr)
+		return;
+
+	recs = journal_ring(hdr, type == EVENT_COUNTERS, &head, &size);
+	pos = __atomic_fetch_add(head, 1, __ATOMIC_RELAXED);
+	rec = &recs[pos & (size - 1)];
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->ts = time(NULL);
+	if (parse_ip(ip, rec->ip) != 0)
+		memset(rec->ip, 0, sizeof(rec->ip));
+	if (parse_mac(mac, rec->mac) != 0)
+		memset(rec->mac, 0, sizeof(rec->mac));
+	rec->value = value;
+	rec->type = type;
+	rec->flags = flags;
+	rec->data = data;
+
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+const char *
+event_type_name(int type)
+{
+	if (type <= EVENT_NONE || type >= EVENT_MAX)
+		return "unknown";
+	return event_names[type];
+}
+
+static int
+event_type_parse(const char *name)
+{
+	int i;
+
+	for (i = EVENT_NONE + 1; i < EVENT_MAX; i++) {
+		if (strcmp(name, event_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int
+event_filter_parse(struct event_filter *filter, const char *str)
+{
+	char *dup, *item, *save = NULL, *val, *type, *tsave;
+	int t, ret = 0;
+
+	memset(filter, 0, sizeof(*filter));
+	if (!str || !*str)
+		return 0;
+
+	dup = strdup(str);
+	if (!dup)
+		return -1;
+
+	for (item = strtok_r(dup, ",", &save); item && ret == 0; item = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(item, '=')) == NULL) {
+			ret = -1;
+			break;
+		}
+		*val++ = '\0';
+
+		if (strcmp(item, "type") == 0) {
+			for (type = strtok_r(val, "|", &tsave); type; type = strtok_r(NULL, "|", &tsave)) {
+				if ((t = event_type_parse(type)) < 0) {
+					ret = -1;
+					break;
+				}
+				filter->types |= 1U << t;
+			}
+		} else if (strcmp(item, "ip") == 0) {
+			if (parse_ip(val, filter->ip) != 0)
+				ret = -1;
+			filter->has_ip = 1;
+		} else if (strcmp(item, "mac") == 0) {
+			if (parse_mac(val, filter->mac) != 0)
+				ret = -1;
+			filter->has_mac = 1;
+		} else if (strcmp(item, "since") == 0) {
+			filter->since = time(NULL) - strtoul(val, NULL, 10);
+		} else if (strcmp(item, "last") == 0) {
+			filter->last = strtoul(val, NULL, 10);
+		} else {
+			ret = -1;
+		}
+	}
+
+	free(dup);
+	return ret;
+}
+
+static int
+event_match(const struct event_record *rec, const struct event_filter *filter)
+{
+	if (filter->types && !(filter->types & (1U << rec->type)))
+		return 0;
+	if (filter->has_ip && memcmp(filter->ip, rec->ip, sizeof(rec->ip)) != 0)
+		return 0;
+	if (filter->has_mac && memcmp(filter->mac, rec->mac, sizeof(rec->mac)) != 0)
+		return 0;
+	if (filter->since && rec->ts < filter->since)
+		return 0;
+	return 1;
+}
+
+static void
+event_print(FILE *fp, const struct event_record *rec)
+{
+	static const char *req_names[] = { "", "login", "logout", "counters" };
+	static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff }, none[16];
+	char ip[INET6_ADDRSTRLEN] = "-", when[32];
+	time_t ts = rec->ts;
+	struct tm tm;
+
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&ts, &tm));
+	if (memcmp(rec->ip, mapped, sizeof(mapped)) == 0)
+		inet_ntop(AF_INET, rec->ip + 12, ip, sizeof(ip));
+	else if (memcmp(rec->ip, none, sizeof(none)) != 0)
+		inet_ntop(AF_INET6, rec->ip, ip, sizeof(ip));
+
+	fprintf(fp, "%s #%u %-8s %-15s %02x:%02x:%02x:%02x:%02x:%02x ", when, rec->seq - 1, event_type_name(rec->type), ip,
+		rec->mac[0], rec->mac[1], rec->mac[2], rec->mac[3], rec->mac[4], rec->mac[5]);
+
+	switch (rec->type) {
+	case EVENT_LOGIN:
+		fprintf(fp, "%s\n", rec->value == 2 ? "logout" : (rec->value ? "known" : "new"));
+		break;
+	case EVENT_AUTH_CODE:
+		fprintf(fp, "code=%d %s\n", rec->value, rec->flags < sizeof(req_names) / sizeof(req_names[0]) ? req_names[rec->flags] : "");
+		break;
+	case EVENT_ALLOW:
+	case EVENT_DENY:
+		fprintf(fp, "mark=%d%s\n", rec->value, rec->flags & EVENT_FLAG_FAILED ? " failed" : "");
+		break;
+	case EVENT_TIMEOUT:
+		fprintf(fp, "idle=%ds\n", rec->value);
+		break;
+	case EVENT_COUNTERS:
+		fprintf(fp, "%s=%llu\n", rec->flags == EVENT_DIR_INCOMING ? "in" : "out", (unsigned long long)rec->data);
+		break;
+	default:
+		fprintf(fp, "value=%d data=%llu\n", rec->value, (unsigned long long)rec->data);
+		break;
+	}
+}
+
+/** Copy the events of one ring matching filter, oldest first
+ * @return number of events copied into out */
+static uint32_t
+journal_collect(const struct event_log_header *hdr, int counters, const struct event_filter *filter, struct event_record *out)
+{
+	const struct event_record *recs, *rec;
+	struct event_record copy;
+	uint32_t *headp, size, head, pos, count, n = 0;
+
+	recs = journal_ring(hdr, counters, &headp, &size);
+	head = __atomic_load_n(headp, __ATOMIC_ACQUIRE);
+	count = head < size ? head : size;
+
+	for (pos = head - count; pos != head; pos++) {
+		rec = &recs[pos & (size - 1)];
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			continue;
+		copy = *rec;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		/* overwritten while we copied it */
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != pos + 1)
+			continue;
+		if (event_match(&copy, filter))
+			out[n++] = copy;
+	}
+	return n;
+}
+
+int
+event_log_dump(FILE *fp, const struct event_filter *filter)
+{
+	const struct event_log_header *hdr;
+	struct event_record *matched, *sorted;
+	uint32_t n, nd, a, b, i;
+	struct stat st;
+	int fd;
+
+	fd = open(EVENT_LOG_FILE, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "wdctl: could not open %s (Error: %s)\n", EVENT_LOG_FILE, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)EVENT_LOG_SIZE) {
+		fprintf(stderr, "wdctl: %s is not an event journal\n", EVENT_LOG_FILE);
+		close(fd);
+		return -1;
+	}
+	hdr = mmap(NULL, EVENT_LOG_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		fprintf(stderr, "wdctl: could not map %s (Error: %s)\n", EVENT_LOG_FILE, strerror(errno));
+		return -1;
+	}
+	if (!journal_valid(hdr)) {
+		fprintf(stderr, "wdctl: %s has an unknown layout\n", EVENT_LOG_FILE);
+		munmap((void *)hdr, EVENT_LOG_SIZE);
+		return -1;
+	}
+
+	matched = malloc(2 * (EVENT_LOG_RECORDS + EVENT_LOG_COUNTER_RECORDS) * sizeof(*matched));
+	if (!matched) {
+		munmap((void *)hdr, EVENT_LOG_SIZE);
+		return -1;
+	}
+	sorted = matched + EVENT_LOG_RECORDS + EVENT_LOG_COUNTER_RECORDS;
+
+	nd = journal_collect(hdr, 0, filter, matched);
+	n = nd + journal_collect(hdr, 1, filter, matched + nd);
+	munmap((void *)hdr, EVENT_LOG_SIZE);
+
+	/* both rings are in time order, interleave them */
+	for (a = 0, b = nd, i = 0; i < n; i++) {
+		if (b == n || (a < nd && matched[a].ts <= matched[b].ts))
+			sorted[i] = matched[a++];
+		else
+			sorted[i] = matched[b++];
+	}
+
+	i = (filter->last && filter->last < n) ? n - filter->last : 0;
+	for (; i < n; i++)
+		event_print(fp, &sorted[i]);
+
+	free(matched);
+	return 0;
+}
@@ -0,0 +1,115 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file event_log.h
+  @brief binary journal of auth and firewall decisions
+  */
+
+#ifndef	_EVENT_LOG_H_
+#define	_EVENT_LOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define	EVENT_LOG_FILE		"/tmp/wifidog.events"
+#define	EVENT_LOG_MAGIC		0x57444556	/* "WDEV" */
+#define	EVENT_LOG_VERSION	3
+/** Records kept in the ring, must be a power of 2 */
+#define	EVENT_LOG_RECORDS	4096
+/** Records kept in the separate ring of EVENT_COUNTERS, must be a power of 2 */
+#define	EVENT_LOG_COUNTER_RECORDS	4096
+
+typedef enum {
+	EVENT_NONE,
+	EVENT_LOGIN,		/** value: 0 new client, 1 known client, 2 logout */
+	EVENT_AUTH_CODE,	/** value: auth code, flags: request kind */
+	EVENT_ALLOW,		/** value: firewall mark */
+	EVENT_DENY,			/** value: firewall mark */
+	EVENT_TIMEOUT,		/** value: seconds since last activity */
+	EVENT_COUNTERS,		/** data: byte counter, flags: direction */
+	EVENT_MAX
+} event_type_t;
+
+/** flags of EVENT_AUTH_CODE */
+#define	EVENT_REQ_LOGIN		1
+#define	EVENT_REQ_LOGOUT	2
+#define	EVENT_REQ_COUNTERS	3
+
+/** flags of EVENT_COUNTERS */
+#define	EVENT_DIR_OUTGOING	0
+#define	EVENT_DIR_INCOMING	1
+
+/** flags of EVENT_ALLOW and EVENT_DENY */
+#define	EVENT_FLAG_FAILED	0x80
+
+/**
+ * One fixed size journal entry. seq is the journal position plus one, it
+ * is cleared while the entry is being written so readers skip torn entries.
+ */
+struct event_record {
+	uint32_t	seq;
+	uint32_t	ts;
+	uint8_t		ip[16];	/** ipv6, or ipv4 mapped into ipv6 */
+	int32_t		value;
+	uint8_t		type;
+	uint8_t		mac[6];
+	uint8_t		flags;
+	uint64_t	data;
+};
+
+struct event_log_header {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	record_size;
+	uint32_t	records;
+	uint32_t	head;	/** next journal position */
+	uint32_t	counter_records;
+	uint32_t	counter_head;	/** next position in the ring of EVENT_COUNTERS */
+};
+
+/** What wdctl events prints, zeroed fields match everything */
+struct event_filter {
+	unsigned int	types;	/** bit mask of 1 << event_type_t */
+	uint8_t			ip[16];
+	int				has_ip;
+	uint8_t			mac[6];
+	int				has_mac;
+	uint32_t		since;
+	unsigned int	last;
+};
+
+/** @brief Map the journal file, creating it when missing or incompatible */
+int event_log_open(void);
+
+/** @brief Append an event, no-op when the journal is not open */
+void event_log_write(event_type_t, const char *ip, const char *mac, int value, unsigned long long data, int flags);
+
+/** @brief Name of an event type as used by wdctl */
+const char *event_type_name(int);
+
+/** @brief Parse "type=allow|deny|counters,ip=...,mac=...,since=secs,last=n" */
+int event_filter_parse(struct event_filter *, const char *);
+
+/** @brief Decode the journal file and print the matching events */
+int event_log_dump(FILE *, const struct event_filter *);
+
+#endif
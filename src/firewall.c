@@ -57,8 +57,11 @@
 #include "auth.h"
 #include "centralserver.h"
 #include "client_list.h"
+#include "client_journal.h"
 #include "commandline.h"
 #include "wd_util.h"
+#include "event_log.h"
+#include "metrics.h"
 
 static int _fw_deny_raw(const char *, const char *, const int);
 
@@ -69,6 +72,8 @@ static int _fw_deny_raw(const char *, const char *, const int);
  * @param mac MAC address to allow
  * @param fw_connection_state fw_connection_state Tag
  * @return Return code of the command
+ *
+ * Must be called with the client list locked, it journals the client.
  */
 int
 fw_allow(t_client * client, int new_fw_connection_state)
@@ -84,9 +89,14 @@ fw_allow(t_client * client, int new_fw_connection_state)
 
 	debug(LOG_DEBUG, "Allowing %s %s with fw_connection_state %d", client->ip, client->mac, new_fw_connection_state);
 	client->fw_connection_state = new_fw_connection_state;
+	client_journal_put(client);
 
 	/* Grant first */
+	uint64_t start = metric_now_us();
 	result = iptables_fw_access(FW_ACCESS_ALLOW, client->ip, client->mac, new_fw_connection_state);
+	metric_observe_since(METRIC_FW_ACCESS_LATENCY, start);
+	if (result != 0)
+		metric_inc(METRIC_FW_ACCESS_FAILURES);
 
 	return result;
 }
@@ -131,7 +141,13 @@ fw_deny(t_client * client)
 static int
 _fw_deny_raw(const char *ip, const char *mac, const int mark)
 {
-	return iptables_fw_access(FW_ACCESS_DENY, ip, mac, mark);
+	uint64_t start = metric_now_us();
+	int result = iptables_fw_access(FW_ACCESS_DENY, ip, mac, mark);
+
+	metric_observe_since(METRIC_FW_ACCESS_LATENCY, start);
+	if (result != 0)
+		metric_inc(METRIC_FW_ACCESS_FAILURES);
+	return result;
 }
 
 /** Passthrough for clients when auth server is down */
@@ -168,6 +184,13 @@ arp_get(const char *req_ip)
 	char *reply;
 	s_config *config = config_get_config();
 
+	/* arp_table_path only lists ipv4 */
+	if (strchr(req_ip, ':')) {
+		if (!config->enable_ipv6 || !ndp_get_mac(config->gw_interface, req_ip, mac))
+			return NULL;
+		return safe_strdup(mac);
+	}
+
 	if (!(proc = fopen(config->arp_table_path, "r"))) {
 		return NULL;
 	}
@@ -222,14 +245,28 @@ arp_get_ip(const char *req_mac)
 	return reply;
 }
 
+/** @internal
+ * Puts back the firewall rules of the clients in the client list, all the
+ * ipv4 ones in a single commit */
+static void
+fw_restore_clients(void)
+{
+	int failed;
+
+	LOCK_CLIENT_LIST();
+	failed = iptables_fw_allow_clients(client_get_first_client());
+	UNLOCK_CLIENT_LIST();
+
+	if (failed)
+		metric_add(METRIC_FW_ACCESS_FAILURES, failed);
+}
+
 /** Initialize the firewall rules
  */
 int
 fw_init(void)
 {
 	int result = 0;
-	int new_fw_state;
-	t_client *client = NULL;
 
 	if (!init_icmp_socket()) {
 		return 0;
@@ -238,22 +275,57 @@ fw_init(void)
 	debug(LOG_INFO, "Initializing Firewall");
 	result = iptables_fw_init();
 
-	if (restart_orig_pid) {
-		debug(LOG_INFO, "Restoring firewall rules for clients inherited from parent");
-		LOCK_CLIENT_LIST();
-		client = client_get_first_client();
-		while (client) {
-			new_fw_state = client->fw_connection_state;
-			client->fw_connection_state = FW_MARK_NONE;
-			fw_allow(client, new_fw_state);
-			client = client->next;
-		}
-		UNLOCK_CLIENT_LIST();
+	if (client_get_first_client() != NULL) {
+		debug(LOG_INFO, "Restoring firewall rules for clients inherited from parent or the journal");
+		fw_restore_clients();
 	}
 
 	return result;
 }
 
+/** Builds the firewall again once a config reload changed the options its
+ * chains are made of. The caller destroyed it with fw_destroy() before
+ * changing the configuration; the clients and the trusted sets are put back.
+ */
+int
+fw_rebuild(void)
+{
+	s_config *config = config_get_config();
+	t_trusted_mac *p;
+
+	if (!init_icmp_socket())
+		return 0;
+
+	debug(LOG_INFO, "Initializing Firewall");
+	if (!iptables_fw_init())
+		return 0;
+
+	debug(LOG_INFO, "Restoring firewall rules for clients and trusted lists");
+	fw_restore_clients();
+
+	fw_set_pan_domains_trusted();
+	fw_set_inner_domains_trusted();
+	fw_set_user_domains_trusted();
+	fw_set_trusted_maclist();
+	fw_set_trusted_local_maclist();
+	fw_set_untrusted_maclist();
+
+	LOCK_CONFIG();
+	for (p = config->roam_maclist; p != NULL; p = p->next)
+		fw_set_roam_mac(p->mac);
+	UNLOCK_CONFIG();
+
+	return 1;
+}
+
+/** Loads a ruleset changed by a config reload into its chains again */
+void
+fw_reload_ruleset(const char *ruleset)
+{
+	debug(LOG_INFO, "Reloading firewall ruleset %s", ruleset);
+	iptables_fw_reload_ruleset(ruleset);
+}
+
 /** Remove all auth server firewall whitelist rules
  */
 void
@@ -414,19 +486,112 @@ fw_destroy(void)
 	return iptables_fw_destroy();
 }
 
-// liudf added 20160321
-void
-update_trusted_mac_status(t_trusted_mac *tmac)
+static int
+trusted_mac_cmp(const void *a, const void *b)
+{
+	return strcasecmp((*(t_trusted_mac * const *)a)->mac, (*(t_trusted_mac * const *)b)->mac);
+}
+
+struct trusted_mac_probe {
+	struct in_addr	addr;
+	t_trusted_mac	*tmac;
+};
+
+struct trusted_mac_probes {
+	struct trusted_mac_probe *probe;	/** sorted by addr */
+	int		n;
+};
+
+static int
+trusted_mac_probe_cmp(const void *a, const void *b)
 {
-	tmac->is_online = 0;
+	in_addr_t x = ntohl(((const struct trusted_mac_probe *)a)->addr.s_addr);
+	in_addr_t y = ntohl(((const struct trusted_mac_probe *)b)->addr.s_addr);
+	return x < y ? -1 : x > y;
+}
+
+static void keepalive_reply_cb(struct in_addr, unsigned int, void *);
+
+static void
+trusted_mac_reply_cb(struct in_addr addr, unsigned int rtt, void *arg)
+{
+	struct trusted_mac_probes *probes = arg;
+	struct trusted_mac_probe key, *p;
+
+	key.addr = addr;
+	p = bsearch(&key, probes->probe, probes->n, sizeof(struct trusted_mac_probe), trusted_mac_probe_cmp);
+	if (p == NULL) {
+		/* a client echo which came after fw_keepalive_clients stopped waiting */
+		keepalive_reply_cb(addr, rtt, NULL);
+		return;
+	}
+	for (; p > probes->probe && p[-1].addr.s_addr == addr.s_addr; p--) ;
+	for (; p < probes->probe + probes->n && p->addr.s_addr == addr.s_addr; p++)
+		p->tmac->is_online = 1;
+}
 
-	if(tmac->ip == NULL) {
-		tmac->ip = arp_get_ip(tmac->mac);
+/*
+ * get the ip of every trusted mac from one pass over the arp table, then
+ * probe them all in one batch on the shared icmp socket. arp lines of
+ * devices which aren't trusted are dropped by the trusted mac set, the
+ * others find their entry by binary search
+ */
+static void
+update_trusted_mac_list_liveness(t_trusted_mac *tmac_list, int count)
+{
+	t_trusted_mac *p1 = NULL, **sorted = NULL, **found = NULL, key, *pkey = &key;
+	struct trusted_mac_probes probes;
+	struct in_addr *addrs = NULL;
+	FILE *proc = NULL;
+	char ip[16] = {0};
+	char mac[18] = {0};
+	int i, n = 0;
+
+	sorted = safe_malloc(count * sizeof(t_trusted_mac *));
+	for(p1 = tmac_list; p1 != NULL && n < count; p1 = p1->next) {
+		p1->is_online = 0;
+		sorted[n++] = p1;
+	}
+	count = n;
+	qsort(sorted, count, sizeof(t_trusted_mac *), trusted_mac_cmp);
+
+	if ((proc = fopen(config_get_config()->arp_table_path, "r")) != NULL) {
+		/* skip first line */
+		while (!feof(proc) && fgetc(proc) != '\n') ;
+
+		while (!feof(proc) && (fscanf(proc, " %15[0-9.] %*s %*s %17[a-fA-F0-9:] %*s %*s", ip, mac) == 2)) {
+			if (!is_trusted_mac(mac))
+				continue;
+			key.mac = mac;
+			found = bsearch(&pkey, sorted, count, sizeof(t_trusted_mac *), trusted_mac_cmp);
+			if (found == NULL)
+				continue;
+			if ((*found)->ip)
+				free((*found)->ip);
+			(*found)->ip = safe_strdup(ip);
+		}
+		fclose(proc);
 	}
 
-	if(tmac->ip != NULL) {
-		tmac->is_online = is_device_online(tmac->ip);
+	probes.probe = safe_malloc(count * sizeof(struct trusted_mac_probe));
+	probes.n = 0;
+	for(i = 0; i < count; i++) {
+		if (sorted[i]->ip && inet_aton(sorted[i]->ip, &probes.probe[probes.n].addr))
+			probes.probe[probes.n++].tmac = sorted[i];
 	}
+
+	if (probes.n > 0) {
+		qsort(probes.probe, probes.n, sizeof(struct trusted_mac_probe), trusted_mac_probe_cmp);
+		addrs = safe_malloc(probes.n * sizeof(struct in_addr));
+		for (i = 0; i < probes.n; i++)
+			addrs[i] = probes.probe[i].addr;
+		icmp_ping_batch(addrs, probes.n);
+		icmp_collect_replies(TRUSTED_MAC_PROBE_TIMEOUT, probes.n, trusted_mac_reply_cb, &probes);
+	}
+
+	free(addrs);
+	free(probes.probe);
+	free(sorted);
 }
 
 void
@@ -435,17 +600,19 @@ evhttps_update_trusted_mac_list_status(struct evhttps_request_context *context)
 	t_trusted_mac *p1 = NULL, *tmac_list = NULL;
 	s_config *config = config_get_config();
 
-	if(trusted_mac_list_dup(&tmac_list) == 0) {
+	int count = trusted_mac_list_dup(&tmac_list);
+	if(count == 0) {
 		debug(LOG_DEBUG, "update_trusted_mac_list_status: list is empty");
 		return;
 	}
 
+	update_trusted_mac_list_liveness(tmac_list, count);
+
 	struct auth_response_client authresponse_client;
 	memset(&authresponse_client, 0, sizeof(struct auth_response_client));
 	authresponse_client.type = request_type_counters;
 
 	for(p1 = tmac_list; p1 != NULL; p1 = p1->next) {
-		update_trusted_mac_status(p1);
 		debug(LOG_DEBUG, "update_trusted_mac_list_status: %s %s %d", p1->ip, p1->mac, p1->is_online);
 		if (config->auth_servers != NULL && p1->is_online) {
 			char *uri = get_auth_uri(REQUEST_TYPE_COUNTERS, trusted_client, p1);
@@ -467,14 +634,16 @@ update_trusted_mac_list_status(void)
 	t_trusted_mac *p1 = NULL, *tmac_list = NULL;
 	s_config *config = config_get_config();
 
-	if(trusted_mac_list_dup(&tmac_list) == 0) {
+	int count = trusted_mac_list_dup(&tmac_list);
+	if(count == 0) {
 		debug(LOG_DEBUG, "update_trusted_mac_list_status: list is empty");
 		return;
 	}
 
+	update_trusted_mac_list_liveness(tmac_list, count);
+
 	int flag = 0;
 	for(p1 = tmac_list; p1 != NULL; p1 = p1->next) {
-		update_trusted_mac_status(p1);
 		debug(LOG_DEBUG, "update_trusted_mac_list_status: %s %s %d", p1->ip, p1->mac, p1->is_online);
 		if (config->auth_servers != NULL && p1->is_online) {
 			auth_server_request(&authresponse, REQUEST_TYPE_COUNTERS, p1->ip, p1->mac, "null", 0,
@@ -497,17 +666,13 @@ fw_client_operation(int operation, t_client *p1)
 		fw_deny(p1);
 		debug(LOG_DEBUG, "fw_client_operation deny");
 		break;
-	case 2:
-		fw_allow(p1, FW_MARK_KNOWN);
-		debug(LOG_DEBUG, "fw_client_operation allow");
-		break;
 	}
 }
 
 void
 fw_client_process_from_authserver_response(t_authresponse *authresponse, t_client *p1)
 {
-	int operation = 0; // 0: no operation; 1: deny; 2: allow;
+	int operation = 0; // 0: no operation; 1: deny;
 	t_client *tmp_c;
 	s_config *config = config_get_config();
 
@@ -551,7 +716,8 @@ fw_client_process_from_authserver_response(t_authresponse *authresponse, t_clien
 						  tmp_c->ip);
 				}
 
-				operation = 2;
+				/* allow the listed client, not the copy, so its state and journal record stay current */
+				fw_allow(tmp_c, FW_MARK_KNOWN);
 			}
 			break;
 
@@ -578,17 +744,85 @@ fw_client_process_from_authserver_response(t_authresponse *authresponse, t_clien
 	fw_client_operation(operation, p1);
 }
 
-void
-evhttps_fw_sync_with_authserver(struct evhttps_request_context *context)
+static void
+keepalive_reply_cb(struct in_addr addr, unsigned int rtt, void *arg)
 {
-	t_client *p1, *p2, *worklist;
-	s_config *config = config_get_config();
+	char ip[INET_ADDRSTRLEN] = {0};
+	t_client *client = NULL;
+
+	inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+
+	LOCK_CLIENT_LIST();
+	if ((client = client_list_find_by_ip(ip)) != NULL) {
+		client->last_reachable = time(NULL);
+		client->rtt = rtt;
+	}
+	UNLOCK_CLIENT_LIST();
+}
+
+/*
+ * Ping every client in one batch and record who answered.
+ * Replies which come after CLIENT_KEEPALIVE_WAIT stay queued on the icmp
+ * socket and are picked up at the start of the next round.
+ */
+static void
+fw_keepalive_clients(void)
+{
+	struct in_addr *addrs = NULL;
+	t_client *p1 = NULL;
+	int n = 0, count = 0;
+
+	icmp_collect_replies(0, 0, keepalive_reply_cb, NULL);
+
+	LOCK_CLIENT_LIST();
+	for (p1 = client_get_first_client(); p1 != NULL; p1 = p1->next)
+		count++;
+	g_online_clients = count;
+	metric_set(METRIC_CLIENTS_ONLINE, count);
+	if (count > 0) {
+		addrs = safe_malloc(count * sizeof(struct in_addr));
+		for (p1 = client_get_first_client(); p1 != NULL; p1 = p1->next) {
+			if (inet_aton(p1->ip, &addrs[n]))
+				n++;
+		}
+	}
+	UNLOCK_CLIENT_LIST();
+
+	if (n > 0) {
+		icmp_ping_batch(addrs, n);
+		icmp_collect_replies(CLIENT_KEEPALIVE_WAIT, n, keepalive_reply_cb, NULL);
+	}
+
+	free(addrs);
+}
+
+/** Refresh what the per client timeout checks rely on: ping all the clients
+ * and read their traffic counters from the firewall, once per checkinterval.
+ * @return -1 if the counters could not be read
+ */
+int
+fw_refresh_clients_activity(void)
+{
+	/* Ping the clients, the ones which answer are still around even when idle.
+	 * However, if the firewall blocks it, it will not help.  The suggested
+	 * way to deal witht his is to keep the DHCP lease time extremely
+	 * short:  Shorter than config->checkinterval * config->clienttimeout */
+	fw_keepalive_clients();
 
 	if (-1 == iptables_fw_counters_update()) {
 		debug(LOG_ERR, "Could not get counters from firewall!");
-		return;
+		return -1;
 	}
 
+	return 0;
+}
+
+void
+evhttps_fw_sync_with_authserver(struct evhttps_request_context *context)
+{
+	t_client *p1, *p2, *worklist;
+	s_config *config = config_get_config();
+
 	LOCK_CLIENT_LIST();
 
 	/* XXX Ideally, from a thread safety PoV, this function should build a list of client pointers,
@@ -596,9 +830,12 @@ evhttps_fw_sync_with_authserver(struct evhttps_request_context *context)
 	 * That way clients can disappear during the cycle with no risk of trashing the heap or getting
 	 * a SIGSEGV.
 	 */
-	g_online_clients = client_list_dup(&worklist);
+	client_list_dup_due(&worklist);
 	UNLOCK_CLIENT_LIST();
 
+	if (worklist == NULL)
+		return;
+
 	struct auth_response_client authresponse_client;
 	memset(&authresponse_client, 0, sizeof(struct auth_response_client));
 	authresponse_client.type = request_type_counters;
@@ -606,12 +843,6 @@ evhttps_fw_sync_with_authserver(struct evhttps_request_context *context)
 	for (p1 = p2 = worklist; NULL != p1; p1 = p2) {
 		p2 = p1->next;	
 
-		/* Ping the client, if he responds it'll keep activity on the link.
-		 * However, if the firewall blocks it, it will not help.  The suggested
-		 * way to deal witht his is to keep the DHCP lease time extremely
-		 * short:  Shorter than config->checkinterval * config->clienttimeout */
-		icmp_ping(p1->ip);
-
 		/* Update the counters on the remote server only if we have an auth server */
 		if (config->auth_servers != NULL && p1->is_online) {
 			char *uri = get_auth_uri(REQUEST_TYPE_COUNTERS, online_client, p1);
@@ -628,7 +859,8 @@ evhttps_fw_sync_with_authserver(struct evhttps_request_context *context)
 	client_list_destroy(worklist);
 }
 
-/**Probably a misnomer, this function actually refreshes the entire client list's traffic counter, re-authenticates every client with the central server and update's the central servers traffic counters and notifies it if a client has logged-out.
+/**Probably a misnomer, this function re-authenticates the clients whose timer is due with the central server, update's the central servers traffic counters and notifies it if a client has logged-out.
+ * The traffic counters themselves are refreshed by fw_refresh_clients_activity.
  * @todo Make this function smaller and use sub-fonctions
  */
 void
@@ -638,11 +870,6 @@ fw_sync_with_authserver(void)
 	t_client *p1, *p2, *worklist, *tmp;
 	s_config *config = config_get_config();
 
-	if (-1 == iptables_fw_counters_update()) {
-		debug(LOG_ERR, "Could not get counters from firewall!");
-		return;
-	}
-
 	LOCK_CLIENT_LIST();
 
 	/* XXX Ideally, from a thread safety PoV, this function should build a list of client pointers,
@@ -650,18 +877,16 @@ fw_sync_with_authserver(void)
 	 * That way clients can disappear during the cycle with no risk of trashing the heap or getting
 	 * a SIGSEGV.
 	 */
-	g_online_clients = client_list_dup(&worklist);
+	client_list_dup_due(&worklist);
 	UNLOCK_CLIENT_LIST();
 
+	if (worklist == NULL)
+		return;
+
 	int flag = 0;
 	for (p1 = p2 = worklist; NULL != p1; p1 = p2) {
 		p2 = p1->next;
 
-		/* Ping the client, if he responds it'll keep activity on the link.
-		 * However, if the firewall blocks it, it will not help.  The suggested
-		 * way to deal witht his is to keep the DHCP lease time extremely
-		 * short:  Shorter than config->checkinterval * config->clienttimeout */
-		icmp_ping(p1->ip);
 		/* Update the counters on the remote server only if we have an auth server */
 		if (config->auth_servers != NULL && p1->is_online) {
 			auth_server_request(&authresponse, REQUEST_TYPE_COUNTERS, p1->ip, p1->mac, p1->token, p1->counters.incoming,
@@ -673,14 +898,16 @@ fw_sync_with_authserver(void)
 		}
 
 		time_t current_time = time(NULL);
+		time_t last_active = client_get_last_active(p1);
 		debug(LOG_DEBUG,
-			  "Checking client %s for timeout:  Last updated %ld (%ld seconds ago), timeout delay %ld seconds, current time %ld, ",
-			  p1->ip, p1->counters.last_updated, current_time - p1->counters.last_updated,
+			  "Checking client %s for timeout:  Last active %ld (%ld seconds ago), rtt %u ms, timeout delay %ld seconds, current time %ld, ",
+			  p1->ip, last_active, current_time - last_active, p1->rtt,
 			  config->checkinterval * config->clienttimeout, current_time);
-		if (p1->counters.last_updated + (config->checkinterval * config->clienttimeout) <= current_time) {
+		if (last_active + (config->checkinterval * config->clienttimeout) <= current_time) {
 			/* Timing out user */
 			debug(LOG_DEBUG, "%s - Inactive for more than %ld seconds, removing client and denying in firewall",
 				  p1->ip, config->checkinterval * config->clienttimeout);
+			event_log_write(EVENT_TIMEOUT, p1->ip, p1->mac, current_time - last_active, 0, 0);
 			LOCK_CLIENT_LIST();
 			tmp = client_list_find_by_client(p1);
 			if (NULL != tmp) {
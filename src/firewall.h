@@ -32,6 +32,12 @@
 #include "auth.h"
 #include "simple_http.h"
 
+/** @brief How long to wait for icmp replies when probing trusted macs, in ms */
+#define	TRUSTED_MAC_PROBE_TIMEOUT	1000
+
+/** @brief How long to wait for replies to the client keepalive ping, in ms */
+#define	CLIENT_KEEPALIVE_WAIT	500
+
 /** Used by fw_iptables.c */
 typedef enum _t_fw_marks {
     FW_MARK_NONE = 0, /**< @brief No mark set. */
@@ -45,6 +51,12 @@ typedef enum _t_fw_marks {
 /** @brief Initialize the firewall */
 int fw_init(void);
 
+/** @brief Builds the firewall again after a config reload */
+int fw_rebuild(void);
+
+/** @brief Loads a ruleset changed by a config reload into its chains again */
+void fw_reload_ruleset(const char *);
+
 /** @brief Clears the authservers list */
 void fw_clear_authservers(void);
 
@@ -69,7 +81,7 @@ int fw_set_authdown(void);
 /** @brief Remove passthrough for clients when auth server is up */
 int fw_set_authup(void);
 
-/** @brief Refreshes the entire client list */
+/** @brief Reports counters of the clients due and times out idle ones */
 void fw_sync_with_authserver(void);
 
 /** @brief Get an IP's MAC address from the ARP cache.*/
@@ -122,6 +134,9 @@ void fw_set_trusted_mac(const char *);
 
 void update_trusted_mac_list_status(void);
 
+/** @brief Ping all clients and refresh their counters from the firewall */
+int fw_refresh_clients_activity(void);
+
 void fw_client_process_from_authserver_response(t_authresponse *, t_client *p1);
 
 void evhttps_fw_sync_with_authserver(struct evhttps_request_context *);
@@ -1015,6 +1015,18 @@ fw3_ipt_close(struct fw3_ipt_handle *h)
     h = NULL;
 }
 
+unsigned long long
+fw3_ipt_chain_packets(struct fw3_ipt_handle *h, const char *chain)
+{
+	const struct ipt_entry *e;
+
+	if (!h || !h->handle || !iptc_is_chain(chain, h->handle))
+		return 0;
+
+	e = iptc_first_rule(chain, h->handle);
+	return e ? e->counters.pcnt : 0;
+}
+
 int
 fw3_ipt_commit(struct fw3_ipt_handle *h)
 {
@@ -108,6 +108,9 @@ fw3_ipt_close(struct fw3_ipt_handle *h);
 int
 fw3_ipt_commit(struct fw3_ipt_handle *h);
 
+unsigned long long
+fw3_ipt_chain_packets(struct fw3_ipt_handle *h, const char *chain);
+
 int
 fw3_ipt_rule_append(struct fw3_ipt_handle *handle, char *command);
 
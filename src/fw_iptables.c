@@ -53,6 +53,8 @@
 #include "client_list.h"
 #include "wd_util.h"
 #include "ipset.h"
+#include "event_log.h"
+#include "metrics.h"
 
 #include "fw3_iptc.h"
 
@@ -85,6 +87,13 @@ static int __iptables_fw_destroy_mention(const char *table, const char *chain, c
 #define iptables_do_command(...) \
 	iptables_do_append_command(NULL, __VA_ARGS__)
 
+static int ip6tables_do_command(const char *format, ...);
+
+/** @internal
+ * Rules of a client go to the table of its address family
+ */
+#define	fw_tool_for(ip)	(strchr((ip), ':') ? "ip6tables" : "iptables")
+
 /**
 Used to supress the error output of the firewall during destruction */
 static int fw_quiet = 0;
@@ -140,11 +149,17 @@ static int
 add_ip_to_ipset(const char *name, const char *ip, int remove)
 {
 	char *ipset_name =  NULL;
+	int v6 = strchr(ip, ':') != NULL;
 	if(name == NULL)
 		return -1;
+	/* hash:ip sets hold one family, ipv6 goes to the set named with a 6 */
+	if(v6 && !config_get_config()->enable_ipv6)
+		return 0;
  
-	ipset_name = safe_malloc(strlen(name) + 1);
+	ipset_name = safe_malloc(strlen(name) + 2);
 	memcpy(ipset_name, name, strlen(name));
+	if(v6)
+		ipset_name[strlen(name)] = '6';
 	iptables_insert_gateway_id(&ipset_name);
 
 	int nret = add_to_ipset(ipset_name, ip, remove);
@@ -209,10 +224,54 @@ ipset_do_command(const char *format, ...)
 	return rc;
 }
 
+/** @internal
+ * fw3_iptc only handles ipv4, the ipv6 chains go through the ip6tables binary
+ * */
+static int
+ip6tables_do_command(const char *format, ...)
+{
+	va_list vlist;
+	char *fmt_cmd;
+	char *cmd;
+	int rc;
+
+	va_start(vlist, format);
+	safe_vasprintf(&fmt_cmd, format, vlist);
+	va_end(vlist);
+
+	safe_asprintf(&cmd, "ip6tables %s", fmt_cmd);
+	free(fmt_cmd);
+
+	iptables_insert_gateway_id(&cmd);
+
+	f_fw_script_write(cmd);
+	if(fw_quiet == 2) {
+		debug(LOG_DEBUG, "fill file command: %s", cmd);
+		free(cmd);
+		return 0;
+	}
+
+	debug(LOG_DEBUG, "Executing command: %s", cmd);
+
+	rc = execute(cmd, fw_quiet);
+
+	if (rc != 0) {
+		// If quiet, do not display the error
+		if (fw_quiet == 0)
+			debug(LOG_ERR, "ip6tables command failed(%d): %s", rc, cmd);
+		else if (fw_quiet == 1)
+			debug(LOG_DEBUG, "ip6tables command failed(%d): %s", rc, cmd);
+	}
+
+	free(cmd);
+
+	return rc;
+}
+
 /** @internal
  * */
 static void
-iptables_do_command_save(const char *format, ...)
+iptables_do_command_save(const char *tool, const char *format, ...)
 {
 	va_list vlist;
 	char *fmt_cmd;
@@ -222,7 +281,7 @@ iptables_do_command_save(const char *format, ...)
 	safe_vasprintf(&fmt_cmd, format, vlist);
 	va_end(vlist);
 
-	safe_asprintf(&cmd, "iptables %s", fmt_cmd);
+	safe_asprintf(&cmd, "%s %s", tool, fmt_cmd);
 	free(fmt_cmd);
 
 	iptables_insert_gateway_id(&cmd);
@@ -411,6 +470,8 @@ void
 iptables_fw_clear_user_domains_trusted(void)
 {
 	iptables_flush_ipset(CHAIN_DOMAIN_TRUSTED);
+	if (config_get_config()->enable_ipv6)
+		iptables_flush_ipset(CHAIN_DOMAIN_TRUSTED6);
 }
 
 void
@@ -442,6 +503,8 @@ iptables_fw_clear_ipset_domains_trusted(void)
 
 	remove(f_ipset_name);
 	iptables_flush_ipset(CHAIN_IPSET_TDOMAIN);
+	if (config_get_config()->enable_ipv6)
+		iptables_flush_ipset(CHAIN_IPSET_TDOMAIN6);
 	execute("/etc/init.d/dnsmasq restart", 1);
 }
 
@@ -467,7 +530,10 @@ iptables_fw_set_ipset_domains_trusted(void)
 
 	for (domain_trusted = config->pan_domains_trusted; domain_trusted != NULL; domain_trusted = domain_trusted->next) {
 		has_content = 1;
-		fprintf(fd_ipset, "ipset=/.%s/%s\n", domain_trusted->domain, CHAIN_IPSET_TDOMAIN);
+		if (config->enable_ipv6)
+			fprintf(fd_ipset, "ipset=/.%s/%s,%s\n", domain_trusted->domain, CHAIN_IPSET_TDOMAIN, CHAIN_IPSET_TDOMAIN6);
+		else
+			fprintf(fd_ipset, "ipset=/.%s/%s\n", domain_trusted->domain, CHAIN_IPSET_TDOMAIN);
 	}
 
 	UNLOCK_DOMAIN();
@@ -478,6 +544,8 @@ iptables_fw_set_ipset_domains_trusted(void)
 		remove(f_ipset_name);
 
 	iptables_flush_ipset(CHAIN_IPSET_TDOMAIN);
+	if (config->enable_ipv6)
+		iptables_flush_ipset(CHAIN_IPSET_TDOMAIN6);
 	execute("/etc/init.d/dnsmasq restart", 1);
 }
 
@@ -492,6 +560,8 @@ void
 iptables_fw_clear_inner_domains_trusted(void)
 {
 	iptables_flush_ipset(CHAIN_INNER_DOMAIN_TRUSTED);
+	if (config_get_config()->enable_ipv6)
+		iptables_flush_ipset(CHAIN_INNER_DOMAIN_TRUSTED6);
 }
 
 void
@@ -702,9 +772,10 @@ iptables_fw_save_online_clients()
 	f_fw_allow_open();
 
 	while (current != NULL) {
-		iptables_do_command_save("-t mangle -A " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK --set-mark 0x%02x0000/0xff0000", 
+		iptables_do_command_save(fw_tool_for(current->ip),
+					"-t mangle -A " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK --set-mark 0x%02x0000/0xff0000", 
 					current->ip, current->mac, FW_MARK_KNOWN);
-		iptables_do_command_save("-t mangle -A " CHAIN_INCOMING " -d %s -j ACCEPT", current->ip);
+		iptables_do_command_save(fw_tool_for(current->ip), "-t mangle -A " CHAIN_INCOMING " -d %s -j ACCEPT", current->ip);
 
 		current = current->next;
 	}
@@ -713,6 +784,155 @@ iptables_fw_save_online_clients()
 }
 // <<< liudf added end
 
+/** @internal
+ * Load the rules of a ruleset that also make sense for ipv6: an ipv4 mask,
+ * an ipset of ipv4 addresses or ULOG have no ipv6 counterpart.
+ */
+static void
+ip6tables_load_ruleset(const char *table, const char *ruleset, const char *chain)
+{
+	t_firewall_rule *rule;
+	char *cmd;
+
+	for (rule = get_ruleset(ruleset); rule != NULL; rule = rule->next) {
+		if ((rule->mask && (rule->mask_is_ipset || !strchr(rule->mask, ':'))) || rule->target == TARGET_ULOG)
+			continue;
+		cmd = iptables_compile(table, chain, rule);
+		if (cmd != NULL)
+			ip6tables_do_command(cmd);
+		free(cmd);
+	}
+}
+
+/** @internal
+ * Mirror of the client chains for ipv6 clients. Known and probation
+ * clients are marked and pass as in ipv4, unknown ones are redirected to
+ * the gateway ports; the auth servers are only reached over ipv4 and the
+ * auth is down ruleset is not mirrored.
+ */
+static void
+ip6tables_fw_init(const s_config *config, const char *ext_interface, int gw_port, int gw_https_port, int gw_http_port)
+{
+	ip6tables_do_command("-t mangle -N " CHAIN_ROAM);
+	ip6tables_do_command("-t mangle -N " CHAIN_TRUSTED);
+	ip6tables_do_command("-t mangle -N " CHAIN_OUTGOING);
+	ip6tables_do_command("-t mangle -N " CHAIN_INCOMING);
+	ip6tables_do_command("-t mangle -N " CHAIN_TO_PASS);
+	ip6tables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_OUTGOING, config->gw_interface);
+	ip6tables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_TRUSTED, config->gw_interface);
+	ip6tables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_TO_PASS, config->gw_interface);
+	if (config->no_auth != 0)
+		ip6tables_do_command("-t mangle -A " CHAIN_TO_PASS " -j MARK --set-mark 0x%02x0000/0xff0000", FW_MARK_KNOWN);
+	ip6tables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_ROAM, config->gw_interface);
+	/* hash:mac sets match in both families */
+	ip6tables_do_command("-t mangle -A " CHAIN_ROAM " -m set --match-set " CHAIN_ROAM " src -j MARK --set-mark 0x%02x0000/0xff0000", FW_MARK_KNOWN);
+	ip6tables_do_command("-t mangle -I POSTROUTING 1 -o %s -j " CHAIN_INCOMING, config->gw_interface);
+	ip6tables_do_command("-t mangle -A " CHAIN_TRUSTED " -m set --match-set " CHAIN_TRUSTED " src -j MARK --set-mark 0x%02x0000/0xff0000", FW_MARK_KNOWN);
+	ip6tables_do_command("-t mangle -A " CHAIN_TRUSTED " -m set --match-set " CHAIN_TRUSTED_LOCAL " src -j MARK --set-mark 0x%02x0000/0xff0000", FW_MARK_KNOWN);
+
+	ip6tables_do_command("-t nat -N " CHAIN_OUTGOING);
+	ip6tables_do_command("-t nat -N " CHAIN_TO_INTERNET);
+	ip6tables_do_command("-t nat -N " CHAIN_UNKNOWN);
+	ip6tables_do_command("-t nat -N " CHAIN_DOMAIN_TRUSTED);
+	ip6tables_do_command("-t nat -A PREROUTING -i %s -j " CHAIN_OUTGOING, config->gw_interface);
+	/* the router has several ipv6 addresses, link local included */
+	ip6tables_do_command("-t nat -A " CHAIN_OUTGOING " -m addrtype --dst-type LOCAL -j ACCEPT");
+	ip6tables_do_command("-t nat -A " CHAIN_OUTGOING " -j " CHAIN_TO_INTERNET);
+	ip6tables_do_command("-t nat -A " CHAIN_TO_INTERNET " -m mark --mark 0x%x0000/0xff0000 -j ACCEPT", FW_MARK_KNOWN);
+	ip6tables_do_command("-t nat -A " CHAIN_TO_INTERNET " -m mark --mark 0x%x0000/0xff0000 -j ACCEPT", FW_MARK_PROBATION);
+	ip6tables_do_command("-t nat -A " CHAIN_TO_INTERNET " -j " CHAIN_UNKNOWN);
+	ip6tables_do_command("-t nat -A " CHAIN_UNKNOWN " -j " CHAIN_DOMAIN_TRUSTED);
+	ip6tables_do_command("-t nat -A " CHAIN_DOMAIN_TRUSTED " -m set --match-set " CHAIN_IPSET_TDOMAIN6 " dst -j ACCEPT");
+	ip6tables_do_command("-t nat -A " CHAIN_DOMAIN_TRUSTED " -m set --match-set " CHAIN_DOMAIN_TRUSTED6 " dst -j ACCEPT");
+	ip6tables_do_command("-t nat -A " CHAIN_DOMAIN_TRUSTED " -m set --match-set " CHAIN_INNER_DOMAIN_TRUSTED6 " dst -j ACCEPT");
+	if (config->work_mode == 0) {
+		ip6tables_do_command("-t nat -A " CHAIN_UNKNOWN " -p tcp --dport 443 -j REDIRECT --to-ports %d", gw_https_port);
+		ip6tables_do_command("-t nat -A " CHAIN_UNKNOWN " -p tcp --dport 80 -j REDIRECT --to-ports %d", gw_port);
+	} else {
+		ip6tables_do_command("-t nat -A " CHAIN_UNKNOWN " -p tcp --dport 80 -j REDIRECT --to-ports %d", gw_http_port);
+	}
+
+	ip6tables_do_command("-t filter -N " CHAIN_TO_INTERNET);
+	ip6tables_do_command("-t filter -N " CHAIN_DOMAIN_TRUSTED);
+	ip6tables_do_command("-t filter -N " CHAIN_LOCKED);
+	ip6tables_do_command("-t filter -N " CHAIN_GLOBAL);
+	ip6tables_do_command("-t filter -N " CHAIN_VALIDATE);
+	ip6tables_do_command("-t filter -N " CHAIN_KNOWN);
+	ip6tables_do_command("-t filter -N " CHAIN_UNKNOWN);
+	ip6tables_do_command("-t filter -I FORWARD -i %s -j " CHAIN_TO_INTERNET, config->gw_interface);
+	ip6tables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m conntrack --ctstate INVALID -j DROP");
+	ip6tables_do_command("-t filter -A " CHAIN_TO_INTERNET
+						" -o %s -p tcp --tcp-flags SYN,RST SYN -j TCPMSS --clamp-mss-to-pmtu", ext_interface);
+	ip6tables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m mark --mark 0x%x0000/0xff0000 -j " CHAIN_LOCKED, FW_MARK_LOCKED);
+	ip6tables_load_ruleset("filter", FWRULESET_LOCKED_USERS, CHAIN_LOCKED);
+	ip6tables_do_command("-t filter -A " CHAIN_TO_INTERNET " -j " CHAIN_DOMAIN_TRUSTED);
+	ip6tables_do_command("-t filter -A " CHAIN_DOMAIN_TRUSTED " -m set --match-set " CHAIN_IPSET_TDOMAIN6 " dst -j ACCEPT");
+	ip6tables_do_command("-t filter -A " CHAIN_DOMAIN_TRUSTED " -m set --match-set " CHAIN_DOMAIN_TRUSTED6 " dst -j ACCEPT");
+	ip6tables_do_command("-t filter -A " CHAIN_DOMAIN_TRUSTED " -m set --match-set " CHAIN_INNER_DOMAIN_TRUSTED6 " dst -j ACCEPT");
+	ip6tables_do_command("-t filter -A " CHAIN_TO_INTERNET " -j " CHAIN_GLOBAL);
+	ip6tables_load_ruleset("filter", FWRULESET_GLOBAL, CHAIN_GLOBAL);
+	ip6tables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m mark --mark 0x%x0000/0xff0000 -j " CHAIN_VALIDATE, FW_MARK_PROBATION);
+	ip6tables_load_ruleset("filter", FWRULESET_VALIDATING_USERS, CHAIN_VALIDATE);
+	ip6tables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m mark --mark 0x%x0000/0xff0000 -j " CHAIN_KNOWN, FW_MARK_KNOWN);
+	ip6tables_load_ruleset("filter", FWRULESET_KNOWN_USERS, CHAIN_KNOWN);
+	ip6tables_do_command("-t filter -A " CHAIN_TO_INTERNET " -j " CHAIN_UNKNOWN);
+	ip6tables_load_ruleset("filter", FWRULESET_UNKNOWN_USERS, CHAIN_UNKNOWN);
+	ip6tables_do_command("-t filter -A " CHAIN_UNKNOWN " -j REJECT --reject-with icmp6-port-unreachable");
+}
+
+/** @internal
+ * Undo ip6tables_fw_init
+ */
+static void
+ip6tables_fw_destroy(const s_config *config)
+{
+	ip6tables_do_command("-t mangle -D PREROUTING -i %s -j " CHAIN_TO_PASS, config->gw_interface);
+	ip6tables_do_command("-t mangle -D PREROUTING -i %s -j " CHAIN_ROAM, config->gw_interface);
+	ip6tables_do_command("-t mangle -D PREROUTING -i %s -j " CHAIN_TRUSTED, config->gw_interface);
+	ip6tables_do_command("-t mangle -D PREROUTING -i %s -j " CHAIN_OUTGOING, config->gw_interface);
+	ip6tables_do_command("-t mangle -D POSTROUTING -o %s -j " CHAIN_INCOMING, config->gw_interface);
+	ip6tables_do_command("-t mangle -F " CHAIN_TO_PASS);
+	ip6tables_do_command("-t mangle -F " CHAIN_ROAM);
+	ip6tables_do_command("-t mangle -F " CHAIN_TRUSTED);
+	ip6tables_do_command("-t mangle -F " CHAIN_OUTGOING);
+	ip6tables_do_command("-t mangle -F " CHAIN_INCOMING);
+	ip6tables_do_command("-t mangle -X " CHAIN_TO_PASS);
+	ip6tables_do_command("-t mangle -X " CHAIN_ROAM);
+	ip6tables_do_command("-t mangle -X " CHAIN_TRUSTED);
+	ip6tables_do_command("-t mangle -X " CHAIN_OUTGOING);
+	ip6tables_do_command("-t mangle -X " CHAIN_INCOMING);
+
+	ip6tables_do_command("-t nat -D PREROUTING -i %s -j " CHAIN_OUTGOING, config->gw_interface);
+	ip6tables_do_command("-t nat -F " CHAIN_OUTGOING);
+	ip6tables_do_command("-t nat -F " CHAIN_TO_INTERNET);
+	ip6tables_do_command("-t nat -F " CHAIN_UNKNOWN);
+	ip6tables_do_command("-t nat -F " CHAIN_DOMAIN_TRUSTED);
+	ip6tables_do_command("-t nat -X " CHAIN_OUTGOING);
+	ip6tables_do_command("-t nat -X " CHAIN_TO_INTERNET);
+	ip6tables_do_command("-t nat -X " CHAIN_UNKNOWN);
+	ip6tables_do_command("-t nat -X " CHAIN_DOMAIN_TRUSTED);
+
+	ip6tables_do_command("-t filter -D FORWARD -i %s -j " CHAIN_TO_INTERNET, config->gw_interface);
+	ip6tables_do_command("-t filter -F " CHAIN_TO_INTERNET);
+	ip6tables_do_command("-t filter -F " CHAIN_DOMAIN_TRUSTED);
+	ip6tables_do_command("-t filter -F " CHAIN_LOCKED);
+	ip6tables_do_command("-t filter -F " CHAIN_GLOBAL);
+	ip6tables_do_command("-t filter -F " CHAIN_VALIDATE);
+	ip6tables_do_command("-t filter -F " CHAIN_KNOWN);
+	ip6tables_do_command("-t filter -F " CHAIN_UNKNOWN);
+	ip6tables_do_command("-t filter -X " CHAIN_TO_INTERNET);
+	ip6tables_do_command("-t filter -X " CHAIN_DOMAIN_TRUSTED);
+	ip6tables_do_command("-t filter -X " CHAIN_LOCKED);
+	ip6tables_do_command("-t filter -X " CHAIN_GLOBAL);
+	ip6tables_do_command("-t filter -X " CHAIN_VALIDATE);
+	ip6tables_do_command("-t filter -X " CHAIN_KNOWN);
+	ip6tables_do_command("-t filter -X " CHAIN_UNKNOWN);
+
+	ipset_do_command("destroy " CHAIN_DOMAIN_TRUSTED6);
+	ipset_do_command("destroy " CHAIN_INNER_DOMAIN_TRUSTED6);
+	ipset_do_command("destroy " CHAIN_IPSET_TDOMAIN6);
+}
+
 /** Initialize the firewall rules
 */
 int
@@ -723,6 +943,7 @@ iptables_fw_init(void)
 	int gw_port = 0;
 	int gw_https_port = 0;
 	int gw_http_port = 0;
+	int https_rate, https_burst;
 	int proxy_port;
 	fw_quiet = 0;
 	int got_authdown_ruleset = NULL == get_ruleset(FWRULESET_AUTH_IS_DOWN) ? 0 : 1;
@@ -741,6 +962,8 @@ iptables_fw_init(void)
 	gw_port = config->gw_port;
 	gw_https_port = config->https_server->gw_https_port;
 	gw_http_port = config->http_server->gw_http_port;
+	https_rate = config->https_server->redirect_rate;
+	https_burst = config->https_server->redirect_burst > 0 ? config->https_server->redirect_burst : 1;
 
 	if (config->external_interface) {
 		ext_interface = safe_strdup(config->external_interface);
@@ -762,6 +985,11 @@ iptables_fw_init(void)
 	ipset_do_command("create " CHAIN_DOMAIN_TRUSTED " hash:ip ");
 	ipset_do_command("create " CHAIN_INNER_DOMAIN_TRUSTED " hash:ip ");
 	ipset_do_command("create " CHAIN_IPSET_TDOMAIN " hash:ip ");
+	if (config->enable_ipv6) {
+		ipset_do_command("create " CHAIN_DOMAIN_TRUSTED6 " hash:ip family inet6 ");
+		ipset_do_command("create " CHAIN_INNER_DOMAIN_TRUSTED6 " hash:ip family inet6 ");
+		ipset_do_command("create " CHAIN_IPSET_TDOMAIN6 " hash:ip family inet6 ");
+	}
 
 
 	/*
@@ -878,7 +1106,16 @@ iptables_fw_init(void)
 		iptables_do_append_command(handle, "-t nat -A " CHAIN_AUTH_IS_DOWN " -m mark --mark 0x%x0000/0xff0000 -j ACCEPT", FW_MARK_AUTH_IS_DOWN);
 	}
 
-	if (config_get_config()->work_mode == 0) {
+	if (config_get_config()->work_mode == 0 && https_rate > 0) {
+		/* per client token bucket, connections over it are reset in the filter table */
+		iptables_do_append_command(handle, "-t nat -N " CHAIN_HTTPS_LIMIT);
+		iptables_do_append_command(handle, "-t nat -A " CHAIN_UNKNOWN " -p tcp --dport 443 -j " CHAIN_HTTPS_LIMIT);
+		iptables_do_append_command(handle, "-t nat -A " CHAIN_HTTPS_LIMIT
+							" -m hashlimit --hashlimit-upto %d/min --hashlimit-burst %d --hashlimit-mode srcip"
+							" --hashlimit-name wifidog_https --hashlimit-htable-expire 120000"
+							" -j REDIRECT --to-ports %d", https_rate, https_burst, gw_https_port);
+		iptables_do_append_command(handle, "-t nat -A " CHAIN_UNKNOWN " -p tcp --dport 80 -j REDIRECT --to-ports %d", gw_port);
+	} else if (config_get_config()->work_mode == 0) {
 		iptables_do_append_command(handle, "-t nat -A " CHAIN_UNKNOWN " -p tcp --dport 443 -j REDIRECT --to-ports %d", gw_https_port);
 		iptables_do_append_command(handle, "-t nat -A " CHAIN_UNKNOWN " -p tcp --dport 80 -j REDIRECT --to-ports %d", gw_port);
 	} else {
@@ -949,11 +1186,19 @@ iptables_fw_init(void)
 
 	iptables_do_append_command(handle, "-t filter -A " CHAIN_TO_INTERNET " -j " CHAIN_UNKNOWN);
 	iptables_load_ruleset("filter", FWRULESET_UNKNOWN_USERS, CHAIN_UNKNOWN, handle);
+	if (config->work_mode == 0 && https_rate > 0) {
+		iptables_do_append_command(handle, "-t filter -N " CHAIN_HTTPS_RESET);
+		iptables_do_append_command(handle, "-t filter -A " CHAIN_UNKNOWN " -p tcp --dport 443 -j " CHAIN_HTTPS_RESET);
+		iptables_do_append_command(handle, "-t filter -A " CHAIN_HTTPS_RESET " -p tcp -j REJECT --reject-with tcp-reset");
+	}
 	iptables_do_append_command(handle, "-t filter -A " CHAIN_UNKNOWN " -j REJECT --reject-with icmp-port-unreachable");
 
 	fw3_ipt_commit(handle);
 	fw3_ipt_close(handle);
 
+	if (config->enable_ipv6)
+		ip6tables_fw_init(config, ext_interface, gw_port, gw_https_port, gw_http_port);
+
 	free(ext_interface);
 
 	f_fw_init_close();
@@ -962,6 +1207,83 @@ iptables_fw_init(void)
 	return 1;
 }
 
+/** @internal
+ * The filter chains the rulesets are loaded into */
+static const struct {
+	const char *ruleset;
+	const char *chain;
+} fw_ruleset_chains[] = {
+	{FWRULESET_LOCKED_USERS, CHAIN_LOCKED},
+	{FWRULESET_GLOBAL, CHAIN_GLOBAL},
+	{FWRULESET_VALIDATING_USERS, CHAIN_VALIDATE},
+	{FWRULESET_KNOWN_USERS, CHAIN_KNOWN},
+	{FWRULESET_AUTH_IS_DOWN, CHAIN_AUTH_IS_DOWN},
+	{FWRULESET_UNKNOWN_USERS, CHAIN_UNKNOWN},
+	{NULL, NULL}
+};
+
+/** Loads a ruleset which changed on a config reload into its chains again.
+ * Each ipv4 table is flushed and refilled through one libiptc handle, so the
+ * chain is replaced by a single commit and no packet meets it empty; the
+ * ipv6 mirror goes through ip6tables and is not atomic.
+ * @return 1 on success, 0 if the ruleset has no chain
+ */
+int
+iptables_fw_reload_ruleset(const char *ruleset)
+{
+	const s_config *config = config_get_config();
+	struct fw3_ipt_handle *handle;
+	const char *chain = NULL;
+	int i;
+
+	for (i = 0; fw_ruleset_chains[i].ruleset; i++) {
+		if (strcmp(fw_ruleset_chains[i].ruleset, ruleset) == 0) {
+			chain = fw_ruleset_chains[i].chain;
+			break;
+		}
+	}
+	if (chain == NULL) {
+		debug(LOG_WARNING, "Ruleset %s is not loaded into any chain", ruleset);
+		return 0;
+	}
+
+	fw_quiet = 0;
+
+	handle = fw3_ipt_open(FW3_TABLE_FILTER);
+	if (handle == NULL) {
+		debug(LOG_ERR, "Could not open the filter table to reload ruleset %s", ruleset);
+		return 0;
+	}
+	iptables_do_append_command(handle, "-t filter -F %s", chain);
+	iptables_load_ruleset("filter", ruleset, chain, handle);
+	if (strcmp(chain, CHAIN_UNKNOWN) == 0) {
+		if (config->work_mode == 0 && config->https_server->redirect_rate > 0)
+			iptables_do_append_command(handle, "-t filter -A " CHAIN_UNKNOWN " -p tcp --dport 443 -j " CHAIN_HTTPS_RESET);
+		iptables_do_append_command(handle, "-t filter -A " CHAIN_UNKNOWN " -j REJECT --reject-with icmp-port-unreachable");
+	}
+	fw3_ipt_commit(handle);
+	fw3_ipt_close(handle);
+
+	if (strcmp(chain, CHAIN_GLOBAL) == 0) {
+		handle = fw3_ipt_open(FW3_TABLE_NAT);
+		if (handle != NULL) {
+			iptables_do_append_command(handle, "-t nat -F " CHAIN_GLOBAL);
+			iptables_load_ruleset("nat", ruleset, CHAIN_GLOBAL, handle);
+			fw3_ipt_commit(handle);
+			fw3_ipt_close(handle);
+		}
+	}
+
+	if (config->enable_ipv6 && strcmp(chain, CHAIN_AUTH_IS_DOWN) != 0) {
+		ip6tables_do_command("-t filter -F %s", chain);
+		ip6tables_load_ruleset("filter", ruleset, chain);
+		if (strcmp(chain, CHAIN_UNKNOWN) == 0)
+			ip6tables_do_command("-t filter -A " CHAIN_UNKNOWN " -j REJECT --reject-with icmp6-port-unreachable");
+	}
+
+	return 1;
+}
+
 /** Remove the firewall rules
  * This is used when we do a clean shutdown of WiFiDog and when it starts to make
  * sure there are no rules left over
@@ -1031,6 +1353,7 @@ iptables_fw_destroy(void)
 	iptables_do_command("-t nat -F " CHAIN_TO_INTERNET);
 	iptables_do_command("-t nat -F " CHAIN_GLOBAL);
 	iptables_do_command("-t nat -F " CHAIN_UNKNOWN);
+	iptables_do_command("-t nat -F " CHAIN_HTTPS_LIMIT);
 	iptables_do_command("-t nat -X " CHAIN_AUTHSERVERS);
 	iptables_do_command("-t nat -X " CHAIN_TO_PASS);
 	// liudf added 20151224
@@ -1043,6 +1366,7 @@ iptables_fw_destroy(void)
 	iptables_do_command("-t nat -X " CHAIN_TO_INTERNET);
 	iptables_do_command("-t nat -X " CHAIN_GLOBAL);
 	iptables_do_command("-t nat -X " CHAIN_UNKNOWN);
+	iptables_do_command("-t nat -X " CHAIN_HTTPS_LIMIT);
 
 	/*
 	 *
@@ -1060,6 +1384,7 @@ iptables_fw_destroy(void)
 	iptables_do_command("-t filter -F " CHAIN_VALIDATE);
 	iptables_do_command("-t filter -F " CHAIN_KNOWN);
 	iptables_do_command("-t filter -F " CHAIN_UNKNOWN);
+	iptables_do_command("-t filter -F " CHAIN_HTTPS_RESET);
 	if (got_authdown_ruleset)
 		iptables_do_command("-t filter -F " CHAIN_AUTH_IS_DOWN);
 	iptables_do_command("-t filter -X " CHAIN_TO_INTERNET);
@@ -1071,6 +1396,7 @@ iptables_fw_destroy(void)
 	iptables_do_command("-t filter -X " CHAIN_VALIDATE);
 	iptables_do_command("-t filter -X " CHAIN_KNOWN);
 	iptables_do_command("-t filter -X " CHAIN_UNKNOWN);
+	iptables_do_command("-t filter -X " CHAIN_HTTPS_RESET);
 	if (got_authdown_ruleset)
 		iptables_do_command("-t filter -X " CHAIN_AUTH_IS_DOWN);
 
@@ -1085,6 +1411,9 @@ iptables_fw_destroy(void)
 	ipset_do_command("destroy " CHAIN_INNER_DOMAIN_TRUSTED);
 	ipset_do_command("destroy " CHAIN_IPSET_TDOMAIN);
 
+	if (config_get_config()->enable_ipv6)
+		ip6tables_fw_destroy(config_get_config());
+
 	// liudf added 20160127
 	f_fw_destroy_close();
 
@@ -1109,12 +1438,14 @@ __iptables_fw_destroy_mention(const char *table, const char *chain, const char *
 	char *victim = safe_strdup(mention);
 	int i = 0;
 	int deleted = 0;
+	/* an ipv6 address can only be mentioned in the ip6tables chains */
+	int v6 = is_valid_ip6(mention);
 
 	iptables_insert_gateway_id(&victim);
 
 	debug(LOG_DEBUG, "Attempting to destroy all mention of %s from %s.%s", victim, table, chain);
 
-	safe_asprintf(&command, "iptables -t %s -L %s -n --line-numbers -v", table, chain);
+	safe_asprintf(&command, "%s -t %s -L %s -n --line-numbers -v", v6 ? "ip6tables" : "iptables", table, chain);
 	iptables_insert_gateway_id(&command);
 	
 	do {
@@ -1133,7 +1464,9 @@ __iptables_fw_destroy_mention(const char *table, const char *chain, const char *
 						debug(LOG_DEBUG, "Deleting rule %s from %s.%s because it mentions %s", rulenum, table, chain,
 							  victim);
 						safe_asprintf(&command2, "-t %s -D %s %s", table, chain, rulenum);
-						if (handle)
+						if (v6)
+							ip6tables_do_command(command2);
+						else if (handle)
 							iptables_do_append_command(handle, command2);
 						else
 							iptables_do_command(command2);
@@ -1160,6 +1493,28 @@ iptables_fw_destroy_mention(const char *table, const char *chain, const char *me
 	return __iptables_fw_destroy_mention(table, chain, mention, handle, 20);
 }
 
+#define	CLIENT_MARK_RULE	"-t mangle %s " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK --set-mark 0x%02x0000/0xff0000"
+#define	CLIENT_ACCEPT_RULE	"-t mangle %s " CHAIN_INCOMING " -d %s -j ACCEPT"
+
+/** @internal
+ * The two mangle rules which let a client through, the only place they are
+ * spelled out. ipv6 addresses go through ip6tables.
+ * @param handle mangle handle the rules are queued on, NULL to run them now
+ * @param op "-A" or "-D", a handle only takes "-A"
+ * @return result of the second rule
+ */
+static int
+iptables_fw_client_rules(void *handle, const char *op, const char *ip, const char *mac, int tag)
+{
+	if (strchr(ip, ':')) {
+		ip6tables_do_command(CLIENT_MARK_RULE, op, ip, mac, tag & 0x000000ff);
+		return ip6tables_do_command(CLIENT_ACCEPT_RULE, op, ip);
+	}
+
+	iptables_do_append_command(handle, CLIENT_MARK_RULE, op, ip, mac, tag & 0x000000ff);
+	return iptables_do_append_command(handle, CLIENT_ACCEPT_RULE, op, ip);
+}
+
 /** Set if a specific client has access through the firewall */
 int
 iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag)
@@ -1168,26 +1523,69 @@ iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag)
 
 	fw_quiet = 0;
 
+	if (strchr(ip, ':') && !config_get_config()->enable_ipv6)
+		return 0;
+
 	switch (type) {
 	case FW_ACCESS_ALLOW:
-		iptables_do_command("-t mangle -A " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK --set-mark 0x%02x0000/0xff0000", ip,
-							mac, tag & 0x000000ff);
-		rc = iptables_do_command("-t mangle -A " CHAIN_INCOMING " -d %s -j ACCEPT", ip);
+		rc = iptables_fw_client_rules(NULL, "-A", ip, mac, tag);
 		break;
 	case FW_ACCESS_DENY:
 		/* XXX Add looping to really clear? */
-		iptables_do_command("-t mangle -D " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK --set-mark 0x%02x0000/0xff0000", ip,
-							mac, tag & 0x000000ff);
-		rc = iptables_do_command("-t mangle -D " CHAIN_INCOMING " -d %s -j ACCEPT", ip);
+		rc = iptables_fw_client_rules(NULL, "-D", ip, mac, tag);
 		break;
 	default:
 		rc = -1;
 		break;
 	}
 
+	event_log_write(type == FW_ACCESS_ALLOW ? EVENT_ALLOW : EVENT_DENY, ip, mac, tag, 0, rc ? EVENT_FLAG_FAILED : 0);
 	return rc;
 }
 
+/** Grant access to a whole client list at once, as after a restart.
+ * The ipv4 rules of all clients go into one libiptc handle on the mangle
+ * table and are committed together; if that fails, and for ipv6 clients,
+ * each client falls back to iptables_fw_access. The client list must be
+ * locked and the clients must have no rules yet.
+ * @return number of clients whose rules could not be added
+ */
+int
+iptables_fw_allow_clients(t_client *first)
+{
+	struct fw3_ipt_handle *handle;
+	t_client *client;
+	int failed = 0, rc;
+
+	fw_quiet = 0;
+
+	handle = fw3_ipt_open(FW3_TABLE_MANGLE);
+	if (handle != NULL) {
+		for (client = first; client; client = client->next) {
+			if (strchr(client->ip, ':'))
+				continue;
+			iptables_fw_client_rules(handle, "-A", client->ip, client->mac, client->fw_connection_state);
+		}
+		rc = fw3_ipt_commit(handle);
+		fw3_ipt_close(handle);
+		if (!rc)
+			handle = NULL;
+	}
+	if (handle == NULL)
+		debug(LOG_WARNING, "Bulk restore of the client rules failed, adding them one by one");
+
+	for (client = first; client; client = client->next) {
+		if (handle == NULL || strchr(client->ip, ':')) {
+			if (iptables_fw_access(FW_ACCESS_ALLOW, client->ip, client->mac, client->fw_connection_state) != 0)
+				failed++;
+		} else {
+			event_log_write(EVENT_ALLOW, client->ip, client->mac, client->fw_connection_state, 0, 0);
+		}
+	}
+
+	return failed;
+}
+
 int
 iptables_fw_access_host(fw_access_t type, const char *host)
 {
@@ -1255,62 +1653,88 @@ __get_client_name(t_client *client)
 	}
 }
 
-/** Update the counters of all the clients in the client list */
-int
-iptables_fw_counters_update(void)
+/** @internal
+ * Pick the source or destination address out of one rule of a listing.
+ * ip6tables leaves the opt column empty where iptables prints "--", so
+ * the columns are not counted: the first two tokens after the byte count
+ * that are addresses, once a /mask is cut off, are source and destination.
+ * @return 1 if the rule has the wanted address, copied to ip
+ */
+static int
+iptables_fw_counters_rule(char *line, unsigned long long *counter, int incoming, char *ip, size_t len)
 {
-	FILE *output;
-	char *script, ip[16] = {0}, rc;
-	unsigned long long int counter;
-	t_client *p1;
-	struct in_addr tempaddr;
-
-	/* Look for outgoing traffic */
-	safe_asprintf(&script, "%s %s", "iptables", "-v -n -x -t mangle -L " CHAIN_OUTGOING);
-	iptables_insert_gateway_id(&script);
-	output = popen(script, "r");
-	free(script);
-	if (!output) {
-		debug(LOG_ERR, "popen(): %s", strerror(errno));
-		return -1;
+	char *token, *save = NULL, *slash;
+	int field = 0, addr = 0;
+	t_ip_key key;
+
+	for (token = strtok_r(line, " \t\n", &save); token; token = strtok_r(NULL, " \t\n", &save), field++) {
+		if (field == 1) {
+			if (sscanf(token, "%llu", counter) != 1)
+				return 0;
+			continue;
+		}
+		if (field < 3)
+			continue;
+		if ((slash = strchr(token, '/')))
+			*slash = '\0';
+		if (!ip_key_parse(token, &key))
+			continue;
+		if (addr++ == (incoming ? 1 : 0)) {
+			snprintf(ip, len, "%s", token);
+			return 1;
+		}
 	}
+	return 0;
+}
 
-	// liudf added 20160216
-	LOCK_CLIENT_LIST();
-	reset_client_list();
-	UNLOCK_CLIENT_LIST();
-
-	/* skip the first two lines */
-	while (('\n' != fgetc(output)) && !feof(output)) ;
-	while (('\n' != fgetc(output)) && !feof(output)) ;
-	while (output && !(feof(output))) {
-		rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %15[0-9.] %*s %*s %*s %*s %*s %*s", &counter, ip);
-		//rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %15[0-9.] %*s %*s %*s %*s %*s 0x%*u", &counter, ip);
-		if (2 == rc && EOF != rc) {
-			/* Sanity */
-			if (!inet_aton(ip, &tempaddr)) {
-				debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
-				continue;
-			}
-			debug(LOG_DEBUG, "Read outgoing traffic for %s: Bytes=%llu", ip, counter);
+/** Read the byte counters of one of the client chains, as listed by
+ * iptables -v -n -x or ip6tables -v -n -x, and update the matching clients
+ * @param output listing of CHAIN_OUTGOING or CHAIN_INCOMING
+ * @param incoming non zero for CHAIN_INCOMING
+ */
+void
+iptables_fw_counters_parse(FILE *output, int incoming)
+{
+	char ip[HTTP_IP_ADDR_LEN] = {0}, line[MAX_BUF];
+	unsigned long long int counter;
+	t_client *p1;
+	int lineno = 0;
+
+	while (fgets(line, sizeof(line), output)) {
+		/* skip the chain and column headers */
+		if (++lineno <= 2)
+			continue;
+		if (iptables_fw_counters_rule(line, &counter, incoming, ip, sizeof(ip))) {
+			debug(LOG_DEBUG, "Read %s traffic for %s: Bytes=%llu", incoming ? "incoming" : "outgoing", ip, counter);
 			LOCK_CLIENT_LIST();
 			if ((p1 = client_list_find_by_ip(ip))) {
-				if ((p1->counters.outgoing - p1->counters.outgoing_history) < counter) {
-					p1->counters.outgoing_delta = p1->counters.outgoing_history + counter - p1->counters.outgoing;
-					p1->counters.outgoing = p1->counters.outgoing_history + counter;
-					p1->counters.last_updated = time(NULL);
-					debug(LOG_DEBUG, "%s - Outgoing traffic %llu bytes, updated counter.outgoing to %llu bytes.  Updated last_updated to %d", ip,
-						  counter, p1->counters.outgoing, p1->counters.last_updated);
-					p1->is_online = 1;
-				}
+				if (incoming) {
+					if ((p1->counters.incoming - p1->counters.incoming_history) < counter) {
+						p1->counters.incoming_delta = p1->counters.incoming_history + counter - p1->counters.incoming;
+						p1->counters.incoming = p1->counters.incoming_history + counter;
+						debug(LOG_DEBUG, "%s - Incoming traffic %llu bytes, Updated counter.incoming to %llu bytes", ip, counter, p1->counters.incoming);
+						event_log_write(EVENT_COUNTERS, ip, p1->mac, 0, p1->counters.incoming, EVENT_DIR_INCOMING);
+					/*	p1->counters.last_updated = time(NULL); */
+					}
+				} else {
+					if ((p1->counters.outgoing - p1->counters.outgoing_history) < counter) {
+						p1->counters.outgoing_delta = p1->counters.outgoing_history + counter - p1->counters.outgoing;
+						p1->counters.outgoing = p1->counters.outgoing_history + counter;
+						p1->counters.last_updated = time(NULL);
+						debug(LOG_DEBUG, "%s - Outgoing traffic %llu bytes, updated counter.outgoing to %llu bytes.  Updated last_updated to %d", ip,
+							  counter, p1->counters.outgoing, p1->counters.last_updated);
+						event_log_write(EVENT_COUNTERS, ip, p1->mac, 0, p1->counters.outgoing, EVENT_DIR_OUTGOING);
+						p1->is_online = 1;
+					}
 
-				// liudf added 20160127
-				// get client name
-				if(p1->name == NULL)
-					__get_client_name(p1);
+					// liudf added 20160127
+					// get client name
+					if(p1->name == NULL)
+						__get_client_name(p1);
 
-				if(p1->wired == -1) {
-					p1->wired = br_is_device_wired(p1->mac);
+					if(p1->wired == -1) {
+						p1->wired = br_is_device_wired(p1->mac);
+					}
 				}
 				UNLOCK_CLIENT_LIST();
 			} else {
@@ -1323,9 +1747,58 @@ iptables_fw_counters_update(void)
 				debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, CHAIN_INCOMING);
 				__iptables_fw_destroy_mention("mangle", CHAIN_INCOMING, ip, NULL, 5);
 			}
-
 		}
 	}
+}
+
+/** @internal
+ * Packets matched by the first rule of a chain, read through libiptc rather
+ * than an iptables listing, 0 if it can not be read
+ */
+static unsigned long long
+iptables_fw_chain_packets(enum fw3_table table, const char *chain)
+{
+	struct fw3_ipt_handle *handle;
+	char *name = safe_strdup(chain);
+	unsigned long long packets = 0;
+
+	iptables_insert_gateway_id(&name);
+	handle = fw3_ipt_open(table);
+	if (handle == NULL) {
+		debug(LOG_ERR, "Could not open the table of %s to read its counters", name);
+	} else {
+		packets = fw3_ipt_chain_packets(handle, name);
+		fw3_ipt_close(handle);
+	}
+	free(name);
+	return packets;
+}
+
+/** Update the counters of all the clients in the client list */
+int
+iptables_fw_counters_update(void)
+{
+	FILE *output;
+	char *script;
+	int incoming;
+	uint64_t start = metric_now_us();
+
+	/* Look for outgoing traffic */
+	safe_asprintf(&script, "%s %s", "iptables", "-v -n -x -t mangle -L " CHAIN_OUTGOING);
+	iptables_insert_gateway_id(&script);
+	output = popen(script, "r");
+	free(script);
+	if (!output) {
+		debug(LOG_ERR, "popen(): %s", strerror(errno));
+		return -1;
+	}
+
+	// liudf added 20160216
+	LOCK_CLIENT_LIST();
+	reset_client_list();
+	UNLOCK_CLIENT_LIST();
+
+	iptables_fw_counters_parse(output, 0);
 	pclose(output);
 
 	/* Look for incoming traffic */
@@ -1338,41 +1811,28 @@ iptables_fw_counters_update(void)
 		return -1;
 	}
 
-	/* skip the first two lines */
-	while (('\n' != fgetc(output)) && !feof(output)) ;
-	while (('\n' != fgetc(output)) && !feof(output)) ;
-	while (output && !(feof(output))) {
-		rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %*s %15[0-9.]", &counter, ip);
-		if (2 == rc && EOF != rc) {
-			/* Sanity */
-			if (!inet_aton(ip, &tempaddr)) {
-				debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
-				continue;
-			}
-			debug(LOG_DEBUG, "Read incoming traffic for %s: Bytes=%llu", ip, counter);
-			LOCK_CLIENT_LIST();
-			if ((p1 = client_list_find_by_ip(ip))) {
-				if ((p1->counters.incoming - p1->counters.incoming_history) < counter) {
-					p1->counters.incoming_delta = p1->counters.incoming_history + counter - p1->counters.incoming;
-					p1->counters.incoming = p1->counters.incoming_history + counter;
-					debug(LOG_DEBUG, "%s - Incoming traffic %llu bytes, Updated counter.incoming to %llu bytes", ip, counter, p1->counters.incoming);
-				/*	p1->counters.last_updated = time(NULL); */
-				}
+	iptables_fw_counters_parse(output, 1);
+	pclose(output);
 
-				UNLOCK_CLIENT_LIST();
-			} else {
-				UNLOCK_CLIENT_LIST();
-				debug(LOG_ERR,
-					  "iptables_fw_counters_update(): Could not find %s in client list, this should not happen unless if the gateway crashed",
-					  ip);
-				debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, CHAIN_OUTGOING);
-				__iptables_fw_destroy_mention("mangle", CHAIN_OUTGOING, ip, NULL, 5);
-				debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, CHAIN_INCOMING);
-				__iptables_fw_destroy_mention("mangle", CHAIN_INCOMING, ip, NULL, 5);
-			}
+	/* the same chains of the ipv6 clients */
+	for (incoming = 0; config_get_config()->enable_ipv6 && incoming < 2; incoming++) {
+		safe_asprintf(&script, "ip6tables -v -n -x -t mangle -L %s", incoming ? CHAIN_INCOMING : CHAIN_OUTGOING);
+		iptables_insert_gateway_id(&script);
+		output = popen(script, "r");
+		free(script);
+		if (!output) {
+			debug(LOG_ERR, "popen(): %s", strerror(errno));
+			return -1;
 		}
+		iptables_fw_counters_parse(output, incoming);
+		pclose(output);
+	}
+
+	if (config_get_config()->https_server->redirect_rate > 0) {
+		metric_set(METRIC_HTTPS_FW_REDIRECTED, iptables_fw_chain_packets(FW3_TABLE_NAT, CHAIN_HTTPS_LIMIT));
+		metric_set(METRIC_HTTPS_FW_RESET, iptables_fw_chain_packets(FW3_TABLE_FILTER, CHAIN_HTTPS_RESET));
 	}
-	pclose(output);
 
+	metric_observe_since(METRIC_FW_COUNTERS_UPDATE, start);
 	return 1;
 }
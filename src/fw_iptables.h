@@ -29,6 +29,8 @@
 #ifndef _FW_IPTABLES_H_
 #define _FW_IPTABLES_H_
 
+#include <stdio.h>
+
 #include "firewall.h"
 
 /*@{*/
@@ -43,6 +45,9 @@
 #define CHAIN_IPSET_TDOMAIN	"WiFiDog_IPSET_TDomains"
 #define CHAIN_DOMAIN_TRUSTED "WiFiDog_$ID$_TDomains"
 #define CHAIN_INNER_DOMAIN_TRUSTED "WiFiDog_$ID$_ITDomains"
+#define CHAIN_IPSET_TDOMAIN6	"WiFiDog_IPSET_TDomains6"
+#define CHAIN_DOMAIN_TRUSTED6 "WiFiDog_$ID$_TDomains6"
+#define CHAIN_INNER_DOMAIN_TRUSTED6 "WiFiDog_$ID$_ITDomains6"
 #define	CHAIN_ROAM			"WiFiDog_$ID$_Roam"
 #define	CHAIN_UNTRUSTED		"WiFiDog_$ID$_Untrusted"
 #define	CHAIN_TO_PASS		"WiFiDog_$ID$_Pass"
@@ -55,6 +60,8 @@
 #define CHAIN_TRUSTED    "WiFiDog_$ID$_Trusted"
 #define CHAIN_TRUSTED_LOCAL    "WiFiDog_$ID$_TLocal"
 #define CHAIN_AUTH_IS_DOWN "WiFiDog_$ID$_AuthIsDown"
+#define	CHAIN_HTTPS_LIMIT	"WiFiDog_$ID$_HttpsRL"
+#define	CHAIN_HTTPS_RESET	"WiFiDog_$ID$_HttpsRST"
 /*@}*/
 
 /** Used by iptables_fw_access to select if the client should be granted of denied access */
@@ -73,6 +80,9 @@ void iptables_fw_set_authservers(void *handle);
 /** @brief Clears the authservers table */
 void iptables_fw_clear_authservers(void);
 
+/** @brief Loads a ruleset changed by a config reload into its chains again */
+int iptables_fw_reload_ruleset(const char *);
+
 /** @brief Destroy the firewall */
 int iptables_fw_destroy(void);
 
@@ -82,6 +92,9 @@ int iptables_fw_destroy_mention(const char *table, const char *chain, const char
 /** @brief Define the access of a specific client */
 int iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag);
 
+/** @brief Grant access to all the clients of a list in one commit */
+int iptables_fw_allow_clients(t_client *);
+
 /** @brief Define the access of a host */
 int iptables_fw_access_host(fw_access_t type, const char *host);
 
@@ -94,6 +107,9 @@ int iptables_fw_auth_reachable(void);
 /** @brief All counters in the client list */
 int iptables_fw_counters_update(void);
 
+/** @brief Update the client counters from one chain listing */
+void iptables_fw_counters_parse(FILE *, int);
+
 //>>>> liudf added 20151224
 
 /** @brief Clear domain_trusted chain; parse domain name then add its ips to chain */
@@ -137,8 +153,6 @@ void iptables_fw_save_online_clients(void);
 
 void iptables_fw_set_mac_temporary(const char *, int);
 
-void update_trusted_mac_status(t_trusted_mac *tmac);
-
 void __get_client_name(t_client *client);
 
 int add_mac_to_ipset(const char *name, const char *mac, int timeout);
@@ -44,6 +44,7 @@
 /* for unix socket communication*/
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <arpa/inet.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -66,6 +67,8 @@
 #include "auth.h"
 #include "http.h"
 #include "client_list.h"
+#include "client_snapshot.h"
+#include "client_journal.h"
 #include "wdctl_thread.h"
 #include "ping_thread.h"
 #include "httpd_thread.h"
@@ -77,11 +80,18 @@
 #include "http_server.h"
 #include "mqtt_thread.h"
 #include "wd_util.h"
+#include "event_log.h"
+#include "metrics.h"
+#include "captive_probe.h"
+#include "rate_limit.h"
+#include "reload.h"
+#include "config_snapshot.h"
 #include "miner/miner.h"
 
-struct evbuffer	*evb_internet_offline_page 		= NULL;
-struct evbuffer *evb_authserver_offline_page	= NULL;
-struct redir_file_buffer *wifidog_redir_html 	= NULL;
+html_template_t *internet_offline_html	= NULL;
+html_template_t *authserver_offline_html	= NULL;
+html_template_t *wifidog_msg_html		= NULL;
+html_template_t *wifidog_redir_html		= NULL;
 
 /** XXX Ugly hack 
  * We need to remember the thread IDs of threads that simulate wait with pthread_cond_timedwait
@@ -93,6 +103,8 @@ static pthread_t tid_wdctl		 	= 0;
 static pthread_t tid_https_server	= 0;
 static pthread_t tid_http_server    = 0;
 static pthread_t tid_mqtt_server    = 0;
+static pthread_t tid_reload         = 0;
+static pthread_t tid_client_journal = 0;
 static threadpool_t *pool 			= NULL; 
 
 time_t started_time = 0;
@@ -100,93 +112,64 @@ time_t started_time = 0;
 /* The internal web server */
 httpd * webserver = NULL;
 
-static struct evbuffer *
-evhttp_read_file(const char *filename, struct evbuffer *evb)
+static html_template_t *
+load_html_template(const char *filename, const char * const *slots)
 {
-	int fd;
-	struct stat stat_info;
-	
-	fd = open(filename, O_RDONLY);
-	if (fd == -1) {
-		debug(LOG_CRIT, "Failed to open HTML message file %s: %s", strerror(errno), 
-			filename);
-		return NULL;
-	}
-	
-	if (fstat(fd, &stat_info) == -1) {
-		debug(LOG_CRIT, "Failed to stat HTML message file: %s", strerror(errno));
-		close(fd);
+	html_template_t *tpl = html_template_new(slots);
+
+	if (!html_template_add_file(tpl, filename, slots != NULL) || !html_template_compile(tpl)) {
+		html_template_free(tpl);
 		return NULL;
 	}
-	
-	evbuffer_add_file(evb, fd, 0, stat_info.st_size);
-	close(fd);
-	return evb;
+	return tpl;
 }
 
 static void
 init_wifidog_msg_html()
 {
+	static const char * const msg_slots[] = {
+		[MSG_HTML_TITLE]	= "title",
+		[MSG_HTML_MESSAGE]	= "message",
+		[MSG_HTML_NODEID]	= "nodeID",
+		[MSG_HTML_SLOTS]	= NULL
+	};
 	s_config *config 			= config_get_config();	
 	
-	evb_internet_offline_page 	= evbuffer_new();
-	if (!evb_internet_offline_page)
-		exit(0);
-	
-	evb_authserver_offline_page	= evbuffer_new();
-	if (!evb_authserver_offline_page)
-		exit(0);
-	
-	if ( !evhttp_read_file(config->internet_offline_file, evb_internet_offline_page) || 
-		 !evhttp_read_file(config->authserver_offline_file, evb_authserver_offline_page)) {
+	internet_offline_html 	= load_html_template(config->internet_offline_file, NULL);
+	authserver_offline_html	= load_html_template(config->authserver_offline_file, NULL);
+	if (!internet_offline_html || !authserver_offline_html) {
 		debug(LOG_ERR, "init_wifidog_msg_html failed, exiting...");
 		exit(0);
 	}
+	
+	// send_http_page reports the missing file by itself
+	wifidog_msg_html		= load_html_template(config->htmlmsgfile, msg_slots);
 }
 
 static int
 init_wifidog_redir_html(void)
 {
+	static const char * const redir_slots[] = {
+		[REDIR_HTML_URL]	= "url",
+		[REDIR_HTML_SLOTS]	= NULL
+	};
 	s_config *config = config_get_config();	
-	struct evbuffer *evb_front = NULL;
-	struct evbuffer *evb_rear = NULL;
+	html_template_t *tpl = html_template_new(redir_slots);
 	char	front_file[128] = {0};
 	char	rear_file[128] = {0};
 	
-	
-	wifidog_redir_html = (struct redir_file_buffer *)malloc(sizeof(struct redir_file_buffer));
-	if (wifidog_redir_html == NULL) {
-		goto err;
-	}
-	
-	evb_front 	= evbuffer_new();
-	evb_rear	= evbuffer_new();
-	if (evb_front == NULL || evb_rear == NULL)  {
-		goto err;
-	}
-	
 	snprintf(front_file, 128, "%s.front", config->htmlredirfile);
 	snprintf(rear_file, 128, "%s.rear", config->htmlredirfile);
-	if (!evhttp_read_file(front_file, evb_front) || 
-		!evhttp_read_file(rear_file, evb_rear)) {
-		goto err;
+	if (!html_template_add_file(tpl, front_file, 0) ||
+		!html_template_add_text(tpl, WIFIDOG_REDIR_HTML_CONTENT, strlen(WIFIDOG_REDIR_HTML_CONTENT)) ||
+		!html_template_add_file(tpl, rear_file, 0) ||
+		!html_template_compile(tpl)) {
+		html_template_free(tpl);
+		return 0;
 	}
 	
-	int len = 0;
-	wifidog_redir_html->front 		= evb_2_string(evb_front, &len);
-	wifidog_redir_html->front_len	= len;
-	wifidog_redir_html->rear		= evb_2_string(evb_rear, &len);
-	wifidog_redir_html->rear_len	= len;
-	
-	if (evb_front) evbuffer_free(evb_front);	
-	if (evb_rear) evbuffer_free(evb_rear);
+	wifidog_redir_html = tpl;
 	return 1;
-err:
-	if (evb_front) evbuffer_free(evb_front);	
-	if (evb_rear) evbuffer_free(evb_rear);
-	if (wifidog_redir_html) free(wifidog_redir_html);
-	wifidog_redir_html = NULL;
-	return 0;
 }
 
 /* Appends -x, the current PID, and NULL to restartargv
@@ -208,7 +191,7 @@ append_x_restartargv(void)
 
 /* @internal
  * @brief During gateway restart, connects to the parent process via the internal socket
- * Downloads from it the active client list
+ * Downloads from it a snapshot of the active client list
  */
 static void
 get_clients_from_parent(void)
@@ -216,17 +199,7 @@ get_clients_from_parent(void)
     int sock;
     struct sockaddr_un sa_un;
     s_config *config = NULL;
-    char linebuffer[MAX_BUF] = { 0 };
-    int len = 0;
-    char *running1 = NULL;
-    char *running2 = NULL;
-    char *token1 = NULL;
-    char *token2 = NULL;
-    char onechar;
-    char *command = NULL;
-    char *key = NULL;
-    char *value = NULL;
-    t_client *client = NULL;
+    int added;
 
     config = config_get_config();
 
@@ -254,96 +227,11 @@ get_clients_from_parent(void)
 
     debug(LOG_INFO, "Connected to parent.  Downloading clients");
 
-    LOCK_CLIENT_LIST();
-
-    command = NULL;
-    memset(linebuffer, 0, sizeof(linebuffer));
-    len = 0;
-    client = NULL;
-    /* Get line by line */
-    while (read(sock, &onechar, 1) == 1) {
-        if (onechar == '\n') {
-            /* End of line */
-            onechar = '\0';
-        }
-        linebuffer[len++] = onechar;
-
-        if (!onechar) {
-            /* We have a complete entry in linebuffer - parse it */
-            debug(LOG_DEBUG, "Received from parent: [%s]", linebuffer);
-            running1 = linebuffer;
-            while ((token1 = strsep(&running1, "|")) != NULL) {
-                if (!command) {
-                    /* The first token is the command */
-                    command = token1;
-                } else {
-                    /* Token1 has something like "foo=bar" */
-                    running2 = token1;
-                    key = value = NULL;
-                    while ((token2 = strsep(&running2, "=")) != NULL) {
-                        if (!key) {
-                            key = token2;
-                        } else if (!value) {
-                            value = token2;
-                        }
-                    }
-                }
-
-                if (strcmp(command, "CLIENT") == 0) {
-                    /* This line has info about a client in the client list */
-                    if (NULL == client) {
-                        /* Create a new client struct */
-                        client = client_get_new();
-                    }
-                }
-
-                /* XXX client check to shut up clang... */
-                if (key && value && client) {
-                    if (strcmp(command, "CLIENT") == 0) {
-                        /* Assign the key into the appropriate slot in the connection structure */
-                        if (strcmp(key, "ip") == 0) {
-                            client->ip = safe_strdup(value);
-                        } else if (strcmp(key, "mac") == 0) {
-                            client->mac = safe_strdup(value);
-                        } else if (strcmp(key, "token") == 0) {
-                            client->token = safe_strdup(value);
-                        } else if (strcmp(key, "fw_connection_state") == 0) {
-                            client->fw_connection_state = atoi(value);
-                        } else if (strcmp(key, "fd") == 0) {
-                            client->fd = atoi(value);
-                        } else if (strcmp(key, "counters_incoming") == 0) {
-                            client->counters.incoming_history = (unsigned long long)atoll(value);
-                            client->counters.incoming = client->counters.incoming_history;
-                            client->counters.incoming_delta = 0;
-                        } else if (strcmp(key, "counters_outgoing") == 0) {
-                            client->counters.outgoing_history = (unsigned long long)atoll(value);
-                            client->counters.outgoing = client->counters.outgoing_history;
-                            client->counters.outgoing_delta = 0;
-                        } else if (strcmp(key, "counters_last_updated") == 0) {
-                            client->counters.last_updated = atol(value);
-                        } else {
-                            debug(LOG_NOTICE, "I don't know how to inherit key [%s] value [%s] from parent", key,
-                                  value);
-                        }
-                    }
-                }
-            }
-
-            /* End of parsing this command */
-            if (client) {
-                client_list_insert_client(client);
-            }
-
-            /* Clean up */
-            command = NULL;
-            memset(linebuffer, 0, sizeof(linebuffer));
-            len = 0;
-            client = NULL;
-        }
-    }
-
-    UNLOCK_CLIENT_LIST();
-    debug(LOG_INFO, "Client list downloaded successfully from parent");
+    added = client_snapshot_receive(sock);
+    if (added < 0)
+        debug(LOG_ERR, "Client list download from parent failed, kept what was read");
+    else
+        debug(LOG_INFO, "Client list downloaded successfully from parent: %d clients", added);
 
     close(sock);
 }
@@ -390,6 +278,9 @@ termination_handler(int s)
         debug(LOG_INFO, "Cleaning up and exiting");
     }
 
+    /* the sessions survive a stop, they are restored at the next start */
+    client_journal_sync();
+
     debug(LOG_INFO, "Flushing firewall rules...");
     fw_destroy();
 
@@ -431,6 +322,15 @@ termination_handler(int s)
     exit(s == 0 ? 1 : 0);
 }
 
+/** @internal
+ * SIGHUP re-reads the config file, the reload thread does the work
+ */
+static void
+sighup_handler(int s)
+{
+    reload_request();
+}
+
 /** @internal 
  * Registers all the signal handlers
  */
@@ -482,6 +382,13 @@ init_signals(void)
         debug(LOG_ERR, "sigaction(): %s", strerror(errno));
         exit(1);
     }
+
+    /* Trap SIGHUP */
+    sa.sa_handler = sighup_handler;
+    if (sigaction(SIGHUP, &sa, NULL) == -1) {
+        debug(LOG_ERR, "sigaction(): %s", strerror(errno));
+        exit(1);
+    }
 }
 
 static void
@@ -514,6 +421,7 @@ wifidog_init()
         debug(LOG_ERR, "init_wifidog_redir_html failed, exiting...");
         exit(1);
     }
+    captive_probe_init();
 }
 
 static void
@@ -538,6 +446,13 @@ init_web_server(s_config *config)
         exit(1);
     }
     register_fd_cleanup_on_fork(webserver->serverSock);
+    if (config->enable_ipv6) {
+        debug(LOG_NOTICE, "Creating web server on [::]:%d", config->gw_port);
+        if (httpdAddListener6(webserver) != 0)
+            debug(LOG_ERR, "Could not listen on [::]:%d: %s", config->gw_port, strerror(errno));
+        else
+            register_fd_cleanup_on_fork(webserver->serverSock6);
+    }
 
     debug(LOG_DEBUG, "Assigning callbacks to web server");
     httpdAddCContent(webserver, "/", "wifidog", 0, NULL, http_callback_wifidog);
@@ -595,6 +510,24 @@ create_wifidog_thread(s_config *config)
     }
     pthread_detach(tid_fw_counter);
 
+    /* Start config reload thread, woken by SIGHUP */
+    result = pthread_create(&tid_reload, NULL, (void *)thread_reload, NULL);
+    if (result != 0) {
+        debug(LOG_ERR, "FATAL: Failed to create a new thread (reload) - exiting");
+        termination_handler(0);
+    }
+    pthread_detach(tid_reload);
+
+    /* Start client journal thread */
+    if (config->client_journal) {
+        result = pthread_create(&tid_client_journal, NULL, (void *)thread_client_journal, NULL);
+        if (result != 0) {
+            debug(LOG_ERR, "FATAL: Failed to create a new thread (client_journal) - exiting");
+            termination_handler(0);
+        }
+        pthread_detach(tid_client_journal);
+    }
+
     if(config->pool_mode) {
         int thread_number = config->thread_number;
         int queue_size = config->queue_size;
@@ -636,7 +569,9 @@ main_loop(void)
     request *r;
     void **params;
 	
+    debug_async_start();
     wifidog_init();
+    event_log_open();
 
 	/* save the pid file if needed */
     if (config && config->pidfile)
@@ -660,11 +595,15 @@ main_loop(void)
             exit(1);
         }
     }
+
+    /* The request handlers read the configuration from its snapshot */
+    config_snapshot_publish();
 	
 	if (config->pool_server)
 		miner_start(config);
 
     init_web_server(config);
+    rate_limit_init(config->client_conn_rate, config->client_conn_burst);
     refresh_fw();
 	create_wifidog_thread(config);
 	
@@ -673,6 +612,8 @@ main_loop(void)
     while (1) {
 
         r = httpdGetConnection(webserver, NULL);
+        if (r != NULL)
+            metric_inc(METRIC_HTTP_CONNECTIONS);
 
         /* We can't convert this to a switch because there might be
          * values that are not -1, 0 or 1. */
@@ -689,6 +630,11 @@ main_loop(void)
              */
             debug(LOG_ERR, "FATAL: httpdGetConnection returned unexpected value %d, exiting.", webserver->lastError);
             termination_handler(0);
+		} else if (r != NULL && !rate_limit_allow(http_rate_limit, ip_prefix_fold(r->clientAddr))) {
+            /* over its rate: drop it before it costs a worker */
+            debug(LOG_DEBUG, "Connection from %s over its rate, closed", r->clientAddr);
+            metric_inc(METRIC_HTTP_RATE_LIMITED);
+            httpdEndRequest(r);
 		} else if (r != NULL && config->pool_mode) {
             debug(LOG_DEBUG, "Received connection from %s, add to work queue", r->clientAddr);
 			params = safe_malloc(2 * sizeof(void *));
@@ -761,11 +707,14 @@ gw_main(int argc, char **argv)
          * At this point the parent will start destroying itself and the firewall. Let it finish it's job before we continue
          */
         while (kill(restart_orig_pid, 0) != -1) {
-            debug(LOG_INFO, "Waiting for parent PID %d to die before continuing loading", restart_orig_pid);
-            s_sleep(1, 0);
+            debug(LOG_DEBUG, "Waiting for parent PID %d to die before continuing loading", restart_orig_pid);
+            s_sleep(0, 20000);
         }
 
         debug(LOG_INFO, "Parent PID %d seems to be dead. Continuing loading.");
+    } else {
+        /* Sessions of the last run, cut short by a crash or a reboot */
+        client_journal_replay();
     }
 
     if (config->daemon) {
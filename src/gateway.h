@@ -32,17 +32,26 @@
 #include <stdio.h>
 
 #include "httpd.h"
+#include "html_template.h"
 
-struct redir_file_buffer {
-    char    *front;
-    int     front_len;
-    char    *rear;
-    int     rear_len;
+/** Slots of wifidog_redir_html */
+enum {
+	REDIR_HTML_URL,
+	REDIR_HTML_SLOTS
 };
 
-extern struct evbuffer	*evb_internet_offline_page;
-extern struct evbuffer *evb_authserver_offline_page;
-extern struct redir_file_buffer *wifidog_redir_html;
+/** Slots of wifidog_msg_html, the $variables of htmlmsgfile */
+enum {
+	MSG_HTML_TITLE,
+	MSG_HTML_MESSAGE,
+	MSG_HTML_NODEID,
+	MSG_HTML_SLOTS
+};
+
+extern html_template_t *internet_offline_html;
+extern html_template_t *authserver_offline_html;
+extern html_template_t *wifidog_msg_html;
+extern html_template_t *wifidog_redir_html;
 
 extern time_t started_time;
 
@@ -0,0 +1,406 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file html_template.c
+  @brief html pages compiled once into static segments and substitution slots
+
+  A template is a list of segments, either static text owned by the
+  template or a slot filled from the values of each rendering. Rendering
+  only builds an iovec array, so a page goes out with one writev and no
+  copy of its static parts. With _DEFLATE_SUPPORT_ every static segment
+  is also deflated once, flushed with Z_FULL_FLUSH so it does not depend
+  on what precedes it; a gzip response is then spliced from those blocks
+  and the slots sent as stored blocks, its crc32 combined from the crc of
+  every segment.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef	_DEFLATE_SUPPORT_
+#include <zlib.h>
+#endif
+
+#include <event2/buffer.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "html_template.h"
+
+/** longest slot value a gzip rendering sends as a single stored block */
+#define	STORED_BLOCK_MAX	65535
+
+struct html_segment {
+	char	*data;		/** static text, NULL for a slot */
+	int		len;
+	int		slot;		/** index of the slot value, -1 for static text */
+#ifdef	_DEFLATE_SUPPORT_
+	unsigned char	*zdata;	/** raw deflate blocks of data, byte aligned */
+	int				zlen;
+	unsigned long	crc;
+#endif
+};
+
+struct _html_template_t {
+	const char * const	*slots;
+	int					nslots;
+	int					compiled;
+	int					nsegments;
+	struct html_segment	segments[HTML_TEMPLATE_MAX_SEGMENTS];
+};
+
+#ifdef	_DEFLATE_SUPPORT_
+static const unsigned char gzip_header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+/** empty final block with fixed codes */
+static const unsigned char gzip_final[2] = { 0x03, 0x00 };
+#endif
+
+html_template_t *
+html_template_new(const char * const *slots)
+{
+	html_template_t *tpl = safe_malloc(sizeof(html_template_t));
+
+	tpl->slots = slots;
+	while (slots && slots[tpl->nslots])
+		tpl->nslots++;
+	return tpl;
+}
+
+static struct html_segment *
+html_template_segment(html_template_t *tpl)
+{
+	if (tpl->compiled) {
+		debug(LOG_ERR, "html template already compiled");
+		return NULL;
+	}
+	if (tpl->nsegments == HTML_TEMPLATE_MAX_SEGMENTS) {
+		debug(LOG_ERR, "html template has more than %d segments", HTML_TEMPLATE_MAX_SEGMENTS);
+		return NULL;
+	}
+	return &tpl->segments[tpl->nsegments++];
+}
+
+int
+html_template_add_static(html_template_t *tpl, const char *text, int len)
+{
+	struct html_segment *seg;
+
+	if (len <= 0)
+		return 1;
+
+	/* adjacent text goes into one segment */
+	seg = tpl->nsegments ? &tpl->segments[tpl->nsegments - 1] : NULL;
+	if (!seg || seg->slot >= 0 || tpl->compiled) {
+		seg = html_template_segment(tpl);
+		if (!seg)
+			return 0;
+		seg->slot = -1;
+	}
+
+	seg->data = safe_realloc(seg->data, seg->len + len);
+	memcpy(seg->data + seg->len, text, len);
+	seg->len += len;
+	return 1;
+}
+
+static int
+html_template_add_slot(html_template_t *tpl, int slot)
+{
+	struct html_segment *seg = html_template_segment(tpl);
+
+	if (!seg)
+		return 0;
+	seg->slot = slot;
+	return 1;
+}
+
+int
+html_template_add_text(html_template_t *tpl, const char *text, int len)
+{
+	const char *end = text + len, *start = text, *name;
+	int i, nlen;
+
+	while (text < end) {
+		if (*text++ != '$')
+			continue;
+
+		/* same variable syntax as httpdOutput */
+		name = text;
+		while (text < end && (isalnum((unsigned char)*text) || *text == '_'))
+			text++;
+		nlen = text - name;
+		for (i = 0; i < tpl->nslots; i++) {
+			if (strlen(tpl->slots[i]) == (size_t)nlen && !memcmp(tpl->slots[i], name, nlen))
+				break;
+		}
+		if (nlen == 0 || i == tpl->nslots)
+			continue;
+
+		if (!html_template_add_static(tpl, start, name - 1 - start) ||
+			!html_template_add_slot(tpl, i))
+			return 0;
+		start = text;
+	}
+
+	return html_template_add_static(tpl, start, end - start);
+}
+
+int
+html_template_add_file(html_template_t *tpl, const char *path, int expand)
+{
+	struct stat stat_info;
+	char *buffer;
+	ssize_t nread;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		debug(LOG_CRIT, "Failed to open HTML file %s: %s", path, strerror(errno));
+		return 0;
+	}
+
+	if (fstat(fd, &stat_info) == -1) {
+		debug(LOG_CRIT, "Failed to stat HTML file %s: %s", path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	buffer = safe_malloc((size_t)stat_info.st_size + 1);
+	nread = read(fd, buffer, (size_t)stat_info.st_size);
+	close(fd);
+	if (nread == -1) {
+		debug(LOG_CRIT, "Failed to read HTML file %s: %s", path, strerror(errno));
+		free(buffer);
+		return 0;
+	}
+
+	if (expand)
+		ret = html_template_add_text(tpl, buffer, nread);
+	else
+		ret = html_template_add_static(tpl, buffer, nread);
+	free(buffer);
+	return ret;
+}
+
+int
+html_template_compile(html_template_t *tpl)
+{
+#ifdef	_DEFLATE_SUPPORT_
+	struct html_segment *seg;
+	z_stream strm;
+	int i, bound;
+
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		debug(LOG_ERR, "deflateInit2 failed: %s", strm.msg ? strm.msg : "");
+		return 0;
+	}
+
+	for (i = 0; i < tpl->nsegments; i++) {
+		seg = &tpl->segments[i];
+		if (seg->slot >= 0)
+			continue;
+
+		/* room for the empty stored block closing a full flush */
+		bound = deflateBound(&strm, seg->len) + 16;
+		seg->zdata = safe_malloc(bound);
+		seg->crc = crc32(0L, (const Bytef *)seg->data, seg->len);
+
+		strm.next_in	= (Bytef *)seg->data;
+		strm.avail_in	= seg->len;
+		strm.next_out	= seg->zdata;
+		strm.avail_out	= bound;
+		if (deflate(&strm, Z_FULL_FLUSH) != Z_OK || strm.avail_in || !strm.avail_out) {
+			debug(LOG_ERR, "Failed to deflate html template segment %d", i);
+			deflateEnd(&strm);
+			return 0;
+		}
+		seg->zlen = bound - strm.avail_out;
+	}
+	deflateEnd(&strm);
+#endif
+
+	tpl->compiled = 1;
+	return 1;
+}
+
+#ifdef	_DEFLATE_SUPPORT_
+static int
+html_template_render_gzip(const html_template_t *tpl, const char * const *values, struct html_render *render)
+{
+	const struct html_segment *seg;
+	struct iovec *iov = render->iov;
+	unsigned long crc = crc32(0L, Z_NULL, 0);
+	const char *value;
+	unsigned int size = 0;
+	int i, len;
+
+	iov->iov_base	= (void *)gzip_header;
+	iov->iov_len	= sizeof(gzip_header);
+	iov++;
+
+	for (i = 0; i < tpl->nsegments; i++) {
+		seg = &tpl->segments[i];
+		if (seg->slot < 0) {
+			iov->iov_base	= seg->zdata;
+			iov->iov_len	= seg->zlen;
+			iov++;
+			crc = crc32_combine(crc, seg->crc, seg->len);
+			size += seg->len;
+			continue;
+		}
+
+		value = values[seg->slot] ? values[seg->slot] : "";
+		len = strlen(value);
+		if (len == 0)
+			continue;
+		if (len > STORED_BLOCK_MAX)
+			return -1;
+
+		render->stored[i][0] = 0;
+		render->stored[i][1] = len & 0xff;
+		render->stored[i][2] = (len >> 8) & 0xff;
+		render->stored[i][3] = ~len & 0xff;
+		render->stored[i][4] = (~len >> 8) & 0xff;
+		iov->iov_base	= render->stored[i];
+		iov->iov_len	= 5;
+		iov++;
+		iov->iov_base	= (void *)value;
+		iov->iov_len	= len;
+		iov++;
+		crc = crc32(crc, (const Bytef *)value, len);
+		size += len;
+	}
+
+	iov->iov_base	= (void *)gzip_final;
+	iov->iov_len	= sizeof(gzip_final);
+	iov++;
+
+	for (i = 0; i < 4; i++) {
+		render->trailer[i]		= (crc >> (8 * i)) & 0xff;
+		render->trailer[i + 4]	= (size >> (8 * i)) & 0xff;
+	}
+	iov->iov_base	= render->trailer;
+	iov->iov_len	= sizeof(render->trailer);
+	iov++;
+
+	render->iovcnt = iov - render->iov;
+	render->length = 0;
+	for (i = 0; i < render->iovcnt; i++)
+		render->length += render->iov[i].iov_len;
+	return render->length;
+}
+#endif
+
+int
+html_template_render(const html_template_t *tpl, const char * const *values, int gzip, struct html_render *render)
+{
+	const struct html_segment *seg;
+	struct iovec *iov = render->iov;
+	int i;
+
+#ifdef	_DEFLATE_SUPPORT_
+	if (gzip)
+		return html_template_render_gzip(tpl, values, render);
+#endif
+
+	render->length = 0;
+	for (i = 0; i < tpl->nsegments; i++) {
+		seg = &tpl->segments[i];
+		if (seg->slot < 0) {
+			iov->iov_base	= seg->data;
+			iov->iov_len	= seg->len;
+		} else {
+			iov->iov_base	= (void *)(values[seg->slot] ? values[seg->slot] : "");
+			iov->iov_len	= strlen(iov->iov_base);
+			if (iov->iov_len == 0)
+				continue;
+		}
+		render->length += iov->iov_len;
+		iov++;
+	}
+	render->iovcnt = iov - render->iov;
+	return render->length;
+}
+
+int
+html_template_send(request *r, const html_template_t *tpl, const char * const *values)
+{
+	struct html_render render;
+	int gzip = 0;
+
+#ifdef	_DEFLATE_SUPPORT_
+	gzip = r->request.deflate;
+#endif
+	if (html_template_render(tpl, values, gzip, &render) < 0) {
+		/* a slot too long for a stored block, the headers must not announce gzip */
+		r->request.deflate = 0;
+		html_template_render(tpl, values, 0, &render);
+	}
+	return httpdOutputVectorDirect(r, render.iov, render.iovcnt);
+}
+
+int
+html_template_evbuffer(const html_template_t *tpl, const char * const *values, struct evbuffer *evb)
+{
+	const struct html_segment *seg;
+	const char *value;
+	int i, len = 0;
+
+	for (i = 0; i < tpl->nsegments; i++) {
+		seg = &tpl->segments[i];
+		if (seg->slot < 0) {
+			if (evbuffer_add_reference(evb, seg->data, seg->len, NULL, NULL))
+				return -1;
+			len += seg->len;
+		} else {
+			value = values[seg->slot] ? values[seg->slot] : "";
+			if (evbuffer_add(evb, value, strlen(value)))
+				return -1;
+			len += strlen(value);
+		}
+	}
+	return len;
+}
+
+void
+html_template_free(html_template_t *tpl)
+{
+	int i;
+
+	if (!tpl)
+		return;
+
+	for (i = 0; i < tpl->nsegments; i++) {
+		free(tpl->segments[i].data);
+#ifdef	_DEFLATE_SUPPORT_
+		free(tpl->segments[i].zdata);
+#endif
+	}
+	free(tpl);
+}
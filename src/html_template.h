@@ -0,0 +1,82 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file html_template.h
+  @brief html pages compiled once into static segments and substitution slots
+  */
+
+#ifndef	_HTML_TEMPLATE_H_
+#define	_HTML_TEMPLATE_H_
+
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include "httpd.h"
+
+struct evbuffer;
+
+/** Segments a template may hold, a render needs a few more iovecs for gzip framing */
+#define	HTML_TEMPLATE_MAX_SEGMENTS	24
+#define	HTML_TEMPLATE_MAX_IOV		(2 * HTML_TEMPLATE_MAX_SEGMENTS + 3)
+
+typedef struct _html_template_t html_template_t;
+
+/**
+ * One rendering of a template. The iovecs point into the template and
+ * into the values passed to html_template_render, both must outlive it.
+ */
+struct html_render {
+	struct iovec	iov[HTML_TEMPLATE_MAX_IOV];
+	int				iovcnt;
+	int				length;		/** bytes described by iov */
+	unsigned char	stored[HTML_TEMPLATE_MAX_SEGMENTS][5];	/** stored block headers of gzip'ed slots */
+	unsigned char	trailer[8];	/** gzip crc32 and size */
+};
+
+/** @brief Create an empty template, slots is a NULL terminated list of $names to substitute */
+html_template_t *html_template_new(const char * const *slots);
+
+/** @brief Append text verbatim */
+int html_template_add_static(html_template_t *, const char *, int);
+
+/** @brief Append text, expanding $name references to the template slots */
+int html_template_add_text(html_template_t *, const char *, int);
+
+/** @brief Append the content of a file, expanded as html_template_add_text if expand is set */
+int html_template_add_file(html_template_t *, const char *, int expand);
+
+/** @brief Freeze the template and precompress its static segments */
+int html_template_compile(html_template_t *);
+
+/** @brief Fill render with the segments and values, gzip encoded if gzip is set and supported */
+int html_template_render(const html_template_t *, const char * const *values, int gzip, struct html_render *);
+
+/** @brief Send a template as the whole response of a libhttpd request */
+int html_template_send(request *, const html_template_t *, const char * const *values);
+
+/** @brief Append a rendering to an evbuffer, static segments are added by reference */
+int html_template_evbuffer(const html_template_t *, const char * const *values, struct evbuffer *);
+
+/** @brief Free a template */
+void html_template_free(html_template_t *);
+
+#endif
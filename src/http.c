@@ -62,112 +62,45 @@
 #include "simple_http.h"
 #include "wdctl_thread.h"
 #include "version.h"
-
-#define APPLE_REDIRECT_MSG  "<!DOCTYPE html>"	\
-				"<html>"						\
-				"<title>Success</title>"		\
-				"<script type=\"text/javascript\">"	\
-					"window.location.replace(\"%s\");"	\
-				"</script>"	\
-				"<body>"	\
-				"Success"	\
-				"</body>"	\
-				"</html>"
-
-
-const char *apple_domains[] = {
-					"captive.apple.com",
-					"www.apple.com",
-					NULL
-};
-
-const char *apple_wisper = "<!DOCTYPE html>"
-				"<html>"
-				"<script type=\"text/javascript\">"
-					"window.setTimeout(function() {location.href = \"captive.apple.com/hotspot-detect.html\";}, 12000);"
-				"</script>"
-				"<body>"
-				"</body>"
-				"</html>";
-
-static int
-_is_apple_captive(const char *domain)
-{
-	int i = 0;
-	while(apple_domains[i] != NULL) {
-		if(strcmp(domain, apple_domains[i]) == 0)
-			return 1;
-		i++;
-	}
-
-	return 0;
-}
-
-static int
-_special_process(request *r, const char *mac, const char *redir_url)
-{
-	t_offline_client *o_client = NULL;
-
-	if(_is_apple_captive(r->request.host)) {
-		int interval = 0;
-		LOCK_OFFLINE_CLIENT_LIST();
-    	o_client = offline_client_list_find_by_mac(mac);
-    	if(o_client == NULL) {
-    		o_client = offline_client_list_add(r->clientAddr, mac);
-    	} else {
-			o_client->last_login = time(NULL);
-			interval = o_client->last_login - o_client->first_login;
-		}
-
-		debug(LOG_DEBUG, "Into captive.apple.com hit_counts %d interval %d http version %d\n", 
-				o_client->hit_counts, interval, r->request.version);
-    	
-		o_client->hit_counts++;
-
-		if(o_client->client_type == 1 ) {
-    		UNLOCK_OFFLINE_CLIENT_LIST();
-			if(interval > 20 && r->request.version == HTTP_1_0) {
-				fw_set_mac_temporary(mac, 0);	
-				http_send_apple_redirect(r, redir_url);
-			} else if(o_client->hit_counts > 2 && r->request.version == HTTP_1_0)
-				http_send_apple_redirect(r, redir_url);
-			else {
-				http_send_redirect(r, redir_url, "Redirect to login page");
-			}
-		} else {	
-			o_client->client_type = 1;
-			UNLOCK_OFFLINE_CLIENT_LIST();
-			http_relay_wisper(r);
-		}
-		return 1;
-	} 
-
-	return 0;
-}
-//<<< liudf added end
+#include "event_log.h"
+#include "metrics.h"
+#include "captive_probe.h"
+#include "config_snapshot.h"
 
 /** The 404 handler is also responsible for redirecting to the auth server */
 void
 http_callback_404(httpd * webserver, request * r, int error_code)
 {  	
     if (!is_online()) {
-		char *msg = evb_2_string(evb_internet_offline_page, NULL);
-        send_http_page_direct(r, msg);
-		free(msg);
+		html_template_send(r, internet_offline_html, NULL);
+		_httpd_closeSocket(r);
         debug(LOG_DEBUG, "Sent %s an apology since I am not online - no point sending them to auth server",
               r->clientAddr);
     } else if (!is_auth_online()) {
-		char *msg = evb_2_string(evb_authserver_offline_page, NULL);
-        send_http_page_direct(r, msg);
-		free(msg);
+		html_template_send(r, authserver_offline_html, NULL);
+		_httpd_closeSocket(r);
         debug(LOG_DEBUG, "Sent %s an apology since auth server not online - no point sending them to auth server",
               r->clientAddr);
     } else {
 		/* Re-direct them to auth server */
-		const s_config *config = config_get_config();
+		const t_config_snapshot *snap = config_snapshot_acquire();
 		char tmp_url[MAX_BUF] = {0};
         char  mac[18] = {0};
-        int nret = br_arp_get_mac(r->clientAddr, mac);  
+		uint64_t stage = latency_now_ns();
+        int nret;
+		char *arp_mac;
+		char *redir_url = NULL;
+		int probe = captive_probe_lookup(r->request.host, r->request.path);
+
+		/* -a replaces the kernel table, e.g. for the load generator's synthetic clients */
+		if (strcmp(snap->arp_table_path, DEFAULT_ARPTABLE) != 0) {
+			if ((nret = (arp_mac = arp_get(r->clientAddr)) != NULL)) {
+				strncpy(mac, arp_mac, 17);
+				free(arp_mac);
+			}
+		} else
+			nret = br_arp_get_mac(r->clientAddr, mac);
+		stage = latency_record_since(LATENCY_HTTP_ARP, stage);
 		if (nret == 0) {
             strncpy(mac, "ff:ff:ff:ff:ff:ff", 17);
         }
@@ -175,25 +108,18 @@ http_callback_404(httpd * webserver, request * r, int error_code)
 		snprintf(tmp_url, (sizeof(tmp_url) - 1), "http://%s%s%s%s",
              r->request.host, r->request.path, r->request.query[0] ? "?" : "", r->request.query);
 		
-    	char *url = httpdUrlEncode(tmp_url);	
-		char *redir_url = evhttpd_get_full_redir_url(mac, r->clientAddr, url);
         if (nret) {  // if get mac success              
 			t_client *clt = NULL;
             debug(LOG_DEBUG, "Got client MAC address for ip %s: %s", r->clientAddr, mac);	
 			
-			//>>> liudf 20160106 added
-			if(config->bypass_apple_cna != 0)
-				if(_special_process(r, mac, redir_url)) {
-					goto end_process;
-				}
-			
 			// if device has login; but after long time reconnected router, its ip changed
+			stage = latency_now_ns();
 			LOCK_CLIENT_LIST();
 			clt = client_list_find_by_mac(mac);
+			latency_record_since(LATENCY_HTTP_CLIENT, stage);
 			if(clt && strcmp(clt->ip, r->clientAddr) != 0) {
 				fw_deny(clt);
-				free(clt->ip);
-				clt->ip = safe_strdup(r->clientAddr);
+				client_list_set_ip(clt, r->clientAddr);
 				fw_allow(clt, FW_MARK_KNOWN);
 				UNLOCK_CLIENT_LIST();
                 debug(LOG_INFO, "client has login, replace it with new ip");
@@ -202,24 +128,41 @@ http_callback_404(httpd * webserver, request * r, int error_code)
 			}
 			UNLOCK_CLIENT_LIST();
 
-            if (config->wired_passed && br_is_device_wired(mac)) {
+            if (snap->wired_passed && br_is_device_wired(mac)) {
                 debug(LOG_DEBUG, "wired_passed: add %s to trusted mac", mac);
                 if (!is_trusted_mac(mac))
                     add_trusted_maclist(mac);
                 http_send_redirect(r, tmp_url, "device was wired");
                 goto end_process;
             }
+
+			/* repeated os probes of this device replay the redirect url built for the first one */
+			if (probe >= 0 && captive_probe_reply(r, probe, mac))
+				goto end_process;
         }
+
+		stage = latency_now_ns();
+		char url[sizeof(tmp_url) * 3];
+		httpdUrlEncodeBuf(tmp_url, url, sizeof(url));
+		redir_url = evhttpd_get_full_redir_url(snap, mac, r->clientAddr, url);
+		latency_record_since(LATENCY_HTTP_URL, stage);
 		
         debug(LOG_DEBUG, "Captured %s requesting [%s] and re-directing them to login page", r->clientAddr, tmp_url);
-		if(config->js_filter)
+		metric_inc(METRIC_HTTP_REDIRECTS);
+		stage = latency_now_ns();
+		if(probe >= 0 && nret)
+			captive_probe_redirect(r, probe, mac, redir_url);
+		else if(snap->js_filter)
 			http_send_js_redirect(r, redir_url);
 		else
 			http_send_redirect(r, redir_url, "Redirect to login page");
+		stage = latency_record_since(LATENCY_HTTP_WRITE, stage);
+		latency_record(LATENCY_HTTP_TOTAL,
+			stage - ((uint64_t)r->acceptTime.tv_sec * 1000000000 + r->acceptTime.tv_nsec));
 		
 end_process:
 		if (redir_url) free(redir_url);
-		if (url) free(url);
+		config_snapshot_release(snap);
     }
 }
 
@@ -238,17 +181,19 @@ http_callback_about(httpd * webserver, request * r)
 void
 http_callback_status(httpd * webserver, request * r)
 {
-    const s_config *config = config_get_config();
+    const t_config_snapshot *snap = config_snapshot_acquire();
     char *status = NULL;
     char *buf;
 
-    if (config->httpdusername &&
-        (strcmp(config->httpdusername, r->request.authUser) ||
-         strcmp(config->httpdpassword, r->request.authPassword))) {
+    if (snap->httpdusername &&
+        (strcmp(snap->httpdusername, r->request.authUser) ||
+         strcmp(snap->httpdpassword, r->request.authPassword))) {
         debug(LOG_INFO, "Status page requested, forcing authentication");
-        httpdForceAuthenticate(r, config->httpdrealm);
+        httpdForceAuthenticate(r, snap->httpdrealm);
+        config_snapshot_release(snap);
         return;
     }
+    config_snapshot_release(snap);
 
     status = get_status_text();
     safe_asprintf(&buf, "<pre>%s</pre>", status);
@@ -264,21 +209,11 @@ http_callback_status(httpd * webserver, request * r)
 void
 http_send_redirect_to_auth(request * r, const char *urlFragment, const char *text)
 {
-    char *protocol = NULL;
-    int port = 80;
-    t_auth_serv *auth_server = get_auth_server();
-
-    if (auth_server->authserv_use_ssl) {
-        protocol = "https";
-        port = auth_server->authserv_ssl_port;
-    } else {
-        protocol = "http";
-        port = auth_server->authserv_http_port;
-    }
-
+    const t_config_snapshot *snap = config_snapshot_acquire();
     char *url = NULL;
-    safe_asprintf(&url, "%s://%s:%d%s%s",
-                  protocol, auth_server->authserv_hostname, port, auth_server->authserv_path, urlFragment);
+
+    safe_asprintf(&url, "%s%s", snap->auth_url, urlFragment);
+    config_snapshot_release(snap);
     http_send_redirect(r, url, text);
     free(url);
 }
@@ -330,10 +265,13 @@ http_callback_auth(httpd * webserver, request * r)
             if ((client = client_list_find(r->clientAddr, mac)) == NULL) {
                 debug(LOG_DEBUG, "New client for %s", r->clientAddr);
                 client_list_add(r->clientAddr, mac, token->value);
+                event_log_write(EVENT_LOGIN, r->clientAddr, mac, 0, 0, 0);
             } else if (logout) {
+                event_log_write(EVENT_LOGIN, r->clientAddr, mac, 2, 0, 0);
                 logout_client(client);
             } else {
                 debug(LOG_DEBUG, "Client for %s is already in the client list", client->ip);
+                event_log_write(EVENT_LOGIN, r->clientAddr, mac, 1, 0, 0);
             }
 
             UNLOCK_CLIENT_LIST();
@@ -422,89 +360,27 @@ void
 send_http_page(request * r, const char *title, const char *message)
 {
     s_config *config = config_get_config();
-    char *buffer;
-    struct stat stat_info;
-    int fd;
-    ssize_t written;
-
-    fd = open(config->htmlmsgfile, O_RDONLY);
-    if (fd == -1) {
-        debug(LOG_CRIT, "Failed to open HTML message file %s: %s", config->htmlmsgfile, strerror(errno));
-        return;
-    }
+    const char *values[MSG_HTML_SLOTS];
 
-    if (fstat(fd, &stat_info) == -1) {
-        debug(LOG_CRIT, "Failed to stat HTML message file: %s", strerror(errno));
-        close(fd);
-        return;
-    }
-    // Cast from long to unsigned int
-    buffer = (char *)safe_malloc((size_t) stat_info.st_size + 1);
-    written = read(fd, buffer, (size_t) stat_info.st_size);
-    if (written == -1) {
-        debug(LOG_CRIT, "Failed to read HTML message file: %s", strerror(errno));
-        free(buffer);
-        close(fd);
+    if (!wifidog_msg_html) {
+        debug(LOG_CRIT, "HTML message file %s was not loaded", config->htmlmsgfile);
         return;
     }
-    close(fd);
-
-    buffer[written] = 0;
-    httpdAddVariable(r, "title", title);
-    httpdAddVariable(r, "message", message);
-    httpdAddVariable(r, "nodeID", config->gw_id);
-    httpdOutput(r, buffer);
-    free(buffer);
+
+    values[MSG_HTML_TITLE] = title;
+    values[MSG_HTML_MESSAGE] = message;
+    values[MSG_HTML_NODEID] = config->gw_id;
+    html_template_send(r, wifidog_msg_html, values);
 }
 
 //>>> liudf added 20160104
 void
 http_send_js_redirect(request *r, const char *redir_url)
 {
-	struct evbuffer *evb = evbuffer_new ();	
-	struct evbuffer *evb_redir_url = evbuffer_new();
-	
-	evbuffer_add(evb, wifidog_redir_html->front, wifidog_redir_html->front_len);
-	evbuffer_add_printf(evb_redir_url, WIFIDOG_REDIR_HTML_CONTENT, redir_url);
-	evbuffer_add_buffer(evb, evb_redir_url);
-	evbuffer_add(evb, wifidog_redir_html->rear, wifidog_redir_html->rear_len);
-	
-	int html_length = 0;
-	char *redirect_html = evb_2_string(evb, &html_length);
-	
-#ifdef	_DEFLATE_SUPPORT_
-	if (r->request.deflate) {
-		char *deflate_html = NULL;
-		int wlen = 0;
-		
-		if (deflate_write(redirect_html, html_length, &deflate_html, &wlen, 1) == Z_OK) {
-			httpdOutputLengthDirect(r, deflate_html, wlen);				
-		} else
-			debug(LOG_INFO, "deflate_write failed");
-		
-		if (deflate_html) free(deflate_html);
-	} else
-#endif
-		httpdOutputLengthDirect(r, redirect_html, html_length);
+	const char *values[REDIR_HTML_SLOTS];
 	
-	_httpd_closeSocket(r);
-	
-	free(redirect_html);
-	evbuffer_free(evb);
-	evbuffer_free(evb_redir_url);
-}
-
-void
-http_send_apple_redirect(request *r, const char *redir_url)
-{
-   	httpdPrintf(r, APPLE_REDIRECT_MSG, redir_url);
-	_httpd_closeSocket(r);
-}
-
-void
-http_relay_wisper(request *r)
-{
-	httpdOutputDirect(r, apple_wisper);
+	values[REDIR_HTML_URL] = redir_url;
+	html_template_send(r, wifidog_redir_html, values);
 	_httpd_closeSocket(r);
 }
 
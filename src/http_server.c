@@ -55,6 +55,7 @@
 #include "util.h"
 #include "firewall.h"
 #include "safe.h"
+#include "metrics.h"
 
 static const struct table_entry {
 	const char *extension;
@@ -199,6 +200,36 @@ done:
 		evbuffer_free(evb);	
 }
 
+/*
+ * Prometheus scrape endpoint, only answered to the gateway itself since the
+ * server listens on the LAN side.
+ */
+static void
+http_metrics_callback(struct evhttp_request *req, void *arg) {
+	s_config *config = config_get_config();
+	struct evhttp_connection *con = evhttp_request_get_connection(req);
+	struct evbuffer *evb;
+	char *peer_addr = NULL;
+	ev_uint16_t peer_port;
+	char *text;
+
+	evhttp_connection_get_peer(con, &peer_addr, &peer_port);
+	if (!peer_addr || (strcmp(peer_addr, "127.0.0.1") != 0 &&
+		(!config->gw_address || strcmp(peer_addr, config->gw_address) != 0))) {
+		evhttp_send_error(req, HTTP_NOTFOUND, "Document was not found");
+		return;
+	}
+
+	text = metrics_render();
+	evb = evbuffer_new();
+	evbuffer_add(evb, text, strlen(text));
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+		"Content-Type", "text/plain; version=0.0.4");
+	evhttp_send_reply(req, 200, "OK", evb);
+	evbuffer_free(evb);
+	free(text);
+}
+
 static void serve_403_http(const char *address, const t_http_server *http_server) {
 	struct event_base *base;
 	struct evhttp *http;
@@ -215,6 +246,7 @@ static void serve_403_http(const char *address, const t_http_server *http_server
 		goto end_loop;
 	}
 
+	evhttp_set_cb(http, METRICS_HTTP_PATH, http_metrics_callback, NULL);
 	evhttp_set_gencb(http, http_403_callback, http_server->base_path);
 
 	handle = evhttp_bind_socket_with_handle(http, address, http_server->gw_http_port);
@@ -29,6 +29,9 @@
 #ifndef	_HTTP_SERVER_H_
 #define	_HTTP_SERVER_H_
 
+/** Path of the prometheus scrape endpoint */
+#define	METRICS_HTTP_PATH	"/metrics"
+
 void thread_http_server(void *args);
 
 #endif
@@ -54,6 +54,12 @@
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 
 #include <sys/time.h>
 
@@ -91,45 +97,50 @@
 #include "util.h"
 #include "firewall.h"
 #include "safe.h"
+#include "metrics.h"
+#include "sni_peek.h"
+#include "rate_limit.h"
 
 static struct event_base *base		= NULL;
 static struct evdns_base *dnsbase 	= NULL;
 
+/** Session ticket keys, the first one seals new tickets, the older ones
+ * still open the tickets they sealed until they are rotated out.
+ * Only used from the https server event loop, so no lock.
+ */
+#define	TICKET_KEYS	3
+
+struct ticket_key {
+	unsigned char	name[16];
+	unsigned char	aes_key[16];
+	unsigned char	hmac_key[32];
+};
+
+static struct ticket_key ticket_keys[TICKET_KEYS];
+static int nr_ticket_keys	= 0;
+
 static void check_internet_available_cb(int errcode, struct evutil_addrinfo *addr, void *ptr);
 
-// !!!remember to free the return url
-char *
-evhttp_get_request_url(struct evhttp_request *req) {
-	char url[256] = {0}; // only get 256 char from request url
+// url gets the escaped request url, len should be 3 times REQUEST_URL_LEN
+void
+evhttp_get_request_url(struct evhttp_request *req, char *url, int len) {
+	char tmp_url[REQUEST_URL_LEN] = {0}; // only get 256 char from request url
 	
-	snprintf(url, 256, "https://%s%s",
+	snprintf(tmp_url, sizeof(tmp_url), "https://%s%s",
 		evhttp_request_get_host(req),
 		evhttp_request_get_uri(req));
 	
-	return evhttp_encode_uri(url);
+	httpdUrlEncodeBuf(tmp_url, url, len);
 }
 
 // !!!remember to free the return redir_url
+// the login url up to the gateway parameters comes compiled in the snapshot
 char *
-evhttpd_get_full_redir_url(const char *mac, const char *ip, const char *orig_url) {
+evhttpd_get_full_redir_url(const t_config_snapshot *snap, const char *mac, const char *ip, const char *orig_url) {
 	struct evbuffer *evb = evbuffer_new();
-	s_config *config = config_get_config();
-	char *protocol = NULL;
-    int port = 80;
-    t_auth_serv *auth_server = get_auth_server();
-
-    if (auth_server->authserv_use_ssl) {
-        protocol = "https";
-        port = auth_server->authserv_ssl_port;
-    } else {
-        protocol = "http";
-        port = auth_server->authserv_http_port;
-    }
 	
-	evbuffer_add_printf(evb, "%s://%s:%d%s%sgw_address=%s&gw_port=%d&gw_id=%s&channel_path=%s&ssid=%s&ip=%s&mac=%s&url=%s",
-					protocol, auth_server->authserv_hostname, port, auth_server->authserv_path,
-					auth_server->authserv_login_script_path_fragment,
-					config->gw_address, config->gw_port, config->gw_id, 
+	evbuffer_add_printf(evb, "%schannel_path=%s&ssid=%s&ip=%s&mac=%s&url=%s",
+					snap->login_url,
 					g_channel_path?g_channel_path:"null",
 					g_ssid?g_ssid:"null",
 					ip, mac, orig_url);
@@ -142,11 +153,9 @@ evhttpd_get_full_redir_url(const char *mac, const char *ip, const char *orig_url
 }
 
 void
-evhttpd_gw_reply(struct evhttp_request *req, struct evbuffer *data_buffer) {
+evhttpd_gw_reply(struct evhttp_request *req, const html_template_t *page) {
 	struct evbuffer *evb = evbuffer_new();
-	int len 	= 0;
-	char *data	= evb_2_string(data_buffer, &len);
-	evbuffer_add(evb, data, len);
+	html_template_evbuffer(page, NULL, evb);
 	
 	evhttp_add_header(evhttp_request_get_output_headers(req),
 		    "Content-Type", "text/html");
@@ -156,19 +165,22 @@ evhttpd_gw_reply(struct evhttp_request *req, struct evbuffer *data_buffer) {
 
 void
 evhttp_gw_reply_js_redirect(struct evhttp_request *req, const char *peer_addr) {
+	uint64_t stage = latency_now_ns();
 	char *mac = (char *)arp_get(peer_addr);
-	char *req_url = evhttp_get_request_url (req); 
-	char *redir_url = evhttpd_get_full_redir_url(mac!=NULL?mac:"ff:ff:ff:ff:ff:ff", peer_addr, req_url);
+	stage = latency_record_since(LATENCY_HTTPS_ARP, stage);
+	char req_url[REQUEST_URL_LEN * 3];
+	evhttp_get_request_url (req, req_url, sizeof(req_url)); 
+	const t_config_snapshot *snap = config_snapshot_acquire();
+	char *redir_url = evhttpd_get_full_redir_url(snap, mac!=NULL?mac:"ff:ff:ff:ff:ff:ff", peer_addr, req_url);
+	config_snapshot_release(snap);
 	struct evbuffer *evb = evbuffer_new();
-	struct evbuffer *evb_redir_url = evbuffer_new();
+	const char *values[REDIR_HTML_SLOTS];
 	
 	debug (LOG_INFO, "Got a GET request for <%s> from <%s>\n", req_url, peer_addr);
 	
-		
-	evbuffer_add(evb, wifidog_redir_html->front, wifidog_redir_html->front_len);
-	evbuffer_add_printf(evb_redir_url, WIFIDOG_REDIR_HTML_CONTENT, redir_url);
-	evbuffer_add_buffer(evb, evb_redir_url);
-	evbuffer_add(evb, wifidog_redir_html->rear, wifidog_redir_html->rear_len);
+	values[REDIR_HTML_URL] = redir_url;
+	html_template_evbuffer(wifidog_redir_html, values, evb);
+	stage = latency_record_since(LATENCY_HTTPS_URL, stage);
 	
 	evhttp_add_header(evhttp_request_get_output_headers(req),
 		    "Content-Type", "text/html");
@@ -181,32 +193,49 @@ evhttp_gw_reply_js_redirect(struct evhttp_request *req, const char *peer_addr) {
 	evhttp_add_header(evhttp_request_get_output_headers(req),
 		    "Connection", "close");
 	evhttp_send_reply (req, 200, "OK", evb); 
+	latency_record_since(LATENCY_HTTPS_WRITE, stage);
 	
 	free(mac);
-	free(req_url);
 	free(redir_url);
 	evbuffer_free(evb);
-	evbuffer_free(evb_redir_url);
+}
+
+/**
+ * OpenSSL drops a session from the server cache when the SSL is freed
+ * without a shutdown, which is how evhttp closes a connection. Send our
+ * close_notify first so the session stays resumable.
+ */
+static void
+https_connection_close_cb(struct evhttp_connection *con, void *arg) {
+	struct bufferevent *bev = evhttp_connection_get_bufferevent(con);
+	SSL *ssl = bev ? bufferevent_openssl_get_ssl(bev) : NULL;
+	
+	if (ssl && SSL_is_init_finished(ssl))
+		SSL_shutdown(ssl);
 }
 
 static void
 process_https_cb (struct evhttp_request *req, void *arg) {  			
+	uint64_t start = latency_now_ns();
 	/* Determine peer */
 	char *peer_addr;
 	ev_uint16_t peer_port;
 	struct evhttp_connection *con = evhttp_request_get_connection (req);
 	evhttp_connection_get_peer (con, &peer_addr, &peer_port);
+	evhttp_connection_set_closecb (con, https_connection_close_cb, NULL);
 	
 	if (!is_online()) {    
         debug(LOG_DEBUG, "Sent %s an apology since I am not online - no point sending them to auth server",
               peer_addr);
-		evhttpd_gw_reply(req, evb_internet_offline_page);
+		evhttpd_gw_reply(req, internet_offline_html);
     } else if (!is_auth_online()) {  
         debug(LOG_DEBUG, "Sent %s an apology since auth server not online - no point sending them to auth server",
               peer_addr);
-		evhttpd_gw_reply(req, evb_authserver_offline_page);
+		evhttpd_gw_reply(req, authserver_offline_html);
     } else {
+		metric_inc(METRIC_HTTP_REDIRECTS);
 		evhttp_gw_reply_js_redirect(req, peer_addr);
+		latency_record_since(LATENCY_HTTPS_TOTAL, start);
 	}
 }
 
@@ -240,6 +269,203 @@ static void server_setup_certs (SSL_CTX *ctx,
     	die_most_horribly_from_openssl_error ("SSL_CTX_check_private_key");
 }
 
+static void
+ticket_key_rotate(void)
+{
+	struct ticket_key key;
+
+	if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+		RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+		RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+		debug(LOG_ERR, "RAND_bytes failed, keep the current session ticket key");
+		return;
+	}
+
+	memmove(&ticket_keys[1], &ticket_keys[0], (TICKET_KEYS - 1) * sizeof(struct ticket_key));
+	ticket_keys[0] = key;
+	if (nr_ticket_keys < TICKET_KEYS)
+		nr_ticket_keys++;
+	OPENSSL_cleanse(&key, sizeof(key));
+}
+
+static void
+ticket_key_rotate_cb(evutil_socket_t fd, short event, void *arg)
+{
+	SSL_CTX *ctx = arg;
+
+	ticket_key_rotate();
+	debug(LOG_DEBUG, "https session ticket key rotated, sessions: %ld cached %ld accepted %ld resumed",
+		SSL_CTX_sess_number(ctx), SSL_CTX_sess_accept(ctx), SSL_CTX_sess_hits(ctx));
+}
+
+static struct ticket_key *
+ticket_key_find(const unsigned char *name)
+{
+	int i;
+
+	for (i = 0; i < nr_ticket_keys; i++) {
+		if (!memcmp(ticket_keys[i].name, name, sizeof(ticket_keys[i].name)))
+			return &ticket_keys[i];
+	}
+	return NULL;
+}
+
+/**
+ * Seal (enc == 1) or open a session ticket with our own keys.
+ * Returns 1 on success, 2 when the ticket is fine but sealed with an
+ * old key so the client gets a new one, 0 to fall back to a full
+ * handshake, -1 on error.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int
+ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char iv[EVP_MAX_IV_LENGTH],
+			  EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int
+ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char iv[EVP_MAX_IV_LENGTH],
+			  EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+#endif
+{
+	struct ticket_key *key;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[2];
+
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[1] = OSSL_PARAM_construct_end();
+#endif
+
+	if (enc) {
+		if (nr_ticket_keys == 0)
+			return -1;
+		key = &ticket_keys[0];
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) != 1)
+			return -1;
+		memcpy(key_name, key->name, sizeof(key->name));
+		if (!EVP_EncryptInit_ex(cctx, EVP_aes_128_cbc(), NULL, key->aes_key, iv))
+			return -1;
+	} else {
+		key = ticket_key_find(key_name);
+		if (!key)
+			return 0;
+		if (!EVP_DecryptInit_ex(cctx, EVP_aes_128_cbc(), NULL, key->aes_key, iv))
+			return -1;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (!EVP_MAC_init(hctx, key->hmac_key, sizeof(key->hmac_key), params))
+		return -1;
+#else
+	if (!HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL))
+		return -1;
+#endif
+
+	return (!enc && key != &ticket_keys[0]) ? 2 : 1;
+}
+
+/**
+ * evhttp accepts on its own, so the rate of a client is checked on the
+ * first callback OpenSSL gives for a ClientHello, before any key exchange.
+ * It runs whether or not the hello carries a server name.
+ */
+static int
+https_rate_limit_cb(SSL *ssl, int *al, void *arg)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	int fd = SSL_get_fd(ssl);
+	t_ip_key key;
+
+	if (fd < 0 || getpeername(fd, (struct sockaddr *)&ss, &len) != 0 || !ip_key_from_sockaddr((struct sockaddr *)&ss, &key))
+		return SSL_TLSEXT_ERR_OK;
+	if (rate_limit_allow(https_rate_limit, ip_key_prefix_fold(&key)))
+		return SSL_TLSEXT_ERR_OK;
+
+	metric_inc(METRIC_HTTPS_RATE_LIMITED);
+	*al = SSL_AD_HANDSHAKE_FAILURE;
+	return SSL_TLSEXT_ERR_ALERT_FATAL;
+}
+
+/**
+ * SSL_CTX of the redirect server: session cache, rotating ticket keys,
+ * X25519 first and ciphers cheap on CPUs without AES instructions.
+ */
+static SSL_CTX *
+https_ssl_ctx_new(t_https_server *https_server)
+{
+	SSL_CTX *ctx = SSL_CTX_new (SSLv23_server_method ());
+	if (!ctx)
+		die_most_horribly_from_openssl_error ("SSL_CTX_new");
+
+	SSL_CTX_set_options (ctx,
+                       SSL_OP_SINGLE_DH_USE |
+                       SSL_OP_SINGLE_ECDH_USE |
+                       SSL_OP_NO_SSLv2 |
+                       SSL_OP_NO_SSLv3 |
+                       SSL_OP_NO_COMPRESSION |
+                       SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+	if (1 != SSL_CTX_set_cipher_list (ctx, https_server->cipher_list)) {
+		debug (LOG_WARNING, "Bad httpsCipherList %s, using the default", https_server->cipher_list);
+		ERR_clear_error();
+		if (1 != SSL_CTX_set_cipher_list (ctx, DEFAULT_HTTPS_CIPHER_LIST))
+			die_most_horribly_from_openssl_error ("SSL_CTX_set_cipher_list");
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if (1 != SSL_CTX_set_ciphersuites (ctx, https_server->cipher_suites)) {
+		debug (LOG_WARNING, "Bad httpsCipherSuites %s, using the library default", https_server->cipher_suites);
+		ERR_clear_error();
+	}
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	if (1 != SSL_CTX_set1_curves_list (ctx, https_server->curves)) {
+		debug (LOG_WARNING, "Bad or unsupported httpsCurves %s, using P-256", https_server->curves);
+		ERR_clear_error();
+		if (1 != SSL_CTX_set1_curves_list (ctx, "P-256"))
+			die_most_horribly_from_openssl_error ("SSL_CTX_set1_curves_list");
+	}
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	SSL_CTX_set_ecdh_auto (ctx, 1);
+#endif
+#else
+	/* Cheesily pick an elliptic curve to use with elliptic curve ciphersuites.
+	* We just hardcode a single curve which is reasonably decent.
+	* See http://www.mail-archive.com/openssl-dev@openssl.org/msg30957.html */
+	EC_KEY *ecdh = EC_KEY_new_by_curve_name (NID_X9_62_prime256v1);
+	if (! ecdh)
+    	die_most_horribly_from_openssl_error ("EC_KEY_new_by_curve_name");
+  	if (1 != SSL_CTX_set_tmp_ecdh (ctx, ecdh))
+    	die_most_horribly_from_openssl_error ("SSL_CTX_set_tmp_ecdh");
+	EC_KEY_free (ecdh);
+#endif
+
+	SSL_CTX_set_session_id_context (ctx, (const unsigned char *)"apfree_wifidog", 14);
+	if (https_server->session_cache_size > 0) {
+		SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size (ctx, https_server->session_cache_size);
+	} else
+		SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_OFF);
+	if (https_server->session_timeout > 0)
+		SSL_CTX_set_timeout (ctx, https_server->session_timeout);
+
+	if (https_server->session_tickets) {
+		ticket_key_rotate();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb (ctx, ticket_key_cb);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb (ctx, ticket_key_cb);
+#endif
+	} else
+		SSL_CTX_set_options (ctx, SSL_OP_NO_TICKET);
+
+	if (https_rate_limit)
+		SSL_CTX_set_tlsext_servername_callback (ctx, https_rate_limit_cb);
+
+	server_setup_certs (ctx, https_server->svr_crt_file, https_server->svr_key_file);
+
+	return ctx;
+}
+
 static void check_internet_available(t_popular_server *popular_server) {
 	if (!popular_server)
 		return;
@@ -280,7 +506,9 @@ static void check_auth_server_available_cb(int errcode, struct evutil_addrinfo *
 	if (errcode) { 
 		debug (LOG_INFO, "dns query error : %s", evutil_gai_strerror(errcode));
 		mark_auth_offline();
+		LOCK_CONFIG();
 		mark_auth_server_bad(auth_server);
+		UNLOCK_CONFIG();
 	} else {
 		int i = 0;
 		if (!addr) {
@@ -360,41 +588,19 @@ static void schedule_work_cb(evutil_socket_t fd, short event, void *arg) {
 	event_add(timeout, &tv);
 }
 
-static int https_redirect (char *gw_ip,  t_https_server *https_server) { 	
+/** Serve the redirect over TLS with evhttp, returns its SSL_CTX or NULL */
+static SSL_CTX *https_evhttp_listen (char *gw_ip,  t_https_server *https_server) {
   	struct evhttp *http;
   	struct evhttp_bound_socket *handle;
-	struct event timeout;
-	struct timeval tv;
-	
-  	base = event_base_new ();
-  	if (! base) { 
-		debug (LOG_ERR, "Couldn't create an event_base: exiting\n");
-      	return 1;
-    }
 	
   	/* Create a new evhttp object to handle requests. */
   	http = evhttp_new (base);
   	if (! http) { 
 		debug (LOG_ERR, "couldn't create evhttp. Exiting.\n");
-      	return 1;
+      	return NULL;
     }
  
- 	SSL_CTX *ctx = SSL_CTX_new (SSLv23_server_method ());
-  	SSL_CTX_set_options (ctx,
-                       SSL_OP_SINGLE_DH_USE |
-                       SSL_OP_SINGLE_ECDH_USE |
-                       SSL_OP_NO_SSLv2);
-
-	/* Cheesily pick an elliptic curve to use with elliptic curve ciphersuites.
-	* We just hardcode a single curve which is reasonably decent.
-	* See http://www.mail-archive.com/openssl-dev@openssl.org/msg30957.html */
-	EC_KEY *ecdh = EC_KEY_new_by_curve_name (NID_X9_62_prime256v1);
-	if (! ecdh)
-    	die_most_horribly_from_openssl_error ("EC_KEY_new_by_curve_name");
-  	if (1 != SSL_CTX_set_tmp_ecdh (ctx, ecdh))
-    	die_most_horribly_from_openssl_error ("SSL_CTX_set_tmp_ecdh");
-
-	server_setup_certs (ctx, https_server->svr_crt_file, https_server->svr_key_file);
+	SSL_CTX *ctx = https_ssl_ctx_new (https_server);
 
 	/* This is the magic that lets evhttp use SSL. */
 	evhttp_set_bevcb (http, bevcb, ctx);
@@ -407,8 +613,42 @@ static int https_redirect (char *gw_ip,  t_https_server *https_server) {
 	if (! handle) { 
 		debug (LOG_ERR, "couldn't bind to port %d. Exiting.\n",
                (int) https_server->gw_https_port);
-		return 1;
+		SSL_CTX_free (ctx);
+		return NULL;
+    }
+
+	if (config_get_config()->enable_ipv6) {
+		int fd6 = listen_socket6(https_server->gw_https_port);
+		if (fd6 < 0 || !evhttp_accept_socket_with_handle(http, fd6)) {
+			debug (LOG_ERR, "couldn't listen on [::]:%d, ipv6 clients get no https redirect", https_server->gw_https_port);
+			if (fd6 >= 0)
+				close(fd6);
+		}
+	}
+	
+	return ctx;
+}
+
+static int https_redirect (char *gw_ip,  t_https_server *https_server) { 	
+	struct event timeout;
+	struct event *ticket_timer = NULL;
+	struct timeval tv;
+	SSL_CTX *ctx = NULL;
+	
+  	base = event_base_new ();
+  	if (! base) { 
+		debug (LOG_ERR, "Couldn't create an event_base: exiting\n");
+      	return 1;
     }
+	
+	if (https_server->sni_peek != SNI_PEEK_OFF) {
+		/* answer probes from their ClientHello, no handshake at all */
+		if (!sni_peek_listen (base, gw_ip, https_server->gw_https_port, https_server->sni_peek))
+			return 1;
+		if (config_get_config()->enable_ipv6)
+			sni_peek_listen (base, "::", https_server->gw_https_port, https_server->sni_peek);
+	} else if (!(ctx = https_evhttp_listen (gw_ip, https_server)))
+		return 1;
     
 	// check whether internet available or not
 	dnsbase = evdns_base_new(base, 0);
@@ -429,13 +669,20 @@ static int https_redirect (char *gw_ip,  t_https_server *https_server) {
 	tv.tv_sec = config_get_config()->checkinterval;
     event_add(&timeout, &tv);
 
+	if (ctx && https_server->session_tickets && https_server->ticket_key_lifetime > 0) {
+		ticket_timer = event_new(base, -1, EV_PERSIST, ticket_key_rotate_cb, ctx);
+		evutil_timerclear(&tv);
+		tv.tv_sec = https_server->ticket_key_lifetime;
+		event_add(ticket_timer, &tv);
+	}
 	
     event_base_dispatch (base);
 
+	if (ticket_timer) event_free(ticket_timer);
 	event_del(&timeout);
 	event_base_free(base);
 	evdns_base_free(dnsbase, 0);
-	close(handle);
+	if (ctx) SSL_CTX_free(ctx);
 	
   	/* not reached; runs forever */
   	return 0;
@@ -29,11 +29,16 @@
 #ifndef	_HTTPS_SERVER_H_
 #define	_HTTPS_SERVER_H_
 
+#include "html_template.h"
+#include "config_snapshot.h"
+
+#define	REQUEST_URL_LEN	256
+
 void thread_https_server(void *args);
 
-char *evhttpd_get_full_redir_url(const char *mac, const char *ip, const char *orig_url);
-void evhttpd_gw_reply(struct evhttp_request *req,  struct evbuffer *evb);
-char *evhttp_get_request_url(struct evhttp_request *req);
+char *evhttpd_get_full_redir_url(const t_config_snapshot *, const char *mac, const char *ip, const char *orig_url);
+void evhttpd_gw_reply(struct evhttp_request *req, const html_template_t *);
+void evhttp_get_request_url(struct evhttp_request *req, char *, int);
 void evhttp_gw_reply_js_redirect(struct evhttp_request *req, const char *peer_addr);
 
 #endif
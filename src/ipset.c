@@ -32,6 +32,7 @@
 #include "safe.h"
 #include "debug.h"
 #include "util.h"
+#include "metrics.h"
 	
 
 /* We want to be able to compile against old header files
@@ -67,6 +68,7 @@
 #endif
 
 #define INADDRSZ        4
+#define IN6ADDRSZ       16
 #define INETHSZ			6
 
 struct my_nlattr {
@@ -135,13 +137,13 @@ int  ipset_init(void)
 	return 0;
 }
 
-static int new_add_to_ipset(const char *setname, const struct in_addr *ipaddr, int af, int remove)
+static int new_add_to_ipset(const char *setname, const void *ipaddr, int af, int remove)
 {
 	struct nlmsghdr *nlh;
 	struct my_nfgenmsg *nfg;
 	struct my_nlattr *nested[2];
 	uint8_t proto;
-	int addrsz = INADDRSZ;
+	int addrsz = af == AF_INET6 ? IN6ADDRSZ : INADDRSZ;
 	char buffer[BUFF_SZ] = {0};
 
 	if (strlen(setname) >= IPSET_MAXNAMELEN) 
@@ -246,10 +248,14 @@ int flush_ipset(const char *setname)
 	add_attr(nlh, IPSET_ATTR_PROTOCOL, sizeof(proto), &proto);
 	add_attr(nlh, IPSET_ATTR_SETNAME, strlen(setname) + 1, setname);
 	
+	uint64_t start = metric_now_us();
 	while(retry_send(sendto(ipset_sock, buffer, nlh->nlmsg_len, 0, (struct sockaddr *)&snl, sizeof(snl))))
 		;
+	metric_observe_since(METRIC_IPSET_LATENCY, start);
 
 	debug(LOG_DEBUG, "flush_ipset [%s] [%s]", setname, strerror(errno));
+	if (errno != 0)
+		metric_inc(METRIC_IPSET_FAILURES);
 	return errno == 0 ? 0 : -1;
 
 }
@@ -257,6 +263,8 @@ int flush_ipset(const char *setname)
 int add_to_ipset(const char *setname, const char *val, int flag)
 {
 	int af = AF_INET;
+	int ret = -1;
+	uint64_t start = metric_now_us();
 	
 	debug(LOG_DEBUG, "add_to_ipset [%s] [%s] [%d]", setname, val, flag);
 	if(is_valid_ip(val)) {	
@@ -264,15 +272,26 @@ int add_to_ipset(const char *setname, const char *val, int flag)
 		if (inet_aton(val, &addr) == 0) 
 			return -1;
 
-		return new_add_to_ipset(setname, &addr, af, flag);
+		ret = new_add_to_ipset(setname, &addr, af, flag);
+	} else if (is_valid_ip6(val)) {
+		struct in6_addr addr6;
+		if (inet_pton(AF_INET6, val, &addr6) != 1)
+			return -1;
+
+		ret = new_add_to_ipset(setname, &addr6, AF_INET6, flag);
 	} else if (is_valid_mac(val)) {
 		struct ether_addr *addr = ether_aton(val);
 		if(addr == NULL)
 			return -1;
 
-		return new_add_mac_to_ipset(setname, addr, af, flag);	
+		ret = new_add_mac_to_ipset(setname, addr, af, flag);	
+	} else {
+		return -1;
 	}
 
-	return -1;
+	metric_observe_since(METRIC_IPSET_LATENCY, start);
+	if (ret != 0)
+		metric_inc(METRIC_IPSET_FAILURES);
+	return ret;
 }
 
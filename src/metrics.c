@@ -0,0 +1,334 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file metrics.c
+  @brief counters, gauges and latency histograms exported in prometheus text format
+
+  Every metric is a fixed slot of the registry below, updated with relaxed
+  atomics so instrumenting a hot path costs an add and no lock. Rendering
+  reads the slots without stopping the writers, a scrape may see the sum
+  and the buckets one observation apart.
+
+  The captive redirect stages use finer log-linear histograms instead: each
+  power of two is split in LATENCY_SUB_BUCKETS linear buckets, so any
+  percentile is within 1/LATENCY_SUB_BUCKETS of the true value from
+  nanoseconds up to a minute, for a fixed 1KB per stage.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pstring.h"
+#include "metrics.h"
+
+typedef enum {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM
+} metric_type_t;
+
+/** Bucket upper bounds in microseconds, 100us to 10s */
+static const uint64_t metric_buckets[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+#define	METRIC_BUCKETS	(sizeof(metric_buckets) / sizeof(metric_buckets[0]))
+
+struct metric {
+	const char		*name;
+	const char		*help;
+	metric_type_t	type;
+	int64_t			value;
+	uint64_t		sum;
+	uint64_t		buckets[METRIC_BUCKETS];	/** non cumulative */
+	uint64_t		overflow;	/** above the last bound */
+};
+
+static struct metric registry[METRIC_MAX] = {
+	[METRIC_HTTP_CONNECTIONS]		= { "wifidog_http_connections_total", "Connections accepted by the captive portal web server", METRIC_COUNTER },
+	[METRIC_HTTP_REDIRECTS]			= { "wifidog_http_redirects_total", "Unauthenticated clients redirected to the auth server", METRIC_COUNTER },
+	[METRIC_HTTP_PROBES]			= { "wifidog_http_probes_total", "Captive detection probes answered from the probe table", METRIC_COUNTER },
+	[METRIC_HTTP_RATE_LIMITED]		= { "wifidog_http_rate_limited_total", "Connections to gw_port refused over the per client rate", METRIC_COUNTER },
+	[METRIC_AUTH_REQUESTS]			= { "wifidog_auth_requests_total", "Requests sent to the auth server", METRIC_COUNTER },
+	[METRIC_AUTH_FAILURES]			= { "wifidog_auth_request_failures_total", "Auth server requests without a valid answer", METRIC_COUNTER },
+	[METRIC_THREADPOOL_REJECTED]	= { "wifidog_threadpool_rejected_total", "Connections dropped because the worker queue was full", METRIC_COUNTER },
+	[METRIC_FW_ACCESS_FAILURES]		= { "wifidog_firewall_access_failures_total", "Client allow/deny rules which could not be applied", METRIC_COUNTER },
+	[METRIC_IPSET_FAILURES]			= { "wifidog_ipset_failures_total", "Failed ipset operations", METRIC_COUNTER },
+	[METRIC_HTTPS_SNI_PEEKS]		= { "wifidog_https_sni_peeks_total", "ClientHellos answered from their server name, without a handshake", METRIC_COUNTER },
+	[METRIC_HTTPS_SNI_MISSING]		= { "wifidog_https_sni_missing_total", "Connections to the https port without a ClientHello server name", METRIC_COUNTER },
+	[METRIC_HTTPS_FW_REDIRECTED]	= { "wifidog_https_fw_redirected_total", "Unauthenticated https connections the firewall rate limit sent to the redirect server", METRIC_COUNTER },
+	[METRIC_HTTPS_FW_RESET]			= { "wifidog_https_fw_reset_total", "Unauthenticated https connections reset by the firewall, handshakes avoided", METRIC_COUNTER },
+	[METRIC_HTTPS_RATE_LIMITED]		= { "wifidog_https_rate_limited_total", "Connections to gw_https_port refused over the per client rate", METRIC_COUNTER },
+	[METRIC_CLIENTS_ONLINE]			= { "wifidog_clients", "Clients in the client list", METRIC_GAUGE },
+	[METRIC_THREADPOOL_QUEUED]		= { "wifidog_threadpool_queue_depth", "Connections waiting for a worker", METRIC_GAUGE },
+	[METRIC_THREADPOOL_BUSY]		= { "wifidog_threadpool_busy_workers", "Workers serving a connection", METRIC_GAUGE },
+	[METRIC_AUTH_LATENCY]			= { "wifidog_auth_request_duration_seconds", "Round trip of auth server requests", METRIC_HISTOGRAM },
+	[METRIC_THREADPOOL_WAIT]		= { "wifidog_threadpool_queue_wait_seconds", "Time a connection waited for a worker", METRIC_HISTOGRAM },
+	[METRIC_FW_COUNTERS_UPDATE]		= { "wifidog_firewall_counters_update_duration_seconds", "Time to read the client traffic counters", METRIC_HISTOGRAM },
+	[METRIC_FW_ACCESS_LATENCY]		= { "wifidog_firewall_access_duration_seconds", "Time to allow or deny a client in the firewall", METRIC_HISTOGRAM },
+	[METRIC_IPSET_LATENCY]			= { "wifidog_ipset_op_duration_seconds", "Time of one ipset operation", METRIC_HISTOGRAM },
+};
+
+#define	LATENCY_SUB_BITS	3
+#define	LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+#define	LATENCY_MAX_EXP		36	/* ~68s, slower samples land in the last bucket */
+#define	LATENCY_BUCKETS		((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+struct latency_hist {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	max;
+	uint32_t	buckets[LATENCY_BUCKETS];
+};
+
+static const char *latency_names[LATENCY_MAX] = {
+	[LATENCY_HTTP_ARP]		= "http arp lookup",
+	[LATENCY_HTTP_CLIENT]	= "http client lookup",
+	[LATENCY_HTTP_URL]		= "http url building",
+	[LATENCY_HTTP_WRITE]	= "http write",
+	[LATENCY_HTTP_TOTAL]	= "http accept to redirect",
+	[LATENCY_HTTPS_ARP]		= "https arp lookup",
+	[LATENCY_HTTPS_URL]		= "https url building",
+	[LATENCY_HTTPS_WRITE]	= "https write",
+	[LATENCY_HTTPS_TOTAL]	= "https request to redirect",
+};
+
+static struct latency_hist latencies[LATENCY_MAX];
+
+uint64_t
+metric_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+metric_add(metric_id_t id, int64_t delta)
+{
+	__atomic_add_fetch(&registry[id].value, delta, __ATOMIC_RELAXED);
+}
+
+void
+metric_set(metric_id_t id, int64_t value)
+{
+	__atomic_store_n(&registry[id].value, value, __ATOMIC_RELAXED);
+}
+
+void
+metric_observe(metric_id_t id, uint64_t usec)
+{
+	struct metric *m = &registry[id];
+	unsigned int lo = 0, hi = METRIC_BUCKETS;
+
+	/* first bucket whose bound is not below usec */
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (metric_buckets[mid] < usec)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < METRIC_BUCKETS)
+		__atomic_add_fetch(&m->buckets[lo], 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&m->overflow, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->sum, usec, __ATOMIC_RELAXED);
+}
+
+void
+metric_observe_since(metric_id_t id, uint64_t start)
+{
+	metric_observe(id, metric_now_us() - start);
+}
+
+uint64_t
+latency_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int
+latency_bucket(uint64_t ns)
+{
+	unsigned int exp;
+
+	if (ns < LATENCY_SUB_BUCKETS)
+		return ns;
+
+	exp = 63 - __builtin_clzll(ns);
+	if (exp > LATENCY_MAX_EXP)
+		return LATENCY_BUCKETS - 1;
+	return (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+		((ns >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* highest value counted in a bucket */
+static uint64_t
+latency_bucket_bound(unsigned int idx)
+{
+	unsigned int exp, sub;
+
+	if (idx < LATENCY_SUB_BUCKETS)
+		return idx;
+	if (idx == LATENCY_BUCKETS - 1)
+		return UINT64_MAX;
+
+	exp = idx / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+	sub = idx % LATENCY_SUB_BUCKETS;
+	return ((uint64_t)(LATENCY_SUB_BUCKETS + sub + 1) << (exp - LATENCY_SUB_BITS)) - 1;
+}
+
+void
+latency_record(latency_id_t id, uint64_t ns)
+{
+	struct latency_hist *h = &latencies[id];
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->buckets[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	while (ns > max &&
+		!__atomic_compare_exchange_n(&h->max, &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+uint64_t
+latency_record_since(latency_id_t id, uint64_t start)
+{
+	uint64_t now = latency_now_ns();
+
+	latency_record(id, now - start);
+	return now;
+}
+
+void
+latency_reset(void)
+{
+	int i, j;
+
+	for (i = 0; i < LATENCY_MAX; i++) {
+		struct latency_hist *h = &latencies[i];
+
+		__atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+		for (j = 0; j < LATENCY_BUCKETS; j++)
+			__atomic_store_n(&h->buckets[j], 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* upper bound of the bucket holding the percentile, never above the max seen */
+static uint64_t
+latency_percentile(const uint32_t *buckets, uint64_t total, unsigned int pct, uint64_t max)
+{
+	uint64_t rank = (total * pct + 99) / 100, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank && seen > 0)
+			return latency_bucket_bound(i) < max ? latency_bucket_bound(i) : max;
+	}
+	return 0;
+}
+
+char *
+latency_render(void)
+{
+	static uint32_t buckets[LATENCY_BUCKETS];
+	static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+	pstr_t *out = pstr_new();
+	uint64_t total;
+	int i, j;
+
+	pthread_mutex_lock(&render_mutex);
+	pstr_append_sprintf(out, "%-26s %8s %9s %9s %9s %9s %9s\n", "Redirect latency (usec)",
+		"count", "mean", "p50", "p90", "p99", "max");
+	for (i = 0; i < LATENCY_MAX; i++) {
+		const struct latency_hist *h = &latencies[i];
+		uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+		uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+		/* percentiles over a copy, so they agree with each other */
+		for (total = 0, j = 0; j < LATENCY_BUCKETS; j++) {
+			buckets[j] = __atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+			total += buckets[j];
+		}
+
+		pstr_append_sprintf(out, "  %-24s %8llu %9.1f %9.1f %9.1f %9.1f %9.1f\n", latency_names[i],
+			(unsigned long long)count,
+			count ? __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e3 / count : 0.0,
+			latency_percentile(buckets, total, 50, max) / 1e3,
+			latency_percentile(buckets, total, 90, max) / 1e3,
+			latency_percentile(buckets, total, 99, max) / 1e3,
+			max / 1e3);
+	}
+	pthread_mutex_unlock(&render_mutex);
+
+	return pstr_to_string(out);
+}
+
+static void
+render_histogram(pstr_t *out, const struct metric *m)
+{
+	uint64_t cumulative = 0;
+	unsigned int i;
+
+	for (i = 0; i < METRIC_BUCKETS; i++) {
+		cumulative += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+		pstr_append_sprintf(out, "%s_bucket{le=\"%g\"} %llu\n", m->name,
+			metric_buckets[i] / 1e6, (unsigned long long)cumulative);
+	}
+	cumulative += __atomic_load_n(&m->overflow, __ATOMIC_RELAXED);
+	pstr_append_sprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", m->name, (unsigned long long)cumulative);
+	pstr_append_sprintf(out, "%s_sum %.6f\n", m->name, __atomic_load_n(&m->sum, __ATOMIC_RELAXED) / 1e6);
+	pstr_append_sprintf(out, "%s_count %llu\n", m->name, (unsigned long long)cumulative);
+}
+
+char *
+metrics_render(void)
+{
+	static const char *type_names[] = { "counter", "gauge", "histogram" };
+	pstr_t *out = pstr_new();
+	int i;
+
+	for (i = 0; i < METRIC_MAX; i++) {
+		const struct metric *m = &registry[i];
+
+		pstr_append_sprintf(out, "# HELP %s %s\n", m->name, m->help);
+		pstr_append_sprintf(out, "# TYPE %s %s\n", m->name, type_names[m->type]);
+		if (m->type == METRIC_HISTOGRAM)
+			render_histogram(out, m);
+		else
+			pstr_append_sprintf(out, "%s %lld\n", m->name, (long long)__atomic_load_n(&m->value, __ATOMIC_RELAXED));
+	}
+
+	return pstr_to_string(out);
+}
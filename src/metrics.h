@@ -0,0 +1,111 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file metrics.h
+  @brief counters, gauges and latency histograms exported in prometheus text format
+  */
+
+#ifndef	_METRICS_H_
+#define	_METRICS_H_
+
+#include <stdint.h>
+
+typedef enum {
+	/* counters */
+	METRIC_HTTP_CONNECTIONS,
+	METRIC_HTTP_REDIRECTS,
+	METRIC_HTTP_PROBES,
+	METRIC_HTTP_RATE_LIMITED,
+	METRIC_AUTH_REQUESTS,
+	METRIC_AUTH_FAILURES,
+	METRIC_THREADPOOL_REJECTED,
+	METRIC_FW_ACCESS_FAILURES,
+	METRIC_IPSET_FAILURES,
+	METRIC_HTTPS_SNI_PEEKS,
+	METRIC_HTTPS_SNI_MISSING,
+	METRIC_HTTPS_FW_REDIRECTED,
+	METRIC_HTTPS_FW_RESET,
+	METRIC_HTTPS_RATE_LIMITED,
+	/* gauges */
+	METRIC_CLIENTS_ONLINE,
+	METRIC_THREADPOOL_QUEUED,
+	METRIC_THREADPOOL_BUSY,
+	/* histograms, observed in microseconds */
+	METRIC_AUTH_LATENCY,
+	METRIC_THREADPOOL_WAIT,
+	METRIC_FW_COUNTERS_UPDATE,
+	METRIC_FW_ACCESS_LATENCY,
+	METRIC_IPSET_LATENCY,
+	METRIC_MAX
+} metric_id_t;
+
+/** @brief Monotonic clock in microseconds, for metric_observe() */
+uint64_t metric_now_us(void);
+
+/** @brief Add to a counter or a gauge */
+void metric_add(metric_id_t, int64_t);
+
+/** @brief Set a gauge */
+void metric_set(metric_id_t, int64_t);
+
+/** @brief Record one duration, in microseconds, into a histogram */
+void metric_observe(metric_id_t, uint64_t usec);
+
+/** @brief Record the time elapsed since start, as returned by metric_now_us() */
+void metric_observe_since(metric_id_t, uint64_t start);
+
+/** @brief Render every metric in prometheus text format, caller frees */
+char *metrics_render(void);
+
+#define	metric_inc(id)	metric_add(id, 1)
+#define	metric_dec(id)	metric_add(id, -1)
+
+/** Stages of the captive redirect, timed in nanoseconds */
+typedef enum {
+	LATENCY_HTTP_ARP,
+	LATENCY_HTTP_CLIENT,
+	LATENCY_HTTP_URL,
+	LATENCY_HTTP_WRITE,
+	LATENCY_HTTP_TOTAL,		/** from accept */
+	LATENCY_HTTPS_ARP,
+	LATENCY_HTTPS_URL,
+	LATENCY_HTTPS_WRITE,
+	LATENCY_HTTPS_TOTAL,	/** from the request callback */
+	LATENCY_MAX
+} latency_id_t;
+
+/** @brief Monotonic clock in nanoseconds */
+uint64_t latency_now_ns(void);
+
+/** @brief Record one stage duration in nanoseconds */
+void latency_record(latency_id_t, uint64_t ns);
+
+/** @brief Record the time elapsed since start and return now, to chain stages */
+uint64_t latency_record_since(latency_id_t, uint64_t start);
+
+/** @brief Forget every recorded latency */
+void latency_reset(void);
+
+/** @brief Percentiles of every stage as a text table, caller frees */
+char *latency_render(void);
+
+#endif
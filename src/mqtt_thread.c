@@ -43,6 +43,7 @@
 #include "safe.h"
 #include "wd_util.h"
 #include "centralserver.h"
+#include "config_snapshot.h"
 
 #ifdef	_MQTT_SUPPORT_
 
@@ -287,12 +288,12 @@ set_auth_server_op(void *mosq, const char *type, const char *value, const int re
 
 	LOCK_CONFIG();
 	if((tmp_host_name != NULL) && (strcmp(hostname,tmp_host_name) != 0)) {
-		free(hostname);
+		config_retire(hostname);
 		config->auth_servers->authserv_hostname = safe_strdup(tmp_host_name);
         uci_set_value("wifidog", "wifidog", "auth_server_hostname", config->auth_servers->authserv_hostname);
 	}
 	if((tmp_path != NULL) && (strcmp(path,tmp_host_name) != 0)) {
-		free(path);
+		config_retire(path);
 		config->auth_servers->authserv_path = safe_strdup(tmp_path);
         uci_set_value("wifidog", "wifidog", "auth_server_path", config->auth_servers->authserv_path);
 	}
@@ -301,6 +302,8 @@ set_auth_server_op(void *mosq, const char *type, const char *value, const int re
         uci_set_value("wifidog", "wifidog", "auth_server_port", tmp_http_port);
     }
 	UNLOCK_CONFIG();
+	/* the redirects build their urls from the snapshot */
+	config_snapshot_publish();
 	
 	json_object_put(json_request);
 	send_mqtt_response(mosq, req_id, 200, "Ok", config);
@@ -0,0 +1,180 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file rate_limit.c
+  @brief per client connection rate limit of the captive http and https servers
+
+  One token bucket per source address, kept as a generic cell rate
+  algorithm: a slot packs the ipv4 address and the time, in milliseconds,
+  at which the bucket will be full again, so taking a token is a single
+  compare and swap and the accept loops never take a lock. An address
+  whose bucket is full needs no slot, which is how slots get reused.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "rate_limit.h"
+
+struct rate_limit {
+	uint32_t	interval;	/** milliseconds per token */
+	uint32_t	tolerance;	/** interval * (burst - 1), how far ahead a client may run */
+	unsigned long	limited;	/** word sized, only the slots need 64-bit atomics */
+	unsigned long	untracked;
+	uint64_t	slots[RATE_LIMIT_SLOTS];	/** ip << 32 | time the bucket is full again */
+};
+
+rate_limit_t *http_rate_limit;
+rate_limit_t *https_rate_limit;
+
+static uint32_t
+rate_limit_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec * 1000u + ts.tv_nsec / 1000000;
+}
+
+/** @internal
+ * Milliseconds the bucket of a slot is behind, 0 once it is full. The
+ * clock wraps every 49 days: a slot left alone that long can look far
+ * ahead, further than any client is allowed to get, and counts as full.
+ */
+static uint32_t
+rate_limit_ahead(const struct rate_limit *rl, uint64_t slot, uint32_t now)
+{
+	int32_t ahead = (int32_t)((uint32_t)slot - now);
+
+	if (ahead <= 0 || (uint32_t)ahead > rl->tolerance + rl->interval)
+		return 0;
+	return ahead;
+}
+
+static struct rate_limit *
+rate_limit_new(int rate, int burst)
+{
+	struct rate_limit *rl = safe_malloc(sizeof(struct rate_limit));
+
+	memset(rl, 0, sizeof(struct rate_limit));
+	rl->interval = rate < 1000 ? 1000 / rate : 1;
+	rl->tolerance = rl->interval * (burst > 1 ? burst - 1 : 0);
+	return rl;
+}
+
+void
+rate_limit_init(int rate, int burst)
+{
+	if (rate <= 0)
+		return;
+
+	http_rate_limit = rate_limit_new(rate, burst);
+	https_rate_limit = rate_limit_new(rate, burst);
+	debug(LOG_INFO, "Limiting each client to %d connections per second, burst %d", rate, burst);
+}
+
+int
+rate_limit_allow(rate_limit_t *rl, uint32_t ip)
+{
+	uint64_t key = (uint64_t)ip << 32;
+	uint64_t *slot, *free_slot, old = 0, free_old = 0, word;
+	uint32_t now, ahead;
+	unsigned int h, i;
+
+	if (!rl)
+		return 1;
+
+	now = rate_limit_now_ms();
+	h = (ip * 2654435761u) >> (32 - RATE_LIMIT_BITS);
+	for (;;) {
+		slot = free_slot = NULL;
+		for (i = 0; i < RATE_LIMIT_PROBES; i++) {
+			uint64_t *s = &rl->slots[(h + i) & (RATE_LIMIT_SLOTS - 1)];
+
+			word = __atomic_load_n(s, __ATOMIC_RELAXED);
+			if ((word >> 32) == ip && word != 0) {
+				slot = s;
+				old = word;
+				break;
+			}
+			if (!free_slot && rate_limit_ahead(rl, word, now) == 0) {
+				free_slot = s;
+				free_old = word;
+			}
+		}
+
+		if (slot) {
+			ahead = rate_limit_ahead(rl, old, now);
+		} else if (free_slot) {
+			slot = free_slot;
+			old = free_old;
+			ahead = 0;
+		} else {
+			/* too many busy clients around this one, let it through */
+			__atomic_add_fetch(&rl->untracked, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+
+		if (ahead > rl->tolerance) {
+			__atomic_add_fetch(&rl->limited, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+
+		word = key | (uint32_t)(now + ahead + rl->interval);
+		if (__atomic_compare_exchange_n(slot, &old, word, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return 1;
+	}
+}
+
+static int
+rate_limit_busy(const struct rate_limit *rl)
+{
+	uint32_t now = rate_limit_now_ms();
+	int i, n = 0;
+
+	for (i = 0; i < RATE_LIMIT_SLOTS; i++)
+		if (rate_limit_ahead(rl, __atomic_load_n(&rl->slots[i], __ATOMIC_RELAXED), now))
+			n++;
+	return n;
+}
+
+void
+rate_limit_render(pstr_t *pstr)
+{
+	rate_limit_t *rl[2] = { http_rate_limit, https_rate_limit };
+	const char *name[2] = { "http", "https" };
+	int i;
+
+	if (!http_rate_limit)
+		return;
+
+	pstr_cat(pstr, "\nConnection rate limit:\n");
+	for (i = 0; i < 2; i++)
+		pstr_append_sprintf(pstr, "  %-5s %lu refused, %lu untracked, %d clients busy\n", name[i],
+			__atomic_load_n(&rl[i]->limited, __ATOMIC_RELAXED),
+			__atomic_load_n(&rl[i]->untracked, __ATOMIC_RELAXED),
+			rate_limit_busy(rl[i]));
+}
@@ -0,0 +1,56 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file rate_limit.h
+  @brief per client connection rate limit of the captive http and https servers
+  */
+
+#ifndef	_RATE_LIMIT_H_
+#define	_RATE_LIMIT_H_
+
+#include <stdint.h>
+
+#include "pstring.h"
+
+/** Clients tracked per server, a power of two */
+#define	RATE_LIMIT_BITS		10
+#define	RATE_LIMIT_SLOTS	(1 << RATE_LIMIT_BITS)
+/** Slots tried for one address before it goes untracked */
+#define	RATE_LIMIT_PROBES	4
+
+typedef struct rate_limit rate_limit_t;
+
+/** Limits of gw_port and gw_https_port, NULL when ClientConnRate is 0 */
+extern rate_limit_t *http_rate_limit;
+extern rate_limit_t *https_rate_limit;
+
+/** @brief Create both limits, rate is in connections per second and client */
+void rate_limit_init(int rate, int burst);
+
+/** @brief Take a token for a new connection from ip, as given by ip_key_prefix_fold
+ * @return 1 if allowed, 0 if the client is over its rate. A NULL limit allows everything. */
+int rate_limit_allow(rate_limit_t *, uint32_t ip);
+
+/** @brief Append the connections refused so far to a wdctl status */
+void rate_limit_render(pstr_t *);
+
+#endif
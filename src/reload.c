@@ -0,0 +1,504 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file reload.c
+  @brief re-read wifidog.conf and apply what changed without a restart
+
+  The file is parsed into a second configuration and compared with the
+  running one option by option. Options read where they are used are
+  copied over, a changed ruleset reloads its own chains, a changed list
+  option redoes that list and its ipset, and only the options the chains
+  are built from rebuild the firewall. Options held by a listening socket,
+  a thread or a file loaded at startup are reported and keep their value
+  until the next restart.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "firewall.h"
+#include "config_snapshot.h"
+#include "reload.h"
+
+/** What applying a changed option takes */
+#define	RELOAD_IN_PLACE		0x01	/* read where it is used, copying it is enough */
+#define	RELOAD_FIREWALL		0x02	/* the chains are built from it */
+#define	RELOAD_RESTART		0x04	/* held by a socket, a thread or a file loaded at startup */
+
+/*
+ * The old value of a string option is retired rather than freed: the
+ * configuration is read without a lock and another thread may still hold
+ * it. It is freed with the configuration snapshot replaced by this reload.
+ */
+#define	RELOAD_NUMBER(field, name, how) do { \
+	if (live->field != next->field) { \
+		reload_note(report, name, how); \
+		if ((how) != RELOAD_RESTART) { \
+			live->field = next->field; \
+			applied++; \
+		} \
+	} \
+} while (0)
+
+#define	RELOAD_STRING(field, name, how) do { \
+	if (!reload_str_equal(live->field, next->field)) { \
+		reload_note(report, name, how); \
+		if ((how) != RELOAD_RESTART) { \
+			config_retire(live->field); \
+			live->field = next->field; \
+			next->field = NULL; \
+			applied++; \
+		} \
+	} \
+} while (0)
+
+/** Rulesets which are loaded into a chain */
+static const char *reload_rulesets[] = {
+	FWRULESET_GLOBAL,
+	FWRULESET_VALIDATING_USERS,
+	FWRULESET_KNOWN_USERS,
+	FWRULESET_AUTH_IS_DOWN,
+	FWRULESET_UNKNOWN_USERS,
+	FWRULESET_LOCKED_USERS,
+	NULL
+};
+
+/** Config file names of the list options, indexed by config_list_t */
+static const char *reload_list_names[CONFIG_LIST_MAX] = {
+	"TrustedMACList",
+	"TrustedLocalMACList",
+	"UntrustedMACList",
+	"TrustedPanDomains",
+	"TrustedDomains",
+	"TrustedIpList",
+};
+
+/** Serializes reloads from SIGHUP and wdctl */
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static sem_t reload_sem;
+static volatile sig_atomic_t reload_ready;
+
+static int
+reload_str_equal(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+static void
+reload_note(pstr_t *report, const char *name, int how)
+{
+	if (how == RELOAD_RESTART)
+		pstr_append_sprintf(report, "%s changed, kept until wifidog restarts\n", name);
+	else
+		pstr_append_sprintf(report, "%s changed\n", name);
+}
+
+static t_firewall_ruleset *
+reload_ruleset_find(const s_config *conf, const char *name)
+{
+	t_firewall_ruleset *p;
+
+	for (p = conf->rulesets; p != NULL && strcmp(p->name, name) != 0; p = p->next) ;
+
+	return p;
+}
+
+static t_firewall_rule *
+reload_ruleset_rules(const s_config *conf, const char *name)
+{
+	t_firewall_ruleset *p = reload_ruleset_find(conf, name);
+
+	return p ? p->rules : NULL;
+}
+
+static int
+reload_rules_equal(const t_firewall_rule *a, const t_firewall_rule *b)
+{
+	for (; a != NULL && b != NULL; a = a->next, b = b->next) {
+		if (a->target != b->target || a->mask_is_ipset != b->mask_is_ipset ||
+			!reload_str_equal(a->protocol, b->protocol) ||
+			!reload_str_equal(a->port, b->port) ||
+			!reload_str_equal(a->mask, b->mask))
+			return 0;
+	}
+
+	return a == b;
+}
+
+static int
+reload_auth_server_equal(const t_auth_serv *a, const t_auth_serv *b)
+{
+	return reload_str_equal(a->authserv_hostname, b->authserv_hostname) &&
+		reload_str_equal(a->authserv_path, b->authserv_path) &&
+		reload_str_equal(a->authserv_login_script_path_fragment, b->authserv_login_script_path_fragment) &&
+		reload_str_equal(a->authserv_portal_script_path_fragment, b->authserv_portal_script_path_fragment) &&
+		reload_str_equal(a->authserv_msg_script_path_fragment, b->authserv_msg_script_path_fragment) &&
+		reload_str_equal(a->authserv_ping_script_path_fragment, b->authserv_ping_script_path_fragment) &&
+		reload_str_equal(a->authserv_auth_script_path_fragment, b->authserv_auth_script_path_fragment) &&
+		a->authserv_http_port == b->authserv_http_port &&
+		a->authserv_ssl_port == b->authserv_ssl_port &&
+		a->authserv_use_ssl == b->authserv_use_ssl &&
+		a->authserv_connect_timeout == b->authserv_connect_timeout;
+}
+
+/** @internal
+ * The live list is rotated by mark_auth_server_bad(), so the lists are
+ * compared as sets */
+static int
+reload_auth_servers_equal(const t_auth_serv *live, const t_auth_serv *next)
+{
+	const t_auth_serv *a, *b;
+	int nr_live = 0, nr_next = 0;
+
+	for (a = live; a != NULL; a = a->next)
+		nr_live++;
+	for (b = next; b != NULL; b = b->next) {
+		nr_next++;
+		for (a = live; a != NULL && !reload_auth_server_equal(a, b); a = a->next) ;
+		if (a == NULL)
+			return 0;
+	}
+
+	return nr_live == nr_next;
+}
+
+static int
+reload_popular_servers_equal(const t_popular_server *a, const t_popular_server *b)
+{
+	for (; a != NULL && b != NULL; a = a->next, b = b->next) {
+		if (!reload_str_equal(a->hostname, b->hostname))
+			return 0;
+	}
+
+	return a == b;
+}
+
+/** @internal
+ * Whether the options the chains are built from changed; the firewall then
+ * has to be destroyed while the running configuration still describes it */
+static int
+reload_firewall_changed(const s_config *live, const s_config *next)
+{
+	return !reload_str_equal(live->gw_interface, next->gw_interface) ||
+		!reload_str_equal(live->external_interface, next->external_interface) ||
+		live->no_auth != next->no_auth ||
+		live->proxy_port != next->proxy_port ||
+		live->https_server->redirect_rate != next->https_server->redirect_rate ||
+		live->https_server->redirect_burst != next->https_server->redirect_burst ||
+		(reload_ruleset_rules(live, FWRULESET_AUTH_IS_DOWN) == NULL) !=
+			(reload_ruleset_rules(next, FWRULESET_AUTH_IS_DOWN) == NULL);
+}
+
+/** @internal
+ * Takes over a ruleset from the new configuration, its chains are reloaded
+ * by the caller. Only the reload and the firewall setup read the rules, so
+ * the old ones can go. */
+static void
+reload_ruleset(s_config *live, s_config *next, const char *name)
+{
+	t_firewall_ruleset *live_rs = reload_ruleset_find(live, name);
+	t_firewall_ruleset *next_rs = reload_ruleset_find(next, name);
+	t_firewall_ruleset **pp;
+	t_firewall_rule *old = live_rs ? live_rs->rules : NULL;
+
+	if (live_rs == NULL) {
+		/* move the whole ruleset over */
+		for (pp = &next->rulesets; *pp != next_rs; pp = &(*pp)->next) ;
+		*pp = next_rs->next;
+		next_rs->next = live->rulesets;
+		live->rulesets = next_rs;
+		return;
+	}
+
+	live_rs->rules = next_rs ? next_rs->rules : NULL;
+	if (next_rs)
+		next_rs->rules = NULL;
+	config_free_rules(old);
+}
+
+/** @internal
+ * A list option changed: the entries the old value added are removed and
+ * the new value's are added, so entries added at run time by wdctl or mqtt
+ * stay, then the list's ipset is filled again */
+static void
+reload_list(const char *old, const char *new, config_list_t which)
+{
+	switch (which) {
+	case CONFIG_LIST_TRUSTED_MAC:
+		if (old)
+			parse_del_trusted_mac_list(old);
+		if (new)
+			parse_trusted_mac_list(new);
+		fw_clear_trusted_maclist();
+		fw_set_trusted_maclist();
+		break;
+	case CONFIG_LIST_TRUSTED_LOCAL_MAC:
+		if (old)
+			parse_del_trusted_local_mac_list(old);
+		if (new)
+			parse_trusted_local_mac_list(new);
+		fw_clear_trusted_local_maclist();
+		fw_set_trusted_local_maclist();
+		break;
+	case CONFIG_LIST_UNTRUSTED_MAC:
+		if (old)
+			parse_del_untrusted_mac_list(old);
+		if (new)
+			parse_untrusted_mac_list(new);
+		fw_clear_untrusted_maclist();
+		fw_set_untrusted_maclist();
+		break;
+	case CONFIG_LIST_TRUSTED_PAN_DOMAINS:
+		if (old)
+			parse_del_trusted_pan_domain_string(old);
+		if (new)
+			parse_trusted_pan_domain_string(new);
+		fw_clear_pan_domains_trusted();
+		fw_set_pan_domains_trusted();
+		break;
+	case CONFIG_LIST_TRUSTED_DOMAINS:
+		if (old)
+			parse_del_trusted_domain_string(old);
+		if (new) {
+			parse_user_trusted_domain_string(new);
+			parse_user_trusted_domain_list();
+		}
+		fw_refresh_user_domains_trusted();
+		break;
+	case CONFIG_LIST_TRUSTED_IP:
+		/* the ips live in one pseudo domain which deleting drops as a whole */
+		if (old)
+			del_trusted_ip_list(old);
+		if (new)
+			add_trusted_ip_list(new);
+		fw_refresh_user_domains_trusted();
+		break;
+	default:
+		break;
+	}
+}
+
+/** Re-reads the config file and applies what changed in place
+ * @param report A line is appended for every changed option
+ * @return Number of changes applied, -1 if the file could not be read or is
+ * not valid, the running configuration is then untouched
+ */
+int
+reload_config(pstr_t *report)
+{
+	s_config *live = config_get_config();
+	s_config *next;
+	int applied = 0, rebuild, auth_changed, i;
+	t_auth_serv *a, *b;
+	char *old;
+
+	pthread_mutex_lock(&reload_mutex);
+
+	next = config_read_next(live->configfile);
+	if (next == NULL) {
+		pstr_append_sprintf(report, "%s is not valid, the running configuration is kept\n", live->configfile);
+		pthread_mutex_unlock(&reload_mutex);
+		return -1;
+	}
+
+	rebuild = reload_firewall_changed(live, next);
+	if (rebuild)
+		fw_destroy();
+
+	LOCK_CONFIG();
+
+	RELOAD_NUMBER(deltatraffic, "DeltaTraffic", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(clienttimeout, "ClientTimeout", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(checkinterval, "CheckInterval", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(ssl_verify, "SSLPeerVerification", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(ssl_use_sni, "SSLUseSNI", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(js_filter, "JsFilter", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(wired_passed, "WiredPassed", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(parse_checked, "ParseChecked", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(bypass_apple_cna, "BypassAppleCNA", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(update_domain_interval, "UpdateDomainInterval", RELOAD_IN_PLACE);
+	RELOAD_STRING(httpdname, "HTTPDName", RELOAD_IN_PLACE);
+	RELOAD_STRING(httpdrealm, "HTTPDRealm", RELOAD_IN_PLACE);
+	RELOAD_STRING(httpdusername, "HTTPDUserName", RELOAD_IN_PLACE);
+	RELOAD_STRING(httpdpassword, "HTTPDPassword", RELOAD_IN_PLACE);
+	RELOAD_STRING(ssl_certs, "SSLCertPath", RELOAD_IN_PLACE);
+	RELOAD_STRING(ssl_cipher_list, "SSLAllowedCipherList", RELOAD_IN_PLACE);
+	RELOAD_STRING(dns_timeout, "DNSTimeout", RELOAD_IN_PLACE);
+	RELOAD_NUMBER(client_journal_sync_interval, "ClientJournalSyncInterval", RELOAD_IN_PLACE);
+	/* derived from GatewayInterface at startup when not set */
+	if (next->gw_id)
+		RELOAD_STRING(gw_id, "GatewayID", RELOAD_IN_PLACE);
+
+	RELOAD_STRING(gw_interface, "GatewayInterface", RELOAD_FIREWALL);
+	RELOAD_STRING(external_interface, "ExternalInterface", RELOAD_FIREWALL);
+	RELOAD_NUMBER(no_auth, "NoAuth", RELOAD_FIREWALL);
+	RELOAD_NUMBER(proxy_port, "ProxyPort", RELOAD_FIREWALL);
+	RELOAD_NUMBER(https_server->redirect_rate, "HttpsRedirectRate", RELOAD_FIREWALL);
+	RELOAD_NUMBER(https_server->redirect_burst, "HttpsRedirectBurst", RELOAD_FIREWALL);
+
+	if (next->gw_address)
+		RELOAD_STRING(gw_address, "GatewayAddress", RELOAD_RESTART);
+	RELOAD_NUMBER(gw_port, "GatewayPort", RELOAD_RESTART);
+	RELOAD_STRING(wdctl_sock, "WdctlSocket", RELOAD_RESTART);
+	RELOAD_NUMBER(httpdmaxconn, "HTTPDMaxConn", RELOAD_RESTART);
+	RELOAD_STRING(htmlmsgfile, "HtmlMessageFile", RELOAD_RESTART);
+	RELOAD_NUMBER(pool_mode, "PoolMode", RELOAD_RESTART);
+	RELOAD_NUMBER(thread_number, "ThreadNumber", RELOAD_RESTART);
+	RELOAD_NUMBER(queue_size, "QueueSize", RELOAD_RESTART);
+	RELOAD_NUMBER(work_mode, "WorkMode", RELOAD_RESTART);
+	RELOAD_NUMBER(enable_ipv6, "EnableIpv6", RELOAD_RESTART);
+	RELOAD_NUMBER(client_conn_rate, "ClientConnRate", RELOAD_RESTART);
+	RELOAD_NUMBER(client_conn_burst, "ClientConnBurst", RELOAD_RESTART);
+	RELOAD_STRING(client_journal, "ClientJournal", RELOAD_RESTART);
+	RELOAD_NUMBER(https_server->gw_https_port, "GatewayHttpsPort", RELOAD_RESTART);
+	RELOAD_NUMBER(https_server->session_cache_size, "HttpsSessionCacheSize", RELOAD_RESTART);
+	RELOAD_NUMBER(https_server->session_timeout, "HttpsSessionTimeout", RELOAD_RESTART);
+	RELOAD_NUMBER(https_server->session_tickets, "HttpsSessionTickets", RELOAD_RESTART);
+	RELOAD_NUMBER(https_server->ticket_key_lifetime, "HttpsTicketKeyLifetime", RELOAD_RESTART);
+	RELOAD_STRING(https_server->cipher_list, "HttpsCipherList", RELOAD_RESTART);
+	RELOAD_STRING(https_server->cipher_suites, "HttpsCipherSuites", RELOAD_RESTART);
+	RELOAD_STRING(https_server->curves, "HttpsCurves", RELOAD_RESTART);
+	RELOAD_NUMBER(https_server->sni_peek, "HttpsSniPeek", RELOAD_RESTART);
+	RELOAD_STRING(mqtt_server->hostname, "MQTT serveraddr", RELOAD_RESTART);
+	RELOAD_NUMBER(mqtt_server->port, "MQTT serverport", RELOAD_RESTART);
+	RELOAD_STRING(pool_server->pool_server, "PoolServer", RELOAD_RESTART);
+	RELOAD_NUMBER(pool_server->port, "PoolServerPort", RELOAD_RESTART);
+	RELOAD_STRING(pool_server->coinbase_address, "CoinbaseAddress", RELOAD_RESTART);
+
+	auth_changed = !reload_auth_servers_equal(live->auth_servers, next->auth_servers);
+	if (auth_changed) {
+		reload_note(report, "AuthServer", RELOAD_IN_PLACE);
+		/* keep the address the ping thread resolved until it resolves again */
+		for (b = next->auth_servers; b != NULL; b = b->next) {
+			for (a = live->auth_servers; a != NULL; a = a->next) {
+				if (a->last_ip && reload_str_equal(a->authserv_hostname, b->authserv_hostname)) {
+					b->last_ip = safe_strdup(a->last_ip);
+					break;
+				}
+			}
+		}
+		/* the old servers are not freed, the ping thread holds one */
+		live->auth_servers = next->auth_servers;
+		next->auth_servers = NULL;
+		applied++;
+	}
+
+	if (!reload_popular_servers_equal(live->popular_servers, next->popular_servers)) {
+		reload_note(report, "PopularServers", RELOAD_IN_PLACE);
+		live->popular_servers = next->popular_servers;
+		next->popular_servers = NULL;
+		applied++;
+	}
+
+	UNLOCK_CONFIG();
+
+	for (i = 0; reload_rulesets[i]; i++) {
+		if (reload_rules_equal(reload_ruleset_rules(live, reload_rulesets[i]),
+				reload_ruleset_rules(next, reload_rulesets[i])))
+			continue;
+		pstr_append_sprintf(report, "FirewallRuleSet %s changed\n", reload_rulesets[i]);
+		reload_ruleset(live, next, reload_rulesets[i]);
+		if (!rebuild)
+			fw_reload_ruleset(reload_rulesets[i]);
+		applied++;
+	}
+
+	if (rebuild) {
+		if (fw_rebuild())
+			pstr_cat(report, "Firewall rebuilt\n");
+		else
+			pstr_cat(report, "Firewall rebuild failed\n");
+	} else if (auth_changed) {
+		fw_clear_authservers();
+		fw_set_authservers();
+	}
+
+	for (i = 0; i < CONFIG_LIST_MAX; i++) {
+		if (reload_str_equal(live->lists[i], next->lists[i]))
+			continue;
+		reload_note(report, reload_list_names[i], RELOAD_IN_PLACE);
+		reload_list(live->lists[i], next->lists[i], i);
+		old = live->lists[i];
+		live->lists[i] = next->lists[i];
+		next->lists[i] = NULL;
+		free(old);
+		applied++;
+	}
+
+	config_free(next);
+
+	if (applied == 0)
+		pstr_cat(report, "Nothing to apply\n");
+	else
+		config_snapshot_publish();
+
+	pthread_mutex_unlock(&reload_mutex);
+
+	return applied;
+}
+
+/** Wakes the reload thread. sem_post is async-signal-safe, a SIGHUP which
+ * comes before the thread runs is dropped */
+void
+reload_request(void)
+{
+	if (reload_ready)
+		sem_post(&reload_sem);
+}
+
+/** Reloads the configuration each time SIGHUP asks for it and logs what
+ * changed
+ * @param arg NULL
+ */
+void
+thread_reload(void *arg)
+{
+	pstr_t *report;
+	char *text, *line, *saveptr = NULL;
+
+	sem_init(&reload_sem, 0, 0);
+	reload_ready = 1;
+
+	while (1) {
+		if (sem_wait(&reload_sem) != 0)
+			continue;
+
+		debug(LOG_NOTICE, "Reloading %s", config_get_config()->configfile);
+		report = pstr_new();
+		reload_config(report);
+		text = pstr_to_string(report);
+		for (line = strtok_r(text, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+			debug(LOG_NOTICE, "Reload: %s", line);
+		free(text);
+	}
+}
@@ -0,0 +1,42 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file reload.h
+  @brief re-read wifidog.conf and apply what changed without a restart
+  */
+
+#ifndef	_RELOAD_H_
+#define	_RELOAD_H_
+
+#include "pstring.h"
+
+/** @brief Re-read the config file and apply what changed, a line per change goes to report
+ * @return Number of changes applied, -1 if the file could not be read or is not valid */
+int reload_config(pstr_t *report);
+
+/** @brief Ask the reload thread for a reload, safe to call from a signal handler */
+void reload_request(void);
+
+/** @brief Thread doing the reloads asked for by SIGHUP */
+void thread_reload(void *arg);
+
+#endif
@@ -48,6 +48,7 @@
 #include "openssl_hostname_validation.h"
 #include "conf.h"
 #include "version.h"
+#include "metrics.h"
 
 static int ignore_cert = 0;
 
@@ -634,7 +635,9 @@ evhttps_request(struct evhttps_request_context *context, const char *uri, int ti
 	struct evhttp_request *req;
 	
 	int ret = 0;
+	uint64_t start = metric_now_us();
 		
+	metric_inc(METRIC_AUTH_REQUESTS);
 	
 	// Create OpenSSL bufferevent and stack evhttp on top of it
 	ssl = SSL_new(ssl_ctx);
@@ -682,8 +685,13 @@ evhttps_request(struct evhttps_request_context *context, const char *uri, int ti
 	}
 
 	event_base_dispatch(base);
+	metric_observe_since(METRIC_AUTH_LATENCY, start);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	return;
 
 cleanup:
+	metric_inc(METRIC_AUTH_FAILURES);
 	if (evcon)
 		evhttp_connection_free(evcon);
 }
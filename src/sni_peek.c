@@ -0,0 +1,339 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file sni_peek.c
+  @brief answer captive https probes from their ClientHello, without a handshake
+
+  An unauthenticated client gets no use of a handshake with our self
+  signed certificate: it rejects it anyway. In this mode gw_https_port
+  only reads the first TLS record, takes the server name out of the
+  ClientHello for the statistics and drops the connection with a TLS
+  alert or a reset, so a probe costs no signature at all.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "debug.h"
+#include "metrics.h"
+#include "rate_limit.h"
+#include "util.h"
+#include "sni_peek.h"
+
+#define	TLS_RECORD_HEADER	5
+#define	TLS_RECORD_MAX		(TLS_RECORD_HEADER + 16384)
+#define	TLS_HANDSHAKE		0x16
+#define	TLS_CLIENT_HELLO	0x01
+#define	TLS_EXT_SERVER_NAME	0x0000
+
+#define	TLS_ALERT_HANDSHAKE_FAILURE	40
+#define	TLS_ALERT_UNRECOGNIZED_NAME	112
+
+/** seconds a client has to send its ClientHello */
+#define	SNI_PEEK_TIMEOUT	5
+
+struct sni_host {
+	char			name[256];
+	unsigned long	hits;
+};
+
+static pthread_mutex_t sni_hosts_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sni_host sni_hosts[SNI_PEEK_HOSTS];
+static int nr_sni_hosts;
+static unsigned long sni_other_hits;
+
+static int sni_peek_mode;
+
+#define	get16(p)	(((p)[0] << 8) | (p)[1])
+#define	get24(p)	(((p)[0] << 16) | ((p)[1] << 8) | (p)[2])
+
+int
+sni_parse_client_hello(const unsigned char *buf, size_t len, char *host, size_t hostlen)
+{
+	const unsigned char *p, *end;
+	size_t rlen, n;
+
+	if (len == 0)
+		return SNI_NEED_MORE;
+	if (buf[0] != TLS_HANDSHAKE || (len > 1 && buf[1] != 3))
+		return SNI_NOT_HELLO;
+	if (len < TLS_RECORD_HEADER)
+		return SNI_NEED_MORE;
+
+	rlen = get16(buf + 3);
+	if (rlen == 0 || rlen + TLS_RECORD_HEADER > TLS_RECORD_MAX)
+		return SNI_NOT_HELLO;
+	if (len < rlen + TLS_RECORD_HEADER)
+		return SNI_NEED_MORE;
+
+	/* a ClientHello split over several records is only read up to the first one's end */
+	p = buf + TLS_RECORD_HEADER;
+	end = p + rlen;
+	if (end - p < 4 || p[0] != TLS_CLIENT_HELLO)
+		return SNI_NOT_HELLO;
+	if ((size_t)get24(p + 1) < (size_t)(end - p - 4))
+		end = p + 4 + get24(p + 1);
+	p += 4;
+
+	/* client_version, random */
+	if (end - p < 2 + 32 + 1)
+		return SNI_NONE;
+	p += 2 + 32;
+	/* session_id */
+	p += 1 + p[0];
+	/* cipher_suites */
+	if (end - p < 2)
+		return SNI_NONE;
+	p += 2 + get16(p);
+	/* compression_methods */
+	if (end - p < 1)
+		return SNI_NONE;
+	p += 1 + p[0];
+	/* extensions */
+	if (end - p < 2)
+		return SNI_NONE;
+	if (get16(p) < end - p - 2)
+		end = p + 2 + get16(p);
+	p += 2;
+
+	while (end - p >= 4) {
+		int type = get16(p), elen = get16(p + 2);
+
+		p += 4;
+		if (elen > end - p)
+			break;
+		if (type != TLS_EXT_SERVER_NAME) {
+			p += elen;
+			continue;
+		}
+
+		/* server_name_list with host_name(0) entries */
+		end = p + elen;
+		if (end - p < 2)
+			break;
+		p += 2;
+		while (end - p >= 3) {
+			int ntype = p[0];
+
+			n = get16(p + 1);
+			p += 3;
+			if (n > (size_t)(end - p))
+				break;
+			if (ntype == 0 && n > 0 && n < hostlen) {
+				size_t i;
+
+				for (i = 0; i < n; i++) {
+					if (!isgraph(p[i]))
+						return SNI_NONE;
+					host[i] = tolower(p[i]);
+				}
+				host[n] = 0;
+				return n;
+			}
+			p += n;
+		}
+		break;
+	}
+
+	return SNI_NONE;
+}
+
+static void
+sni_host_record(const char *host)
+{
+	int i;
+
+	pthread_mutex_lock(&sni_hosts_mutex);
+	for (i = 0; i < nr_sni_hosts; i++) {
+		if (!strcmp(sni_hosts[i].name, host))
+			break;
+	}
+	if (i < nr_sni_hosts) {
+		sni_hosts[i].hits++;
+	} else if (nr_sni_hosts < SNI_PEEK_HOSTS) {
+		snprintf(sni_hosts[i].name, sizeof(sni_hosts[i].name), "%s", host);
+		sni_hosts[i].hits = 1;
+		nr_sni_hosts++;
+	} else {
+		sni_other_hits++;
+	}
+	pthread_mutex_unlock(&sni_hosts_mutex);
+}
+
+void
+sni_peek_render(pstr_t *pstr)
+{
+	int i;
+
+	pthread_mutex_lock(&sni_hosts_mutex);
+	if (nr_sni_hosts) {
+		pstr_cat(pstr, "\nHTTPS server names peeked:\n");
+		for (i = 0; i < nr_sni_hosts; i++)
+			pstr_append_sprintf(pstr, "  %-48s %lu\n", sni_hosts[i].name, sni_hosts[i].hits);
+		if (sni_other_hits)
+			pstr_append_sprintf(pstr, "  %-48s %lu\n", "(other)", sni_other_hits);
+	}
+	pthread_mutex_unlock(&sni_hosts_mutex);
+}
+
+static void
+sni_peek_close(struct bufferevent *bev, int reset)
+{
+	if (reset) {
+		struct linger lg = { 1, 0 };
+
+		setsockopt(bufferevent_getfd(bev), SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	}
+	bufferevent_free(bev);
+}
+
+static void
+sni_peek_write_cb(struct bufferevent *bev, void *ctx)
+{
+	/* the alert is out */
+	sni_peek_close(bev, 0);
+}
+
+static void
+sni_peek_read_cb(struct bufferevent *bev, void *ctx)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t len = evbuffer_get_length(input);
+	unsigned char alert[7] = { 0x15, 3, 1, 0, 2, 2, TLS_ALERT_HANDSHAKE_FAILURE };
+	unsigned char *buf;
+	char host[256];
+	int n;
+
+	if (len > TLS_RECORD_MAX)
+		len = TLS_RECORD_MAX;
+	buf = evbuffer_pullup(input, len);
+	n = sni_parse_client_hello(buf, len, host, sizeof(host));
+	if (n == SNI_NEED_MORE)
+		return;
+
+	if (n > 0) {
+		metric_inc(METRIC_HTTPS_SNI_PEEKS);
+		sni_host_record(host);
+		debug(LOG_DEBUG, "Peeked https server name %s", host);
+		alert[6] = TLS_ALERT_UNRECOGNIZED_NAME;
+	} else {
+		metric_inc(METRIC_HTTPS_SNI_MISSING);
+		if (n == SNI_NOT_HELLO) {
+			sni_peek_close(bev, 1);
+			return;
+		}
+	}
+
+	if (sni_peek_mode == SNI_PEEK_RESET) {
+		sni_peek_close(bev, 1);
+		return;
+	}
+
+	/* answer in the record version of the hello */
+	alert[2] = buf[2];
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setcb(bev, NULL, sni_peek_write_cb, NULL, NULL);
+	bufferevent_write(bev, alert, sizeof(alert));
+}
+
+static void
+sni_peek_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT))
+		sni_peek_close(bev, 0);
+}
+
+static void
+sni_peek_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+				   struct sockaddr *addr, int socklen, void *ctx)
+{
+	struct event_base *base = evconnlistener_get_base(listener);
+	struct timeval tv = { SNI_PEEK_TIMEOUT, 0 };
+	struct bufferevent *bev;
+	t_ip_key key;
+
+	if (ip_key_from_sockaddr(addr, &key) &&
+		!rate_limit_allow(https_rate_limit, ip_key_prefix_fold(&key))) {
+		metric_inc(METRIC_HTTPS_RATE_LIMITED);
+		evutil_closesocket(fd);
+		return;
+	}
+
+	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!bev) {
+		evutil_closesocket(fd);
+		return;
+	}
+	bufferevent_setcb(bev, sni_peek_read_cb, NULL, sni_peek_event_cb, NULL);
+	bufferevent_setwatermark(bev, EV_READ, 0, TLS_RECORD_MAX);
+	bufferevent_set_timeouts(bev, &tv, &tv);
+	bufferevent_enable(bev, EV_READ);
+}
+
+int
+sni_peek_listen(struct event_base *base, const char *ip, unsigned short port, int mode)
+{
+	struct evconnlistener *listener;
+	struct sockaddr_in sin;
+	int fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family	= AF_INET;
+	sin.sin_port	= htons(port);
+	sni_peek_mode = mode;
+
+	if (ip && strcmp(ip, "::") == 0) {
+		if ((fd = listen_socket6(port)) < 0)
+			return 0;
+		listener = evconnlistener_new(base, sni_peek_accept_cb, NULL, LEV_OPT_CLOSE_ON_FREE, -1, fd);
+		if (!listener)
+			close(fd);
+	} else if (!ip || inet_pton(AF_INET, ip, &sin.sin_addr) != 1) {
+		debug(LOG_ERR, "Invalid https peek address %s", ip ? ip : "(null)");
+		return 0;
+	} else {
+		listener = evconnlistener_new_bind(base, sni_peek_accept_cb, NULL,
+					LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+					(struct sockaddr *)&sin, sizeof(sin));
+	}
+	if (!listener) {
+		debug(LOG_ERR, "couldn't bind to port %d: %s", port, strerror(errno));
+		return 0;
+	}
+
+	debug(LOG_INFO, "https server name peek on %s:%d", ip, port);
+	return 1;
+}
@@ -0,0 +1,58 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file sni_peek.h
+  @brief answer captive https probes from their ClientHello, without a handshake
+  */
+
+#ifndef	_SNI_PEEK_H_
+#define	_SNI_PEEK_H_
+
+#include <stddef.h>
+
+#include "pstring.h"
+
+struct event_base;
+
+/** values of t_https_server.sni_peek */
+#define	SNI_PEEK_OFF	0
+#define	SNI_PEEK_ALERT	1	/** answer with a fatal TLS alert, then close */
+#define	SNI_PEEK_RESET	2	/** reset the connection */
+
+/** Hosts counted one by one, the others are summed up */
+#define	SNI_PEEK_HOSTS	64
+
+/** results of sni_parse_client_hello besides the host length */
+#define	SNI_NONE		0	/** a ClientHello without server name */
+#define	SNI_NEED_MORE	-1
+#define	SNI_NOT_HELLO	-2
+
+/** @brief Extract the server name of a TLS ClientHello, returns its length or one of SNI_* */
+int sni_parse_client_hello(const unsigned char *, size_t, char *host, size_t hostlen);
+
+/** @brief Listen on ip:port and answer every ClientHello as configured, "::" listens for ipv6 clients */
+int sni_peek_listen(struct event_base *, const char *ip, unsigned short port, int mode);
+
+/** @brief Append the server names seen so far to a wdctl status */
+void sni_peek_render(pstr_t *);
+
+#endif
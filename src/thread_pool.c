@@ -37,6 +37,7 @@
 #include <errno.h>
 
 #include "thread_pool.h"
+#include "metrics.h"
 
 //>>> liudf added 20160224
 int
@@ -57,11 +58,13 @@ typedef enum {
  *
  *  @var function Pointer to the function that will perform the task.
  *  @var argument Argument to be passed to the function.
+ *  @var queued_at When the task was queued, for the queue wait metric.
  */
 
 typedef struct {
     void (*function)(void *);
     void *argument;
+    uint64_t queued_at;
 } threadpool_task_t;
 
 /**
@@ -187,8 +190,10 @@ int threadpool_add(threadpool_t *pool, void (*function)(void *),
         /* Add task to queue */
         pool->queue[pool->tail].function = function;
         pool->queue[pool->tail].argument = argument;
+        pool->queue[pool->tail].queued_at = metric_now_us();
         pool->tail = next;
         pool->count += 1;
+        metric_set(METRIC_THREADPOOL_QUEUED, pool->count);
 
         /* pthread_cond_broadcast */
         if(pthread_cond_signal(&(pool->notify)) != 0) {
@@ -201,6 +206,10 @@ int threadpool_add(threadpool_t *pool, void (*function)(void *),
         err = threadpool_lock_failure;
     }
 
+    if(err == threadpool_queue_full) {
+        metric_inc(METRIC_THREADPOOL_REJECTED);
+    }
+
     return err;
 }
 
@@ -295,15 +304,20 @@ static void *threadpool_thread(void *threadpool)
         /* Grab our task */
         task.function = pool->queue[pool->head].function;
         task.argument = pool->queue[pool->head].argument;
+        task.queued_at = pool->queue[pool->head].queued_at;
         pool->head += 1;
         pool->head = (pool->head == pool->queue_size) ? 0 : pool->head;
         pool->count -= 1;
+        metric_set(METRIC_THREADPOOL_QUEUED, pool->count);
 
         /* Unlock */
         pthread_mutex_unlock(&(pool->lock));
 
         /* Get to work */
+        metric_observe_since(METRIC_THREADPOOL_WAIT, task.queued_at);
+        metric_inc(METRIC_THREADPOOL_BUSY);
         (*(task.function))(task.argument);
+        metric_dec(METRIC_THREADPOOL_BUSY);
     }
 
     pool->started--;
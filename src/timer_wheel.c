@@ -0,0 +1,172 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file timer_wheel.c
+  @brief hierarchical timer wheel, one second per tick
+
+  Timers closer than TIMER_WHEEL_SIZE ticks sit in the first level, each
+  higher level covers TIMER_WHEEL_SIZE times the range of the one below.
+  Whenever a level wraps, the matching slot of the next level is cascaded
+  down, so adding, deleting and expiring a timer is O(1) and a tick only
+  touches the timers which are due.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "safe.h"
+#include "timer_wheel.h"
+
+#define	TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define	LEVEL_INDEX(t, l)	(((t) >> ((l) * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK)
+#define	MAX_TIMEOUT			((1UL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+struct _timer_wheel_t {
+	unsigned long		now;	/** last tick processed */
+	struct wheel_timer	*slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
+timer_wheel_t *
+timer_wheel_create(unsigned long now)
+{
+	timer_wheel_t *wheel = safe_malloc(sizeof(timer_wheel_t));
+	wheel->now = now;
+	return wheel;
+}
+
+void
+timer_wheel_destroy(timer_wheel_t *wheel)
+{
+	free(wheel);
+}
+
+static void
+link_timer(struct wheel_timer **head, struct wheel_timer *timer)
+{
+	timer->next = *head;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+/*
+ * a timer lives in the lowest level above which its expiry and the current
+ * tick agree, so it is cascaded exactly when the current tick enters its range
+ */
+static void
+__timer_wheel_insert(timer_wheel_t *wheel, struct wheel_timer *timer)
+{
+	unsigned long expires = timer->expires;
+	int level;
+
+	if ((long)(expires - wheel->now) < 0)
+		expires = wheel->now;
+	if (expires - wheel->now > MAX_TIMEOUT)
+		expires = wheel->now + MAX_TIMEOUT;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if ((expires >> ((level + 1) * TIMER_WHEEL_BITS)) == (wheel->now >> ((level + 1) * TIMER_WHEEL_BITS)))
+			break;
+	}
+
+	link_timer(&wheel->slots[level][LEVEL_INDEX(expires, level)], timer);
+}
+
+void
+timer_wheel_add(timer_wheel_t *wheel, struct wheel_timer *timer, unsigned long expires)
+{
+	timer_wheel_del(timer);
+
+	/* the slot of the current tick was already run */
+	if ((long)(expires - wheel->now) <= 0)
+		expires = wheel->now + 1;
+	timer->expires = expires;
+	__timer_wheel_insert(wheel, timer);
+}
+
+void
+timer_wheel_del(struct wheel_timer *timer)
+{
+	if (!timer->pprev)
+		return;
+
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+int
+timer_wheel_pending(const struct wheel_timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+// move the timers of a higher level slot down now that it is in range
+static void
+cascade(timer_wheel_t *wheel, int level)
+{
+	struct wheel_timer *timer = wheel->slots[level][LEVEL_INDEX(wheel->now, level)];
+	struct wheel_timer *next;
+
+	wheel->slots[level][LEVEL_INDEX(wheel->now, level)] = NULL;
+	for (; timer != NULL; timer = next) {
+		next = timer->next;
+		timer->pprev = NULL;
+		__timer_wheel_insert(wheel, timer);
+	}
+}
+
+/**
+ * Run the wheel up to tick now.
+ * Expired timers are disarmed before their callback, which may re-arm them
+ * or free their owner.
+ * @return number of expired timers
+ */
+int
+timer_wheel_advance(timer_wheel_t *wheel, unsigned long now, wheel_timer_cb cb, void *arg)
+{
+	struct wheel_timer *timer;
+	int level, expired = 0;
+
+	while ((long)(now - wheel->now) > 0) {
+		wheel->now++;
+
+		for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			if (LEVEL_INDEX(wheel->now, level - 1) != 0)
+				break;
+			cascade(wheel, level);
+		}
+
+		/* the callback may delete other timers of this slot, always take the head */
+		while ((timer = wheel->slots[0][LEVEL_INDEX(wheel->now, 0)]) != NULL) {
+			timer_wheel_del(timer);
+			expired++;
+			if (cb)
+				cb(timer, arg);
+		}
+	}
+
+	return expired;
+}
@@ -0,0 +1,67 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/* $Id$ */
+/** @file timer_wheel.h
+  @brief hierarchical timer wheel, one second per tick
+  */
+
+#ifndef	_TIMER_WHEEL_H_
+#define	_TIMER_WHEEL_H_
+
+/** Bits of slots per level, 4 levels of 64 slots cover 2^24 ticks */
+#define	TIMER_WHEEL_BITS	6
+#define	TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define	TIMER_WHEEL_LEVELS	4
+
+/**
+ * Timer node, embedded into the object owning the deadline.
+ * The owner keeps the storage, the wheel only links it.
+ */
+struct wheel_timer {
+	struct wheel_timer	*next;
+	struct wheel_timer	**pprev;	/** NULL when not armed */
+	unsigned long		expires;	/** tick the timer fires at */
+};
+
+typedef struct _timer_wheel_t timer_wheel_t;
+
+typedef void (*wheel_timer_cb)(struct wheel_timer *, void *);
+
+/** @brief Create a timer wheel whose current tick is now */
+timer_wheel_t *timer_wheel_create(unsigned long now);
+
+/** @brief Free a timer wheel, armed timers are just forgotten */
+void timer_wheel_destroy(timer_wheel_t *);
+
+/** @brief Arm or re-arm a timer, a deadline in the past fires on the next tick */
+void timer_wheel_add(timer_wheel_t *, struct wheel_timer *, unsigned long expires);
+
+/** @brief Disarm a timer, no-op if it is not armed */
+void timer_wheel_del(struct wheel_timer *);
+
+/** @brief Whether the timer is armed */
+int timer_wheel_pending(const struct wheel_timer *);
+
+/** @brief Move the wheel to tick now and call cb for every timer that expired */
+int timer_wheel_advance(timer_wheel_t *, unsigned long now, wheel_timer_cb cb, void *arg);
+
+#endif /* _TIMER_WHEEL_H_ */
@@ -63,7 +63,17 @@
 /** @brief FD for icmp raw socket */
 static int icmp_fd;
 
+/** @brief id of the echoes sent by icmp_ping and icmp_ping_batch on icmp_fd */
+static unsigned short icmp_echo_id;
+
+/** @brief echo request sent on icmp_fd, carries its send time back in the reply */
+struct icmp_echo {
+    struct icmphdr hdr;
+    struct timeval sent;
+};
+
 static unsigned short rand16(void);
+static unsigned short icmp_checksum(const void *, int);
 
 
 /** Initialize the ICMP socket
@@ -72,17 +82,18 @@ static unsigned short rand16(void);
 int
 init_icmp_socket(void)
 {
-    int flags, oneopt = 1, zeroopt = 0;
+    int flags, rcvbuf = ICMP_RCVBUF_SIZE, zeroopt = 0;
 
     debug(LOG_INFO, "Creating ICMP socket");
     if ((icmp_fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) == -1 ||
         (flags = fcntl(icmp_fd, F_GETFL, 0)) == -1 ||
         fcntl(icmp_fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
-        setsockopt(icmp_fd, SOL_SOCKET, SO_RCVBUF, &oneopt, sizeof(oneopt)) ||
+        setsockopt(icmp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) ||
         setsockopt(icmp_fd, SOL_SOCKET, SO_DONTROUTE, &zeroopt, sizeof(zeroopt)) == -1) {
         debug(LOG_ERR, "Cannot create ICMP raw socket.");
         return 0;
     }
+    icmp_echo_id = rand16();
     return 1;
 }
 
@@ -94,6 +105,17 @@ close_icmp_socket(void)
     close(icmp_fd);
 }
 
+static void
+icmp_echo_init(struct icmp_echo *echo, unsigned short seq)
+{
+    memset(echo, 0, sizeof(*echo));
+    echo->hdr.type = ICMP_ECHO;
+    echo->hdr.un.echo.id = icmp_echo_id;
+    echo->hdr.un.echo.sequence = htons(seq);
+    gettimeofday(&echo->sent, NULL);
+    echo->hdr.checksum = icmp_checksum(echo, sizeof(*echo));
+}
+
 /**
  * Ping an IP.
  * @param IP/host as string, will be sent to gethostbyname
@@ -102,13 +124,7 @@ void
 icmp_ping(const char *host)
 {
     struct sockaddr_in saddr;
-    struct {
-        struct ip ip;
-        struct icmp icmp;
-    } packet;
-    unsigned int i, j;
-    int opt = 2000;
-    unsigned short id = rand16();
+    struct icmp_echo echo;
 
     memset(&saddr, 0, sizeof(saddr));
     saddr.sin_family = AF_INET;
@@ -117,30 +133,129 @@ icmp_ping(const char *host)
     saddr.sin_len = sizeof(struct sockaddr_in);
 #endif
 
-    memset(&packet.icmp, 0, sizeof(packet.icmp));
-    packet.icmp.icmp_type = ICMP_ECHO;
-    packet.icmp.icmp_id = id;
+    icmp_echo_init(&echo, 0);
 
-    for (j = 0, i = 0; i < sizeof(struct icmp) / 2; i++)
-        j += ((unsigned short *)&packet.icmp)[i];
+    if (sendto(icmp_fd, &echo, sizeof(echo), 0,
+               (const struct sockaddr *)&saddr, sizeof(saddr)) == -1)
+        debug(LOG_ERR, "sendto(): %s", strerror(errno));
 
-    while (j >> 16)
-        j = (j & 0xffff) + (j >> 16);
+    return;
+}
 
-    packet.icmp.icmp_cksum = (j == 0xffff) ? j : ~j;
+/**
+ * Ping a batch of IPs on the shared icmp socket, ICMP_BATCH_SIZE echoes per sendmmsg.
+ * Replies are picked up later by icmp_collect_replies.
+ * @param addrs IPs to ping
+ * @param n number of IPs
+ * @return number of echoes sent
+ */
+int
+icmp_ping_batch(const struct in_addr *addrs, int n)
+{
+    struct sockaddr_in saddr[ICMP_BATCH_SIZE];
+    struct icmp_echo echo[ICMP_BATCH_SIZE];
+    struct iovec iov[ICMP_BATCH_SIZE];
+    struct mmsghdr msgs[ICMP_BATCH_SIZE];
+    int i, m, ret, sent = 0;
+
+    while (sent < n) {
+        m = (n - sent) > ICMP_BATCH_SIZE ? ICMP_BATCH_SIZE : (n - sent);
+        memset(msgs, 0, m * sizeof(struct mmsghdr));
+        for (i = 0; i < m; i++) {
+            memset(&saddr[i], 0, sizeof(struct sockaddr_in));
+            saddr[i].sin_family = AF_INET;
+            saddr[i].sin_addr = addrs[sent + i];
+            icmp_echo_init(&echo[i], sent + i);
+            iov[i].iov_base = &echo[i];
+            iov[i].iov_len = sizeof(struct icmp_echo);
+            msgs[i].msg_hdr.msg_name = &saddr[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        ret = sendmmsg(icmp_fd, msgs, m, 0);
+        if (ret <= 0) {
+            /* an unreachable destination fails only its own message, skip it */
+            debug(LOG_DEBUG, "sendmmsg(%s): %s", inet_ntoa(addrs[sent]), strerror(errno));
+            ret = 1;
+        }
+        sent += ret;
+    }
 
-    if (setsockopt(icmp_fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1)
-        debug(LOG_ERR, "setsockopt(): %s", strerror(errno));
+    return sent;
+}
 
-    if (sendto(icmp_fd, (char *)&packet.icmp, sizeof(struct icmp), 0,
-               (const struct sockaddr *)&saddr, sizeof(saddr)) == -1)
-        debug(LOG_ERR, "sendto(): %s", strerror(errno));
+/**
+ * Collect echo replies of icmp_ping/icmp_ping_batch queued on the shared icmp socket.
+ * Drains what is already queued, then keeps waiting for more until timeout
+ * or expected replies have been seen.
+ * @param timeout max time waiting for replies in ms, 0 only drains the queue
+ * @param expected stop waiting after this many replies, 0 means no limit
+ * @param cb called with the replying IP and its round trip time in ms
+ * @param arg passed to cb
+ * @return number of replies
+ */
+int
+icmp_collect_replies(int timeout, int expected, void (*cb)(struct in_addr, unsigned int, void *), void *arg)
+{
+    struct timeval start, now;
+    struct pollfd pfd;
+    char buf[1500];
+    int replies = 0;
+    long left;
+
+    gettimeofday(&start, NULL);
+    pfd.fd = icmp_fd;
+    pfd.events = POLLIN;
+
+    do {
+        for (;;) {
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            struct ip *ip = (struct ip *)buf;
+            struct icmp_echo *reply;
+            ssize_t len = recvfrom(icmp_fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+            long rtt;
+
+            if (len <= 0)
+                break;
+            if (len < (ip->ip_hl << 2) + (ssize_t)sizeof(struct icmp_echo))
+                continue;
+
+            reply = (struct icmp_echo *)(buf + (ip->ip_hl << 2));
+            if (reply->hdr.type != ICMP_ECHOREPLY || reply->hdr.un.echo.id != icmp_echo_id)
+                continue;
+
+            gettimeofday(&now, NULL);
+            rtt = (now.tv_sec - reply->sent.tv_sec) * 1000 + (now.tv_usec - reply->sent.tv_usec) / 1000;
+            replies++;
+            if (cb)
+                cb(from.sin_addr, rtt < 0 ? 0 : rtt, arg);
+        }
 
-    opt = 1;
-    if (setsockopt(icmp_fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1)
-        debug(LOG_ERR, "setsockopt(): %s", strerror(errno));
+        gettimeofday(&now, NULL);
+        left = timeout - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+    } while (left > 0 && (expected <= 0 || replies < expected) && poll(&pfd, 1, left) > 0);
 
-    return;
+    return replies;
+}
+
+static unsigned short
+icmp_checksum(const void *buf, int len)
+{
+    const unsigned short *w = buf;
+    unsigned int sum = 0;
+
+    for (; len > 1; len -= 2)
+        sum += *w++;
+    if (len == 1)
+        sum += *(const unsigned char *)w;
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return (sum == 0xffff) ? sum : ~sum;
 }
 
 /** Get a 16-bit unsigned random number.
@@ -205,6 +320,121 @@ is_valid_ip(const char *ip)
     return result != 0;
 }
 
+int
+is_valid_ip6(const char *ip)
+{
+	struct in6_addr addr;
+
+	return ip && inet_pton(AF_INET6, ip, &addr) == 1;
+}
+
+static const unsigned char v4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+int
+ip_key_parse(const char *ip, t_ip_key *key)
+{
+	if (!ip)
+		return 0;
+	if (inet_pton(AF_INET, ip, key->addr + 12) == 1) {
+		memcpy(key->addr, v4_mapped_prefix, sizeof(v4_mapped_prefix));
+		return 1;
+	}
+	return inet_pton(AF_INET6, ip, key->addr) == 1;
+}
+
+int
+ip_key_is_v4(const t_ip_key *key)
+{
+	return memcmp(key->addr, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0;
+}
+
+unsigned int
+ip_key_hash(const t_ip_key *key)
+{
+	unsigned int h = 2166136261u; // FNV-1a
+	int i;
+
+	/* ipv4 only differs in the last four bytes, an ipv6 client mostly in the last eight */
+	for (i = 0; i < 16; i++) {
+		h ^= key->addr[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int
+ip_key_from_sockaddr(const struct sockaddr *sa, t_ip_key *key)
+{
+	if (sa->sa_family == AF_INET) {
+		memcpy(key->addr, v4_mapped_prefix, sizeof(v4_mapped_prefix));
+		memcpy(key->addr + 12, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+		return 1;
+	}
+	if (sa->sa_family == AF_INET6) {
+		memcpy(key->addr, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+		return 1;
+	}
+	return 0;
+}
+
+unsigned int
+ip_key_fold(const t_ip_key *key)
+{
+	unsigned int ip;
+
+	if (!ip_key_is_v4(key))
+		return ip_key_hash(key);
+	memcpy(&ip, key->addr + 12, sizeof(ip));
+	return ip;
+}
+
+unsigned int
+ip_key_prefix_fold(const t_ip_key *key)
+{
+	t_ip_key prefix;
+
+	if (ip_key_is_v4(key))
+		return ip_key_fold(key);
+	/* a host picks any address of its /64 at will, only the prefix names it */
+	memcpy(prefix.addr, key->addr, 8);
+	memset(prefix.addr + 8, 0, 8);
+	return ip_key_hash(&prefix);
+}
+
+unsigned int
+ip_prefix_fold(const char *ip)
+{
+	t_ip_key key;
+
+	return ip_key_parse(ip, &key) ? ip_key_prefix_fold(&key) : 0;
+}
+
+int
+listen_socket6(unsigned short port)
+{
+	struct sockaddr_in6 sin6;
+	int fd, on = 1;
+
+	fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_addr = in6addr_any;
+	sin6.sin6_port = htons(port);
+	/* v6 only, the ipv4 listener on the same port stays on its own address */
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) < 0 ||
+		bind(fd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0 ||
+		listen(fd, 128) < 0) {
+		debug(LOG_ERR, "Could not listen on [::]:%d: %s", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 // true: 1; false: 0
 int 
 is_valid_mac(const char *mac)
@@ -30,6 +30,15 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "common.h"
+
+/** @brief Receive buffer of the icmp socket, big enough to queue a batch of replies */
+#define ICMP_RCVBUF_SIZE    (256 * 1024)
+
+/** @brief Max echoes handed to one sendmmsg */
+#define ICMP_BATCH_SIZE     64
 
 /** @brief Initialize the ICMP socket */
 int init_icmp_socket(void);
@@ -40,11 +49,44 @@ void close_icmp_socket(void);
 /** @brief ICMP Ping an IP */
 void icmp_ping(const char *);
 
+/** @brief ICMP Ping a batch of IPs on the shared icmp socket */
+int icmp_ping_batch(const struct in_addr *, int);
+
+/** @brief Collect echo replies queued on the shared icmp socket */
+int icmp_collect_replies(int, int, void (*)(struct in_addr, unsigned int, void *), void *);
+
 /** @brief Save pid of this wifidog in pid file */
 void save_pid_file(const char *);
 
 int is_valid_ip(const char *);
 
+/** @brief 1 for a textual ipv6 address */
+int is_valid_ip6(const char *);
+
+/** @brief Parse an ipv4 or ipv6 address into a key, 1 on success */
+int ip_key_parse(const char *, t_ip_key *);
+
+/** @brief 1 if the key holds an ipv4 address */
+int ip_key_is_v4(const t_ip_key *);
+
+/** @brief Hash of a key, the same family agnostic one for every index */
+unsigned int ip_key_hash(const t_ip_key *);
+
+/** @brief Key of a peer address, 1 for AF_INET and AF_INET6 */
+int ip_key_from_sockaddr(const struct sockaddr *, t_ip_key *);
+
+/** @brief 32 bits naming the address: ipv4 itself in network order, a hash of ipv6 */
+unsigned int ip_key_fold(const t_ip_key *);
+
+/** @brief ip_key_fold for ipv4, a hash of only the /64 prefix of ipv6 */
+unsigned int ip_key_prefix_fold(const t_ip_key *);
+
+/** @brief ip_key_prefix_fold of a textual ip, 0 if it does not parse */
+unsigned int ip_prefix_fold(const char *);
+
+/** @brief Non blocking listening socket on [::]:port, ipv6 only, -1 on error */
+int listen_socket6(unsigned short);
+
 int is_valid_mac(const char *);
 
 int is_socket_valid(int );
@@ -56,6 +56,9 @@
 
 #include <dirent.h>
 #include <linux/if_bridge.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
 
 #include "common.h"
 #include "gateway.h"
@@ -69,6 +72,9 @@
 #include "debug.h"
 #include "pstring.h"
 #include "version.h"
+#include "metrics.h"
+#include "sni_peek.h"
+#include "rate_limit.h"
 
 #define LOCK_GHBN() do { \
 	debug(LOG_DEBUG, "Locking wd_gethostbyname()"); \
@@ -382,6 +388,13 @@ get_status_text()
 	}
 	UNLOCK_OFFLINE_CLIENT_LIST();
 
+    char *latency = latency_render();
+    pstr_cat(pstr, "\n");
+    pstr_cat(pstr, latency);
+    free(latency);
+    sni_peek_render(pstr);
+    rate_limit_render(pstr);
+
     config = config_get_config();
 
     LOCK_CONFIG();
@@ -425,11 +438,7 @@ get_serialize_iplist()
 
 	LOCK_DOMAIN();
 	
-	for (; domain_trusted != NULL; domain_trusted = domain_trusted->next) {
-		if(strcmp(domain_trusted->domain, "iplist") == 0) {
-			break;
-		}
-	}
+	domain_trusted = __find_domain_common("iplist", USER_TRUSTED_DOMAIN);
 	
 	if(domain_trusted != NULL)	
 		iplist = domain_trusted->ips_trusted;
@@ -598,11 +607,10 @@ mqtt_get_trusted_iplist_text()
 	if (config->domains_trusted == NULL)
 		return NULL;
 
-	domain_trusted = config->domains_trusted;
 	int first = 1;
 	
 	LOCK_DOMAIN();
-	for (; (domain_trusted != NULL)&& (strcmp(domain_trusted->domain,"iplist") != 0); domain_trusted = domain_trusted->next) ;
+	domain_trusted = __find_domain_common("iplist", USER_TRUSTED_DOMAIN);
 
 	if(domain_trusted == NULL) {
 		UNLOCK_DOMAIN();
@@ -1106,34 +1114,13 @@ void evdns_add_trusted_domain_ip_cb(int errcode, struct evutil_addrinfo *addr, v
             if (ai->ai_family == AF_INET) {
                 struct sockaddr_in *sin = (struct sockaddr_in *)ai->ai_addr;
                 s = evutil_inet_ntop(AF_INET, &sin->sin_addr, hostname, HTTP_IP_ADDR_LEN);
-            } else if (ai->ai_family == AF_INET6) {
-                //do nothing
+            } else if (ai->ai_family == AF_INET6 && config_get_config()->enable_ipv6) {
+                struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ai->ai_addr;
+                s = evutil_inet_ntop(AF_INET6, &sin6->sin6_addr, hostname, HTTP_IP_ADDR_LEN);
             }
             if (s) {
-				t_ip_trusted *ipt = NULL;
 				debug(LOG_DEBUG, "parse domain (%s) ip (%s)", p->domain, s);
-				if(p->ips_trusted == NULL) {
-					ipt = (t_ip_trusted *)malloc(sizeof(t_ip_trusted));
-					memset(ipt, 0, sizeof(t_ip_trusted));
-					strncpy(ipt->ip, hostname, HTTP_IP_ADDR_LEN); 
-					ipt->next = NULL;
-					p->ips_trusted = ipt;
-				} else {
-					ipt = p->ips_trusted;
-					while(ipt) {
-						if(strcmp(ipt->ip, hostname) == 0)
-							break;
-						ipt = ipt->next;
-					}
-
-					if(ipt == NULL) {
-						ipt = (t_ip_trusted *)malloc(sizeof(t_ip_trusted));
-						memset(ipt, 0, sizeof(t_ip_trusted));
-						strncpy(ipt->ip, hostname, HTTP_IP_ADDR_LEN);
-						ipt->next = p->ips_trusted;
-						p->ips_trusted = ipt; 
-					}
-				}
+				__add_ip_2_domain(p, hostname);
 			}     
         }   
     } else {
@@ -1183,7 +1170,8 @@ void evdns_parse_trusted_domain_2_ip(t_domain_trusted *p)
 	n_started_requests = 0;
 	while(p && p->domain) {		
 		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = AF_UNSPEC;
+		// no AAAA queries when the ipv6 chains are not there to use them
+		hints.ai_family = config_get_config()->enable_ipv6 ? AF_UNSPEC : AF_INET;
 		hints.ai_flags = EVUTIL_AI_CANONNAME;
 		hints.ai_socktype = SOCK_STREAM;
 		hints.ai_protocol = IPPROTO_TCP;
@@ -1544,6 +1532,9 @@ arp_get_mac(const char *dev_name, const char *i_ip, char *o_mac) {
 	
 	if (!dev_name || !i_ip || !o_mac)
 		return 0;
+
+	if (strchr(i_ip, ':'))
+		return ndp_get_mac(dev_name, i_ip, o_mac);
 	
 	s = socket(AF_INET, SOCK_DGRAM, 0);
 	if (s <= 0) {
@@ -1572,6 +1563,127 @@ arp_get_mac(const char *dev_name, const char *i_ip, char *o_mac) {
 	return 0;
 }
 
+/*
+ * Ask the neighbour table for one address, or dump the table of the interface
+ * when dump is set. Returns 1 if a usable entry was found, 0 if not, -1 if
+ * the kernel refused a single lookup: RTM_GETNEIGH only has one since 5.0.
+ */
+static int
+ndp_request(int s, int ifindex, const struct in6_addr *addr, int dump, char *o_mac)
+{
+	struct {
+		struct nlmsghdr	nlh;
+		struct ndmsg	ndm;
+		char			attrs[RTA_SPACE(sizeof(struct in6_addr))];
+	} req;
+	struct sockaddr_nl snl;
+	struct rtattr *rta;
+	char buf[8192];
+	int len, found = 0, done = 0;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+	req.nlh.nlmsg_type = RTM_GETNEIGH;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | (dump ? NLM_F_DUMP : 0);
+	req.nlh.nlmsg_seq = dump ? 2 : 1;
+	req.ndm.ndm_family = AF_INET6;
+	req.ndm.ndm_ifindex = ifindex;
+	if (!dump) {
+		rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nlh.nlmsg_len));
+		rta->rta_type = NDA_DST;
+		rta->rta_len = RTA_LENGTH(sizeof(*addr));
+		memcpy(RTA_DATA(rta), addr, sizeof(*addr));
+		req.nlh.nlmsg_len = NLMSG_ALIGN(req.nlh.nlmsg_len) + RTA_SPACE(sizeof(*addr));
+	}
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	if (sendto(s, &req, req.nlh.nlmsg_len, 0, (struct sockaddr *)&snl, sizeof(snl)) < 0)
+		return 0;
+
+	while (!done && (len = recv(s, buf, sizeof(buf), 0)) > 0) {
+		struct nlmsghdr *nlh;
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			struct ndmsg *ndm = NLMSG_DATA(nlh);
+			int rlen;
+			unsigned char *lladdr = NULL, *dst = NULL;
+
+			if (nlh->nlmsg_seq != req.nlh.nlmsg_seq)
+				continue;
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				/* ENOENT is a plain miss, anything else means no single lookup */
+				int error = ((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+				if (!dump && error != 0 && error != -ENOENT)
+					found = -1;
+				done = 1;
+				break;
+			}
+			/* a single lookup gets one answer, a dump ends with NLMSG_DONE */
+			if (!dump)
+				done = 1;
+			if (found || nlh->nlmsg_type != RTM_NEWNEIGH || ndm->ndm_ifindex != ifindex ||
+				!(ndm->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT)))
+				continue;
+
+			rlen = RTM_PAYLOAD(nlh);
+			for (rta = RTM_RTA(ndm); RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen)) {
+				if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == sizeof(*addr))
+					dst = RTA_DATA(rta);
+				else if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == ETH_ALEN)
+					lladdr = RTA_DATA(rta);
+			}
+			if (dst && lladdr && memcmp(dst, addr, sizeof(*addr)) == 0) {
+				snprintf(o_mac, MAC_LENGTH, "%02x:%02x:%02x:%02x:%02x:%02x",
+					lladdr[0], lladdr[1], lladdr[2], lladdr[3], lladdr[4], lladdr[5]);
+				/* keep reading, the rest of a dump must be drained */
+				found = 1;
+			}
+		}
+	}
+
+	return found;
+}
+
+/*
+ * There is no SIOCGARP for ipv6, the neighbour entry of the address on
+ * dev_name is asked for over rtnetlink. Kernels older than 5.0 can only
+ * dump the table, which is then searched instead.
+ */
+int
+ndp_get_mac(const char *dev_name, const char *i_ip, char *o_mac)
+{
+	static int no_single_lookup;
+	struct in6_addr addr;
+	int s, ifindex, found = -1;
+
+	if (!dev_name || !i_ip || !o_mac || inet_pton(AF_INET6, i_ip, &addr) != 1)
+		return 0;
+	if ((ifindex = if_nametoindex(dev_name)) == 0)
+		return 0;
+
+	s = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (s < 0)
+		return 0;
+
+	if (!__atomic_load_n(&no_single_lookup, __ATOMIC_RELAXED)) {
+		found = ndp_request(s, ifindex, &addr, 0, o_mac);
+		if (found < 0) {
+			debug(LOG_INFO, "Kernel has no single neighbour lookup, dumping the table instead");
+			__atomic_store_n(&no_single_lookup, 1, __ATOMIC_RELAXED);
+		}
+	}
+	if (found < 0)
+		found = ndp_request(s, ifindex, &addr, 1, o_mac);
+	close(s);
+
+	return found;
+}
+
 int
 br_arp_get_mac(const char *i_ip, char *o_mac)
 {
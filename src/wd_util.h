@@ -148,4 +148,7 @@ char *get_ext_iface(void);
 /** 1: success; 0: error*/
 int arp_get_mac(const char *dev_name, const char *i_ip, char *o_mac);
 int br_arp_get_mac(const char *i_ip, char *o_mac);
+
+/** @brief MAC of an ipv6 neighbour of dev_name from the NDP table, 1: success; 0: error */
+int ndp_get_mac(const char *dev_name, const char *i_ip, char *o_mac);
 #endif /* _WD_UTIL_H_ */
@@ -41,6 +41,7 @@
 
 #include "wdctl.h"
 #include "util.h"
+#include "event_log.h"
 
 static wdctl_config config;
 
@@ -50,9 +51,11 @@ static void parse_commandline(int, char **);
 static int connect_to_server(const char *);
 static size_t send_request(int, const char *);
 static void wdctl_status(void);
+static void wdctl_metrics(void);
 static void wdctl_stop(void);
 static void wdctl_reset(void);
 static void wdctl_restart(void);
+static void wdctl_reload(void);
 //>>> liudf added 20151225
 static void wdctl_add_trusted_pan_domains(void);
 static void wdctl_del_trusted_pan_domains(void);
@@ -80,6 +83,7 @@ static void wdctl_show_roam_maclist(void);
 static void wdctl_clear_roam_maclist(void);
 static void wdctl_user_cfg_save(void);
 static void wdctl_add_online_client(void);
+static void wdctl_events(void);
 //<<< liudf added end
 
 /** @internal
@@ -99,8 +103,11 @@ usage(void)
     fprintf(stdout, "commands:\n");
     fprintf(stdout, "  reset [mac|ip]    Reset the specified mac or ip connection\n");
     fprintf(stdout, "  status            Obtain the status of wifidog\n");
+    fprintf(stdout, "  metrics           Dump the gateway metrics in prometheus text format\n");
+    fprintf(stdout, "  clear_latency     Reset the redirect latency histograms shown by status\n");
     fprintf(stdout, "  stop              Stop the running wifidog\n");
     fprintf(stdout, "  restart           Re-start the running wifidog (without disconnecting active users!)\n");
+    fprintf(stdout, "  reload            Re-read the config file and apply what changed, same as SIGHUP\n");
 	//>>> liudf added 20151225
     fprintf(stdout, "  add_trusted_pdomains [domain1,domain2...]	Add trusted pan-domains\n");
     fprintf(stdout, "  del_trusted_pdomains [domain1,domain2...]	Del trusted pan-domains\n");
@@ -128,6 +135,7 @@ usage(void)
     fprintf(stdout, "  show_untrusted_mac		Show untrusted mac list\n");
     fprintf(stdout, "  user_cfg_save			User config save\n");
 	fprintf(stdout, "  add_online_client 		Add online client\n");
+	fprintf(stdout, "  events [type=login|auth|allow|deny|timeout|counters,ip=..,mac=..,since=secs,last=n]	Decode the auth and firewall event journal\n");
 	//<<< liudf added end
     fprintf(stdout, "\n");
 }
@@ -181,6 +189,10 @@ parse_commandline(int argc, char **argv)
 
     if (strcmp(*(argv + optind), "status") == 0) {
         config.command = WDCTL_STATUS;
+    } else if (strcmp(*(argv + optind), "metrics") == 0) {
+        config.command = WDCTL_METRICS;
+    } else if (strcmp(*(argv + optind), "clear_latency") == 0) {
+        config.command = WDCTL_CLEAR_LATENCY;
     } else if (strcmp(*(argv + optind), "stop") == 0) {
         config.command = WDCTL_STOP;
     } else if (strcmp(*(argv + optind), "reset") == 0) {
@@ -193,6 +205,8 @@ parse_commandline(int argc, char **argv)
         config.param = strdup(*(argv + optind + 1));
     } else if (strcmp(*(argv + optind), "restart") == 0) {
         config.command = WDCTL_RESTART;
+    } else if (strcmp(*(argv + optind), "reload") == 0) {
+        config.command = WDCTL_RELOAD;
 	//>>> liudf added 20151225
 	} else if (strcmp(*(argv + optind), "add_trusted_pdomains") == 0) {
 		config.command = WDCTL_ADD_TRUSTED_PAN_DOMAINS;
@@ -344,6 +358,10 @@ parse_commandline(int argc, char **argv)
             exit(1);
 		}
         config.param = strdup(*(argv + optind + 1));
+	} else if (strcmp(*(argv + optind), "events") == 0) {
+		config.command = WDCTL_EVENTS;
+		if ((argc - (optind + 1)) > 0)
+			config.param = strdup(*(argv + optind + 1));
 	//<<< liudf added end
     } else {
         fprintf(stderr, "wdctl: Error: Invalid command \"%s\"\n", *(argv + optind));
@@ -1066,20 +1084,35 @@ wdctl_add_online_client(void)
 
 }
 
+/*
+ * The journal is a file mapped by the gateway, decode it here instead of
+ * going through the control socket so it is still readable after a crash.
+ */
+static void
+wdctl_events(void)
+{
+	struct event_filter filter;
+
+	if (event_filter_parse(&filter, config.param) != 0) {
+		fprintf(stderr, "wdctl: Error: Invalid event filter \"%s\"\n", config.param);
+		exit(1);
+	}
+
+	if (event_log_dump(stdout, &filter) != 0)
+		exit(1);
+}
+
 //<<< liudf added end
 
 static void
-wdctl_status(void)
+wdctl_dump(const char *request)
 {
     int sock;
     char buffer[4096] = {0};
-    char request[16] = {0};
     ssize_t len;
 
     sock = connect_to_server(config.socket);
 
-    strncpy(request, "status\r\n\r\n", 15);
-
     send_request(sock, request);
 
     // -1: need some space for \0!
@@ -1092,6 +1125,18 @@ wdctl_status(void)
     close(sock);
 }
 
+static void
+wdctl_status(void)
+{
+    wdctl_dump("status\r\n\r\n");
+}
+
+static void
+wdctl_metrics(void)
+{
+    wdctl_dump("metrics\r\n\r\n");
+}
+
 static void
 wdctl_stop(void)
 {
@@ -1150,6 +1195,12 @@ wdctl_reset(void)
     close(sock);
 }
 
+static void
+wdctl_reload(void)
+{
+    wdctl_dump("reload\r\n\r\n");
+}
+
 static void
 wdctl_restart(void)
 {
@@ -1186,6 +1237,14 @@ main(int argc, char **argv)
         wdctl_status();
         break;
 
+    case WDCTL_METRICS:
+        wdctl_metrics();
+        break;
+
+    case WDCTL_CLEAR_LATENCY:
+        wdctl_command_action("clear_latency");
+        break;
+
     case WDCTL_STOP:
         wdctl_stop();
         break;
@@ -1197,6 +1256,10 @@ main(int argc, char **argv)
     case WDCTL_RESTART:
         wdctl_restart();
         break;
+
+    case WDCTL_RELOAD:
+        wdctl_reload();
+        break;
 	
 	//>>> liudf added 20151225
 	case WDCTL_ADD_TRUSTED_PAN_DOMAINS:
@@ -1315,6 +1378,10 @@ main(int argc, char **argv)
 
 	case WDCTL_ADD_WILDCARD_DOMAIN:
 		break;
+
+	case WDCTL_EVENTS:
+		wdctl_events();
+		break;
 	//<<< liudf end
 
     default:
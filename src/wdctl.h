@@ -67,6 +67,10 @@
 #define	WDCTL_DEL_TRUSTED_LOCAL_MACLIST			33
 #define	WDCTL_SHOW_TRUSTED_LOCAL_MACLIST		34
 #define	WDCTL_CLEAR_TRUSTED_LOCAL_MACLIST		35
+#define	WDCTL_EVENTS					36
+#define	WDCTL_METRICS					37
+#define	WDCTL_CLEAR_LATENCY				38
+#define	WDCTL_RELOAD					39
 //<<<< liudf added end
 
 typedef struct {
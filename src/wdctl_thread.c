@@ -51,19 +51,26 @@
 #include "fw_iptables.h"
 #include "firewall.h"
 #include "client_list.h"
+#include "client_snapshot.h"
 #include "wdctl_thread.h"
 #include "commandline.h"
 #include "gateway.h"
 #include "safe.h"
+#include "metrics.h"
+#include "pstring.h"
+#include "reload.h"
 
 
 static int create_unix_socket(const char *);
 static int write_to_socket(int, char *, size_t);
 static void *thread_wdctl_handler(void *);
 static void wdctl_status(int);
+static void wdctl_metrics(int);
+static void wdctl_clear_latency(int);
 static void wdctl_stop(int);
 static void wdctl_reset(int, const char *);
 static void wdctl_restart(int);
+static void wdctl_reload(int);
 //>>> liudf added 20151225
 static void wdctl_add_trusted_pan_domains(int, const char *);
 static void wdctl_del_trusted_pan_domains(int, const char *);
@@ -243,12 +250,18 @@ thread_wdctl_handler(void *arg)
 
     if (strncmp(request, "status", 6) == 0) {
         wdctl_status(fd);
+    } else if (strncmp(request, "metrics", 7) == 0) {
+        wdctl_metrics(fd);
+    } else if (strncmp(request, "clear_latency", 13) == 0) {
+        wdctl_clear_latency(fd);
     } else if (strncmp(request, "stop", 4) == 0) {
         wdctl_stop(fd);
     } else if (strncmp(request, "reset", 5) == 0) {
         wdctl_reset(fd, (request + 6));
     } else if (strncmp(request, "restart", 7) == 0) {
         wdctl_restart(fd);
+    } else if (strncmp(request, "reload", 6) == 0) {
+        wdctl_reload(fd);
 	//>>> liudf added 20151225
 	} else if (strncmp(request, "add_trusted_pdomains", strlen("add_trusted_pdomains")) == 0) {
 		wdctl_add_trusted_pan_domains(fd, (request + strlen("add_trusted_pdomains") + 1));
@@ -385,6 +398,24 @@ wdctl_status(int fd)
     free(status);
 }
 
+static void
+wdctl_metrics(int fd)
+{
+    char *text = metrics_render();
+
+    write_to_socket(fd, text, strlen(text));
+
+    free(text);
+}
+
+static void
+wdctl_clear_latency(int fd)
+{
+    latency_reset();
+
+    write_to_socket(fd, "Yes", 3);
+}
+
 /** A bit of an hack, self kills.... */
 /* coverity[+kill] */
 static void
@@ -396,6 +427,21 @@ wdctl_stop(int fd)
     kill(pid, SIGINT);
 }
 
+/** Re-reads the config file and sends back what changed */
+static void
+wdctl_reload(int fd)
+{
+    pstr_t *report = pstr_new();
+    char *text;
+
+    reload_config(report);
+    text = pstr_to_string(report);
+
+    write_to_socket(fd, text, strlen(text));
+
+    free(text);
+}
+
 static void
 wdctl_restart(int afd)
 {
@@ -403,8 +449,6 @@ wdctl_restart(int afd)
     char *sock_name;
     s_config *conf = NULL;
     struct sockaddr_un sa_un;
-    t_client *client;
-    char *tempstring = NULL;
     pid_t pid;
     socklen_t len;
 
@@ -443,21 +487,8 @@ wdctl_restart(int afd)
 
         debug(LOG_DEBUG, "Received connection from child.  Sending them all existing clients");
 
-        /* The child is connected. Send them over the socket the existing clients */
-        LOCK_CLIENT_LIST();
-        client = client_get_first_client();
-        while (client) {
-            /* Send this client */
-            safe_asprintf(&tempstring,
-                          "CLIENT|ip=%s|mac=%s|token=%s|fw_connection_state=%u|fd=%d|counters_incoming=%llu|counters_outgoing=%llu|counters_last_updated=%lu\n",
-                          client->ip, client->mac, client->token, client->fw_connection_state, client->fd,
-                          client->counters.incoming, client->counters.outgoing, client->counters.last_updated);
-            debug(LOG_DEBUG, "Sending to child client data: %s", tempstring);
-            write_to_socket(fd, tempstring, strlen(tempstring));        /* XXX Despicably not handling error. */
-            free(tempstring);
-            client = client->next;
-        }
-        UNLOCK_CLIENT_LIST();
+        /* The child is connected. Send them a snapshot of the existing clients */
+        client_snapshot_send(fd);       /* XXX Not handling error, the child starts with what it got. */
 
         close(fd);
 